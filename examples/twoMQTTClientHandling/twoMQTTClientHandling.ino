@@ -18,7 +18,7 @@ EspMQTTClient client1(
   "TestClient1"
 );
 
-// The client #2 will handle MQTT connection to 192.168.1.101.
+// The client #2 will handle MQTT connection to 192.168.1.101, as a session of client1 (see setup()).
 EspMQTTClient client2(
   "192.168.1.101",
   1883,
@@ -34,6 +34,9 @@ void setup()
   // We redirect the connection established callback of client2 to onConnectionEstablishedClient2.
   // This will prevent the two client from calling the same callback (default to onConnectionEstablished)
   client2.setOnConnectionEstablishedCallback(onConnectionEstablishedClient2); 
+
+  // client1.loop() will also handle client2, sharing the WiFi status and the timers of client1
+  client1.addSession(client2);
 }
 
 // For client1
@@ -56,6 +59,5 @@ void onConnectionEstablishedClient2()
 
 void loop()
 {
-  client1.loop();
-  client2.loop();
+  client1.loop(); // client2.loop() does nothing now that it is a session of client1
 }
@@ -0,0 +1,93 @@
+#!/usr/bin/env python3
+"""
+Send a firmware to devices running EspMQTTClient with enableMqttOtaUpdate().
+
+  python3 mqtt_ota_upload.py --broker 192.168.1.100 --topic TestClient/ota firmware.bin
+
+Several --topic can be given to update a fleet at once. Requires paho-mqtt (pip install paho-mqtt).
+The chunk size must not exceed MQTT_OTA_MAX_CHUNK_SIZE of the device (2048 by default).
+"""
+
+import argparse
+import hashlib
+import json
+import struct
+import sys
+import time
+
+import paho.mqtt.client as mqtt
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("firmware")
+    parser.add_argument("--broker", required=True)
+    parser.add_argument("--port", type=int, default=1883)
+    parser.add_argument("--username")
+    parser.add_argument("--password")
+    parser.add_argument("--topic", action="append", required=True, help="OTA topic of a device, <mqttClientName>/ota by default")
+    parser.add_argument("--chunk-size", type=int, default=2048)
+    parser.add_argument("--timeout", type=float, default=30, help="seconds without progress before giving up")
+    args = parser.parse_args()
+
+    with open(args.firmware, "rb") as f:
+        firmware = f.read()
+    md5 = hashlib.md5(firmware).hexdigest()
+
+    # Offset to send next for each device, rewound when a device reports a lost chunk
+    devices = {topic: {"offset": 0, "state": "idle", "progress": time.time(), "sent": time.time()} for topic in args.topic}
+
+    def on_message(client, userdata, message):
+        topic = message.topic[: -len("/status")]
+        status = json.loads(message.payload)
+        device = devices[topic]
+        device["state"] = status["state"]
+        if status["state"] == "running":
+            device["offset"] = status["offset"]
+        device["progress"] = time.time()
+        if "error" in status:
+            print("%s: %s" % (topic, status["error"]), file=sys.stderr)
+
+    client = mqtt.Client()
+    if args.username:
+        client.username_pw_set(args.username, args.password)
+    client.on_message = on_message
+    client.connect(args.broker, args.port)
+    for topic in devices:
+        client.subscribe(topic + "/status")
+        client.publish(topic + "/begin", "%d %s" % (len(firmware), md5))
+    client.loop_start()
+
+    while True:
+        running = [t for t, d in devices.items() if d["state"] not in ("succeeded", "failed")]
+        if not running:
+            break
+        for topic in running:
+            device = devices[topic]
+            if time.time() - device["progress"] > args.timeout:
+                print("%s: no progress, giving up" % topic, file=sys.stderr)
+                device["state"] = "failed"
+                continue
+            offset = device["offset"]
+            if device["state"] != "running":
+                continue
+            if offset >= len(firmware):
+                # The last chunks may have been lost, sending begin again makes the device report its offset
+                if time.time() - device["sent"] > 2:
+                    client.publish(topic + "/begin", "%d %s" % (len(firmware), md5))
+                    device["sent"] = time.time()
+                continue
+            chunk = firmware[offset : offset + args.chunk_size]
+            client.publish(topic + "/data", struct.pack(">I", offset) + chunk).wait_for_publish()
+            device["offset"] = offset + len(chunk)
+            device["sent"] = time.time()
+        time.sleep(0.001)
+
+    client.loop_stop()
+    for topic, device in devices.items():
+        print("%s: %s" % (topic, device["state"]))
+    return 0 if all(d["state"] == "succeeded" for d in devices.values()) else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,120 @@
+#!/usr/bin/env python3
+"""
+Decode the record batches published by EspMQTTClient with publish(topic, MqttRecordBatch).
+
+  python3 mqtt_record_decoder.py --broker 192.168.1.100 --topic TestClient/telemetry
+  python3 mqtt_record_decoder.py batch.bin
+
+Each record is printed on a line as its timestamp (milliseconds of the device) followed by its values.
+decode() can also be imported to handle the records from another script. Subscribing requires paho-mqtt
+(pip install paho-mqtt), decoding files does not.
+"""
+
+import argparse
+import struct
+import sys
+
+FORMAT_VERSION = 1
+TYPE_INT = 0
+TYPE_FLOAT = 1
+
+
+def read_varint(payload, offset):
+    value = 0
+    shift = 0
+    while True:
+        if offset >= len(payload):
+            raise ValueError("truncated varint")
+        byte = payload[offset]
+        offset += 1
+        value |= (byte & 0x7F) << shift
+        if byte < 0x80:
+            return value, offset
+        shift += 7
+
+
+def decode(payload):
+    """Return the records of a batch as a list of (timestamp, [values])."""
+    if len(payload) < 7:
+        raise ValueError("frame shorter than its header")
+    version, count, timestamp = struct.unpack_from("<BHI", payload, 0)
+    if version != FORMAT_VERSION:
+        raise ValueError("unsupported frame version %d" % version)
+
+    records = []
+    offset = 7
+    for _ in range(count):
+        delta, offset = read_varint(payload, offset)
+        # The device computes timestamps on 32 bits, so they wrap like millis()
+        timestamp = (timestamp + delta) & 0xFFFFFFFF
+        if offset >= len(payload):
+            raise ValueError("truncated record")
+        value_count = payload[offset]
+        offset += 1
+
+        values = []
+        for _ in range(value_count):
+            if offset >= len(payload):
+                raise ValueError("truncated value")
+            value_type = payload[offset]
+            offset += 1
+            if value_type == TYPE_INT:
+                zigzag, offset = read_varint(payload, offset)
+                values.append((zigzag >> 1) ^ -(zigzag & 1))
+            elif value_type == TYPE_FLOAT:
+                values.append(struct.unpack_from("<f", payload, offset)[0])
+                offset += 4
+            else:
+                raise ValueError("unknown value type %d" % value_type)
+        records.append((timestamp, values))
+
+    if offset != len(payload):
+        raise ValueError("%d bytes after the last record" % (len(payload) - offset))
+    return records
+
+
+def print_records(records, prefix=""):
+    for timestamp, values in records:
+        print("%s%d %s" % (prefix, timestamp, " ".join(repr(value) for value in values)))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("file", nargs="*", help="payloads to decode instead of subscribing")
+    parser.add_argument("--broker")
+    parser.add_argument("--port", type=int, default=1883)
+    parser.add_argument("--username")
+    parser.add_argument("--password")
+    parser.add_argument("--topic", action="append", help="topic the batches are published on, wildcards allowed")
+    args = parser.parse_args()
+
+    if args.file:
+        for path in args.file:
+            with open(path, "rb") as f:
+                print_records(decode(f.read()))
+        return
+
+    if not args.broker or not args.topic:
+        parser.error("--broker and --topic are required to subscribe")
+
+    import paho.mqtt.client as mqtt
+
+    def on_message(client, userdata, message):
+        try:
+            print_records(decode(message.payload), message.topic + " ")
+        except ValueError as error:
+            print("%s: %s" % (message.topic, error), file=sys.stderr)
+        sys.stdout.flush()
+
+    client = mqtt.Client()
+    if args.username:
+        client.username_pw_set(args.username, args.password)
+    client.on_message = on_message
+    client.connect(args.broker, args.port)
+    for topic in args.topic:
+        client.subscribe(topic)
+    client.loop_forever()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,127 @@
+#include "DelayedExecutionScheduler.h"
+
+
+DelayedExecutionScheduler::DelayedExecutionScheduler()
+{
+  mNextHandle = 0;
+  mRunningHandle = 0;
+  mRunningCancelled = false;
+}
+
+
+// =============== Public functions =================
+
+DelayedExecutionHandle DelayedExecutionScheduler::schedule(const unsigned long currentMillis, const unsigned long delay, const unsigned long period, DelayedExecutionCallback callback)
+{
+  if (++mNextHandle == 0)
+    mNextHandle = 1;
+
+  TimerRecord timer = { currentMillis + delay, period, mNextHandle, callback };
+  push(timer);
+  return timer.handle;
+}
+
+bool DelayedExecutionScheduler::cancel(const DelayedExecutionHandle handle)
+{
+  if (handle == 0)
+    return false;
+
+  if (handle == mRunningHandle)
+  {
+    bool wasCancelled = mRunningCancelled;
+    mRunningCancelled = true;
+    return !wasCancelled;
+  }
+
+  for (size_t i = 0 ; i < mTimers.size() ; i++)
+  {
+    if (mTimers[i].handle == handle)
+    {
+      removeAt(i);
+      return true;
+    }
+  }
+  return false;
+}
+
+void DelayedExecutionScheduler::run(const unsigned long currentMillis)
+{
+  // Timers added by the callbacks are executed at the next run at the earliest, even with a delay of 0
+  size_t remainingExecutions = mTimers.size();
+
+  while (remainingExecutions-- > 0 && isDue(currentMillis))
+  {
+    TimerRecord timer = std::move(mTimers[0]);
+    removeAt(0);
+
+    mRunningHandle = timer.handle;
+    mRunningCancelled = false;
+    timer.callback();
+    mRunningHandle = 0;
+
+    if (timer.period > 0 && !mRunningCancelled)
+    {
+      // Keep the cadence, unless we are late by more than a period
+      timer.targetMillis += timer.period;
+      if (!isBefore(currentMillis, timer.targetMillis))
+        timer.targetMillis = currentMillis + timer.period;
+      push(timer);
+    }
+  }
+}
+
+
+// ================== Private functions ====================
+
+void DelayedExecutionScheduler::push(TimerRecord &timer)
+{
+  mTimers.push_back(std::move(timer));
+  siftUp(mTimers.size() - 1);
+}
+
+void DelayedExecutionScheduler::removeAt(const size_t index)
+{
+  size_t last = mTimers.size() - 1;
+  if (index != last)
+    mTimers[index] = std::move(mTimers[last]);
+  mTimers.pop_back();
+
+  if (index < mTimers.size())
+  {
+    siftDown(index);
+    siftUp(index);
+  }
+}
+
+void DelayedExecutionScheduler::siftUp(size_t index)
+{
+  while (index > 0)
+  {
+    size_t parent = (index - 1) / 2;
+    if (!isBefore(mTimers[index].targetMillis, mTimers[parent].targetMillis))
+      break;
+    std::swap(mTimers[index], mTimers[parent]);
+    index = parent;
+  }
+}
+
+void DelayedExecutionScheduler::siftDown(size_t index)
+{
+  size_t size = mTimers.size();
+  while (true)
+  {
+    size_t smallest = index;
+    size_t left = 2 * index + 1;
+    size_t right = left + 1;
+
+    if (left < size && isBefore(mTimers[left].targetMillis, mTimers[smallest].targetMillis))
+      smallest = left;
+    if (right < size && isBefore(mTimers[right].targetMillis, mTimers[smallest].targetMillis))
+      smallest = right;
+    if (smallest == index)
+      break;
+
+    std::swap(mTimers[index], mTimers[smallest]);
+    index = smallest;
+  }
+}
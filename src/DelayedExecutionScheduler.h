@@ -0,0 +1,48 @@
+#ifndef DELAYED_EXECUTION_SCHEDULER_H
+#define DELAYED_EXECUTION_SCHEDULER_H
+
+#include <Arduino.h>
+#include <vector>
+
+typedef std::function<void()> DelayedExecutionCallback;
+typedef unsigned int DelayedExecutionHandle; // 0 is never a valid handle
+
+/*
+  Timers kept in a min-heap ordered by due time, so checking if something is due only looks at the top of the heap.
+  Times are compared with the difference of the two millis() values, which stays correct when millis() wraps
+  as long as the timers are due in less than 24 days.
+*/
+class DelayedExecutionScheduler
+{
+public:
+  DelayedExecutionScheduler();
+
+  DelayedExecutionHandle schedule(const unsigned long currentMillis, const unsigned long delay, const unsigned long period, DelayedExecutionCallback callback); // period of 0 for a single execution
+  bool cancel(const DelayedExecutionHandle handle); // Return false if the timer was already executed or cancelled
+  void run(const unsigned long currentMillis); // Execute the due timers
+
+  inline bool isDue(const unsigned long currentMillis) const { return !mTimers.empty() && !isBefore(currentMillis, mTimers[0].targetMillis); };
+  inline size_t size() const { return mTimers.size(); };
+
+private:
+  struct TimerRecord {
+    unsigned long targetMillis;
+    unsigned long period;
+    DelayedExecutionHandle handle;
+    DelayedExecutionCallback callback;
+  };
+
+  std::vector<TimerRecord> mTimers;
+  DelayedExecutionHandle mNextHandle;
+  DelayedExecutionHandle mRunningHandle; // Handle of the timer being executed, to allow it to cancel itself
+  bool mRunningCancelled;
+
+  void push(TimerRecord &timer);
+  void removeAt(const size_t index);
+  void siftUp(size_t index);
+  void siftDown(size_t index);
+
+  static inline bool isBefore(const unsigned long a, const unsigned long b) { return (long)(a - b) < 0; };
+};
+
+#endif
@@ -3,22 +3,62 @@
 
 /*
   Based on the HTTP update exemple of ESP32 core
+
+  The firmware is written to flash by a separate task through two buffers, so the next part of the upload is
+  received while the previous one is written. When the size and MD5 of the firmware are given in the query
+  (POST /?size=482304&md5=...), the space is checked before anything is written and Update verifies the MD5
+  as the firmware is written. An interrupted upload can be resumed by posting the rest of the file with
+  ?offset=<bytes received>, the number of bytes received is returned by GET /?status.
 */
 
 #include <WebServer.h>
 #include <Update.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include "MqttLogBuffer.h"
 
-#define ESP32_WEB_UPDATE_HTML "<html><body><form method='POST' action='' enctype='multipart/form-data'><input type='file' name='update'><input type='submit' value='Update'></form></body></html>"
+#define ESP32_WEB_UPDATE_HTML "<html><body><form method='POST' action='' enctype='multipart/form-data' onsubmit='var f=this.update.files[0];if(f)this.action=\"?size=\"+f.size;'><input type='file' name='update'><input type='submit' value='Update'></form></body></html>"
 #define ESP32_WEB_UPDATE_SUCCESS_RESPONSE "<META http-equiv=\"refresh\" content=\"10;URL=/\">Update Success! Rebooting...\n"
+#ifndef ESP32_WEB_UPDATE_BUFFER_SIZE
+  #define ESP32_WEB_UPDATE_BUFFER_SIZE 4096 // Size of each of the two buffers, allocated for the time of the update
+#endif
+#define ESP32_WEB_UPDATE_RESTART_DELAY 1000 // Time left to send the response before restarting
 
 class ESP32HTTPUpdateServer
 {
 private:
+  struct WriteRequest {
+    int buffer; // -1 to stop the writer task
+    size_t length;
+  };
+
   WebServer* _server;
 
   String _username;
   String _password;
   bool _serialDebugging;
+  bool _authenticated; // For the upload in progress, its chunks are ignored otherwise
+  bool _uploadFailed;
+  bool _uploadSucceeded;
+  String _error;
+  bool _restartRequested;
+  unsigned long _restartRequestMillis;
+
+  // Update session, kept after an interrupted upload so it can be resumed
+  bool _sessionActive;
+  size_t _sessionSize; // 0 if not given
+  String _sessionMd5;
+  size_t _received;
+
+  // Double buffering, the buffers go from _freeQueue to the writer task through _fullQueue
+  uint8_t* _buffers[2];
+  int _currentBuffer; // Being filled by the upload, -1 if none
+  size_t _currentLength;
+  QueueHandle_t _freeQueue;
+  QueueHandle_t _fullQueue;
+  SemaphoreHandle_t _writerDone;
+  volatile bool _writeError;
 
 public:
   ESP32HTTPUpdateServer(bool serialDebugging = false)
@@ -26,6 +66,28 @@ public:
     _server = NULL;
     _username = "";
     _password = "";
+    _serialDebugging = serialDebugging;
+    _authenticated = false;
+    _uploadFailed = false;
+    _uploadSucceeded = false;
+    _restartRequested = false;
+    _restartRequestMillis = 0;
+    _sessionActive = false;
+    _sessionSize = 0;
+    _received = 0;
+    _buffers[0] = _buffers[1] = NULL;
+    _currentBuffer = -1;
+    _currentLength = 0;
+    _freeQueue = NULL;
+    _fullQueue = NULL;
+    _writerDone = NULL;
+    _writeError = false;
+  }
+
+  ~ESP32HTTPUpdateServer()
+  {
+    if (_sessionActive)
+      abortSession();
   }
 
   void setup(WebServer* server, const char* path = "/", const char* username = "", const char* password = "")
@@ -37,67 +99,292 @@ public:
     // Get of the index handling
     _server->on(path, HTTP_GET, [&]() {
       // Force authentication if a user and password are defined
-      if (_username.length() > 0 && _password.length() > 0 && !_server->authenticate(_username.c_str(), _password.c_str()))
+      if (!isAuthenticated())
         return _server->requestAuthentication();
 
       _server->sendHeader("Connection", "close");
-      _server->send(200, "text/html", ESP32_WEB_UPDATE_HTML);
+      if (_server->hasArg("status"))
+        _server->send(200, "application/json", String("{\"active\":") + (_sessionActive ? "true" : "false") + ",\"offset\":" + _received + ",\"size\":" + _sessionSize + "}");
+      else
+        _server->send(200, "text/html", ESP32_WEB_UPDATE_HTML);
     });
 
-    // Post of the file handling
+    // Post of the file handling, the restart is done by loop() once the response is sent
     _server->on(path, HTTP_POST, [&]() {
+      if (!_authenticated)
+        return _server->requestAuthentication();
+
       _server->client().setNoDelay(true);
-      _server->send_P(200, "text/html", (Update.hasError()) ? "FAIL" : ESP32_WEB_UPDATE_SUCCESS_RESPONSE);
-      delay(100);
-      _server->client().stop();
-      ESP.restart();
+      _server->sendHeader("Connection", "close");
+      if (_uploadSucceeded)
+      {
+        _server->send(200, "text/html", ESP32_WEB_UPDATE_SUCCESS_RESPONSE);
+        _restartRequested = true;
+        _restartRequestMillis = millis();
+      }
+      else
+        _server->send(500, "text/plain", "FAIL: " + _error);
     }, [&]() {
-      HTTPUpload& upload = _server->upload();
+      handleUpload();
+    });
+
+    _server->begin();
+  }
+
+  // Must be called regularly, restart the device after a successful update
+  void loop()
+  {
+    if (_restartRequested && millis() - _restartRequestMillis >= ESP32_WEB_UPDATE_RESTART_DELAY)
+      ESP.restart();
+  }
 
-      if (upload.status == UPLOAD_FILE_START) 
+private:
+  bool isAuthenticated()
+  {
+    return _username.length() == 0 || _password.length() == 0 || _server->authenticate(_username.c_str(), _password.c_str());
+  }
+
+  void handleUpload()
+  {
+    HTTPUpload& upload = _server->upload();
+
+    if (upload.status == UPLOAD_FILE_START)
+    {
+      _uploadFailed = true;
+      _uploadSucceeded = false;
+
+      // Check if we are authenticated
+      _authenticated = isAuthenticated();
+      if (!_authenticated)
       {
-        // Check if we are authenticated
-        if (!(_username.length() == 0 || _password.length() == 0 || _server->authenticate(_username.c_str(), _password.c_str())))
-        {
-          if (_serialDebugging)
-            Serial.printf("Unauthenticated Update\n");
+        ESPMQTT_LOG_ERROR(_serialDebugging, "WEB! Unauthenticated Update\n");
+        return;
+      }
 
-          return;
-        }
+      size_t size = _server->hasArg("size") ? strtoul(_server->arg("size").c_str(), NULL, 10) : 0;
+      size_t offset = _server->hasArg("offset") ? strtoul(_server->arg("offset").c_str(), NULL, 10) : 0;
+      String md5 = _server->arg("md5");
 
-        // Debugging message for upload start
-        if (_serialDebugging) 
+      if (offset > 0)
+      {
+        if (!_sessionActive || offset != _received || size != _sessionSize || !md5.equalsIgnoreCase(_sessionMd5))
         {
-          Serial.setDebugOutput(true);
-          Serial.printf("Update: %s\n", upload.filename.c_str());
+          _error = "no update to resume at this offset";
+          ESPMQTT_LOG_ERROR(_serialDebugging, "WEB! Can't resume the update at %u bytes, %u received.\n", (unsigned int)offset, (unsigned int)_received);
+          return;
         }
-
-        // Starting update
-        bool error = Update.begin(UPDATE_SIZE_UNKNOWN);
-        if (_serialDebugging && error)
-          Update.printError(Serial);
+        ESPMQTT_LOG_INFO(_serialDebugging, "WEB: Update resumed at %u bytes\n", (unsigned int)offset);
       }
-      else if (upload.status == UPLOAD_FILE_WRITE) 
+      else
       {
-        if (Update.write(upload.buf, upload.currentSize) != upload.currentSize && _serialDebugging) 
-          Update.printError(Serial);
+        if (_sessionActive)
+          abortSession();
+        if (!startSession(size, md5))
+        {
+          ESPMQTT_LOG_ERROR(_serialDebugging, "WEB! Update failed to start, %s\n", _error.c_str());
+          return;
+        }
+        ESPMQTT_LOG_INFO(_serialDebugging, "WEB: Update: %s\n", upload.filename.c_str());
       }
-      else if (upload.status == UPLOAD_FILE_END) 
+
+      _uploadFailed = false;
+    }
+    else if (!_authenticated || _uploadFailed)
+      return; // The rest of an upload that was refused
+    else if (upload.status == UPLOAD_FILE_WRITE)
+    {
+      if (!writeData(upload.buf, upload.currentSize))
       {
-        if (Update.end(true) && _serialDebugging)
-          Serial.printf("Update Success: %u\nRebooting...\n", upload.totalSize);
-        else if(_serialDebugging)
-          Update.printError(Serial);
+        _uploadFailed = true;
+        ESPMQTT_LOG_ERROR(_serialDebugging, "WEB! Update failed, %s\n", _error.c_str());
+        abortSession();
+      }
+    }
+    else if (upload.status == UPLOAD_FILE_END)
+    {
+      _uploadSucceeded = finishSession();
+      if (_uploadSucceeded)
+        ESPMQTT_LOG_INFO(_serialDebugging, "WEB: Update Success: %u\nRebooting...\n", (unsigned int)upload.totalSize);
+      else
+        ESPMQTT_LOG_ERROR(_serialDebugging, "WEB! Update failed, %s\n", _error.c_str());
+    }
+    else
+    {
+      // Likely a broken connection, what was received is written so the upload can be resumed from there
+      submitBuffer();
+      ESPMQTT_LOG_ERROR(_serialDebugging, "WEB! Update interrupted at %u bytes, post the rest with ?offset=%u to resume\n", (unsigned int)_received, (unsigned int)_received);
+    }
+  }
 
-        if(_serialDebugging)
-          Serial.setDebugOutput(false);
+  bool startSession(const size_t size, const String &md5)
+  {
+    // With a known size, the space is checked before anything is written
+    if (!Update.begin(size > 0 ? size : UPDATE_SIZE_UNKNOWN))
+    {
+      _error = Update.errorString();
+      return false;
+    }
+
+    // Update computes the MD5 as the firmware is written and checks it in Update.end()
+    if (md5.length() > 0 && !Update.setMD5(md5.c_str()))
+    {
+      Update.abort();
+      _error = "invalid MD5";
+      return false;
+    }
+
+    if (!startWriter())
+    {
+      Update.abort();
+      _error = "not enough memory";
+      return false;
+    }
+
+    _sessionActive = true;
+    _sessionSize = size;
+    _sessionMd5 = md5;
+    _received = 0;
+    return true;
+  }
+
+  bool writeData(const uint8_t* data, size_t length)
+  {
+    while (length > 0)
+    {
+      if (_writeError)
+      {
+        _error = "flash write failed";
+        return false;
       }
-      else if(_serialDebugging)
-        Serial.printf("Update Failed Unexpectedly (likely broken connection): status=%d\n", upload.status);
-    });
 
-    _server->begin();
+      // Wait for the writer task only when both buffers are full
+      if (_currentBuffer < 0)
+        xQueueReceive(_freeQueue, &_currentBuffer, portMAX_DELAY);
+
+      size_t count = ESP32_WEB_UPDATE_BUFFER_SIZE - _currentLength;
+      if (count > length)
+        count = length;
+
+      memcpy(_buffers[_currentBuffer] + _currentLength, data, count);
+      _currentLength += count;
+      _received += count;
+      data += count;
+      length -= count;
+
+      if (_currentLength == ESP32_WEB_UPDATE_BUFFER_SIZE)
+        submitBuffer();
+    }
+    return true;
+  }
+
+  bool finishSession()
+  {
+    submitBuffer();
+    stopWriter();
+    _sessionActive = false;
+
+    if (_writeError)
+    {
+      Update.abort();
+      _error = "flash write failed";
+      return false;
+    }
+
+    // A firmware of known size must be complete
+    if (!Update.end(_sessionSize == 0))
+    {
+      _error = Update.errorString();
+      return false;
+    }
+    return true;
+  }
+
+  void abortSession()
+  {
+    stopWriter();
+    Update.abort();
+    _sessionActive = false;
+  }
+
+  void submitBuffer()
+  {
+    if (_currentBuffer < 0 || _currentLength == 0)
+      return;
+
+    WriteRequest request = { _currentBuffer, _currentLength };
+    xQueueSend(_fullQueue, &request, portMAX_DELAY);
+    _currentBuffer = -1;
+    _currentLength = 0;
+  }
+
+  bool startWriter()
+  {
+    _buffers[0] = (uint8_t*)malloc(ESP32_WEB_UPDATE_BUFFER_SIZE);
+    _buffers[1] = (uint8_t*)malloc(ESP32_WEB_UPDATE_BUFFER_SIZE);
+    _freeQueue = xQueueCreate(2, sizeof(int));
+    _fullQueue = xQueueCreate(3, sizeof(WriteRequest)); // Both buffers and the stop request
+    _writerDone = xSemaphoreCreateBinary();
+    _currentBuffer = -1;
+    _currentLength = 0;
+    _writeError = false;
+
+    if (_buffers[0] == NULL || _buffers[1] == NULL || _freeQueue == NULL || _fullQueue == NULL || _writerDone == NULL
+      || xTaskCreate(writerTask, "webUpdateWriter", 4096, this, 1, NULL) != pdPASS)
+    {
+      releaseWriter();
+      return false;
+    }
+
+    for (int i = 0 ; i < 2 ; i++)
+      xQueueSend(_freeQueue, &i, 0);
+    return true;
+  }
+
+  // Wait for the buffers submitted to be written, then stop the writer task
+  void stopWriter()
+  {
+    if (_fullQueue == NULL)
+      return;
+
+    WriteRequest request = { -1, 0 };
+    xQueueSend(_fullQueue, &request, portMAX_DELAY);
+    xSemaphoreTake(_writerDone, portMAX_DELAY);
+    releaseWriter();
+  }
+
+  void releaseWriter()
+  {
+    free(_buffers[0]);
+    free(_buffers[1]);
+    _buffers[0] = _buffers[1] = NULL;
+    if (_freeQueue != NULL)
+      vQueueDelete(_freeQueue);
+    if (_fullQueue != NULL)
+      vQueueDelete(_fullQueue);
+    if (_writerDone != NULL)
+      vSemaphoreDelete(_writerDone);
+    _freeQueue = NULL;
+    _fullQueue = NULL;
+    _writerDone = NULL;
+    _currentBuffer = -1;
+    _currentLength = 0;
+  }
+
+  static void writerTask(void* parameter)
+  {
+    ESP32HTTPUpdateServer* updater = (ESP32HTTPUpdateServer*)parameter;
+    WriteRequest request;
+
+    while (xQueueReceive(updater->_fullQueue, &request, portMAX_DELAY) == pdTRUE && request.buffer >= 0)
+    {
+      if (!updater->_writeError && Update.write(updater->_buffers[request.buffer], request.length) != request.length)
+        updater->_writeError = true;
+      xQueueSend(updater->_freeQueue, &request.buffer, portMAX_DELAY);
+    }
+
+    xSemaphoreGive(updater->_writerDone);
+    vTaskDelete(NULL);
   }
 };
 
-#endif
\ No newline at end of file
+#endif
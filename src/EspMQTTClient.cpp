@@ -1,4 +1,6 @@
 #include "EspMQTTClient.h"
+#include <new>
+#include <limits.h>
 
 
 // =============== Constructor / destructor ===================
@@ -90,49 +92,148 @@ EspMQTTClient::EspMQTTClient(
   const char* mqttPassword,
   const char* mqttClientName,
   const short mqttServerPort) :
+  mWifiBackoff(CONNECTION_RETRY_DELAY, CONNECTION_RETRY_MAX_DELAY, WIFI_CONNECTION_MIN_RETRY_DELAY),
   mWifiSsid(wifiSsid),
   mWifiPassword(wifiPassword),
-  mMqttServerIp(mqttServerIp),
+  mMqttBackoff(CONNECTION_RETRY_DELAY, CONNECTION_RETRY_MAX_DELAY),
   mMqttUsername(mqttUsername),
   mMqttPassword(mqttPassword),
   mMqttClientName(mqttClientName),
-  mMqttServerPort(mqttServerPort),
-  mMqttClient(mqttServerIp, mqttServerPort, mWifiClient)
+  mTransport(mWifiClient),
+  mMqttClient(mqttServerIp, mqttServerPort, mTransport)
 {
+  // Brokers
+  mBrokerCount = 0;
+  mBrokerIndex = 0;
+  mDnsCacheTtl = DNS_CACHE_TTL;
+  mDnsBackgroundRefresh = false;
+  addBroker(mqttServerIp, mqttServerPort);
+
   // WiFi connection
   mWifiConnected = false;
+  mWifiConnecting = false;
   mLastWifiConnectionAttemptMillis = 0;
-  mLastWifiConnectionSuccessMillis = 0;
+  mWifiRetryDelay = 0;
+
+  // Network client
+  mNetworkClient = &mWifiClient;
+  mSecureClient = NULL;
+  mTlsCaCert = NULL;
+  mTlsFingerprint = NULL;
+  #ifdef ESP8266
+    mTlsTrustAnchors = NULL;
+    mTlsSession = NULL;
+  #endif
 
   // MQTT client
+  mTopicSubscriptionList = NULL;
   mTopicSubscriptionListSize = 0;
+  mDispatchDepth = 0;
+  mHasRemovedSubscriptions = false;
+  mTopicSubscriptionListCapacity = MAX_TOPIC_SUBSCRIPTION_LIST_SIZE;
   mMqttConnected = false;
+  mMqttConnectionState = MQTT_STATE_DISCONNECTED;
+  mMqttConnectionStepMillis = 0;
   mLastMqttConnectionMillis = 0;
+  mMqttRetryDelay = 0; // The first attempt is immediate
   mMqttLastWillTopic = 0;
   mMqttLastWillMessage = 0;
   mMqttLastWillRetain = false;
+  mMqttLastWillQos = 0;
   mMqttCleanSession = true;
+  mNextPacketId = 0;
+  mPublishQueueMaxMessagesPerLoop = 0;
+  mQos1WindowSize = 0;
+  mStreamingPublish = false;
+  mStreamingPublishRemaining = 0;
   mMqttClient.setCallback([this](char* topic, byte* payload, unsigned int length) {this->mqttMessageReceivedCallback(topic, payload, length);});
 
   // Web updater
   mUpdateServerAddress = NULL;
   mHttpServer = NULL;
   mHttpUpdater = NULL;
+  mOtaUpdater = NULL;
 
   // other
   mEnableSerialLogs = false;
   mConnectionEstablishedCallback = onConnectionEstablished;
   mShowLegacyConstructorWarning = false;
-  mDelayedExecutionListSize = 0;
   mConnectionEstablishedCount = 0;
+
+  // Metrics
+  mMetricsPublishingHandle = 0;
+
+  // Sessions
+  mScheduler = &mDelayedExecutionScheduler;
+  mOwner = NULL;
+  mNextSession = NULL;
+
+  // Network task
+  #ifdef ESP32
+    mNetworkTask = NULL;
+    mNetworkMutex = NULL;
+    mConnectionEstablishedPending = false;
+    mSketchPublishFailures = 0;
+  #endif
 }
 
 EspMQTTClient::~EspMQTTClient()
 {
+  // The network task is deleted between two iterations, while the sketch holds the mutex. A session is only
+  // removed from the list of its owner while the task is kept out
+  #ifdef ESP32
+    if (mNetworkTask != NULL && mOwner == NULL)
+    {
+      xSemaphoreTakeRecursive(mNetworkMutex, portMAX_DELAY);
+      vTaskDelete(mNetworkTask);
+      vSemaphoreDelete(mNetworkMutex);
+      for (EspMQTTClient* session = this ; session != NULL ; session = session->mNextSession)
+      {
+        session->mNetworkTask = NULL;
+        session->mNetworkMutex = NULL;
+      }
+    }
+  #endif
+  lockNetwork();
+
   if (mHttpServer != NULL)
     delete mHttpServer;
   if (mHttpUpdater != NULL)
     delete mHttpUpdater;
+  if (mOtaUpdater != NULL)
+    delete mOtaUpdater;
+  if (mSecureClient != NULL)
+    delete mSecureClient;
+  #ifdef ESP8266
+    if (mTlsTrustAnchors != NULL)
+      delete mTlsTrustAnchors;
+    if (mTlsSession != NULL)
+      delete mTlsSession;
+  #endif
+  if (mTopicSubscriptionList != NULL)
+    delete[] mTopicSubscriptionList;
+
+  // A session destroyed before its owner leaves the owner's list, the sessions of a destroyed owner go back to standalone clients
+  if (mOwner != NULL)
+  {
+    EspMQTTClient* previous = mOwner;
+    while (previous->mNextSession != this)
+      previous = previous->mNextSession;
+    previous->mNextSession = mNextSession;
+  }
+  else
+  {
+    for (EspMQTTClient* session = mNextSession ; session != NULL ; )
+    {
+      EspMQTTClient* next = session->mNextSession;
+      session->mOwner = NULL;
+      session->mNextSession = NULL;
+      session->mScheduler = &session->mDelayedExecutionScheduler;
+      session = next;
+    }
+  }
+
+  unlockNetwork();
 }
 
 
@@ -153,8 +254,8 @@ void EspMQTTClient::enableHTTPWebUpdater(const char* username, const char* passw
     mUpdateServerPassword = (char*)password;
     mUpdateServerAddress = (char*)address;
   }
-  else if (mEnableSerialLogs)
-    Serial.print("SYS! You can't call enableHTTPWebUpdater() more than once !\n");
+  else
+    ESPMQTT_LOG_ERROR(mEnableSerialLogs, "SYS! You can't call enableHTTPWebUpdater() more than once !\n");
 }
 
 void EspMQTTClient::enableHTTPWebUpdater(const char* address)
@@ -165,386 +266,2045 @@ void EspMQTTClient::enableHTTPWebUpdater(const char* address)
     enableHTTPWebUpdater(mMqttUsername, mMqttPassword, address);
 }
 
+void EspMQTTClient::setMaxTopicSubscriptions(const unsigned int maxTopicSubscriptions)
+{
+  if (mTopicSubscriptionList == NULL)
+    mTopicSubscriptionListCapacity = maxTopicSubscriptions;
+  else
+    ESPMQTT_LOG_ERROR(mEnableSerialLogs, "SYS! setMaxTopicSubscriptions() must be called before the first subscribe(), ignored.\n");
+}
+
+void EspMQTTClient::enablePublishQueue(const size_t maxBytes, const MqttPublishQueue::OverflowPolicy overflowPolicy, const unsigned int maxMessagesPerLoop)
+{
+  if (mPublishQueue.isEnabled())
+  {
+    ESPMQTT_LOG_ERROR(mEnableSerialLogs, "SYS! You can't call enablePublishQueue() more than once !\n");
+    return;
+  }
+
+  if (!mPublishQueue.begin(maxBytes, overflowPolicy))
+    ESPMQTT_LOG_ERROR(mEnableSerialLogs, "SYS! Unable to allocate %u bytes for the publish queue.\n", (unsigned int)maxBytes);
+  mPublishQueueMaxMessagesPerLoop = maxMessagesPerLoop;
+}
+
+bool EspMQTTClient::setPublishPolicy(const char* topicFilter, const MqttPublishPolicy &policy)
+{
+  NetworkLock lock(this);
+
+  if (mPublishLimiter.addPolicy(topicFilter, policy))
+    return true;
+
+  ESPMQTT_LOG_ERROR(mEnableSerialLogs, "SYS! Unable to set the publish policy of %s, the filter is invalid or there are already %u policies.\n", topicFilter, MQTT_PUBLISH_POLICY_MAX_POLICIES);
+  return false;
+}
+
+void EspMQTTClient::setMqttReconnectionBackoff(const unsigned long initialDelay, const unsigned long maxDelay)
+{
+  mMqttBackoff.setDelays(initialDelay, maxDelay);
+}
+
+void EspMQTTClient::setWifiReconnectionBackoff(const unsigned long initialDelay, const unsigned long maxDelay)
+{
+  mWifiBackoff.setDelays(initialDelay, maxDelay, WIFI_CONNECTION_MIN_RETRY_DELAY);
+}
+
 void EspMQTTClient::enableMQTTPersistence()
 {
   mMqttCleanSession = false;
 }
 
-void EspMQTTClient::enableLastWillMessage(const char* topic, const char* message, const bool retain)
+void EspMQTTClient::enableLastWillMessage(const char* topic, const char* message, const bool retain, const byte qos)
 {
   mMqttLastWillTopic = (char*)topic;
   mMqttLastWillMessage = (char*)message;
   mMqttLastWillRetain = retain;
+  mMqttLastWillQos = qos;
 }
 
-
-// =============== Public functions =================
-
-void EspMQTTClient::loop()
+void EspMQTTClient::enableQos1Publish(const unsigned int windowSize, const size_t maxBytes)
 {
-  unsigned long currentMillis = millis();
-
-  if (WiFi.status() == WL_CONNECTED)
+  if (mInflightMessages.isEnabled())
   {
-    // If we just being connected to wifi
-    if (!mWifiConnected)
-    {
-      if (mEnableSerialLogs)
-        Serial.printf("WiFi: Connected, ip : %s\n", WiFi.localIP().toString().c_str());
+    ESPMQTT_LOG_ERROR(mEnableSerialLogs, "SYS! You can't call enableQos1Publish() more than once !\n");
+    return;
+  }
 
-      mLastWifiConnectionSuccessMillis = millis();
-      
-      // Config of web updater
-      if (mHttpServer != NULL)
-      {
-        MDNS.begin(mMqttClientName);
-        mHttpUpdater->setup(mHttpServer, mUpdateServerAddress, mUpdateServerUsername, mUpdateServerPassword);
-        mHttpServer->begin();
-        MDNS.addService("http", "tcp", 80);
-      
-        if (mEnableSerialLogs)
-          Serial.printf("WEB: Updater ready, open http://%s.local in your browser and login with username '%s' and password '%s'.\n", mMqttClientName, mUpdateServerUsername, mUpdateServerPassword);
-      }
-  
-      mWifiConnected = true;
-    }
-    
-    // MQTT handling
-    if (mMqttClient.connected())
-      mMqttClient.loop();
-    else
-    {
-      if (mMqttConnected)
-      {
-        if (mEnableSerialLogs)
-          Serial.println("MQTT! Lost connection.");
-        
-        mTopicSubscriptionListSize = 0;
-        mMqttConnected = false;
-      }
-      
-      if (currentMillis - mLastMqttConnectionMillis > CONNECTION_RETRY_DELAY || mLastMqttConnectionMillis == 0)
-        connectToMqttBroker();
-    }
-      
-    // Web updater handling
-    if (mHttpServer != NULL)
-    {
-      mHttpServer->handleClient();
-      #ifdef ESP8266
-        MDNS.update(); // We need to do this only for ESP8266
-      #endif
-    }
-      
+  // A message is only sent once the store has room for it, so the store never has to drop one
+  if (!mInflightMessages.begin(maxBytes, MqttPublishQueue::DROP_NEWEST))
+  {
+    ESPMQTT_LOG_ERROR(mEnableSerialLogs, "SYS! Unable to allocate %u bytes for the QoS 1 messages.\n", (unsigned int)maxBytes);
+    return;
   }
-  else // If we are not connected to wifi
+
+  mQos1WindowSize = windowSize > 0 ? windowSize : 1;
+  mTransport.setAckHandler(pubackReceived, this);
+}
+
+void EspMQTTClient::enableQos1Persistence(fs::FS &fileSystem, const char* path)
+{
+  if (!mInflightMessages.isEnabled())
   {
-    if (mWifiConnected) 
-    {
-      if (mEnableSerialLogs)
-        Serial.println("WiFi! Lost connection.");
-      
-      mWifiConnected = false;
+    ESPMQTT_LOG_ERROR(mEnableSerialLogs, "SYS! enableQos1Publish() must be called before enableQos1Persistence().\n");
+    return;
+  }
 
-      // If we handle wifi, we force disconnection to clear the last connection
-      if (mWifiSsid != NULL)
-        WiFi.disconnect();
-    }
-    
-    // We retry to connect to the wifi if we handle it and there was no attempt since the last connection lost
-    if (mWifiSsid != NULL && (mLastWifiConnectionAttemptMillis == 0 || mLastWifiConnectionSuccessMillis > mLastWifiConnectionAttemptMillis))
-      connectToWifi();
+  uint16_t lastPacketId;
+  if (!mInflightJournal.begin(fileSystem, path, mInflightMessages, &lastPacketId))
+    ESPMQTT_LOG_ERROR(mEnableSerialLogs, "SYS! Unable to open %s, the unacknowledged messages will be lost on reboot.\n", path);
+
+  // The new messages must not reuse the packet id of a restored one
+  if (lastPacketId != 0)
+    mNextPacketId = lastPacketId;
+
+  if (!mInflightMessages.isEmpty())
+    ESPMQTT_LOG_INFO(mEnableSerialLogs, "MQTT: %u unacknowledged messages restored from %s\n", mInflightMessages.count(), path);
+}
+
+/**
+ * The update is started by a "<size> <md5>" message on <topic>/begin, then the firmware is sent on <topic>/data
+ * in chunks prefixed by their offset. The progress is reported on <topic>/status.
+ */
+void EspMQTTClient::enableMqttOtaUpdate(const char* topic)
+{
+  if (mOtaUpdater != NULL)
+  {
+    ESPMQTT_LOG_ERROR(mEnableSerialLogs, "SYS! You can't call enableMqttOtaUpdate() more than once !\n");
+    return;
   }
-  
-  // Delayed execution handling
-  if (mDelayedExecutionListSize > 0)
+
+  mOtaUpdater = new MqttOtaUpdater(mEnableSerialLogs);
+  if (topic != NULL)
+    mOtaTopic = topic;
+  else
   {
-    unsigned long currentMillis = millis();
+    mOtaTopic = mMqttClientName;
+    mOtaTopic += OTA_TOPIC_SUFFIX;
+  }
 
-    for(byte i = 0 ; i < mDelayedExecutionListSize ; i++)
-    {
-      if (mDelayedExecutionList[i].targetMillis <= currentMillis)
-      {
-        mDelayedExecutionList[i].callback();
-        for(byte j = i ; j < mDelayedExecutionListSize-1 ; j++)
-          mDelayedExecutionList[j] = mDelayedExecutionList[j + 1];
-        mDelayedExecutionListSize--;
-        i--;
-      }
-    }
+  subscribe(mOtaTopic + "/begin", [this](const String &payload) {
+    char* md5;
+    unsigned long size = strtoul(payload.c_str(), &md5, 10);
+    while (*md5 == ' ')
+      md5++;
+    NetworkLock lock(this);
+    this->mOtaUpdater->begin(size, md5);
+  });
+
+  subscribe(mOtaTopic + "/abort", [this](const String &payload) {
+    NetworkLock lock(this);
+    this->mOtaUpdater->abort();
+  });
+
+  MessageStreamCallbacks dataCallbacks;
+  dataCallbacks.onBegin = [this](const char* topic, size_t length) { this->mOtaUpdater->beginChunk(length); };
+  dataCallbacks.onChunk = [this](const uint8_t* data, size_t length) { this->mOtaUpdater->writeChunk(data, length); };
+  dataCallbacks.onEnd = [this](bool complete) { this->mOtaUpdater->endChunk(complete); };
+  subscribe(mOtaTopic + "/data", dataCallbacks);
+}
+
+void EspMQTTClient::enableMetricsPublishing(const unsigned long interval, const char* topic)
+{
+  if (topic != NULL)
+    mMetricsTopic = topic;
+  else
+  {
+    mMetricsTopic = mMqttClientName;
+    mMetricsTopic += METRICS_TOPIC_SUFFIX;
   }
 
-  // Old constructor support warning
-  if (mEnableSerialLogs && mShowLegacyConstructorWarning)
+  if (mMetricsPublishingHandle != 0)
+    cancelDelayedExecution(mMetricsPublishingHandle);
+  mMetricsPublishingHandle = executePeriodically(interval, [this]() { this->publishMetrics(); });
+}
+
+bool EspMQTTClient::addBroker(const char* mqttServerIp, const short mqttServerPort)
+{
+  if (mBrokerCount >= MAX_MQTT_BROKERS)
   {
-    mShowLegacyConstructorWarning = false;
-    Serial.print("SYS! You are using a constructor that will be deleted soon, please update your code with the new construction format.\n");
+    ESPMQTT_LOG_ERROR(mEnableSerialLogs, "SYS! Too many brokers, please change MAX_MQTT_BROKERS to a higher value. [%s] ignored.\n", mqttServerIp);
+    return false;
   }
 
+  BrokerEndpoint& broker = mBrokers[mBrokerCount++];
+  broker.host = mqttServerIp;
+  broker.port = mqttServerPort;
+  broker.latencyMillis = 0;
+  broker.failures = 0;
+  broker.lastFailureMillis = 0;
+  broker.isLiteral = broker.address.fromString(mqttServerIp);
+  broker.hasAddress = broker.isLiteral;
+  broker.resolvedMillis = 0;
+  broker.dnsState = DNS_IDLE;
+  broker.lookupStartMillis = 0;
+  return true;
 }
 
-bool EspMQTTClient::publish(const String &topic, const String &payload, bool retain)
+void EspMQTTClient::setDnsCache(const unsigned long ttl, const bool refreshInBackground)
 {
-  bool success = mMqttClient.publish(topic.c_str(), payload.c_str(), retain);
+  mDnsCacheTtl = ttl;
+  mDnsBackgroundRefresh = refreshInBackground;
+}
 
-  if (mEnableSerialLogs) 
-  {
-    if(success)
-      Serial.printf("MQTT << [%s] %s\n", topic.c_str(), payload.c_str());
+/**
+ * Without caCert nor fingerprint the connection is encrypted but the broker is not authenticated.
+ * The fingerprint is the SHA-1 of the certificate on ESP8266 and its SHA-256 on ESP32, as hexadecimal bytes.
+ * On ESP8266 the session is resumed on reconnection when the broker allows it, which saves most of the handshake;
+ * the ESP32 WiFiClientSecure does not expose the session so every connection does a full handshake.
+ */
+void EspMQTTClient::enableTls(const char* caCert, const char* fingerprint)
+{
+  if (mSecureClient == NULL)
+    mSecureClient = new WiFiClientSecure();
+  mTlsCaCert = caCert;
+  mTlsFingerprint = fingerprint;
+
+  #ifdef ESP8266
+    if (caCert != NULL)
+    {
+      if (mTlsTrustAnchors != NULL)
+        delete mTlsTrustAnchors;
+      mTlsTrustAnchors = new BearSSL::X509List(caCert);
+      mSecureClient->setTrustAnchors(mTlsTrustAnchors);
+    }
+    else if (fingerprint != NULL)
+      mSecureClient->setFingerprint(fingerprint);
     else
-      Serial.println("MQTT! publish failed, is the message too long ?"); // This can occurs if the message is too long according to the maximum defined in PubsubClient.h
-  }
+      mSecureClient->setInsecure();
 
-  return success;
+    if (mTlsSession == NULL)
+      mTlsSession = new BearSSL::Session();
+    mSecureClient->setSession(mTlsSession);
+  #else
+    if (caCert == NULL)
+      mSecureClient->setInsecure(); // The fingerprint is checked once connected
+  #endif
+
+  if (caCert == NULL && fingerprint == NULL)
+    ESPMQTT_LOG_ERROR(mEnableSerialLogs, "MQTT! TLS enabled without CA certificate nor fingerprint, the broker is not authenticated\n");
+
+  setNetworkClient(*mSecureClient);
 }
 
-bool EspMQTTClient::subscribe(const String &topic, MessageReceivedCallback messageReceivedCallback)
+// The client is connected with connect(IPAddress, port), the broker address being resolved by this class
+void EspMQTTClient::setNetworkClient(Client &client)
 {
-  // Check the possibility to add a new topic
-  if (mTopicSubscriptionListSize >= MAX_TOPIC_SUBSCRIPTION_LIST_SIZE) 
+  mNetworkClient = &client;
+  mTransport.setNetworkClient(client);
+}
+
+#ifdef ESP32
+/**
+ * The network task handles WiFi, the connections of this client and of its sessions, the web updater and the
+ * MQTT updates, so a slow sketch callback no longer delays the keepalives nor the socket reads. loop() must still
+ * be called: it calls the subscription callbacks, except the streamed ones which are called by the network task
+ * as the payload arrives, the connection established callbacks and the delayed executions.
+ * The messages are passed between the tasks through lock-free buffers, the sketch only holds the task mutex
+ * while it changes the subscriptions or streams a message with beginPublish().
+ */
+bool EspMQTTClient::enableNetworkTask(const size_t bufferBytes, const BaseType_t core, const UBaseType_t priority)
+{
+  if (mNetworkTask != NULL || mOwner != NULL)
   {
-    if (mEnableSerialLogs)
-      Serial.println("MQTT! Subscription list is full, ignored.");
+    ESPMQTT_LOG_ERROR(mEnableSerialLogs, "SYS! enableNetworkTask() can only be called once, on a client that is not a session. Ignored.\n");
     return false;
   }
 
-  // Check the duplicate of the subscription to the topic
-  bool found = false;
-  for (byte i = 0; i < mTopicSubscriptionListSize && !found; i++)
-    found = mTopicSubscriptionList[i].topic.equals(topic);
+  for (EspMQTTClient* session = this ; session != NULL ; session = session->mNextSession)
+  {
+    if (!session->mInboundMessages.begin(bufferBytes) || !session->mOutboundMessages.begin(bufferBytes))
+    {
+      ESPMQTT_LOG_ERROR(mEnableSerialLogs, "SYS! Unable to allocate the network task buffers.\n");
+      return false;
+    }
+  }
 
-  if (found) 
+  mNetworkMutex = xSemaphoreCreateRecursiveMutex();
+  if (mNetworkMutex == NULL)
   {
-    if (mEnableSerialLogs)
-      Serial.printf("MQTT! Subscribed to [%s] already, ignored.\n", topic.c_str());
+    ESPMQTT_LOG_ERROR(mEnableSerialLogs, "SYS! Unable to create the network task mutex.\n");
     return false;
   }
 
-  // All checks are passed - do the job
-  bool success = mMqttClient.subscribe(topic.c_str());
+  // The task waits for the mutex until every session knows it
+  TaskHandle_t task;
+  xSemaphoreTakeRecursive(mNetworkMutex, portMAX_DELAY);
+  if (xTaskCreatePinnedToCore(networkTask, "mqtt", MQTT_NETWORK_TASK_STACK_SIZE, this, priority, &task, core) != pdPASS)
+  {
+    ESPMQTT_LOG_ERROR(mEnableSerialLogs, "SYS! Unable to create the network task.\n");
+    xSemaphoreGiveRecursive(mNetworkMutex);
+    vSemaphoreDelete(mNetworkMutex);
+    mNetworkMutex = NULL;
+    return false;
+  }
 
-  if(success)
-    mTopicSubscriptionList[mTopicSubscriptionListSize++] = { topic, messageReceivedCallback, NULL };
-  
-  if (mEnableSerialLogs)
+  for (EspMQTTClient* session = this ; session != NULL ; session = session->mNextSession)
   {
-    if(success)
-      Serial.printf("MQTT: Subscribed to [%s]\n", topic.c_str());
-    else
-      Serial.println("MQTT! subscribe failed");
+    session->mNetworkMutex = mNetworkMutex;
+    session->mNetworkTask = task;
   }
+  xSemaphoreGiveRecursive(mNetworkMutex);
 
-  return success;
+  ESPMQTT_LOG_INFO(mEnableSerialLogs, "MQTT: Network task started on core %d\n", (int)core);
+  return true;
 }
+#endif
 
-bool EspMQTTClient::subscribe(const String &topic, MessageReceivedCallbackWithTopic messageReceivedCallback)
+/**
+ * The session keeps its own broker, credentials, subscriptions and callbacks. WiFi.status() is checked once per loop()
+ * for all the sessions, and the timers of the session are scheduled with the ones of this client. Timers created
+ * on the session before this call stay in its own scheduler, which is run by the loop() of this client too.
+ */
+void EspMQTTClient::addSession(EspMQTTClient &session)
 {
-  if(subscribe(topic, (MessageReceivedCallback)NULL))
+  if (&session == this || mOwner != NULL || session.mOwner != NULL || session.mNextSession != NULL)
   {
-    mTopicSubscriptionList[mTopicSubscriptionListSize-1].callbackWithTopic = messageReceivedCallback;
-    return true;
+    ESPMQTT_LOG_ERROR(mEnableSerialLogs, "SYS! A session can only be added once, to a client that is not a session itself. Ignored.\n");
+    return;
   }
-  return false;
+
+  if (session.mWifiSsid != NULL)
+  {
+    ESPMQTT_LOG_ERROR(mEnableSerialLogs, "SYS! The WiFi of a session is handled by its owner, its WiFi credentials are ignored.\n");
+    session.mWifiSsid = NULL;
+  }
+
+  #ifdef ESP32
+    if (mNetworkTask != NULL)
+    {
+      ESPMQTT_LOG_ERROR(mEnableSerialLogs, "SYS! Sessions must be added before enableNetworkTask(). Ignored.\n");
+      return;
+    }
+  #endif
+
+  EspMQTTClient* last = this;
+  while (last->mNextSession != NULL)
+    last = last->mNextSession;
+  last->mNextSession = &session;
+
+  session.mOwner = this;
+  session.mWifiConnected = mWifiConnected;
+  if (session.mDelayedExecutionScheduler.size() == 0)
+    session.mScheduler = mScheduler;
 }
 
-bool EspMQTTClient::unsubscribe(const String &topic)
+
+// =============== Public functions =================
+
+void EspMQTTClient::loop()
 {
-  bool found = false;
-  bool success = false;
+  // A session is handled by the loop() of its owner
+  if (mOwner != NULL)
+    return;
 
-  for (byte i = 0; i < mTopicSubscriptionListSize; i++)
-  {
-    if (!found)
+  // The network task handles the connections, the sketch callbacks are left to this loop
+  #ifdef ESP32
+    if (mNetworkTask != NULL)
     {
-      if (mTopicSubscriptionList[i].topic.equals(topic))
+      for (EspMQTTClient* session = this ; session != NULL ; session = session->mNextSession)
       {
-        found = true;
-        success = mMqttClient.unsubscribe(topic.c_str());
-
-        if (mEnableSerialLogs)
+        if (session->mStreamingPublish)
         {
-          if(success)
-            Serial.printf("MQTT: Unsubscribed from %s\n", topic.c_str());
-          else
-            Serial.println("MQTT! unsubscribe failed");
+          ESPMQTT_LOG_ERROR(mEnableSerialLogs, "MQTT! endPublish() was not called before loop().\n");
+          session->endPublish();
         }
+
+        session->dispatchInboundMessages();
+        if (session->mConnectionEstablishedPending.exchange(false))
+          session->mConnectionEstablishedCallback();
       }
-    }
 
-    if (found)
-    {
-      if ((i + 1) < MAX_TOPIC_SUBSCRIPTION_LIST_SIZE)
-        mTopicSubscriptionList[i] = mTopicSubscriptionList[i + 1];
+      runDelayedExecutions(millis());
+      return;
     }
-  }
-
-  if (found)
-    mTopicSubscriptionListSize--;
-  else if (mEnableSerialLogs)
-    Serial.println("MQTT! Topic cannot be found to unsubscribe, ignored.");
+  #endif
 
-  return success;
+  unsigned long loopStartMicros = micros();
+  handleNetwork(millis());
+  runDelayedExecutions(millis());
+  endLoop(loopStartMicros);
 }
 
-void EspMQTTClient::executeDelayed(const unsigned long delay, DelayedExecutionCallback callback)
+bool EspMQTTClient::publish(const char* topic, const uint8_t* payload, const size_t length, const bool retain, const byte qos)
 {
-  if (mDelayedExecutionListSize < MAX_DELAYED_EXECUTION_LIST_SIZE)
-  {
-    DelayedExecutionRecord delayedExecutionRecord;
-    delayedExecutionRecord.targetMillis = millis() + delay;
-    delayedExecutionRecord.callback = callback;
-    
-    mDelayedExecutionList[mDelayedExecutionListSize] = delayedExecutionRecord;
-    mDelayedExecutionListSize++;
-  }
-  else if (mEnableSerialLogs)
-    Serial.printf("SYS! The list of delayed functions is full.\n");
+  return publishMessage(topic, payload, length, retain, qos);
 }
 
+bool EspMQTTClient::setTopicPrefix(const char* prefix)
+{
+  if (mTopicRegistry.setPrefix(prefix))
+    return true;
 
-// ================== Private functions ====================-
+  ESPMQTT_LOG_ERROR(mEnableSerialLogs, "SYS! setTopicPrefix() must be called before the first registerTopic(), ignored.\n");
+  return false;
+}
 
-void EspMQTTClient::connectToWifi()
+MqttTopicHandle EspMQTTClient::registerTopic(const char* topic)
 {
-  WiFi.mode(WIFI_STA);
-  #ifdef ESP32
-    WiFi.setHostname(mMqttClientName);
-  #else
-    WiFi.hostname(mMqttClientName);
-  #endif
-  WiFi.begin(mWifiSsid, mWifiPassword);
+  MqttTopicHandle handle = mTopicRegistry.add(topic);
+  if (handle == 0)
+    ESPMQTT_LOG_ERROR(mEnableSerialLogs, "SYS! Unable to register the topic %s, it is empty or there are already %u topics.\n", topic, MQTT_MAX_TOPIC_HANDLES);
+  else
+    ESPMQTT_LOG_DEBUG(mEnableSerialLogs, "MQTT: Topic [%s] registered as %u\n", mTopicRegistry.topic(handle), handle);
 
-  if (mEnableSerialLogs)
-    Serial.printf("\nWiFi: Connecting to %s ... \n", mWifiSsid);
-  
-  mLastWifiConnectionAttemptMillis = millis();
+  return handle;
 }
 
-void EspMQTTClient::connectToMqttBroker()
+bool EspMQTTClient::publish(const MqttTopicHandle handle, const uint8_t* payload, const size_t length, const bool retain, const byte qos)
 {
-  if (mEnableSerialLogs)
-    Serial.printf("MQTT: Connecting to broker @%s ... ", mMqttServerIp);
-
-  if (mMqttClient.connect(mMqttClientName, mMqttUsername, mMqttPassword, mMqttLastWillTopic, 0, mMqttLastWillRetain, mMqttLastWillMessage, mMqttCleanSession))
+  const char* topic = mTopicRegistry.topic(handle);
+  if (topic == NULL)
   {
-    mMqttConnected = true;
-    
-    if (mEnableSerialLogs) 
-      Serial.println("ok.");
+    ESPMQTT_LOG_ERROR(mEnableSerialLogs, "MQTT! publish failed, %u is not a registered topic handle.\n", handle);
+    countPublishFailure();
+    return false;
+  }
+
+  return publishMessage(topic, payload, length, retain, qos);
+}
 
-    mConnectionEstablishedCount++;
-    mConnectionEstablishedCallback();
+bool EspMQTTClient::publish(const char* topic, MqttRecordBatch &batch, const bool retain, const byte qos)
+{
+  // The open record would be sent half written, then lost by clear()
+  if (batch.isRecordOpen())
+  {
+    ESPMQTT_LOG_ERROR(mEnableSerialLogs, "MQTT! publish failed, call endRecord() before publishing the batch.\n");
+    countPublishFailure();
+    return false;
   }
-  else if (mEnableSerialLogs)
+
+  if (batch.count() == 0)
+    return true;
+
+  if (!publishMessage(topic, batch.data(), batch.size(), retain, qos))
+    return false;
+
+  batch.clear();
+  return true;
+}
+
+bool EspMQTTClient::publishMessage(const char* topic, const uint8_t* payload, const size_t length, const bool retain, const byte qos)
+{
+  // This is also the case of a MqttTopicBuffer that overflowed
+  if (topic == NULL || topic[0] == '\0')
   {
-    Serial.print("unable to connect, ");
+    ESPMQTT_LOG_ERROR(mEnableSerialLogs, "MQTT! publish failed, the topic is empty.\n");
+    countPublishFailure();
+    return false;
+  }
 
-    switch (mMqttClient.state())
+  // With the network task, the message is copied for the task to send it
+  #ifdef ESP32
+    if (isSketchTask())
     {
-      case -4:
-        Serial.println("MQTT_CONNECTION_TIMEOUT");
-        break;
-      case -3:
-        Serial.println("MQTT_CONNECTION_LOST");
-        break;
-      case -2:
-        Serial.println("MQTT_CONNECT_FAILED");
-        break;
-      case -1:
-        Serial.println("MQTT_DISCONNECTED");
-        break;
-      case 1:
-        Serial.println("MQTT_CONNECT_BAD_PROTOCOL");
-        break;
-      case 2:
-        Serial.println("MQTT_CONNECT_BAD_CLIENT_ID");
-        break;
-      case 3:
-        Serial.println("MQTT_CONNECT_UNAVAILABLE");
-        break;
-      case 4:
-        Serial.println("MQTT_CONNECT_BAD_CREDENTIALS");
-        break;
-      case 5:
-        Serial.println("MQTT_CONNECT_UNAUTHORIZED");
-        break;
+      byte flags = (retain ? MqttPublishQueue::FLAG_RETAIN : 0) | (qos > 0 ? MqttPublishQueue::FLAG_QOS1 : 0);
+      if (mOutboundMessages.push(topic, payload, length, flags))
+        return true;
+
+      ESPMQTT_LOG_ERROR(mEnableSerialLogs, "MQTT! publish failed, the network task buffer is full.\n");
+      countPublishFailure();
+      return false;
+    }
+  #endif
+
+  // A message held by its policy is sent by loop() once its topic is allowed to send again
+  if (mPublishLimiter.isEnabled())
+  {
+    byte flags = (retain ? MqttPublishQueue::FLAG_RETAIN : 0) | (qos > 0 ? MqttPublishQueue::FLAG_QOS1 : 0);
+    MqttPublishLimiter::Decision decision = mPublishLimiter.submit(topic, payload, length, flags, millis());
+    if (decision != MqttPublishLimiter::SEND)
+    {
+      ESPMQTT_LOG_DEBUG(mEnableSerialLogs, "MQTT: Message for [%s] %s by its publish policy\n", topic, decision == MqttPublishLimiter::HELD ? "held" : "suppressed");
+      return true;
     }
   }
-  
-  mLastMqttConnectionMillis = millis();
-}
 
-/**
- * Matching MQTT topics, handling the eventual presence of a single wildcard character
- *
- * @param topic1 is the topic may contain a wildcard
- * @param topic2 must not contain wildcards
- * @return true on MQTT topic match, false otherwise
- */
-bool EspMQTTClient::mqttTopicMatch(const String &topic1, const String &topic2) {
-	//Serial.println(String("Comparing: ") + topic1 + " and " + topic2);
-	int i = 0;
-	if((i = topic1.indexOf('#')) >= 0) {
-		//Serial.print("# detected at position "); Serial.println(i);
-		String t1a = topic1.substring(0, i);
-		String t1b = topic1.substring(i+1);
-		//Serial.println(String("t1a: ") + t1a);
-		//Serial.println(String("t1b: ") + t1b);
-		if((t1a.length() == 0 || topic2.startsWith(t1a))&&
-		   (t1b.length() == 0 || topic2.endsWith(t1b)))
-		   return true;
-	} else if((i= topic1.indexOf('+')) >= 0) {
-		//Serial.print("+ detected at position "); Serial.println(i);
-		String t1a = topic1.substring(0, i);
-		String t1b = topic1.substring(i+1);
-		//Serial.println(String("t1a: ") + t1a);
-		//Serial.println(String("t1b: ") + t1b);
-		if((t1a.length() == 0 || topic2.startsWith(t1a))&&
-		   (t1b.length() == 0 || topic2.endsWith(t1b))) {
-			if(topic2.substring(t1a.length(), topic2.length()-t1b.length()).indexOf('/') == -1)
-				return true;
-		}
-
-	} else {
-		return topic1.equals(topic2);
-	}
-	return false;
+  return sendMessage(topic, payload, length, retain, qos);
 }
 
-void EspMQTTClient::mqttMessageReceivedCallback(char* topic, byte* payload, unsigned int length)
+bool EspMQTTClient::sendMessage(const char* topic, const uint8_t* payload, const size_t length, const bool retain, const byte qos)
 {
-  // Convert the payload into a String
-  // First, We ensure that we dont bypass the maximum size of the PubSubClient library buffer that originated the payload
-  // This buffer has a maximum length of MQTT_MAX_PACKET_SIZE and the payload begin at "headerSize + topicLength + 1"
-  unsigned int strTerminationPos;
-  if (strlen(topic) + length + 9 >= MQTT_MAX_PACKET_SIZE)
-  {
-    strTerminationPos = length - 1;
+  if (qos > 0)
+    return publishQos1(topic, payload, length, retain);
 
-    if (mEnableSerialLogs)
-      Serial.print("MQTT! Your message may be truncated, please change MQTT_MAX_PACKET_SIZE of PubSubClient.h to a higher value.\n");
-  }
+  // Once messages are queued, the next ones are queued too until the queue is drained by loop(), to keep them in order
+  if (mPublishQueue.isEnabled() && (!mMqttConnected || !mPublishQueue.isEmpty()))
+    return enqueuePublish(topic, payload, length, retain ? MqttPublishQueue::FLAG_RETAIN : 0);
+
+  bool success = mMqttClient.publish(topic, payload, length, retain);
+
+  // The message is kept for later if it failed because the socket was busy
+  if (!success && mPublishQueue.isEnabled() && fitsInPacket(topic, length))
+    return enqueuePublish(topic, payload, length, retain ? MqttPublishQueue::FLAG_RETAIN : 0);
+
+  if (success)
+    mMetrics.messagesOut++;
   else
-    strTerminationPos = length;
+    mMetrics.publishFailures++;
 
-  // Second, we add the string termination code at the end of the payload and we convert it to a String object
-  payload[strTerminationPos] = '\0';
-  String payloadStr((char*)payload);
-  String topicStr(topic);
+  if(success)
+    ESPMQTT_LOG_DEBUG(mEnableSerialLogs, "MQTT << [%s] %.*s\n", topic, (int)length, (const char*)payload);
+  else
+    ESPMQTT_LOG_ERROR(mEnableSerialLogs, "MQTT! publish failed, is the message too long ?\n"); // This can occurs if the message is too long according to the maximum defined in PubsubClient.h
 
-  // Logging
-  if (mEnableSerialLogs)
-    Serial.printf("MQTT >> [%s] %s\n", topic, payloadStr.c_str());
+  return success;
+}
 
-  // Send the message to subscribers
-  for (byte i = 0 ; i < mTopicSubscriptionListSize ; i++)
+// With the network task, the task is kept out until endPublish()
+bool EspMQTTClient::beginPublish(const char* topic, const size_t length, const bool retain)
+{
+  if (mStreamingPublish)
+  {
+    ESPMQTT_LOG_ERROR(mEnableSerialLogs, "MQTT! beginPublish() called before endPublish(), ignored.\n");
+    return false;
+  }
+
+  lockNetwork();
+  if (!mMqttConnected || !mMqttClient.beginPublish(topic, length, retain))
+  {
+    ESPMQTT_LOG_ERROR(mEnableSerialLogs, "MQTT! beginPublish failed, not connected.\n");
+    mMetrics.publishFailures++;
+    unlockNetwork();
+    return false;
+  }
+
+  ESPMQTT_LOG_DEBUG(mEnableSerialLogs, "MQTT << [%s] streaming %u bytes\n", topic, (unsigned int)length);
+
+  mStreamingPublish = true;
+  mStreamingPublishRemaining = length;
+  return true;
+}
+
+size_t EspMQTTClient::write(const uint8_t* data, const size_t length)
+{
+  if (!mStreamingPublish)
+    return 0;
+
+  // Bytes past the announced length would be read by the broker as the next packet
+  size_t count = length < mStreamingPublishRemaining ? length : mStreamingPublishRemaining;
+  if (count == 0)
+    return 0;
+
+  size_t written = mMqttClient.write(data, count);
+  mStreamingPublishRemaining -= written;
+  return written;
+}
+
+bool EspMQTTClient::endPublish()
+{
+  if (!mStreamingPublish)
+    return false;
+  mStreamingPublish = false;
+
+  // The broker waits for the announced length, a shorter message can only be abandoned by closing the connection
+  bool success = mStreamingPublishRemaining == 0 && mMqttClient.endPublish();
+  if (success)
+    mMetrics.messagesOut++;
+  else
+  {
+    ESPMQTT_LOG_ERROR(mEnableSerialLogs, "MQTT! Streamed publish incomplete, %u bytes missing, closing the connection.\n", (unsigned int)mStreamingPublishRemaining);
+    mTransport.stop();
+    mMetrics.publishFailures++;
+  }
+
+  unlockNetwork();
+  return success;
+}
+
+bool EspMQTTClient::publish(const char* topic, const size_t length, PublishPayloadProducer producer, const bool retain)
+{
+  if (!beginPublish(topic, length, retain))
+    return false;
+
+  uint8_t chunk[STREAMED_PUBLISH_CHUNK_SIZE];
+  while (mStreamingPublishRemaining > 0)
+  {
+    size_t maxLength = mStreamingPublishRemaining < sizeof(chunk) ? mStreamingPublishRemaining : sizeof(chunk);
+    size_t produced = producer(chunk, maxLength);
+    if (produced == 0 || produced > maxLength || write(chunk, produced) != produced)
+      break;
+  }
+
+  return endPublish();
+}
+
+// With the network task, the subscriptions are only changed while the task is kept out
+bool EspMQTTClient::subscribe(const char* topic, MessageReceivedCallback messageReceivedCallback)
+{
+  NetworkLock lock(this);
+  TopicSubscriptionRecord* subscription = addSubscription(topic);
+  if (subscription == NULL)
+    return false;
+
+  subscription->setCallback(messageReceivedCallback);
+  return true;
+}
+
+bool EspMQTTClient::subscribe(const char* topic, MessageReceivedCallbackWithTopic messageReceivedCallback)
+{
+  NetworkLock lock(this);
+  TopicSubscriptionRecord* subscription = addSubscription(topic);
+  if (subscription == NULL)
+    return false;
+
+  subscription->setCallback(messageReceivedCallback);
+  return true;
+}
+
+bool EspMQTTClient::subscribe(const char* topic, MessageReceivedCallbackRaw messageReceivedCallback)
+{
+  NetworkLock lock(this);
+  TopicSubscriptionRecord* subscription = addSubscription(topic);
+  if (subscription == NULL)
+    return false;
+
+  subscription->setCallback(messageReceivedCallback);
+  return true;
+}
+
+/**
+ * Once a streamed subscription is made, the transport frames the incoming packets and diverts the PUBLISH packets
+ * larger than the PubSubClient buffer, which would be dropped otherwise.
+ */
+bool EspMQTTClient::subscribe(const char* topic, const MessageStreamCallbacks &messageStreamCallbacks)
+{
+  NetworkLock lock(this);
+  if (!mTransport.setStreamHandler(MQTT_MAX_PACKET_SIZE, streamedMessageReceived, this))
+  {
+    ESPMQTT_LOG_ERROR(mEnableSerialLogs, "SYS! Unable to allocate the stream buffer, subscription ignored.\n");
+    return false;
+  }
+
+  TopicSubscriptionRecord* subscription = addSubscription(topic);
+  if (subscription == NULL)
+    return false;
+
+  subscription->setCallback(messageStreamCallbacks);
+  return true;
+}
+
+bool EspMQTTClient::unsubscribe(const char* topic)
+{
+  NetworkLock lock(this);
+  int index = mTopicSubscriptionTrie.find(topic);
+
+  if (index < 0 || mTopicSubscriptionList[index].removed)
+  {
+    ESPMQTT_LOG_ERROR(mEnableSerialLogs, "MQTT! Topic cannot be found to unsubscribe, ignored.\n");
+    return false;
+  }
+
+  // When disconnected, removing the topic from the table is enough as it will not be subscribed again
+  bool success = true;
+  if (mMqttConnected)
+  {
+    success = mMqttClient.unsubscribe(topic);
+
+    if(success)
+      ESPMQTT_LOG_INFO(mEnableSerialLogs, "MQTT: Unsubscribed from %s\n", topic);
+    else
+      ESPMQTT_LOG_ERROR(mEnableSerialLogs, "MQTT! unsubscribe failed\n");
+  }
+
+  removeSubscription(index);
+
+  return success;
+}
+
+size_t EspMQTTClient::getSubscriptionsMemoryUsage() const
+{
+  size_t usage = mTopicSubscriptionListCapacity * sizeof(TopicSubscriptionRecord) + mTopicSubscriptionTrie.memoryUsage();
+  for (unsigned int i = 0 ; i < mTopicSubscriptionListSize ; i++)
+  {
+    usage += strlen(mTopicSubscriptionList[i].topic) + 1;
+    if (mTopicSubscriptionList[i].callbackType == TopicSubscriptionRecord::CALLBACK_STREAM)
+      usage += sizeof(MessageStreamCallbacks);
+  }
+  return usage;
+}
+
+// With the network task, the sketch gets a copy made while the task is kept out
+const MqttClientMetrics& EspMQTTClient::getMetrics()
+{
+  NetworkLock lock(this);
+  mMetrics.bytesIn = mTransport.bytesRead();
+  mMetrics.bytesOut = mTransport.bytesWritten();
+
+  #ifdef ESP32
+    mMetrics.publishFailures += mSketchPublishFailures.exchange(0);
+    if (isSketchTask())
+    {
+      mMetricsSnapshot = mMetrics;
+      return mMetricsSnapshot;
+    }
+  #endif
+
+  return mMetrics;
+}
+
+void EspMQTTClient::resetMetrics()
+{
+  NetworkLock lock(this);
+  mMetrics.reset();
+  mTransport.resetByteCounters();
+
+  #ifdef ESP32
+    mSketchPublishFailures = 0;
+  #endif
+}
+
+// The publish() calls failing before the message reaches the network task
+void EspMQTTClient::countPublishFailure()
+{
+  #ifdef ESP32
+    if (isSketchTask())
+    {
+      mSketchPublishFailures++;
+      return;
+    }
+  #endif
+
+  mMetrics.publishFailures++;
+}
+
+DelayedExecutionHandle EspMQTTClient::executeDelayed(const unsigned long delay, DelayedExecutionCallback callback)
+{
+  return mScheduler->schedule(millis(), delay, 0, callback);
+}
+
+DelayedExecutionHandle EspMQTTClient::executePeriodically(const unsigned long period, DelayedExecutionCallback callback)
+{
+  if (period == 0)
+  {
+    ESPMQTT_LOG_ERROR(mEnableSerialLogs, "SYS! The period of executePeriodically() can't be 0, ignored.\n");
+    return 0;
+  }
+  return mScheduler->schedule(millis(), period, period, callback);
+}
+
+bool EspMQTTClient::cancelDelayedExecution(const DelayedExecutionHandle handle)
+{
+  return mScheduler->cancel(handle);
+}
+
+
+// ================== Private functions ====================-
+
+EspMQTTClient::TopicSubscriptionRecord* EspMQTTClient::addSubscription(const char* topic)
+{
+  // The table is allocated once, at the capacity set by setMaxTopicSubscriptions()
+  if (mTopicSubscriptionList == NULL)
+    mTopicSubscriptionList = new TopicSubscriptionRecord[mTopicSubscriptionListCapacity];
+
+  // A subscription already in the table only get its callback replaced, this is the case when a sketch subscribes
+  // again in onConnectionEstablished() after a reconnection
+  int index = mTopicSubscriptionTrie.find(topic);
+  if (index >= 0 && mDispatchDepth == 0)
+  {
+    ESPMQTT_LOG_INFO(mEnableSerialLogs, "MQTT: Subscribed to [%s] already, callback updated.\n", topic);
+    return &mTopicSubscriptionList[index];
+  }
+
+  // Check the possibility to add a new topic
+  if (mTopicSubscriptionListSize >= mTopicSubscriptionListCapacity) 
+  {
+    ESPMQTT_LOG_ERROR(mEnableSerialLogs, "MQTT! Subscription list is full, ignored.\n");
+    return NULL;
+  }
+
+  // Check the validity of the topic filter, the routing table only accept filters respecting the MQTT specification.
+  // Inserting never frees a node, so it is done even while the table is walked by a dispatch
+  if (index < 0 && !mTopicSubscriptionTrie.insert(topic, mTopicSubscriptionListSize))
+  {
+    ESPMQTT_LOG_ERROR(mEnableSerialLogs, "MQTT! [%s] is not a valid topic filter, ignored.\n", topic);
+    return NULL;
+  }
+
+  // All checks are passed - do the job, or let resubscribe() do it once connected.
+  // A subscription still in the table is already subscribed, unless it was unsubscribed during this dispatch
+  if (mMqttConnected && (index < 0 || mTopicSubscriptionList[index].removed))
+  {
+    bool success = mMqttClient.subscribe(topic);
+
+    if(success)
+      ESPMQTT_LOG_INFO(mEnableSerialLogs, "MQTT: Subscribed to [%s]\n", topic);
+    else
+      ESPMQTT_LOG_ERROR(mEnableSerialLogs, "MQTT! subscribe failed\n");
+
+    // The nodes just inserted are not being walked, removing them is safe during a dispatch
+    if (!success)
+    {
+      if (index < 0)
+        mTopicSubscriptionTrie.remove(topic);
+      return NULL;
+    }
+  }
+  else if (!mMqttConnected)
+    ESPMQTT_LOG_INFO(mEnableSerialLogs, "MQTT: [%s] will be subscribed once connected\n", topic);
+
+  // During a dispatch the callback of the existing record may be running, it is replaced by a new record
+  if (index >= 0)
+  {
+    ESPMQTT_LOG_INFO(mEnableSerialLogs, "MQTT: Subscribed to [%s] already, callback updated.\n", topic);
+    mTopicSubscriptionList[index].removed = true;
+    mHasRemovedSubscriptions = true;
+    mTopicSubscriptionTrie.setValue(topic, mTopicSubscriptionListSize);
+  }
+
+  TopicSubscriptionRecord& subscription = mTopicSubscriptionList[mTopicSubscriptionListSize++];
+  subscription.topic = strdup(topic);
+  return &subscription;
+}
+
+/**
+ * Swap-remove, the last record take the place of the removed one.
+ * While a message is dispatched the record is only marked as removed, endDispatch() removes it afterwards.
+ */
+void EspMQTTClient::removeSubscription(const unsigned int index)
+{
+  if (mDispatchDepth > 0)
+  {
+    mTopicSubscriptionList[index].removed = true;
+    mHasRemovedSubscriptions = true;
+    return;
+  }
+
+  // A record replaced during a dispatch no longer owns its topic in the routing table
+  if (mTopicSubscriptionTrie.find(mTopicSubscriptionList[index].topic) == (int)index)
+    mTopicSubscriptionTrie.remove(mTopicSubscriptionList[index].topic);
+  mTopicSubscriptionListSize--;
+
+  if (index != mTopicSubscriptionListSize)
+  {
+    mTopicSubscriptionList[index].moveFrom(mTopicSubscriptionList[mTopicSubscriptionListSize]);
+    mTopicSubscriptionTrie.setValue(mTopicSubscriptionList[index].topic, index);
+  }
+  else
+    mTopicSubscriptionList[index].reset();
+}
+
+/**
+ * Subscribe again to every topic of the table, with as many topics per SUBSCRIBE packet as MQTT_MAX_PACKET_SIZE allows.
+ * PubSubClient only sends one topic per packet, so the packets are built here and written directly to the socket.
+ */
+void EspMQTTClient::resubscribe()
+{
+  uint8_t buffer[MQTT_MAX_PACKET_SIZE];
+  MqttPacketBuilder packet(buffer, sizeof(buffer));
+  unsigned int packetCount = 0;
+
+  for (unsigned int i = 0 ; i < mTopicSubscriptionListSize ; i++)
+  {
+    const char* topic = mTopicSubscriptionList[i].topic;
+    size_t topicLength = strlen(topic);
+    size_t topicSize = MqttPacketBuilder::stringSize(topicLength) + 1; // Followed by the requested QoS
+
+    if (!packet.isEmpty() && packet.remaining() < topicSize)
+    {
+      if (sendPacket(packet))
+        packetCount++;
+      packet.begin(0);
+    }
+
+    if (packet.isEmpty())
+    {
+      packet.begin(MQTTSUBSCRIBE | MQTTQOS1);
+      packet.writeUint16(nextPacketId());
+    }
+
+    if (packet.remaining() < topicSize)
+    {
+      ESPMQTT_LOG_ERROR(mEnableSerialLogs, "MQTT! [%s] is too long to be subscribed, please change MQTT_MAX_PACKET_SIZE of PubSubClient.h to a higher value.\n", topic);
+      continue;
+    }
+
+    packet.writeString(topic, topicLength);
+    packet.writeByte(0);
+  }
+
+  if (!packet.isEmpty() && sendPacket(packet))
+    packetCount++;
+
+  if (mTopicSubscriptionListSize > 0)
+    ESPMQTT_LOG_INFO(mEnableSerialLogs, "MQTT: Subscribed again to %u topics in %u packets\n", mTopicSubscriptionListSize, packetCount);
+}
+
+bool EspMQTTClient::enqueuePublish(const char* topic, const uint8_t* payload, const size_t length, const byte flags)
+{
+  if (!fitsInPacket(topic, length))
+  {
+    ESPMQTT_LOG_ERROR(mEnableSerialLogs, "MQTT! publish failed, is the message too long ?\n");
+    mMetrics.publishFailures++;
+    return false;
+  }
+
+  bool success = mPublishQueue.push(topic, payload, length, flags);
+  if (!success)
+    mMetrics.publishFailures++;
+
+  if (success)
+    ESPMQTT_LOG_DEBUG(mEnableSerialLogs, "MQTT: Queued message for [%s], %u in queue\n", topic, mPublishQueue.count());
+  else
+    ESPMQTT_LOG_ERROR(mEnableSerialLogs, "MQTT! Publish queue is full, message dropped.\n");
+
+  return success;
+}
+
+// WiFi, broker connections and updaters, from loop() or from the network task
+void EspMQTTClient::handleNetwork(const unsigned long currentMillis)
+{
+  if (WiFi.status() == WL_CONNECTED)
+  {
+    // If we just being connected to wifi
+    if (!mWifiConnected)
+    {
+      ESPMQTT_LOG_INFO(mEnableSerialLogs, "WiFi: Connected, ip : %s\n", WiFi.localIP().toString().c_str());
+
+      mWifiConnecting = false;
+      mWifiBackoff.reset();
+      
+      // Config of web updater
+      if (mHttpServer != NULL)
+      {
+        MDNS.begin(mMqttClientName);
+        mHttpUpdater->setup(mHttpServer, mUpdateServerAddress, mUpdateServerUsername, mUpdateServerPassword);
+        mHttpServer->begin();
+        MDNS.addService("http", "tcp", 80);
+      
+        ESPMQTT_LOG_INFO(mEnableSerialLogs, "WEB: Updater ready, open http://%s.local in your browser and login with username '%s' and password '%s'.\n", mMqttClientName, mUpdateServerUsername, mUpdateServerPassword);
+      }
+  
+      setWifiConnected(true);
+    }
+  }
+  else // If we are not connected to wifi
+  {
+    if (mWifiConnected) 
+    {
+      ESPMQTT_LOG_ERROR(mEnableSerialLogs, "WiFi! Lost connection.\n");
+      
+      setWifiConnected(false);
+
+      // If we handle wifi, we force disconnection to clear the last connection
+      if (mWifiSsid != NULL)
+        WiFi.disconnect();
+    }
+    
+    // We connect to the wifi if we handle it, right after the connection is lost, then after each backoff delay
+    if (mWifiSsid != NULL && (!mWifiConnecting || currentMillis - mLastWifiConnectionAttemptMillis >= mWifiRetryDelay))
+      connectToWifi();
+  }
+
+  // MQTT handling, for this client then for the sessions added to it
+  for (EspMQTTClient* session = this ; session != NULL ; session = session->mNextSession)
+    session->handleSession(currentMillis);
+
+  // Web updater handling
+  if (mWifiConnected && mHttpServer != NULL)
+  {
+    mHttpServer->handleClient();
+    #ifdef ESP8266
+      MDNS.update(); // We need to do this only for ESP8266
+    #else
+      mHttpUpdater->loop(); // Restart once the response to a successful update is sent
+    #endif
+  }
+}
+
+void EspMQTTClient::runDelayedExecutions(const unsigned long currentMillis)
+{
+  // Delayed execution handling, the sessions only have their own timers if they were created before addSession()
+  for (EspMQTTClient* session = this ; session != NULL ; session = session->mNextSession)
+  {
+    if (session->mDelayedExecutionScheduler.isDue(currentMillis))
+      session->mDelayedExecutionScheduler.run(currentMillis);
+  }
+}
+
+// Logs and metrics, at the end of each loop() or of each iteration of the network task
+void EspMQTTClient::endLoop(const unsigned long loopStartMicros)
+{
+  // Old constructor support warning
+  if (mEnableSerialLogs && mShowLegacyConstructorWarning)
+  {
+    mShowLegacyConstructorWarning = false;
+    ESPMQTT_LOG_ERROR(true, "SYS! You are using a constructor that will be deleted soon, please update your code with the new construction format.\n");
+  }
+
+  // Logs are written to the serial port only as fast as its transmit buffer accepts them, so logging never blocks
+  #if ESPMQTT_LOG_LEVEL > ESPMQTT_LOG_LEVEL_NONE
+    if (!MqttLog.isEmpty())
+      MqttLog.drain(Serial, Serial.availableForWrite());
+  #endif
+
+  // Metrics, the loop is shared by the sessions so its duration is recorded for each of them
+  uint32_t freeHeap = ESP.getFreeHeap();
+  unsigned long loopMicros = micros() - loopStartMicros;
+  for (EspMQTTClient* session = this ; session != NULL ; session = session->mNextSession)
+  {
+    if (freeHeap < session->mMetrics.minFreeHeap)
+      session->mMetrics.minFreeHeap = freeHeap;
+    session->mMetrics.recordLoopDuration(loopMicros);
+  }
+}
+
+// Connection to the broker and traffic of one session, WiFi being handled by the loop() of the owner
+void EspMQTTClient::handleSession(const unsigned long currentMillis)
+{
+  #ifdef ESP32
+    if (mNetworkTask != NULL)
+      sendOutboundMessages();
+  #endif
+
+  // A streamed publish left open would be corrupted by the packets sent from this loop
+  if (mStreamingPublish)
+  {
+    ESPMQTT_LOG_ERROR(mEnableSerialLogs, "MQTT! endPublish() was not called before loop().\n");
+    endPublish();
+  }
+
+  if (mPublishLimiter.isDue(currentMillis))
+    mPublishLimiter.flush(currentMillis, sendHeldMessage, this);
+
+  if (mWifiConnected)
+  {
+    if (mDnsBackgroundRefresh)
+      refreshBrokerAddresses(currentMillis);
+
+    if (mMqttConnected && !mMqttClient.connected())
+    {
+      ESPMQTT_LOG_ERROR(mEnableSerialLogs, "MQTT! Lost connection.\n");
+
+      mTransport.stop();
+      mMqttConnected = false;
+      mMqttConnectionState = MQTT_STATE_DISCONNECTED;
+
+      // Another broker is tried right away, otherwise the devices losing their connection at the same time,
+      // like on a broker restart, must not all reconnect at once
+      mLastMqttConnectionMillis = currentMillis;
+      mMqttRetryDelay = brokerFailed(currentMillis);
+    }
+
+    if (mMqttConnected)
+    {
+      mMqttClient.loop();
+
+      if (!mPublishQueue.isEmpty())
+        processPublishQueue();
+    }
+    else
+      handleMqttConnection(currentMillis);
+  }
+
+  // MQTT update handling, the chunks received by this loop are written to flash
+  if (mOtaUpdater != NULL)
+    handleOtaUpdate();
+}
+
+void EspMQTTClient::setWifiConnected(const bool connected)
+{
+  for (EspMQTTClient* session = this ; session != NULL ; session = session->mNextSession)
+  {
+    session->mWifiConnected = connected;
+
+    // A connection to the broker in progress can't succeed anymore
+    if (!connected && session->mMqttConnectionState != MQTT_STATE_CONNECTED && session->mMqttConnectionState != MQTT_STATE_DISCONNECTED)
+    {
+      session->mTransport.stop();
+      session->mMqttConnectionState = MQTT_STATE_DISCONNECTED;
+    }
+  }
+}
+
+bool EspMQTTClient::sendHeldMessage(const char* topic, const uint8_t* payload, size_t length, byte flags, void* context)
+{
+  EspMQTTClient* client = (EspMQTTClient*)context;
+  return client->sendMessage(topic, payload, length, flags & MqttPublishQueue::FLAG_RETAIN, (flags & MqttPublishQueue::FLAG_QOS1) ? 1 : 0);
+}
+
+// Send the queued messages, at most mPublishQueueMaxMessagesPerLoop at each loop() to let the sketch run while a large queue is drained
+void EspMQTTClient::processPublishQueue()
+{
+  const char* topic;
+  const uint8_t* payload;
+  size_t length;
+  byte flags;
+
+  for (unsigned int i = 0 ; i < mPublishQueueMaxMessagesPerLoop && mPublishQueue.front(&topic, &payload, &length, &flags) ; i++)
+  {
+    if (flags & MqttPublishQueue::FLAG_QOS1)
+    {
+      // Kept in the queue until the window opens, so the messages stay in order
+      if (!mTransport.connected() || mInflightMessages.count() >= mQos1WindowSize || !sendQos1(topic, payload, length, flags))
+        break;
+    }
+    else
+    {
+      // If the socket is busy, we retry at the next loop
+      if (!mMqttClient.publish(topic, payload, length, flags & MqttPublishQueue::FLAG_RETAIN))
+        break;
+
+      ESPMQTT_LOG_DEBUG(mEnableSerialLogs, "MQTT << [%s] %.*s\n", topic, (int)length, (const char*)payload);
+      mMetrics.messagesOut++;
+    }
+
+    mPublishQueue.pop(true);
+  }
+}
+
+/**
+ * QoS 1 messages are sent while fewer than mQos1WindowSize messages wait for their PUBACK.
+ * Past this window they go through the publish queue if it is enabled, and fail otherwise.
+ */
+bool EspMQTTClient::publishQos1(const char* topic, const uint8_t* payload, const size_t length, const bool retain)
+{
+  if (!mInflightMessages.isEnabled())
+  {
+    ESPMQTT_LOG_ERROR(mEnableSerialLogs, "SYS! enableQos1Publish() must be called before publishing with QoS 1.\n");
+    mMetrics.publishFailures++;
+    return false;
+  }
+
+  // The packet id takes 2 more bytes than a QoS 0 message
+  if (!fitsInPacket(topic, length + 2))
+  {
+    ESPMQTT_LOG_ERROR(mEnableSerialLogs, "MQTT! publish failed, is the message too long ?\n");
+    mMetrics.publishFailures++;
+    return false;
+  }
+
+  byte flags = MqttPublishQueue::FLAG_QOS1 | (retain ? MqttPublishQueue::FLAG_RETAIN : 0);
+  if (mMqttConnected && mPublishQueue.isEmpty() && mInflightMessages.count() < mQos1WindowSize && sendQos1(topic, payload, length, flags))
+    return true;
+
+  if (mPublishQueue.isEnabled())
+    return enqueuePublish(topic, payload, length, flags);
+
+  ESPMQTT_LOG_ERROR(mEnableSerialLogs, "MQTT! QoS 1 publish failed, %s.\n", mMqttConnected ? "too many messages waiting for their PUBACK" : "not connected");
+  mMetrics.publishFailures++;
+  return false;
+}
+
+// The message is kept until its PUBACK is received, return false if there is no room to keep it
+bool EspMQTTClient::sendQos1(const char* topic, const uint8_t* payload, const size_t length, const byte flags)
+{
+  uint16_t packetId = nextPacketId();
+  if (!mInflightMessages.push(topic, payload, length, flags, packetId))
+    return false;
+
+  if (mInflightJournal.isEnabled())
+    mInflightJournal.appendPublish(topic, payload, length, flags, packetId);
+
+  // A partially written packet can't be completed, the message will be sent again on reconnection
+  if (!writeQos1Packet(topic, payload, length, flags, packetId, false))
+  {
+    ESPMQTT_LOG_ERROR(mEnableSerialLogs, "MQTT! Unable to write the message, closing the connection.\n");
+    mTransport.stop();
+  }
+  else
+    ESPMQTT_LOG_DEBUG(mEnableSerialLogs, "MQTT << [%s] %.*s (QoS 1, id %u)\n", topic, (int)length, (const char*)payload, packetId);
+
+  mMetrics.messagesOut++;
+  return true;
+}
+
+// PubSubClient can only publish with QoS 0, so the packet is built here and written directly to the socket
+bool EspMQTTClient::writeQos1Packet(const char* topic, const uint8_t* payload, const size_t length, const byte flags, const uint16_t packetId, const bool dup)
+{
+  uint8_t buffer[MQTT_MAX_PACKET_SIZE];
+  MqttPacketBuilder packet(buffer, sizeof(buffer));
+
+  uint8_t header = MQTTPUBLISH | MQTTQOS1;
+  if (flags & MqttPublishQueue::FLAG_RETAIN)
+    header |= 0x01;
+  if (dup)
+    header |= 0x08;
+
+  packet.begin(header);
+  return
+    packet.writeString(topic, strlen(topic)) &&
+    packet.writeUint16(packetId) &&
+    packet.writeBytes(payload, length) &&
+    sendPacket(packet);
+}
+
+// The messages sent during the previous connection, or before a reboot, may not have reached the broker
+void EspMQTTClient::retransmitInflightMessages()
+{
+  if (mInflightMessages.isEmpty())
+    return;
+
+  ESPMQTT_LOG_INFO(mEnableSerialLogs, "MQTT: Sending again %u messages waiting for their PUBACK\n", mInflightMessages.count());
+  mInflightMessages.forEach(retransmitInflightMessage, this);
+}
+
+void EspMQTTClient::retransmitInflightMessage(const char* topic, const uint8_t* payload, size_t length, byte flags, uint16_t packetId, void* context)
+{
+  ((EspMQTTClient*)context)->writeQos1Packet(topic, payload, length, flags, packetId, true);
+}
+
+void EspMQTTClient::pubackReceived(uint16_t packetId, void* context)
+{
+  EspMQTTClient* client = (EspMQTTClient*)context;
+
+  // A message sent again on reconnection can be acknowledged twice
+  if (!client->mInflightMessages.acknowledge(packetId))
+    return;
+
+  ESPMQTT_LOG_DEBUG(client->mEnableSerialLogs, "MQTT: PUBACK for id %u, %u still waiting\n", packetId, client->mInflightMessages.count());
+
+  if (client->mInflightJournal.isEnabled())
+    client->mInflightJournal.appendAck(packetId, client->mInflightMessages);
+}
+
+/**
+ * Publish the metrics as a JSON object. It is streamed with beginPublish() as it can be larger than MQTT_MAX_PACKET_SIZE.
+ * Nothing is sent nor queued while disconnected, the next period will carry up to date values anyway.
+ */
+void EspMQTTClient::publishMetrics()
+{
+  NetworkLock lock(this);
+  if (!mMqttConnected)
+    return;
+
+  const MqttClientMetrics& metrics = getMetrics();
+  char json[768];
+  int length = snprintf(json, sizeof(json),
+    "{\"uptime\":%lu,\"messagesIn\":%lu,\"messagesOut\":%lu,\"bytesIn\":%lu,\"bytesOut\":%lu,\"publishFailures\":%lu,"
+    "\"reconnects\":%lu,\"connectMillis\":%lu,\"loopMaxMicros\":%lu,\"callbacks\":%lu,\"callbackTotalMicros\":%lu,"
+    "\"callbackMaxMicros\":%lu,\"minFreeHeap\":%u,\"tlsHandshakes\":%lu,\"tlsResumed\":%lu,\"tlsMillis\":%lu,\"tlsHeap\":%u,"
+    "\"loopHistogram\":[",
+    millis(), metrics.messagesIn, metrics.messagesOut, metrics.bytesIn, metrics.bytesOut, metrics.publishFailures,
+    metrics.reconnectCount, metrics.lastConnectDurationMillis, metrics.loopMaxMicros, metrics.callbackCount, metrics.callbackTotalMicros,
+    metrics.callbackMaxMicros, (unsigned int)metrics.minFreeHeap, metrics.tlsHandshakes, metrics.tlsResumedHandshakes,
+    metrics.lastTlsHandshakeMillis, (unsigned int)metrics.lastTlsHeapUsage);
+
+  for (unsigned int i = 0 ; i < MqttClientMetrics::LOOP_HISTOGRAM_BUCKETS && length > 0 && length < (int)sizeof(json) ; i++)
+    length += snprintf(json + length, sizeof(json) - length, i == 0 ? "%lu" : ",%lu", metrics.loopDurationHistogram[i]);
+  if (length > 0 && length < (int)sizeof(json))
+    length += snprintf(json + length, sizeof(json) - length, "]}");
+
+  if (length <= 0 || length >= (int)sizeof(json))
+    return;
+
+  bool success = 
+    mMqttClient.beginPublish(mMetricsTopic.c_str(), length, false) &&
+    mMqttClient.write((const uint8_t*)json, length) == (size_t)length &&
+    mMqttClient.endPublish();
+
+  if (!success)
+    ESPMQTT_LOG_ERROR(mEnableSerialLogs, "MQTT! Unable to publish the metrics.\n");
+}
+
+void EspMQTTClient::handleOtaUpdate()
+{
+  mOtaUpdater->loop();
+
+  if (!mOtaUpdater->takeStatusChange())
+    return;
+
+  publishOtaStatus();
+
+  if (mOtaUpdater->state() == MqttOtaUpdater::OTA_SUCCEEDED)
+  {
+    ESPMQTT_LOG_INFO(mEnableSerialLogs, "OTA: Restarting on the new firmware\n");
+
+    // The timers belong to the sketch task, the network task has nothing else to do until the restart
+    #ifdef ESP32
+      if (mNetworkTask != NULL)
+      {
+        delay(OTA_RESTART_DELAY);
+        ESP.restart();
+      }
+    #endif
+    executeDelayed(OTA_RESTART_DELAY, []() { ESP.restart(); });
+  }
+}
+
+void EspMQTTClient::publishOtaStatus()
+{
+  static const char* const stateNames[] = { "idle", "running", "succeeded", "failed" };
+
+  char status[128];
+  int length = snprintf(status, sizeof(status), "{\"state\":\"%s\",\"offset\":%u,\"size\":%u", 
+    stateNames[mOtaUpdater->state()], (unsigned int)mOtaUpdater->offset(), (unsigned int)mOtaUpdater->size());
+  if (mOtaUpdater->error() != NULL && length > 0 && length < (int)sizeof(status))
+    length += snprintf(status + length, sizeof(status) - length, ",\"error\":\"%s\"", mOtaUpdater->error());
+  if (length > 0 && length < (int)sizeof(status))
+    snprintf(status + length, sizeof(status) - length, "}");
+
+  publish(mOtaTopic + "/status", status);
+}
+
+// PubSubClient can't send a message larger than its buffer
+bool EspMQTTClient::fitsInPacket(const char* topic, const size_t payloadLength)
+{
+  return MQTT_MAX_HEADER_SIZE + MqttPacketBuilder::stringSize(strlen(topic)) + payloadLength <= MQTT_MAX_PACKET_SIZE;
+}
+
+bool EspMQTTClient::sendPacket(MqttPacketBuilder &packet)
+{
+  size_t length;
+  const uint8_t* data = packet.finish(&length);
+  return mTransport.write(data, length) == length;
+}
+
+uint16_t EspMQTTClient::nextPacketId()
+{
+  if (++mNextPacketId == 0)
+    mNextPacketId = 1;
+  return mNextPacketId;
+}
+
+void EspMQTTClient::connectToWifi()
+{
+  WiFi.mode(WIFI_STA);
+  #ifdef ESP32
+    WiFi.setHostname(mMqttClientName);
+  #else
+    WiFi.hostname(mMqttClientName);
+  #endif
+  WiFi.begin(mWifiSsid, mWifiPassword);
+
+  mWifiConnecting = true;
+  mLastWifiConnectionAttemptMillis = millis();
+  mWifiRetryDelay = mWifiBackoff.nextDelay();
+
+  ESPMQTT_LOG_INFO(mEnableSerialLogs, "\nWiFi: Connecting to %s ... (next attempt in %lu ms)\n", mWifiSsid, mWifiRetryDelay);
+}
+
+/**
+ * Connection to the broker, done one step at each loop() call so an unreachable broker never blocks the sketch
+ * for more than MQTT_TCP_CONNECT_TIMEOUT: resolve the broker address, open the socket and send CONNECT,
+ * then wait for the CONNACK without blocking.
+ */
+void EspMQTTClient::handleMqttConnection(const unsigned long currentMillis)
+{
+  switch (mMqttConnectionState)
+  {
+    case MQTT_STATE_DISCONNECTED:
+      if (currentMillis - mLastMqttConnectionMillis >= mMqttRetryDelay)
+      {
+        mBrokerIndex = selectBroker(currentMillis);
+        ESPMQTT_LOG_INFO(mEnableSerialLogs, "MQTT: Connecting to broker @%s:%d ...\n", mBrokers[mBrokerIndex].host, mBrokers[mBrokerIndex].port);
+
+        mLastMqttConnectionMillis = currentMillis;
+        mMqttConnectionState = MQTT_STATE_RESOLVING;
+      }
+      break;
+
+    case MQTT_STATE_RESOLVING:
+      if (resolveBroker(currentMillis))
+        mMqttConnectionState = MQTT_STATE_CONNECTING;
+      break;
+
+    case MQTT_STATE_CONNECTING:
+      if (!connectSocket() || !sendConnectPacket())
+        mqttConnectionFailed(MQTT_CONNECT_FAILED);
+      else
+      {
+        mMqttConnectionStepMillis = currentMillis;
+        mMqttConnectionState = MQTT_STATE_WAITING_CONNACK;
+      }
+      break;
+
+    case MQTT_STATE_WAITING_CONNACK:
+      if (mTransport.available() >= 4)
+        handleConnack();
+      else if (!mTransport.connected())
+        mqttConnectionFailed(MQTT_CONNECTION_LOST);
+      else if (currentMillis - mMqttConnectionStepMillis >= MQTT_SOCKET_TIMEOUT * 1000UL)
+        mqttConnectionFailed(MQTT_CONNECTION_TIMEOUT);
+      break;
+
+    default:
+      break;
+  }
+}
+
+// The fastest broker among those that did not fail recently, or the one that failed the longest time ago if they all did
+byte EspMQTTClient::selectBroker(const unsigned long currentMillis) const
+{
+  int best = -1;
+  for (byte i = 0 ; i < mBrokerCount ; i++)
+  {
+    if (!isBrokerAvailable(mBrokers[i], currentMillis))
+      continue;
+
+    // A broker never connected to is only preferred to the slower ones by its priority
+    unsigned long latency = mBrokers[i].latencyMillis > 0 ? mBrokers[i].latencyMillis : ULONG_MAX;
+    unsigned long bestLatency = best < 0 ? ULONG_MAX : (mBrokers[best].latencyMillis > 0 ? mBrokers[best].latencyMillis : ULONG_MAX);
+    if (best < 0 || latency < bestLatency)
+      best = i;
+  }
+
+  if (best < 0)
+  {
+    best = 0;
+    for (byte i = 1 ; i < mBrokerCount ; i++)
+    {
+      if (currentMillis - mBrokers[i].lastFailureMillis > currentMillis - mBrokers[best].lastFailureMillis)
+        best = i;
+    }
+  }
+  return best;
+}
+
+bool EspMQTTClient::isBrokerAvailable(const BrokerEndpoint &broker, const unsigned long currentMillis) const
+{
+  if (broker.failures == 0)
+    return true;
+
+  unsigned long cooldown = (unsigned long)BROKER_FAILURE_COOLDOWN * broker.failures;
+  if (cooldown > mMqttBackoff.maxDelay())
+    cooldown = mMqttBackoff.maxDelay();
+  return currentMillis - broker.lastFailureMillis >= cooldown;
+}
+
+// Record the failure of the current broker and return the delay before the next attempt: none if another broker is available
+unsigned long EspMQTTClient::brokerFailed(const unsigned long currentMillis)
+{
+  BrokerEndpoint& broker = mBrokers[mBrokerIndex];
+  broker.failures++;
+  broker.lastFailureMillis = currentMillis;
+
+  if (isBrokerAvailable(mBrokers[selectBroker(currentMillis)], currentMillis))
+    return 0;
+  return mMqttBackoff.nextDelay();
+}
+
+/**
+ * Set mMqttServerAddress to the address of the current broker without blocking, return false while the lookup
+ * is in progress. The connection attempt fails if the lookup fails and no address was ever resolved.
+ */
+bool EspMQTTClient::resolveBroker(const unsigned long currentMillis)
+{
+  BrokerEndpoint& broker = mBrokers[mBrokerIndex];
+
+  updateDnsLookup(broker, currentMillis);
+  if (!broker.isLiteral && !isDnsCacheFresh(broker, currentMillis) && broker.dnsState == DNS_IDLE)
+  {
+    startDnsLookup(broker, currentMillis);
+    updateDnsLookup(broker, currentMillis); // lwIP may have answered from its own cache
+  }
+
+  if (broker.isLiteral || isDnsCacheFresh(broker, currentMillis))
+  {
+    mMqttServerAddress = broker.address;
+    return true;
+  }
+
+  if (broker.dnsState != DNS_FAILED)
+    return false;
+  broker.dnsState = DNS_IDLE;
+
+  if (!broker.hasAddress)
+  {
+    ESPMQTT_LOG_ERROR(mEnableSerialLogs, "MQTT! Unable to resolve %s\n", broker.host);
+    mqttConnectionFailed(MQTT_CONNECT_FAILED);
+    return false;
+  }
+
+  ESPMQTT_LOG_ERROR(mEnableSerialLogs, "MQTT! Unable to resolve %s, using its last known address %s\n", broker.host, broker.address.toString().c_str());
+  mMqttServerAddress = broker.address;
+  return true;
+}
+
+// Resolve the brokers before their cached address expires, so the next connection attempt never waits for DNS
+void EspMQTTClient::refreshBrokerAddresses(const unsigned long currentMillis)
+{
+  for (byte i = 0 ; i < mBrokerCount ; i++)
+  {
+    BrokerEndpoint& broker = mBrokers[i];
+    if (broker.isLiteral || (i == mBrokerIndex && mMqttConnectionState == MQTT_STATE_RESOLVING))
+      continue; // resolveBroker() handles the outcome of that lookup
+
+    updateDnsLookup(broker, currentMillis);
+    if (broker.dnsState == DNS_FAILED)
+      broker.dnsState = DNS_IDLE;
+
+    bool expiring = !broker.hasAddress || currentMillis - broker.resolvedMillis >= mDnsCacheTtl - mDnsCacheTtl / 4;
+    if (expiring && broker.dnsState == DNS_IDLE && currentMillis - broker.lookupStartMillis >= DNS_REFRESH_MIN_INTERVAL)
+      startDnsLookup(broker, currentMillis);
+  }
+}
+
+/**
+ * The lookup is done by lwIP, which answers at once from its cache, honouring the TTL of the DNS records, or calls
+ * dnsLookupDone() once the DNS server replied. This is what WiFi.hostByName() does before blocking on the reply.
+ */
+void EspMQTTClient::startDnsLookup(BrokerEndpoint &broker, const unsigned long currentMillis)
+{
+  ip_addr_t address;
+  broker.lookupStartMillis = currentMillis;
+  broker.dnsState = DNS_PENDING;
+
+  err_t error = dns_gethostbyname(broker.host, &address, dnsLookupDone, &broker);
+  if (error == ERR_OK)
+    dnsLookupDone(broker.host, &address, &broker);
+  else if (error != ERR_INPROGRESS)
+    broker.dnsState = DNS_FAILED;
+}
+
+// Move the result of a finished lookup to the cache, and give up on a lookup taking too long
+void EspMQTTClient::updateDnsLookup(BrokerEndpoint &broker, const unsigned long currentMillis)
+{
+  if (broker.dnsState == DNS_DONE)
+  {
+    broker.address = broker.lookupAddress;
+    broker.hasAddress = true;
+    broker.resolvedMillis = currentMillis;
+    broker.dnsState = DNS_IDLE;
+  }
+  else if (broker.dnsState == DNS_PENDING && currentMillis - broker.lookupStartMillis >= MQTT_DNS_TIMEOUT)
+    broker.dnsState = DNS_FAILED; // A late reply is ignored by dnsLookupDone()
+}
+
+void EspMQTTClient::dnsLookupDone(const char* name, const ip_addr_t* address, void* context)
+{
+  BrokerEndpoint* broker = (BrokerEndpoint*)context;
+  if (broker->dnsState != DNS_PENDING)
+    return;
+
+  if (address != NULL && IP_IS_V4(address))
+  {
+    broker->lookupAddress = IPAddress(ip4_addr_get_u32(ip_2_ip4(address)));
+    broker->dnsState = DNS_DONE;
+  }
+  else
+    broker->dnsState = DNS_FAILED;
+}
+
+bool EspMQTTClient::connectSocket()
+{
+  if (mSecureClient != NULL && mNetworkClient == mSecureClient)
+    return connectTls(mBrokers[mBrokerIndex]);
+  if (mNetworkClient != &mWifiClient)
+    return mNetworkClient->connect(mMqttServerAddress, mBrokers[mBrokerIndex].port);
+
+  #ifdef ESP32
+    return mWifiClient.connect(mMqttServerAddress, mBrokers[mBrokerIndex].port, MQTT_TCP_CONNECT_TIMEOUT);
+  #else
+    mWifiClient.setTimeout(MQTT_TCP_CONNECT_TIMEOUT);
+    return mWifiClient.connect(mMqttServerAddress, mBrokers[mBrokerIndex].port);
+  #endif
+}
+
+/**
+ * Open the socket and do the TLS handshake, which blocks loop() until it ends. Its duration and the heap taken
+ * by the TLS buffers are recorded in the metrics, so full and resumed handshakes can be compared on the device.
+ */
+bool EspMQTTClient::connectTls(const BrokerEndpoint &broker)
+{
+  unsigned long startMillis = millis();
+  uint32_t freeHeap = ESP.getFreeHeap();
+  bool connected;
+  bool resumed = false;
+
+  #ifdef ESP8266
+    // A resumed session keeps the id of the previous one, a full handshake gets a new one
+    br_ssl_session_parameters* session = mTlsSession->getSession();
+    uint8_t previousIdLength = session->session_id_len;
+    uint8_t previousId[sizeof(session->session_id)];
+    memcpy(previousId, session->session_id, sizeof(previousId));
+
+    // BearSSL checks the broker name only when given to connect(), the address resolved is then not used
+    mSecureClient->setTimeout(MQTT_TCP_CONNECT_TIMEOUT);
+    if (mTlsCaCert != NULL && !broker.isLiteral)
+      connected = mSecureClient->connect(broker.host, broker.port);
+    else
+      connected = mSecureClient->connect(mMqttServerAddress, broker.port);
+
+    resumed = connected && previousIdLength > 0 && session->session_id_len == previousIdLength && memcmp(previousId, session->session_id, previousIdLength) == 0;
+  #else
+    connected = mSecureClient->connect(mMqttServerAddress, broker.port, broker.host, mTlsCaCert, NULL, NULL);
+    if (connected && mTlsCaCert == NULL && mTlsFingerprint != NULL && !mSecureClient->verify(mTlsFingerprint, NULL))
+    {
+      ESPMQTT_LOG_ERROR(mEnableSerialLogs, "MQTT! The certificate of %s does not match the fingerprint\n", broker.host);
+      mSecureClient->stop();
+      connected = false;
+    }
+  #endif
+
+  if (!connected)
+    return false;
+
+  mMetrics.lastTlsHandshakeMillis = millis() - startMillis;
+  uint32_t remainingHeap = ESP.getFreeHeap();
+  mMetrics.lastTlsHeapUsage = freeHeap > remainingHeap ? freeHeap - remainingHeap : 0;
+  mMetrics.tlsHandshakes++;
+  if (resumed)
+    mMetrics.tlsResumedHandshakes++;
+
+  ESPMQTT_LOG_INFO(mEnableSerialLogs, "MQTT: %s TLS handshake in %lums, %u bytes of heap used\n", resumed ? "Resumed" : "Full",
+    mMetrics.lastTlsHandshakeMillis, (unsigned int)mMetrics.lastTlsHeapUsage);
+  return true;
+}
+
+bool EspMQTTClient::sendConnectPacket()
+{
+  uint8_t buffer[MQTT_MAX_PACKET_SIZE];
+  MqttPacketBuilder packet(buffer, sizeof(buffer));
+
+  byte flags = 0;
+  if (mMqttCleanSession)
+    flags |= 0x02;
+  if (mMqttLastWillTopic != NULL)
+    flags |= (mMqttLastWillRetain ? 0x24 : 0x04) | ((mMqttLastWillQos & 0x03) << 3);
+  if (mMqttUsername != NULL)
+    flags |= mMqttPassword != NULL ? 0xC0 : 0x80;
+
+  packet.begin(MQTTCONNECT);
+  bool success = 
+    packet.writeString("MQTT", 4) &&
+    packet.writeByte(4) && // MQTT 3.1.1
+    packet.writeByte(flags) &&
+    packet.writeUint16(MQTT_KEEPALIVE) &&
+    packet.writeString(mMqttClientName, strlen(mMqttClientName));
+
+  if (success && mMqttLastWillTopic != NULL)
+    success = packet.writeString(mMqttLastWillTopic, strlen(mMqttLastWillTopic)) && packet.writeString(mMqttLastWillMessage, strlen(mMqttLastWillMessage));
+  if (success && mMqttUsername != NULL)
+    success = packet.writeString(mMqttUsername, strlen(mMqttUsername));
+  if (success && mMqttUsername != NULL && mMqttPassword != NULL)
+    success = packet.writeString(mMqttPassword, strlen(mMqttPassword));
+
+  if (!success)
+    ESPMQTT_LOG_ERROR(mEnableSerialLogs, "MQTT! The CONNECT packet is larger than MQTT_MAX_PACKET_SIZE.\n");
+
+  return success && sendPacket(packet);
+}
+
+void EspMQTTClient::handleConnack()
+{
+  uint8_t connack[4];
+  mTransport.read(connack, sizeof(connack));
+
+  if (connack[0] != MQTTCONNACK || connack[1] != 2)
+  {
+    mqttConnectionFailed(MQTT_CONNECT_FAILED);
+    return;
+  }
+  if (connack[3] != MQTT_CONNECTED)
+  {
+    mqttConnectionFailed(connack[3]);
+    return;
+  }
+
+  // PubSubClient needs to go through its own connect() to be in a connected state, the transport replays the handshake for it
+  mTransport.beginHandshakeReplay(connack, sizeof(connack));
+  bool success = mMqttClient.connect(mMqttClientName, mMqttUsername, mMqttPassword, mMqttLastWillTopic, mMqttLastWillQos, mMqttLastWillRetain, mMqttLastWillMessage, mMqttCleanSession);
+  mTransport.endHandshakeReplay();
+
+  if (!success)
+  {
+    mqttConnectionFailed(mMqttClient.state());
+    return;
+  }
+
+  mMqttConnectionState = MQTT_STATE_CONNECTED;
+  mMqttConnected = true;
+
+  ESPMQTT_LOG_INFO(mEnableSerialLogs, "MQTT: Connected to broker @%s\n", mBrokers[mBrokerIndex].host);
+
+  resubscribe();
+  retransmitInflightMessages();
+
+  // The sender of an update in progress learns where to resume
+  if (mOtaUpdater != NULL && mOtaUpdater->state() == MqttOtaUpdater::OTA_RUNNING)
+    publishOtaStatus();
+
+  mMqttBackoff.reset();
+  mMetrics.lastConnectDurationMillis = millis() - mLastMqttConnectionMillis;
+
+  // A quarter of each new measure goes into the average
+  BrokerEndpoint& broker = mBrokers[mBrokerIndex];
+  unsigned long latency = mMetrics.lastConnectDurationMillis > 0 ? mMetrics.lastConnectDurationMillis : 1;
+  broker.latencyMillis = broker.latencyMillis == 0 ? latency : (broker.latencyMillis * 3 + latency) / 4;
+  broker.failures = 0;
+  if (mConnectionEstablishedCount > 0)
+    mMetrics.reconnectCount++;
+  mConnectionEstablishedCount++;
+
+  #ifdef ESP32
+    if (mNetworkTask != NULL)
+    {
+      mConnectionEstablishedPending = true;
+      return;
+    }
+  #endif
+  mConnectionEstablishedCallback();
+}
+
+void EspMQTTClient::mqttConnectionFailed(const int state)
+{
+  mTransport.stop();
+  mMqttConnectionState = MQTT_STATE_DISCONNECTED;
+  mLastMqttConnectionMillis = millis();
+  mMqttRetryDelay = brokerFailed(mLastMqttConnectionMillis);
+
+  ESPMQTT_LOG_ERROR(mEnableSerialLogs, "MQTT! Unable to connect, %s, next attempt in %lu ms\n", mqttStateToString(state), mMqttRetryDelay);
+}
+
+const char* EspMQTTClient::mqttStateToString(const int state)
+{
+  switch (state)
+  {
+    case MQTT_CONNECTION_TIMEOUT:
+      return "MQTT_CONNECTION_TIMEOUT";
+    case MQTT_CONNECTION_LOST:
+      return "MQTT_CONNECTION_LOST";
+    case MQTT_CONNECT_FAILED:
+      return "MQTT_CONNECT_FAILED";
+    case MQTT_DISCONNECTED:
+      return "MQTT_DISCONNECTED";
+    case MQTT_CONNECT_BAD_PROTOCOL:
+      return "MQTT_CONNECT_BAD_PROTOCOL";
+    case MQTT_CONNECT_BAD_CLIENT_ID:
+      return "MQTT_CONNECT_BAD_CLIENT_ID";
+    case MQTT_CONNECT_UNAVAILABLE:
+      return "MQTT_CONNECT_UNAVAILABLE";
+    case MQTT_CONNECT_BAD_CREDENTIALS:
+      return "MQTT_CONNECT_BAD_CREDENTIALS";
+    case MQTT_CONNECT_UNAUTHORIZED:
+      return "MQTT_CONNECT_UNAUTHORIZED";
+    default:
+      return "unknown error";
+  }
+}
+
+void EspMQTTClient::mqttMessageReceivedCallback(char* topic, byte* payload, unsigned int length)
+{
+  // Logging, the payload is not NUL terminated so its length is given to printf
+  ESPMQTT_LOG_DEBUG(mEnableSerialLogs, "MQTT >> [%s] %.*s\n", topic, (int)length, (const char*)payload);
+  mMetrics.messagesIn++;
+
+  // With the network task, only the streamed subscriptions are called from here, the message is copied for loop() to call the others
+  #ifdef ESP32
+    if (mNetworkTask != NULL)
+    {
+      if (dispatchMessage(topic, payload, length, DISPATCH_STREAMS) > 0 && !mInboundMessages.push(topic, payload, length, 0))
+      {
+        ESPMQTT_LOG_ERROR(mEnableSerialLogs, "MQTT! [%s] dropped, loop() is not called often enough to dispatch the messages.\n", topic);
+        mMetrics.inboundDropped++;
+      }
+      return;
+    }
+  #endif
+
+  dispatchMessage(topic, payload, length, DISPATCH_ALL);
+}
+
+// Send the message to subscribers, the String versions of the topic and the payload are only built if a subscriber needs them
+unsigned int EspMQTTClient::dispatchMessage(const char* topic, byte* payload, const unsigned int length, const DispatchTarget target)
+{
+  MessageDispatchContext context = { this, topic, payload, length, false, target, 0 };
+  unsigned long dispatchStartMicros = micros();
+  beginDispatch();
+  mTopicSubscriptionTrie.match(topic, dispatchToSubscription, &context);
+  endDispatch();
+  mMetrics.recordCallbackDuration(micros() - dispatchStartMicros);
+  return context.skippedCount;
+}
+
+// Records are removed from the end, so the record moved in place of a removed one is never a removed one
+void EspMQTTClient::endDispatch()
+{
+  if (--mDispatchDepth > 0 || !mHasRemovedSubscriptions)
+    return;
+
+  mHasRemovedSubscriptions = false;
+  for (unsigned int i = mTopicSubscriptionListSize ; i-- > 0 ; )
+  {
+    if (mTopicSubscriptionList[i].removed)
+      removeSubscription(i);
+  }
+}
+
+void EspMQTTClient::dispatchToSubscription(int index, void* context)
+{
+  MessageDispatchContext* dispatchContext = (MessageDispatchContext*)context;
+  EspMQTTClient* client = dispatchContext->client;
+  TopicSubscriptionRecord& subscription = client->mTopicSubscriptionList[index];
+  if (subscription.removed)
+    return;
+
+  bool isStream = subscription.callbackType == TopicSubscriptionRecord::CALLBACK_STREAM;
+  if ((dispatchContext->target == DISPATCH_STREAMS && !isStream) || (dispatchContext->target == DISPATCH_CALLBACKS && isStream))
+  {
+    dispatchContext->skippedCount++;
+    return;
+  }
+
+  if (subscription.callbackType == TopicSubscriptionRecord::CALLBACK_RAW)
+  {
+    subscription.callbackRaw(dispatchContext->topic, dispatchContext->payload, dispatchContext->length); // Call the callback
+    return;
+  }
+
+  // A message fitting in the buffer is given to a streamed subscription in a single chunk
+  if (subscription.callbackType == TopicSubscriptionRecord::CALLBACK_STREAM)
+  {
+    MessageStreamCallbacks* callbacks = subscription.callbackStream;
+    if (callbacks->onBegin)
+      callbacks->onBegin(dispatchContext->topic, dispatchContext->length);
+    if (callbacks->onChunk && dispatchContext->length > 0)
+      callbacks->onChunk(dispatchContext->payload, dispatchContext->length);
+    if (callbacks->onEnd)
+      callbacks->onEnd(true);
+    return;
+  }
+
+  if (!dispatchContext->stringsBuilt)
+  {
+    client->mReceivedTopicStr = dispatchContext->topic;
+    copyPayloadToString(client->mReceivedPayloadStr, dispatchContext->payload, dispatchContext->length);
+    dispatchContext->stringsBuilt = true;
+  }
+
+  if (subscription.callbackType == TopicSubscriptionRecord::CALLBACK_PAYLOAD)
+    subscription.callback(client->mReceivedPayloadStr); // Call the callback
+  else
+    subscription.callbackWithTopic(client->mReceivedTopicStr, client->mReceivedPayloadStr); // Call the callback
+}
+
+// Called by the transport while a diverted message is received, the topic is matched again at each chunk as subscriptions may change in between
+void EspMQTTClient::streamedMessageReceived(MqttTransport::StreamEvent event, const char* topic, const uint8_t* data, size_t length, void* context)
+{
+  EspMQTTClient* client = (EspMQTTClient*)context;
+
+  if (event == MqttTransport::STREAM_BEGIN)
+    ESPMQTT_LOG_DEBUG(client->mEnableSerialLogs, "MQTT >> [%s] streaming %u bytes\n", topic, (unsigned int)length);
+
+  StreamDispatchContext dispatchContext = { client, event, topic, data, length, 0 };
+  unsigned long dispatchStartMicros = micros();
+  client->beginDispatch();
+  client->mTopicSubscriptionTrie.match(topic, dispatchStreamToSubscription, &dispatchContext);
+  client->endDispatch();
+  client->mMetrics.recordCallbackDuration(micros() - dispatchStartMicros);
+
+  if (event == MqttTransport::STREAM_BEGIN && dispatchContext.subscriberCount == 0)
+    ESPMQTT_LOG_ERROR(client->mEnableSerialLogs, "MQTT! [%s] is too long for its subscriptions, please subscribe with MessageStreamCallbacks or change MQTT_MAX_PACKET_SIZE of PubSubClient.h to a higher value.\n", topic);
+  else if (event == MqttTransport::STREAM_END)
+    client->mMetrics.messagesIn++;
+}
+
+void EspMQTTClient::dispatchStreamToSubscription(int index, void* context)
+{
+  StreamDispatchContext* dispatchContext = (StreamDispatchContext*)context;
+  TopicSubscriptionRecord& subscription = dispatchContext->client->mTopicSubscriptionList[index];
+
+  if (subscription.removed || subscription.callbackType != TopicSubscriptionRecord::CALLBACK_STREAM)
+    return;
+
+  MessageStreamCallbacks* callbacks = subscription.callbackStream;
+  dispatchContext->subscriberCount++;
+
+  switch (dispatchContext->event)
+  {
+    case MqttTransport::STREAM_BEGIN:
+      if (callbacks->onBegin)
+        callbacks->onBegin(dispatchContext->topic, dispatchContext->length);
+      break;
+    case MqttTransport::STREAM_CHUNK:
+      if (callbacks->onChunk)
+        callbacks->onChunk(dispatchContext->data, dispatchContext->length);
+      break;
+    case MqttTransport::STREAM_END:
+    case MqttTransport::STREAM_ABORT:
+      if (callbacks->onEnd)
+        callbacks->onEnd(dispatchContext->event == MqttTransport::STREAM_END);
+      break;
+  }
+}
+
+bool EspMQTTClient::isSketchTask() const
+{
+  #ifdef ESP32
+    return mNetworkTask != NULL && xTaskGetCurrentTaskHandle() != mNetworkTask;
+  #else
+    return false;
+  #endif
+}
+
+void EspMQTTClient::lockNetwork()
+{
+  #ifdef ESP32
+    if (isSketchTask())
+      xSemaphoreTakeRecursive(mNetworkMutex, portMAX_DELAY);
+  #endif
+}
+
+void EspMQTTClient::unlockNetwork()
+{
+  #ifdef ESP32
+    if (isSketchTask())
+      xSemaphoreGiveRecursive(mNetworkMutex);
+  #endif
+}
+
+#ifdef ESP32
+/**
+ * From loop(), the record is used in place and is writable until pop().
+ * The network task also walks the routing table for the streamed subscriptions, so the dispatch is made under the lock.
+ */
+void EspMQTTClient::dispatchInboundMessages()
+{
+  const char* topic;
+  const uint8_t* payload;
+  size_t length;
+  byte flags;
+
+  while (mInboundMessages.front(&topic, &payload, &length, &flags))
+  {
+    {
+      NetworkLock lock(this);
+      dispatchMessage(topic, (byte*)payload, length, DISPATCH_CALLBACKS);
+    }
+    mInboundMessages.pop();
+  }
+}
+
+// From the network task, the messages published by the sketch go through the usual path, publish queue included
+void EspMQTTClient::sendOutboundMessages()
+{
+  const char* topic;
+  const uint8_t* payload;
+  size_t length;
+  byte flags;
+
+  while (mOutboundMessages.front(&topic, &payload, &length, &flags))
+  {
+    publishMessage(topic, payload, length, flags & MqttPublishQueue::FLAG_RETAIN, (flags & MqttPublishQueue::FLAG_QOS1) ? 1 : 0);
+    mOutboundMessages.pop();
+  }
+}
+
+/**
+ * Each iteration reads at most one packet per connection, so the task only yields while packets or messages
+ * are waiting, and sleeps for a tick otherwise. It still sleeps after MQTT_NETWORK_TASK_MAX_BURST busy
+ * iterations, to let the tasks of lower priority run, the idle task watched by the watchdog among them.
+ */
+void EspMQTTClient::networkTask(void* parameter)
+{
+  EspMQTTClient* client = (EspMQTTClient*)parameter;
+  unsigned int burst = 0;
+
+  for (;;)
   {
-    if (mqttTopicMatch(mTopicSubscriptionList[i].topic, String(topic)))
+    xSemaphoreTakeRecursive(client->mNetworkMutex, portMAX_DELAY);
+    unsigned long loopStartMicros = micros();
+    client->handleNetwork(millis());
+    client->endLoop(loopStartMicros);
+
+    bool busy = false;
+    for (EspMQTTClient* session = client ; session != NULL && !busy ; session = session->mNextSession)
+      busy = (session->mMqttConnected && session->mTransport.available() > 0) || !session->mOutboundMessages.isEmpty();
+    xSemaphoreGiveRecursive(client->mNetworkMutex);
+
+    if (busy && ++burst < MQTT_NETWORK_TASK_MAX_BURST)
+      taskYIELD();
+    else
     {
-      if(mTopicSubscriptionList[i].callback != NULL)
-        mTopicSubscriptionList[i].callback(payloadStr); // Call the callback
-      if(mTopicSubscriptionList[i].callbackWithTopic != NULL)
-        mTopicSubscriptionList[i].callbackWithTopic(topicStr, payloadStr); // Call the callback
+      burst = 0;
+      vTaskDelay(1);
     }
   }
 }
+#endif
+
+/**
+ * Copy a payload that is not NUL terminated into a String.
+ * The last byte is swapped with a NUL for the time of the copy and restored afterward, so we never write
+ * past the end of the PubSubClient buffer, even for a message filling it entirely.
+ */
+void EspMQTTClient::copyPayloadToString(String &str, const byte* payload, unsigned int length)
+{
+  // Copied with its length, the payload may hold NUL bytes
+  str = "";
+  str.concat((const char*)payload, length);
+}
+
+
+// =============== Subscription record ===================
+
+void EspMQTTClient::TopicSubscriptionRecord::setCallback(const MessageReceivedCallback &newCallback)
+{
+  resetCallback();
+  new (&callback) MessageReceivedCallback(newCallback);
+  callbackType = CALLBACK_PAYLOAD;
+}
+
+void EspMQTTClient::TopicSubscriptionRecord::setCallback(const MessageReceivedCallbackWithTopic &newCallback)
+{
+  resetCallback();
+  new (&callbackWithTopic) MessageReceivedCallbackWithTopic(newCallback);
+  callbackType = CALLBACK_PAYLOAD_WITH_TOPIC;
+}
+
+void EspMQTTClient::TopicSubscriptionRecord::setCallback(const MessageReceivedCallbackRaw &newCallback)
+{
+  resetCallback();
+  new (&callbackRaw) MessageReceivedCallbackRaw(newCallback);
+  callbackType = CALLBACK_RAW;
+}
+
+void EspMQTTClient::TopicSubscriptionRecord::setCallback(const MessageStreamCallbacks &newCallbacks)
+{
+  resetCallback();
+  callbackStream = new MessageStreamCallbacks(newCallbacks);
+  callbackType = CALLBACK_STREAM;
+}
+
+void EspMQTTClient::TopicSubscriptionRecord::moveFrom(TopicSubscriptionRecord &other)
+{
+  reset();
+  topic = other.topic;
+  other.topic = NULL;
+
+  switch (other.callbackType)
+  {
+    case CALLBACK_PAYLOAD:
+      new (&callback) MessageReceivedCallback(std::move(other.callback));
+      break;
+    case CALLBACK_PAYLOAD_WITH_TOPIC:
+      new (&callbackWithTopic) MessageReceivedCallbackWithTopic(std::move(other.callbackWithTopic));
+      break;
+    case CALLBACK_RAW:
+      new (&callbackRaw) MessageReceivedCallbackRaw(std::move(other.callbackRaw));
+      break;
+    case CALLBACK_STREAM:
+      callbackStream = other.callbackStream;
+      other.callbackStream = NULL; // The callbacks now belong to this record
+      break;
+  }
+  callbackType = other.callbackType;
+  other.resetCallback();
+}
+
+void EspMQTTClient::TopicSubscriptionRecord::reset()
+{
+  resetCallback();
+  free(topic);
+  topic = NULL;
+  removed = false;
+}
+
+void EspMQTTClient::TopicSubscriptionRecord::resetCallback()
+{
+  switch (callbackType)
+  {
+    case CALLBACK_PAYLOAD:
+      callback.~MessageReceivedCallback();
+      break;
+    case CALLBACK_PAYLOAD_WITH_TOPIC:
+      callbackWithTopic.~MessageReceivedCallbackWithTopic();
+      break;
+    case CALLBACK_RAW:
+      callbackRaw.~MessageReceivedCallbackRaw();
+      break;
+    case CALLBACK_STREAM:
+      delete callbackStream;
+      break;
+  }
+  callbackType = CALLBACK_NONE;
+}
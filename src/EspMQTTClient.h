@@ -2,10 +2,28 @@
 #define ESP_MQTT_CLIENT_H
 
 #include <PubSubClient.h>
+#include <type_traits>
+#include <lwip/dns.h>
+#include "MqttTopicTrie.h"
+#include "MqttPacketBuilder.h"
+#include "MqttPublishQueue.h"
+#include "MqttPublishLimiter.h"
+#include "MqttRecordBatch.h"
+#include "MqttTopicBuffer.h"
+#include "MqttTopicRegistry.h"
+#include "MqttInflightJournal.h"
+#include "DelayedExecutionScheduler.h"
+#include "MqttTransport.h"
+#include "ExponentialBackoff.h"
+#include "MqttClientMetrics.h"
+#include "MqttLogBuffer.h"
+#include "MqttOtaUpdater.h"
+#include "MqttSpscRing.h"
 
 #ifdef ESP8266
 
   #include <ESP8266WiFi.h>
+  #include <WiFiClientSecure.h>
   #include <ESP8266WebServer.h>
   #include <ESP8266mDNS.h>
   #include <ESP8266HTTPUpdateServer.h>
@@ -17,7 +35,11 @@
 #else // for ESP32
 
   #include <WiFiClient.h>
+  #include <WiFiClientSecure.h>
   #include <WebServer.h>
+  #include <freertos/FreeRTOS.h>
+  #include <freertos/task.h>
+  #include <freertos/semphr.h>
   #include <ESPmDNS.h>
   #include "ESP32HTTPUpdateServer.h"
 
@@ -25,50 +47,173 @@
 
 #endif
 
-#define MAX_TOPIC_SUBSCRIPTION_LIST_SIZE 10
-#define MAX_DELAYED_EXECUTION_LIST_SIZE 10
-#define CONNECTION_RETRY_DELAY 10 * 1000
+#ifndef MAX_TOPIC_SUBSCRIPTION_LIST_SIZE
+  #define MAX_TOPIC_SUBSCRIPTION_LIST_SIZE 10 // Default capacity of the subscription table, can be changed per client with setMaxTopicSubscriptions()
+#endif
+#define CONNECTION_RETRY_DELAY 10 * 1000 // Initial window of the reconnection backoff, doubled after each failed attempt
+#define CONNECTION_RETRY_MAX_DELAY 2 * 60 * 1000
+#define WIFI_CONNECTION_MIN_RETRY_DELAY 5 * 1000 // Time left to WiFi.begin() before trying again
+#ifndef MAX_MQTT_BROKERS
+  #define MAX_MQTT_BROKERS 4 // The broker of the constructor and the ones added with addBroker()
+#endif
+#define BROKER_FAILURE_COOLDOWN 30 * 1000 // A broker is avoided for this long after each consecutive failure, up to CONNECTION_RETRY_MAX_DELAY
+#define DNS_CACHE_TTL 5 * 60 * 1000 // Default lifetime of a resolved broker address
+#ifndef MQTT_DNS_TIMEOUT
+  #define MQTT_DNS_TIMEOUT 5000 // Time given to a DNS lookup before falling back to the last known address
+#endif
+#define DNS_REFRESH_MIN_INTERVAL 10 * 1000 // Between two background lookups of the same broker
+#ifndef MQTT_TCP_CONNECT_TIMEOUT
+  #define MQTT_TCP_CONNECT_TIMEOUT 2000 // Maximum time loop() can be blocked while opening the socket to the broker
+#endif
+#ifndef STREAMED_PUBLISH_CHUNK_SIZE
+  #define STREAMED_PUBLISH_CHUNK_SIZE 128 // Stack buffer filled by a PublishPayloadProducer before each write to the socket
+#endif
+#define OTA_TOPIC_SUFFIX "/ota" // Appended to the client name when enableMqttOtaUpdate() is given no topic
+#define OTA_RESTART_DELAY 1000 // Time left to publish the final status before restarting on the new firmware
+#define METRICS_TOPIC_SUFFIX "/$SYS/metrics" // Appended to the client name when enableMetricsPublishing() is given no topic
+#define QOS1_JOURNAL_DEFAULT_PATH "/mqtt_inflight"
+#ifndef MQTT_NETWORK_TASK_STACK_SIZE
+  #define MQTT_NETWORK_TASK_STACK_SIZE 8192
+#endif
+#ifndef MQTT_NETWORK_TASK_MAX_BURST
+  #define MQTT_NETWORK_TASK_MAX_BURST 64 // Iterations of the network task in a row, while busy, before it sleeps for a tick
+#endif
 
 void onConnectionEstablished(); // MUST be implemented in your sketch. Called once everythings is connected (Wifi, mqtt).
 
 typedef std::function<void()> ConnectionEstablishedCallback;
 typedef std::function<void(const String &message)> MessageReceivedCallback;
 typedef std::function<void(const String &topicStr, const String &message)> MessageReceivedCallbackWithTopic;
-typedef std::function<void()> DelayedExecutionCallback;
+typedef std::function<void(const char* topic, const uint8_t* payload, size_t length)> MessageReceivedCallbackRaw; // Payload given straight from the receive buffer, it is not NUL terminated
+// Received payload given chunk by chunk, as it arrives. Messages too large for the PubSubClient buffer can only be received this way
+struct MessageStreamCallbacks {
+  std::function<void(const char* topic, size_t length)> onBegin; // length is the size of the whole payload
+  std::function<void(const uint8_t* data, size_t length)> onChunk;
+  std::function<void(bool complete)> onEnd; // complete is false if the connection was lost before the end of the message
+};
+typedef std::function<size_t(uint8_t* buffer, size_t maxLength)> PublishPayloadProducer; // Fill buffer with the next bytes of the payload and return their number, 0 to abort
 
 class EspMQTTClient 
 {
 private:
   // Wifi related
   bool mWifiConnected;
+  bool mWifiConnecting; // True from the first attempt until connected
   unsigned long mLastWifiConnectionAttemptMillis;
-  unsigned long mLastWifiConnectionSuccessMillis;
+  unsigned long mWifiRetryDelay;
+  ExponentialBackoff mWifiBackoff;
   const char* mWifiSsid;
   const char* mWifiPassword;
   WiFiClient mWifiClient;
 
+  // Network client related
+  Client* mNetworkClient; // The broker connection goes through mWifiClient, mSecureClient or the client given to setNetworkClient()
+  WiFiClientSecure* mSecureClient; // Allocated by enableTls()
+  const char* mTlsCaCert;
+  const char* mTlsFingerprint;
+  #ifdef ESP8266
+    BearSSL::X509List* mTlsTrustAnchors;
+    BearSSL::Session* mTlsSession; // Parameters of the last handshake, offered to the broker to resume the session on reconnection
+  #endif
+
   // MQTT related
+  enum MqttConnectionState : byte {
+    MQTT_STATE_DISCONNECTED,
+    MQTT_STATE_RESOLVING,
+    MQTT_STATE_CONNECTING,
+    MQTT_STATE_WAITING_CONNACK,
+    MQTT_STATE_CONNECTED
+  };
   bool mMqttConnected;
+  MqttConnectionState mMqttConnectionState;
+  unsigned long mMqttConnectionStepMillis; // When the current connection step started
   unsigned long mLastMqttConnectionMillis;
-  const char* mMqttServerIp;
+  unsigned long mMqttRetryDelay;
+  ExponentialBackoff mMqttBackoff;
+  IPAddress mMqttServerAddress;
   const char* mMqttUsername;
   const char* mMqttPassword;
   const char* mMqttClientName;
-  const short mMqttServerPort;
   bool mMqttCleanSession;
   char* mMqttLastWillTopic;
   char* mMqttLastWillMessage;
   bool mMqttLastWillRetain;
+  byte mMqttLastWillQos;
+
+  // Brokers in order of priority, the one connected to is the fastest one that did not fail recently
+  enum DnsLookupState : byte {
+    DNS_IDLE,
+    DNS_PENDING,
+    DNS_DONE, // Set by the lwIP callback, the address is moved to the cache by the next loop()
+    DNS_FAILED
+  };
+  struct BrokerEndpoint {
+    const char* host;
+    short port;
+    unsigned long latencyMillis; // Moving average of the connection durations, 0 until a connection succeeded
+    unsigned int failures; // Consecutive failed connections
+    unsigned long lastFailureMillis;
+
+    // Cached address, still used past its lifetime when DNS fails
+    bool isLiteral; // The host is an IP address, there is nothing to resolve
+    bool hasAddress;
+    IPAddress address;
+    unsigned long resolvedMillis;
+    volatile DnsLookupState dnsState;
+    IPAddress lookupAddress;
+    unsigned long lookupStartMillis;
+  };
+  BrokerEndpoint mBrokers[MAX_MQTT_BROKERS];
+  byte mBrokerCount;
+  byte mBrokerIndex; // Of the broker connected, or being connected
+  unsigned long mDnsCacheTtl;
+  bool mDnsBackgroundRefresh;
 
+  MqttTransport mTransport;
   PubSubClient mMqttClient;
 
+  // A subscription holds only one of the callback types, they share the same storage
   struct TopicSubscriptionRecord {
-    String topic;
-    MessageReceivedCallback callback;
-    MessageReceivedCallbackWithTopic callbackWithTopic;
+    enum : byte { CALLBACK_NONE, CALLBACK_PAYLOAD, CALLBACK_PAYLOAD_WITH_TOPIC, CALLBACK_RAW, CALLBACK_STREAM };
+
+    char* topic;
+    byte callbackType;
+    bool removed; // Unsubscribed or replaced while a message was dispatched, removed from the table once the dispatch ends
+    union {
+      MessageReceivedCallback callback;
+      MessageReceivedCallbackWithTopic callbackWithTopic;
+      MessageReceivedCallbackRaw callbackRaw;
+      MessageStreamCallbacks* callbackStream; // Allocated, to keep the records small
+    };
+
+    TopicSubscriptionRecord() : topic(NULL), callbackType(CALLBACK_NONE), removed(false) {};
+    ~TopicSubscriptionRecord() { reset(); };
+    void setCallback(const MessageReceivedCallback &newCallback);
+    void setCallback(const MessageReceivedCallbackWithTopic &newCallback);
+    void setCallback(const MessageReceivedCallbackRaw &newCallback);
+    void setCallback(const MessageStreamCallbacks &newCallbacks);
+    void moveFrom(TopicSubscriptionRecord &other);
+    void reset();
+    void resetCallback();
   };
-  TopicSubscriptionRecord mTopicSubscriptionList[MAX_TOPIC_SUBSCRIPTION_LIST_SIZE];
-  byte mTopicSubscriptionListSize;
+  TopicSubscriptionRecord* mTopicSubscriptionList; // Allocated at the first subscription
+  unsigned int mTopicSubscriptionListSize;
+  unsigned int mTopicSubscriptionListCapacity;
+  uint16_t mNextPacketId; // For the packets built by this class
+  MqttPublishQueue mPublishQueue; // Disabled until enablePublishQueue() is called
+  unsigned int mPublishQueueMaxMessagesPerLoop;
+  MqttPublishLimiter mPublishLimiter; // Disabled until setPublishPolicy() is called
+  MqttTopicRegistry mTopicRegistry;
+  MqttPublishQueue mInflightMessages; // QoS 1 messages sent and waiting for their PUBACK, disabled until enableQos1Publish() is called
+  unsigned int mQos1WindowSize;
+  MqttInflightJournal mInflightJournal;
+  bool mStreamingPublish; // Between beginPublish() and endPublish()
+  size_t mStreamingPublishRemaining;
+  MqttTopicTrie mTopicSubscriptionTrie; // Map each subscribed topic filter to its index in mTopicSubscriptionList
+  byte mDispatchDepth; // While a message is dispatched the routing table is walked and a callback may be running, so subscriptions are not removed
+  bool mHasRemovedSubscriptions;
+  String mReceivedTopicStr; // Reused for each received message to keep their allocation between messages
+  String mReceivedPayloadStr;
 
   // HTTP update server related
   char* mUpdateServerAddress;
@@ -77,13 +222,28 @@ private:
   WebServer* mHttpServer;
   ESPHTTPUpdateServer* mHttpUpdater;
 
+  // MQTT update related
+  MqttOtaUpdater* mOtaUpdater;
+  String mOtaTopic;
+
   // Delayed execution related
-  struct DelayedExecutionRecord {
-    unsigned long targetMillis;
-    DelayedExecutionCallback callback;
-  };
-  DelayedExecutionRecord mDelayedExecutionList[MAX_DELAYED_EXECUTION_LIST_SIZE];
-  byte mDelayedExecutionListSize;
+  DelayedExecutionScheduler mDelayedExecutionScheduler;
+  DelayedExecutionScheduler* mScheduler; // The one of the owner for a session added before using timers
+
+  // Sessions related, the loop() of the owner handles the WiFi and the timers once for all its sessions
+  EspMQTTClient* mOwner; // NULL unless added to another client with addSession()
+  EspMQTTClient* mNextSession;
+
+  // Network task related, ESP32 only. The task of the owner handles the connections, loop() only calls the sketch callbacks
+  #ifdef ESP32
+    TaskHandle_t mNetworkTask; // NULL while the connections are handled by loop()
+    SemaphoreHandle_t mNetworkMutex; // Recursive, held by the network task while it runs and by the sketch while it uses the connection
+    MqttSpscRing mInboundMessages; // Received by the network task, dispatched by loop()
+    MqttSpscRing mOutboundMessages; // Published by the sketch, sent by the network task
+    std::atomic<bool> mConnectionEstablishedPending; // The callback is called by the next loop()
+    std::atomic<unsigned long> mSketchPublishFailures; // Counted without the lock by the sketch, added to mMetrics by getMetrics()
+    MqttClientMetrics mMetricsSnapshot; // Returned to the sketch, mMetrics is written by the network task
+  #endif
 
   // General behaviour related
   ConnectionEstablishedCallback mConnectionEstablishedCallback;
@@ -91,6 +251,11 @@ private:
   bool mShowLegacyConstructorWarning;
   unsigned int mConnectionEstablishedCount; // Incremented before each mConnectionEstablishedCallback call
 
+  // Metrics related
+  MqttClientMetrics mMetrics;
+  String mMetricsTopic;
+  DelayedExecutionHandle mMetricsPublishingHandle;
+
 public:
   // Wifi + MQTT with no MQTT authentification
   EspMQTTClient(
@@ -156,33 +321,178 @@ public:
   void enableDebuggingMessages(const bool enabled = true); // Allow to display useful debugging messages. Can be set to false to disable them during program execution
   void enableHTTPWebUpdater(const char* username, const char* password, const char* address = "/"); // Activate the web updater, must be set before the first loop() call.
   void enableHTTPWebUpdater(const char* address = "/"); // Will set user and password equal to mMqttUsername and mMqttPassword
+  void setMaxTopicSubscriptions(const unsigned int maxTopicSubscriptions); // Capacity of the subscription table, default to MAX_TOPIC_SUBSCRIPTION_LIST_SIZE. Must be called before the first subscribe()
+  void enablePublishQueue(const size_t maxBytes, const MqttPublishQueue::OverflowPolicy overflowPolicy = MqttPublishQueue::DROP_OLDEST, const unsigned int maxMessagesPerLoop = 5); // Keep the messages published while disconnected or while the socket is busy, and send them from loop()
+  bool setPublishPolicy(const char* topicFilter, const MqttPublishPolicy &policy); // Coalesce, space out or drop the messages published too often on the topics matching topicFilter. See MqttPublishPolicy
+  void setMqttReconnectionBackoff(const unsigned long initialDelay, const unsigned long maxDelay); // Default to CONNECTION_RETRY_DELAY and CONNECTION_RETRY_MAX_DELAY
+  void setWifiReconnectionBackoff(const unsigned long initialDelay, const unsigned long maxDelay); // Same defaults, attempts are never closer than WIFI_CONNECTION_MIN_RETRY_DELAY
   void enableMQTTPersistence(); // Tell the broker to establish a persistent connection. Disabled by default. Must be called before the first loop() execution
-  void enableLastWillMessage(const char* topic, const char* message, const bool retain = false); // Must be set before the first loop() call.
-
-  // Main loop, to call at each sketch loop()
+  void enableLastWillMessage(const char* topic, const char* message, const bool retain = false, const byte qos = 0); // Must be set before the first loop() call.
+  void enableQos1Publish(const unsigned int windowSize = 4, const size_t maxBytes = 2048); // Allow publish() with QoS 1, at most windowSize messages wait for their PUBACK, in a buffer of maxBytes
+  void enableQos1Persistence(fs::FS &fileSystem, const char* path = QOS1_JOURNAL_DEFAULT_PATH); // Keep the unacknowledged messages in a file, to send them again after a reboot. The file system must be mounted
+  void enableMqttOtaUpdate(const char* topic = NULL); // Receive firmware updates on topic, default to "<mqttClientName>/ota". See the README for the protocol
+  void enableMetricsPublishing(const unsigned long interval = 60 * 1000, const char* topic = NULL); // Publish getMetrics() as JSON every interval milliseconds, the topic default to "<mqttClientName>/$SYS/metrics"
+  bool addBroker(const char* mqttServerIp, const short mqttServerPort = 1883); // Broker to fail over to, in order of priority after the one of the constructor. Must be called before the first loop() call
+  void setDnsCache(const unsigned long ttl, const bool refreshInBackground = false); // Lifetime of the resolved broker addresses, default to DNS_CACHE_TTL. With refreshInBackground, the addresses are resolved again before they expire
+  void enableTls(const char* caCert = NULL, const char* fingerprint = NULL); // Connect to the brokers with TLS, verifying their certificate against the PEM caCert or the fingerprint. Must be called before the first loop() call
+  void setNetworkClient(Client &client); // Connect to the brokers through client instead of the WiFi client. Must be called before the first loop() call
+  #ifdef ESP32
+    bool enableNetworkTask(const size_t bufferBytes = 4096, const BaseType_t core = 0, const UBaseType_t priority = 1); // Handle the connections from a task of their own, received and published messages going through buffers of bufferBytes. Must be called after addSession(), at the end of setup()
+  #endif
+  void addSession(EspMQTTClient &session); // Handle the broker connection of session from the loop() of this client, sharing its WiFi connection and timers. Must be called before the first loop() call
+
+  // Main loop, to call at each sketch loop(). It does nothing on a client added to another one with addSession()
   void loop();
 
   // MQTT related
-  bool publish(const String &topic, const String &payload, bool retain = false);
-  bool subscribe(const String &topic, MessageReceivedCallback messageReceivedCallback);
-  bool subscribe(const String &topic, MessageReceivedCallbackWithTopic messageReceivedCallback);
-  bool unsubscribe(const String &topic);   //Unsubscribes from the topic, if it exists, and removes it from the CallbackList.
+  // The const char* versions never allocate, the String ones are kept for convenience
+  bool publish(const char* topic, const uint8_t* payload, const size_t length, const bool retain = false, const byte qos = 0);
+  inline bool publish(const char* topic, const char* payload, const bool retain = false, const byte qos = 0) { return publish(topic, (const uint8_t*)payload, strlen(payload), retain, qos); };
+  // A char buffer and its length, of any integer type: the length would otherwise be converted to retain by the version above
+  template <typename Length, typename = typename std::enable_if<std::is_integral<Length>::value && !std::is_same<Length, bool>::value>::type>
+  inline bool publish(const char* topic, const char* payload, const Length length, const bool retain = false, const byte qos = 0) { return publish(topic, (const uint8_t*)payload, (size_t)length, retain, qos); };
+  inline bool publish(const String &topic, const String &payload, bool retain = false, byte qos = 0) { return publish(topic.c_str(), (const uint8_t*)payload.c_str(), payload.length(), retain, qos); };
+  // Topics registered once, with the device prefix prepended, and published by handle
+  bool setTopicPrefix(const char* prefix); // Prepended with a '/' to the topics registered, must be called before the first registerTopic()
+  MqttTopicHandle registerTopic(const char* topic); // Return the handle to give to publish(), 0 if MQTT_MAX_TOPIC_HANDLES topics are registered already
+  inline const char* getTopic(const MqttTopicHandle handle) const { return mTopicRegistry.topic(handle); }; // Return the full topic, NULL if the handle is not valid
+  bool publish(const MqttTopicHandle handle, const uint8_t* payload, const size_t length, const bool retain = false, const byte qos = 0);
+  inline bool publish(const MqttTopicHandle handle, const char* payload, const bool retain = false, const byte qos = 0) { return publish(handle, (const uint8_t*)payload, strlen(payload), retain, qos); };
+  template <typename Length, typename = typename std::enable_if<std::is_integral<Length>::value && !std::is_same<Length, bool>::value>::type>
+  inline bool publish(const MqttTopicHandle handle, const char* payload, const Length length, const bool retain = false, const byte qos = 0) { return publish(handle, (const uint8_t*)payload, (size_t)length, retain, qos); };
+  inline bool publish(const MqttTopicHandle handle, const String &payload, const bool retain = false, const byte qos = 0) { return publish(handle, (const uint8_t*)payload.c_str(), payload.length(), retain, qos); };
+  bool publish(const char* topic, MqttRecordBatch &batch, const bool retain = false, const byte qos = 0); // Send all the records of batch in one message, and clear it once published. Fails while a record is open
+  inline bool publish(const String &topic, MqttRecordBatch &batch, const bool retain = false, const byte qos = 0) { return publish(topic.c_str(), batch, retain, qos); };
+  // Streamed publish, the payload is written to the socket as it is produced so it is not limited by MQTT_MAX_PACKET_SIZE.
+  // Exactly length bytes must be written before endPublish(), which must be called before the next loop() call. These messages are never queued.
+  bool beginPublish(const char* topic, const size_t length, const bool retain = false);
+  size_t write(const uint8_t* data, const size_t length); // Return the number of bytes written
+  bool endPublish(); // Return false, and close the connection, if less than the announced length was written
+  bool publish(const char* topic, const size_t length, PublishPayloadProducer producer, const bool retain = false);
+  // Subscriptions are kept when the connection is lost and sent again on reconnection, they can also be made before being connected
+  bool subscribe(const char* topic, MessageReceivedCallback messageReceivedCallback);
+  bool subscribe(const char* topic, MessageReceivedCallbackWithTopic messageReceivedCallback);
+  bool subscribe(const char* topic, MessageReceivedCallbackRaw messageReceivedCallback); // No copy of the message is made, the payload must be used before the callback returns
+  bool subscribe(const char* topic, const MessageStreamCallbacks &messageStreamCallbacks); // Receive messages of any size, with a buffer of MQTT_STREAM_CHUNK_SIZE bytes
+  bool unsubscribe(const char* topic);   //Unsubscribes from the topic, if it exists, and removes it from the CallbackList.
+  inline bool subscribe(const String &topic, MessageReceivedCallback messageReceivedCallback) { return subscribe(topic.c_str(), messageReceivedCallback); };
+  inline bool subscribe(const String &topic, MessageReceivedCallbackWithTopic messageReceivedCallback) { return subscribe(topic.c_str(), messageReceivedCallback); };
+  inline bool subscribe(const String &topic, MessageReceivedCallbackRaw messageReceivedCallback) { return subscribe(topic.c_str(), messageReceivedCallback); };
+  inline bool subscribe(const String &topic, const MessageStreamCallbacks &messageStreamCallbacks) { return subscribe(topic.c_str(), messageStreamCallbacks); };
+  inline bool unsubscribe(const String &topic) { return unsubscribe(topic.c_str()); };
+
+  inline const MqttPublishQueue::Stats& getPublishQueueStats() const { return mPublishQueue.stats(); }; // Return the number of messages queued, sent from the queue and dropped
+  inline const MqttPublishLimiter::Stats& getPublishPolicyStats() const { return mPublishLimiter.stats(); }; // Return the number of messages held, replaced by a newer one and suppressed by the deadband
+  inline unsigned int getUnacknowledgedCount() const { return mInflightMessages.count(); }; // Return the number of QoS 1 messages waiting for their PUBACK
 
   // Other
-  void executeDelayed(const unsigned long delay, DelayedExecutionCallback callback);
+  size_t getSubscriptionsMemoryUsage() const; // Return the number of bytes used by the subscription table, its topics and the routing table
+  DelayedExecutionHandle executeDelayed(const unsigned long delay, DelayedExecutionCallback callback); // The returned handle can be given to cancelDelayedExecution()
+  DelayedExecutionHandle executePeriodically(const unsigned long period, DelayedExecutionCallback callback); // Execute the callback every period milliseconds, until cancelled
+  bool cancelDelayedExecution(const DelayedExecutionHandle handle); // Can be called from the callback itself
 
   inline bool isConnected() const { return isWifiConnected() && isMqttConnected(); }; // Return true if everything is connected
   inline bool isWifiConnected() const { return mWifiConnected; }; // Return true if wifi is connected
   inline bool isMqttConnected() const { return mMqttConnected; }; // Return true if mqtt is connected
-  inline bool getConnectionEstablishedCount() const { return mConnectionEstablishedCount; }; // Return the number of time onConnectionEstablished has been called since the beginning.
+  inline const char* getBrokerHost() const { return mBrokers[mBrokerIndex].host; }; // Return the broker connected, or being connected
+  inline unsigned int getConnectionEstablishedCount() const { return mConnectionEstablishedCount; }; // Return the number of time onConnectionEstablished has been called since the beginning.
+
+  const MqttClientMetrics& getMetrics(); // Return the counters since the beginning or since the last resetMetrics() call. With the network task, a copy valid until the next call
+  void resetMetrics();
 
   inline void setOnConnectionEstablishedCallback(ConnectionEstablishedCallback callback) { mConnectionEstablishedCallback = callback; }; // Default to onConnectionEstablished, you might want to override this for special cases like two MQTT connections in the same sketch
 
 private:
+  TopicSubscriptionRecord* addSubscription(const char* topic);
+  void removeSubscription(const unsigned int index);
+  void resubscribe();
+  bool publishMessage(const char* topic, const uint8_t* payload, const size_t length, const bool retain, const byte qos);
+  bool sendMessage(const char* topic, const uint8_t* payload, const size_t length, const bool retain, const byte qos);
+  static bool sendHeldMessage(const char* topic, const uint8_t* payload, size_t length, byte flags, void* context);
+  bool enqueuePublish(const char* topic, const uint8_t* payload, const size_t length, const byte flags);
+  void processPublishQueue();
+  bool publishQos1(const char* topic, const uint8_t* payload, const size_t length, const bool retain);
+  bool sendQos1(const char* topic, const uint8_t* payload, const size_t length, const byte flags);
+  bool writeQos1Packet(const char* topic, const uint8_t* payload, const size_t length, const byte flags, const uint16_t packetId, const bool dup);
+  void retransmitInflightMessages();
+  static void retransmitInflightMessage(const char* topic, const uint8_t* payload, size_t length, byte flags, uint16_t packetId, void* context);
+  static void pubackReceived(uint16_t packetId, void* context);
+  static bool fitsInPacket(const char* topic, const size_t payloadLength);
+  bool sendPacket(MqttPacketBuilder &packet);
+  uint16_t nextPacketId();
+  void handleNetwork(const unsigned long currentMillis);
+  void handleSession(const unsigned long currentMillis);
+  void runDelayedExecutions(const unsigned long currentMillis);
+  void endLoop(const unsigned long loopStartMicros);
+  void setWifiConnected(const bool connected);
   void connectToWifi();
-  void connectToMqttBroker();
-  bool mqttTopicMatch(const String &topic1, const String &topic2);
+  void handleMqttConnection(const unsigned long currentMillis);
+  byte selectBroker(const unsigned long currentMillis) const;
+  bool isBrokerAvailable(const BrokerEndpoint &broker, const unsigned long currentMillis) const;
+  unsigned long brokerFailed(const unsigned long currentMillis);
+  bool resolveBroker(const unsigned long currentMillis);
+  void refreshBrokerAddresses(const unsigned long currentMillis);
+  void startDnsLookup(BrokerEndpoint &broker, const unsigned long currentMillis);
+  void updateDnsLookup(BrokerEndpoint &broker, const unsigned long currentMillis);
+  inline bool isDnsCacheFresh(const BrokerEndpoint &broker, const unsigned long currentMillis) const { return broker.hasAddress && currentMillis - broker.resolvedMillis < mDnsCacheTtl; };
+  static void dnsLookupDone(const char* name, const ip_addr_t* address, void* context);
+  bool connectSocket();
+  bool connectTls(const BrokerEndpoint &broker);
+  bool sendConnectPacket();
+  void handleConnack();
+  void mqttConnectionFailed(const int state);
+  static const char* mqttStateToString(const int state);
   void mqttMessageReceivedCallback(char* topic, byte* payload, unsigned int length);
+  void publishMetrics();
+  void handleOtaUpdate();
+  void publishOtaStatus();
+
+  enum DispatchTarget : byte {
+    DISPATCH_ALL,
+    DISPATCH_STREAMS, // From the network task, the other subscriptions are called by loop()
+    DISPATCH_CALLBACKS // From loop(), with the network task
+  };
+  struct MessageDispatchContext {
+    EspMQTTClient* client;
+    const char* topic;
+    byte* payload;
+    unsigned int length;
+    bool stringsBuilt;
+    byte target;
+    unsigned int skippedCount; // Subscriptions left to the other target
+  };
+  unsigned int dispatchMessage(const char* topic, byte* payload, const unsigned int length, const DispatchTarget target); // Return the number of subscriptions left to the other target
+  inline void beginDispatch() { mDispatchDepth++; };
+  void endDispatch(); // Remove the subscriptions marked as removed during the dispatch
+  static void dispatchToSubscription(int index, void* context);
+
+  struct StreamDispatchContext {
+    EspMQTTClient* client;
+    MqttTransport::StreamEvent event;
+    const char* topic;
+    const uint8_t* data;
+    size_t length;
+    unsigned int subscriberCount;
+  };
+  static void streamedMessageReceived(MqttTransport::StreamEvent event, const char* topic, const uint8_t* data, size_t length, void* context);
+  static void dispatchStreamToSubscription(int index, void* context);
+  static void copyPayloadToString(String &str, const byte* payload, unsigned int length);
+
+  // Network task related, the lock does nothing unless called from another task than the network task
+  bool isSketchTask() const;
+  void lockNetwork();
+  void unlockNetwork();
+  void countPublishFailure(); // From either task, without the lock
+  struct NetworkLock {
+    EspMQTTClient* client;
+    NetworkLock(EspMQTTClient* lockedClient) : client(lockedClient) { client->lockNetwork(); };
+    ~NetworkLock() { client->unlockNetwork(); };
+  };
+  #ifdef ESP32
+    void dispatchInboundMessages();
+    void sendOutboundMessages();
+    static void networkTask(void* parameter);
+  #endif
 };
 
 #endif
@@ -0,0 +1,53 @@
+#ifndef EXPONENTIAL_BACKOFF_H
+#define EXPONENTIAL_BACKOFF_H
+
+#include <Arduino.h>
+
+/*
+  Delay between connection attempts, doubled after each failed attempt up to a maximum, with "full jitter":
+  the delay is drawn at random in the window, so devices that lost their connection at the same time
+  do not retry in lockstep. A minimum delay can be kept for attempts that need time to complete.
+*/
+class ExponentialBackoff
+{
+public:
+  ExponentialBackoff(const unsigned long initialDelay, const unsigned long maxDelay, const unsigned long minDelay = 0)
+  {
+    setDelays(initialDelay, maxDelay, minDelay);
+  };
+
+  void setDelays(const unsigned long initialDelay, const unsigned long maxDelay, const unsigned long minDelay = 0)
+  {
+    mInitialDelay = initialDelay;
+    mMaxDelay = maxDelay > initialDelay ? maxDelay : initialDelay;
+    mMinDelay = minDelay;
+    mAttempts = 0;
+  };
+
+  // Return the delay to wait before the next attempt
+  unsigned long nextDelay()
+  {
+    unsigned long window = mInitialDelay;
+    for (unsigned int i = 0 ; i < mAttempts && window < mMaxDelay ; i++)
+      window = window > mMaxDelay / 2 ? mMaxDelay : window * 2;
+
+    if (mAttempts < 0xFFFF)
+      mAttempts++;
+
+    if (window <= mMinDelay)
+      return mMinDelay;
+    return mMinDelay + random(window - mMinDelay + 1);
+  };
+
+  inline void reset() { mAttempts = 0; }; // To call once connected
+  inline unsigned int attempts() const { return mAttempts; };
+  inline unsigned long maxDelay() const { return mMaxDelay; };
+
+private:
+  unsigned long mInitialDelay;
+  unsigned long mMaxDelay;
+  unsigned long mMinDelay;
+  unsigned int mAttempts;
+};
+
+#endif
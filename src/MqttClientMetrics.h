@@ -0,0 +1,93 @@
+#ifndef MQTT_CLIENT_METRICS_H
+#define MQTT_CLIENT_METRICS_H
+
+#include <Arduino.h>
+
+/*
+  Runtime counters of an EspMQTTClient, returned by getMetrics().
+  Everything is updated in place by loop(), publish() and the message dispatch, nothing is allocated.
+  The loop() durations are kept in a histogram of power of two buckets: bucket 0 counts the calls shorter
+  than LOOP_HISTOGRAM_FIRST_BUCKET_MICROS, each next bucket doubles the bound, and the last one counts everything longer.
+*/
+struct MqttClientMetrics
+{
+  static const unsigned int LOOP_HISTOGRAM_BUCKETS = 12;
+  static const unsigned long LOOP_HISTOGRAM_FIRST_BUCKET_MICROS = 128;
+
+  unsigned long messagesIn;
+  unsigned long messagesOut;
+  unsigned long bytesIn; // Every byte read from or written to the broker socket, protocol overhead included
+  unsigned long bytesOut;
+  unsigned long publishFailures; // publish() calls that returned false
+  unsigned long inboundDropped; // Received messages dropped because loop() did not dispatch them fast enough, with the network task
+  unsigned long reconnectCount; // Connections established after the first one
+  unsigned long lastConnectDurationMillis; // Time taken by the last successful connection attempt, from the DNS resolution to the CONNACK
+  unsigned long lastTlsHandshakeMillis; // TCP connection and TLS handshake of the last TLS connection
+  uint32_t lastTlsHeapUsage; // Heap taken by the last TLS connection, kept until it is closed
+  unsigned long tlsHandshakes;
+  unsigned long tlsResumedHandshakes; // Handshakes that resumed the previous session, only detected on ESP8266
+  unsigned long loopDurationHistogram[LOOP_HISTOGRAM_BUCKETS];
+  unsigned long loopMaxMicros;
+  unsigned long callbackCount; // Received messages dispatched to the subscriptions, and the time spent in their callbacks
+  unsigned long callbackTotalMicros;
+  unsigned long callbackMaxMicros;
+  uint32_t minFreeHeap; // Lowest free heap seen at the end of loop()
+
+  MqttClientMetrics() { reset(); };
+
+  void reset()
+  {
+    messagesIn = 0;
+    messagesOut = 0;
+    bytesIn = 0;
+    bytesOut = 0;
+    publishFailures = 0;
+    inboundDropped = 0;
+    reconnectCount = 0;
+    lastConnectDurationMillis = 0;
+    lastTlsHandshakeMillis = 0;
+    lastTlsHeapUsage = 0;
+    tlsHandshakes = 0;
+    tlsResumedHandshakes = 0;
+    for (unsigned int i = 0 ; i < LOOP_HISTOGRAM_BUCKETS ; i++)
+      loopDurationHistogram[i] = 0;
+    loopMaxMicros = 0;
+    callbackCount = 0;
+    callbackTotalMicros = 0;
+    callbackMaxMicros = 0;
+    minFreeHeap = 0xFFFFFFFF;
+  };
+
+  void recordLoopDuration(const unsigned long duration)
+  {
+    unsigned int bucket = 0;
+    unsigned long bound = LOOP_HISTOGRAM_FIRST_BUCKET_MICROS;
+    while (bucket < LOOP_HISTOGRAM_BUCKETS - 1 && duration >= bound)
+    {
+      bucket++;
+      bound *= 2;
+    }
+
+    loopDurationHistogram[bucket]++;
+    if (duration > loopMaxMicros)
+      loopMaxMicros = duration;
+  };
+
+  void recordCallbackDuration(const unsigned long duration)
+  {
+    callbackCount++;
+    callbackTotalMicros += duration;
+    if (duration > callbackMaxMicros)
+      callbackMaxMicros = duration;
+  };
+
+  // Upper bound of a histogram bucket in microseconds, 0 for the last one which has none
+  static unsigned long loopHistogramBucketBound(const unsigned int bucket)
+  {
+    if (bucket >= LOOP_HISTOGRAM_BUCKETS - 1)
+      return 0;
+    return LOOP_HISTOGRAM_FIRST_BUCKET_MICROS << bucket;
+  };
+};
+
+#endif
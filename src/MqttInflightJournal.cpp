@@ -0,0 +1,118 @@
+#include "MqttInflightJournal.h"
+
+
+MqttInflightJournal::MqttInflightJournal()
+{
+  mFileSystem = NULL;
+  mSize = 0;
+}
+
+
+// =============== Public functions =================
+
+bool MqttInflightJournal::begin(fs::FS &fileSystem, const char* path, MqttPublishQueue &store, uint16_t* lastPacketId)
+{
+  mFileSystem = &fileSystem;
+  mPath = path;
+  *lastPacketId = 0;
+
+  fs::File file = fileSystem.open(path, "r");
+  if (file)
+  {
+    uint8_t header[RECORD_HEADER_SIZE];
+    while (file.read(header, sizeof(header)) == sizeof(header))
+    {
+      byte type = header[0];
+      byte flags = header[1];
+      uint16_t packetId = header[2] | (header[3] << 8);
+      size_t topicLength = header[4] | (header[5] << 8);
+      size_t length = header[6] | (header[7] << 8) | ((size_t)header[8] << 16) | ((size_t)header[9] << 24);
+
+      if (type == RECORD_ACK)
+      {
+        store.acknowledge(packetId);
+        continue;
+      }
+      if (type != RECORD_PUBLISH)
+        break;
+
+      // The topic is NUL terminated in the record given to the store
+      char* topic = (char*)malloc(topicLength + 1 + length);
+      if (topic == NULL)
+        break;
+      uint8_t* payload = (uint8_t*)topic + topicLength + 1;
+      bool complete = 
+        file.read((uint8_t*)topic, topicLength) == topicLength &&
+        file.read(payload, length) == length;
+      topic[topicLength] = '\0';
+
+      if (complete)
+      {
+        store.push(topic, payload, length, flags, packetId);
+        *lastPacketId = packetId;
+      }
+      free(topic);
+      if (!complete)
+        break;
+    }
+    file.close();
+  }
+
+  // Start again with only the messages still waiting
+  rewrite(store);
+  return (bool)mFile;
+}
+
+void MqttInflightJournal::appendPublish(const char* topic, const uint8_t* payload, const size_t length, const byte flags, const uint16_t packetId)
+{
+  writeRecord(RECORD_PUBLISH, topic, strlen(topic), payload, length, flags, packetId);
+  mFile.flush();
+}
+
+void MqttInflightJournal::appendAck(const uint16_t packetId, const MqttPublishQueue &store)
+{
+  if (store.isEmpty() || mSize >= MQTT_INFLIGHT_JOURNAL_COMPACT_SIZE)
+    rewrite(store);
+  else
+  {
+    writeRecord(RECORD_ACK, "", 0, NULL, 0, 0, packetId);
+    mFile.flush();
+  }
+}
+
+
+// ================== Private functions ====================
+
+void MqttInflightJournal::rewrite(const MqttPublishQueue &store)
+{
+  if (mFile)
+    mFile.close();
+
+  mFile = mFileSystem->open(mPath, "w");
+  mSize = 0;
+  store.forEach(rewriteRecord, this);
+  mFile.flush();
+}
+
+void MqttInflightJournal::writeRecord(const byte type, const char* topic, const size_t topicLength, const uint8_t* payload, const size_t length, const byte flags, const uint16_t packetId)
+{
+  if (!mFile)
+    return;
+
+  uint8_t header[RECORD_HEADER_SIZE] = {
+    type, flags,
+    (uint8_t)(packetId & 0xFF), (uint8_t)(packetId >> 8),
+    (uint8_t)(topicLength & 0xFF), (uint8_t)(topicLength >> 8),
+    (uint8_t)(length & 0xFF), (uint8_t)(length >> 8), (uint8_t)(length >> 16), (uint8_t)(length >> 24)
+  };
+  mFile.write(header, sizeof(header));
+  mFile.write((const uint8_t*)topic, topicLength);
+  if (length > 0)
+    mFile.write(payload, length);
+  mSize += sizeof(header) + topicLength + length;
+}
+
+void MqttInflightJournal::rewriteRecord(const char* topic, const uint8_t* payload, size_t length, byte flags, uint16_t packetId, void* context)
+{
+  ((MqttInflightJournal*)context)->writeRecord(RECORD_PUBLISH, topic, strlen(topic), payload, length, flags, packetId);
+}
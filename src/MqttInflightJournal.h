@@ -0,0 +1,44 @@
+#ifndef MQTT_INFLIGHT_JOURNAL_H
+#define MQTT_INFLIGHT_JOURNAL_H
+
+#include <Arduino.h>
+#include <FS.h>
+#include "MqttPublishQueue.h"
+
+#ifndef MQTT_INFLIGHT_JOURNAL_COMPACT_SIZE
+  #define MQTT_INFLIGHT_JOURNAL_COMPACT_SIZE 8192 // Size from which the journal is rewritten with only the messages still waiting for their PUBACK
+#endif
+
+/*
+  File copy of the QoS 1 messages waiting for their PUBACK, so they are sent again after a reboot.
+  Each message sent and each acknowledgement is appended to the file, which is replayed by begin().
+  Appending keeps the flash writes small, the file is rewritten from the store only once it has grown enough,
+  or emptied when nothing is waiting. A record cut by a reboot is ignored.
+*/
+class MqttInflightJournal
+{
+public:
+  MqttInflightJournal();
+
+  bool begin(fs::FS &fileSystem, const char* path, MqttPublishQueue &store, uint16_t* lastPacketId); // Load the messages of the file into store
+  void appendPublish(const char* topic, const uint8_t* payload, const size_t length, const byte flags, const uint16_t packetId);
+  void appendAck(const uint16_t packetId, const MqttPublishQueue &store);
+
+  inline bool isEnabled() const { return mFileSystem != NULL; };
+
+private:
+  static const byte RECORD_PUBLISH = 'P';
+  static const byte RECORD_ACK = 'A';
+  static const size_t RECORD_HEADER_SIZE = 10; // Type, flags, packet id, topic length and payload length
+
+  fs::FS* mFileSystem;
+  String mPath;
+  fs::File mFile; // Open for writing, records are added at its end
+  size_t mSize;
+
+  void rewrite(const MqttPublishQueue &store);
+  void writeRecord(const byte type, const char* topic, const size_t topicLength, const uint8_t* payload, const size_t length, const byte flags, const uint16_t packetId);
+  static void rewriteRecord(const char* topic, const uint8_t* payload, size_t length, byte flags, uint16_t packetId, void* context);
+};
+
+#endif
@@ -0,0 +1,146 @@
+#include "MqttLogBuffer.h"
+
+MqttLogBuffer MqttLog(ESPMQTT_LOG_BUFFER_SIZE);
+
+
+// =============== Constructor / destructor ===================
+
+MqttLogBuffer::MqttLogBuffer(const size_t capacity)
+{
+  mBuffer = NULL;
+  mCapacity = capacity;
+  mHead = 0;
+  mLength = 0;
+  mDroppedPending = 0;
+  mDroppedTotal = 0;
+  #ifdef ESP32
+    portMUX_INITIALIZE(&mLock);
+  #endif
+}
+
+MqttLogBuffer::~MqttLogBuffer()
+{
+  free(mBuffer);
+}
+
+
+// =============== Public functions =================
+
+void MqttLogBuffer::printf(const char* format, ...)
+{
+  // The buffer is allocated on first use, so a firmware that never enables the logs doesn't pay for it
+  if (mBuffer == NULL)
+  {
+    char* buffer = (char*)malloc(mCapacity);
+    if (buffer == NULL)
+      return;
+
+    lock();
+    if (mBuffer == NULL)
+    {
+      mBuffer = buffer;
+      buffer = NULL;
+    }
+    unlock();
+    free(buffer); // Another task allocated it meanwhile
+  }
+
+  char line[ESPMQTT_LOG_MAX_LINE_LENGTH];
+
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(line, sizeof(line), format, args);
+  va_end(args);
+
+  if (length < 0)
+    return;
+
+  // Truncated messages keep their line break
+  if ((size_t)length >= sizeof(line))
+  {
+    length = sizeof(line) - 1;
+    memcpy(line + length - 4, "...\n", 4);
+  }
+
+  lock();
+
+  if (mDroppedPending > 0)
+  {
+    char report[40];
+    int reportLength = snprintf(report, sizeof(report), "SYS! %lu log messages dropped\n", mDroppedPending);
+    if (push(report, reportLength))
+      mDroppedPending = 0;
+  }
+
+  if (mDroppedPending > 0 || !push(line, length))
+  {
+    mDroppedPending++;
+    mDroppedTotal++;
+  }
+
+  unlock();
+}
+
+void MqttLogBuffer::drain(Print &output, size_t maxBytes)
+{
+  // The bytes being written are not touched by push(), the buffer is only locked to read and move the head
+  while (maxBytes > 0)
+  {
+    lock();
+    size_t head = mHead;
+    size_t length = mLength;
+    unlock();
+
+    if (length == 0)
+      return;
+
+    size_t chunk = mCapacity - head; // Until the end of the buffer, the rest is written by the next iteration
+    if (chunk > length)
+      chunk = length;
+    if (chunk > maxBytes)
+      chunk = maxBytes;
+
+    size_t written = output.write((const uint8_t*)mBuffer + head, chunk);
+    if (written == 0)
+      return;
+
+    lock();
+    mHead = (mHead + written) % mCapacity;
+    mLength -= written;
+    unlock();
+    maxBytes -= written;
+  }
+}
+
+
+// ================== Private functions ====================
+
+bool MqttLogBuffer::push(const char* line, const size_t length)
+{
+  if (length > mCapacity - mLength)
+    return false;
+
+  size_t tail = (mHead + mLength) % mCapacity;
+  size_t firstPart = mCapacity - tail;
+  if (firstPart > length)
+    firstPart = length;
+
+  memcpy(mBuffer + tail, line, firstPart);
+  memcpy(mBuffer, line + firstPart, length - firstPart);
+  mLength += length;
+  return true;
+}
+
+void MqttLogBuffer::lock()
+{
+  #ifdef ESP32
+    portENTER_CRITICAL(&mLock);
+  #endif
+}
+
+void MqttLogBuffer::unlock()
+{
+  #ifdef ESP32
+    portEXIT_CRITICAL(&mLock);
+  #endif
+}
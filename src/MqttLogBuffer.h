@@ -0,0 +1,83 @@
+#ifndef MQTT_LOG_BUFFER_H
+#define MQTT_LOG_BUFFER_H
+
+#include <Arduino.h>
+#ifdef ESP32
+  #include <freertos/FreeRTOS.h>
+#endif
+
+// Log levels, ESPMQTT_LOG_LEVEL can be defined in the build flags to remove the less important messages from the firmware
+#define ESPMQTT_LOG_LEVEL_NONE 0
+#define ESPMQTT_LOG_LEVEL_ERROR 1 // "MQTT!", "WiFi!", "SYS!" messages
+#define ESPMQTT_LOG_LEVEL_INFO 2 // Connection and subscription events
+#define ESPMQTT_LOG_LEVEL_DEBUG 3 // Every message sent and received
+
+#ifndef ESPMQTT_LOG_LEVEL
+  #define ESPMQTT_LOG_LEVEL ESPMQTT_LOG_LEVEL_DEBUG
+#endif
+#ifndef ESPMQTT_LOG_BUFFER_SIZE
+  #define ESPMQTT_LOG_BUFFER_SIZE 1024 // Allocated at the first message logged
+#endif
+#ifndef ESPMQTT_LOG_MAX_LINE_LENGTH
+  #define ESPMQTT_LOG_MAX_LINE_LENGTH 160 // Longer messages are truncated
+#endif
+
+// The messages below the level are removed at compile time, with their format strings and arguments.
+// Their format is still checked against the arguments, whatever the level.
+inline void espMqttLogRemoved(const char* format, ...) __attribute__((format(printf, 1, 2)));
+inline void espMqttLogRemoved(const char*, ...) {}
+
+#if ESPMQTT_LOG_LEVEL >= ESPMQTT_LOG_LEVEL_ERROR
+  #define ESPMQTT_LOG_ERROR(enabled, ...) do { if (enabled) MqttLog.printf(__VA_ARGS__); } while (0)
+#else
+  #define ESPMQTT_LOG_ERROR(enabled, ...) do { if (false) espMqttLogRemoved(__VA_ARGS__); } while (0)
+#endif
+#if ESPMQTT_LOG_LEVEL >= ESPMQTT_LOG_LEVEL_INFO
+  #define ESPMQTT_LOG_INFO(enabled, ...) do { if (enabled) MqttLog.printf(__VA_ARGS__); } while (0)
+#else
+  #define ESPMQTT_LOG_INFO(enabled, ...) do { if (false) espMqttLogRemoved(__VA_ARGS__); } while (0)
+#endif
+#if ESPMQTT_LOG_LEVEL >= ESPMQTT_LOG_LEVEL_DEBUG
+  #define ESPMQTT_LOG_DEBUG(enabled, ...) do { if (enabled) MqttLog.printf(__VA_ARGS__); } while (0)
+#else
+  #define ESPMQTT_LOG_DEBUG(enabled, ...) do { if (false) espMqttLogRemoved(__VA_ARGS__); } while (0)
+#endif
+
+/*
+  Ring buffer of formatted log messages, written to the serial port from loop() as fast as its transmit buffer accepts them.
+  Logging never waits for the UART: when the ring buffer is full the message is dropped, and the number of
+  dropped messages is logged once there is room again.
+  On ESP32 messages can be logged from several tasks, the buffer is then only changed under a spinlock,
+  while a single task drains it.
+*/
+class MqttLogBuffer
+{
+public:
+  MqttLogBuffer(const size_t capacity);
+  ~MqttLogBuffer();
+
+  void printf(const char* format, ...) __attribute__((format(printf, 2, 3)));
+  void drain(Print &output, size_t maxBytes); // Write at most maxBytes of the buffered messages to output
+
+  inline bool isEmpty() const { return mLength == 0; };
+  inline unsigned long dropped() const { return mDroppedTotal; }; // Number of messages dropped since the beginning
+
+private:
+  char* mBuffer;
+  size_t mCapacity;
+  size_t mHead; // First byte not yet written to the output
+  size_t mLength;
+  unsigned long mDroppedPending; // Dropped since the last report
+  unsigned long mDroppedTotal;
+  #ifdef ESP32
+    portMUX_TYPE mLock;
+  #endif
+
+  bool push(const char* line, const size_t length);
+  void lock();
+  void unlock();
+};
+
+extern MqttLogBuffer MqttLog; // Shared by all the clients as they write to the same serial port
+
+#endif
@@ -0,0 +1,240 @@
+#include "MqttOtaUpdater.h"
+
+
+// =============== Constructor / destructor ===================
+
+MqttOtaUpdater::MqttOtaUpdater(const bool enableSerialLogs)
+{
+  mEnableSerialLogs = enableSerialLogs;
+  mBuffer = NULL;
+  mError = NULL;
+  mStatusChanged = false;
+  reset();
+}
+
+MqttOtaUpdater::~MqttOtaUpdater()
+{
+  if (mState == OTA_RUNNING)
+    abort();
+  free(mBuffer);
+}
+
+
+// =============== Public functions =================
+
+bool MqttOtaUpdater::begin(const size_t size, const char* md5)
+{
+  if (size == 0 || md5 == NULL || strlen(md5) != 32)
+  {
+    ESPMQTT_LOG_ERROR(mEnableSerialLogs, "OTA! Invalid begin message, \"<size> <md5>\" expected.\n");
+    mError = "invalid begin message";
+    mStatusChanged = true;
+    return false;
+  }
+
+  // The sender starts again after a disconnection, the update goes on from the last chunk received
+  if (mState == OTA_RUNNING && size == mSize && strcasecmp(md5, mMd5) == 0)
+  {
+    ESPMQTT_LOG_INFO(mEnableSerialLogs, "OTA: Resuming the update at %u/%u bytes\n", (unsigned int)mOffset, (unsigned int)mSize);
+    mStatusChanged = true;
+    return true;
+  }
+
+  if (mState == OTA_RUNNING)
+    abort();
+
+  if (mBuffer == NULL)
+  {
+    mBuffer = (uint8_t*)malloc(MQTT_OTA_MAX_CHUNK_SIZE);
+    if (mBuffer == NULL)
+    {
+      fail("not enough memory");
+      return false;
+    }
+  }
+
+  if (!Update.begin(size))
+  {
+    fail("not enough space for the firmware");
+    return false;
+  }
+
+  reset();
+  mState = OTA_RUNNING;
+  mSize = size;
+  memcpy(mMd5, md5, sizeof(mMd5));
+  mError = NULL;
+  mStatusChanged = true;
+
+  // The MD5 is checked by Update.end() once the whole firmware is written
+  if (!Update.setMD5(mMd5))
+  {
+    fail("invalid MD5");
+    return false;
+  }
+
+  ESPMQTT_LOG_INFO(mEnableSerialLogs, "OTA: Update of %u bytes started\n", (unsigned int)mSize);
+  return true;
+}
+
+void MqttOtaUpdater::abort()
+{
+  if (mState != OTA_RUNNING)
+    return;
+
+  #ifdef ESP32
+    Update.abort();
+  #else
+    Update.end(false); // Reset the updater as the firmware is not complete
+  #endif
+
+  ESPMQTT_LOG_INFO(mEnableSerialLogs, "OTA: Update aborted at %u/%u bytes\n", (unsigned int)mOffset, (unsigned int)mSize);
+  reset();
+  mError = "aborted";
+  mStatusChanged = true;
+}
+
+void MqttOtaUpdater::beginChunk(const size_t messageLength)
+{
+  mChunkHeaderLength = 0;
+  mChunkReceived = 0;
+  mChunkLength = messageLength >= sizeof(mChunkHeader) ? messageLength - sizeof(mChunkHeader) : 0;
+  mChunkAccepted = mState == OTA_RUNNING && messageLength >= sizeof(mChunkHeader);
+
+  if (mChunkAccepted && mChunkLength > MQTT_OTA_MAX_CHUNK_SIZE)
+  {
+    fail("chunk larger than MQTT_OTA_MAX_CHUNK_SIZE");
+    mChunkAccepted = false;
+  }
+
+  // The previous chunks are not written to flash yet, the sender will send this one again
+  if (mChunkAccepted && mChunkLength > MQTT_OTA_MAX_CHUNK_SIZE - mBufferLength)
+  {
+    mChunkAccepted = false;
+    if (!mMismatchReported)
+    {
+      mMismatchReported = true;
+      mStatusChanged = true;
+    }
+  }
+}
+
+void MqttOtaUpdater::writeChunk(const uint8_t* data, const size_t length)
+{
+  if (!mChunkAccepted)
+    return;
+
+  size_t position = 0;
+  while (mChunkHeaderLength < sizeof(mChunkHeader) && position < length)
+  {
+    mChunkHeader[mChunkHeaderLength++] = data[position++];
+    if (mChunkHeaderLength < sizeof(mChunkHeader))
+      continue;
+
+    size_t chunkOffset = ((size_t)mChunkHeader[0] << 24) | ((size_t)mChunkHeader[1] << 16) | ((size_t)mChunkHeader[2] << 8) | mChunkHeader[3];
+    if (chunkOffset != mOffset || mOffset + mChunkLength > mSize)
+    {
+      mChunkAccepted = false;
+      if (!mMismatchReported)
+      {
+        ESPMQTT_LOG_ERROR(mEnableSerialLogs, "OTA! Chunk at offset %u received, %u expected\n", (unsigned int)chunkOffset, (unsigned int)mOffset);
+        mMismatchReported = true;
+        mStatusChanged = true;
+      }
+      return;
+    }
+  }
+
+  size_t count = length - position;
+  if (mChunkReceived + count > mChunkLength)
+    count = mChunkLength - mChunkReceived;
+
+  memcpy(mBuffer + mBufferLength + mChunkReceived, data + position, count);
+  mChunkReceived += count;
+}
+
+void MqttOtaUpdater::endChunk(const bool complete)
+{
+  if (mChunkAccepted && complete && mChunkHeaderLength == sizeof(mChunkHeader) && mChunkReceived == mChunkLength)
+  {
+    mBufferLength += mChunkLength;
+    mOffset += mChunkLength;
+    mMismatchReported = false;
+  }
+  mChunkAccepted = false;
+}
+
+void MqttOtaUpdater::loop()
+{
+  if (mState != OTA_RUNNING || mBufferLength == 0)
+    return;
+
+  if (Update.write(mBuffer, mBufferLength) != mBufferLength)
+  {
+    fail("flash write failed");
+    return;
+  }
+  mFlashedLength += mBufferLength;
+  mBufferLength = 0;
+
+  if (mFlashedLength < mSize)
+    return;
+
+  if (!Update.end())
+  {
+    ESPMQTT_LOG_ERROR(mEnableSerialLogs, "OTA! Firmware verification failed, error %u\n", (unsigned int)Update.getError());
+    reset();
+    mState = OTA_FAILED;
+    mError = "verification failed";
+    mStatusChanged = true;
+    return;
+  }
+
+  ESPMQTT_LOG_INFO(mEnableSerialLogs, "OTA: Update of %u bytes succeeded\n", (unsigned int)mSize);
+  mState = OTA_SUCCEEDED;
+  mStatusChanged = true;
+}
+
+bool MqttOtaUpdater::takeStatusChange()
+{
+  bool changed = mStatusChanged;
+  mStatusChanged = false;
+  return changed;
+}
+
+
+// ================== Private functions ====================
+
+void MqttOtaUpdater::fail(const char* error)
+{
+  ESPMQTT_LOG_ERROR(mEnableSerialLogs, "OTA! Update failed, %s\n", error);
+
+  if (mState == OTA_RUNNING)
+  {
+    #ifdef ESP32
+      Update.abort();
+    #else
+      Update.end(false);
+    #endif
+  }
+
+  reset();
+  mState = OTA_FAILED;
+  mError = error;
+  mStatusChanged = true;
+}
+
+void MqttOtaUpdater::reset()
+{
+  mState = OTA_IDLE;
+  mSize = 0;
+  mMd5[0] = '\0';
+  mOffset = 0;
+  mMismatchReported = false;
+  mBufferLength = 0;
+  mFlashedLength = 0;
+  mChunkAccepted = false;
+  mChunkHeaderLength = 0;
+  mChunkLength = 0;
+  mChunkReceived = 0;
+}
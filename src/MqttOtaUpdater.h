@@ -0,0 +1,78 @@
+#ifndef MQTT_OTA_UPDATER_H
+#define MQTT_OTA_UPDATER_H
+
+#include <Arduino.h>
+#include "MqttLogBuffer.h"
+
+#ifdef ESP8266
+  #include <Updater.h>
+#else // for ESP32
+  #include <Update.h>
+#endif
+
+#ifndef MQTT_OTA_MAX_CHUNK_SIZE
+  #define MQTT_OTA_MAX_CHUNK_SIZE 2048 // Largest firmware chunk accepted in a data message, the buffer holding it is allocated by begin()
+#endif
+
+/*
+  Firmware update received over MQTT, written to flash with the Update API.
+  The firmware is sent in data messages starting with the offset of their chunk (4 bytes, big endian).
+  A chunk is only accepted at the offset following the last accepted one, the sender restarts from the offset
+  reported in the status when a message was lost. Chunks are copied to a buffer by the receive path and
+  written to flash by loop(), so a slow flash write never holds the socket.
+*/
+class MqttOtaUpdater
+{
+public:
+  enum State : byte {
+    OTA_IDLE,
+    OTA_RUNNING,
+    OTA_SUCCEEDED, // The new firmware is ready, the device has to restart
+    OTA_FAILED
+  };
+
+  MqttOtaUpdater(const bool enableSerialLogs = false);
+  ~MqttOtaUpdater();
+
+  bool begin(const size_t size, const char* md5); // Start an update, or resume the one in progress if it has the same size and MD5
+  void abort();
+
+  // Receive path of a data message
+  void beginChunk(const size_t messageLength);
+  void writeChunk(const uint8_t* data, const size_t length);
+  void endChunk(const bool complete);
+
+  void loop(); // Write the received chunks to flash
+  bool takeStatusChange(); // Return true once after each change to report to the sender
+
+  inline State state() const { return mState; };
+  inline size_t offset() const { return mOffset; }; // Bytes accepted, the next chunk is expected at this offset
+  inline size_t size() const { return mSize; };
+  inline const char* error() const { return mError; };
+
+private:
+  bool mEnableSerialLogs;
+  State mState;
+  size_t mSize;
+  char mMd5[33];
+  size_t mOffset;
+  const char* mError;
+  bool mStatusChanged;
+  bool mMismatchReported; // A single status is sent for a series of chunks at the wrong offset
+
+  uint8_t* mBuffer; // Chunks accepted but not written to flash yet
+  size_t mBufferLength;
+  size_t mFlashedLength; // Bytes written to flash
+
+  // Data message being received
+  bool mChunkAccepted;
+  uint8_t mChunkHeader[4];
+  size_t mChunkHeaderLength;
+  size_t mChunkLength; // Payload bytes of the message, without the offset
+  size_t mChunkReceived;
+
+  void fail(const char* error);
+  void reset();
+};
+
+#endif
@@ -0,0 +1,81 @@
+#include "MqttPacketBuilder.h"
+
+
+MqttPacketBuilder::MqttPacketBuilder(uint8_t* buffer, size_t capacity) :
+  mBuffer(buffer),
+  mCapacity(capacity),
+  mPosition(MAX_HEADER_SIZE),
+  mHeader(0)
+{
+}
+
+void MqttPacketBuilder::begin(const uint8_t header)
+{
+  mHeader = header;
+  mPosition = MAX_HEADER_SIZE;
+}
+
+bool MqttPacketBuilder::writeByte(const uint8_t value)
+{
+  if (remaining() < 1)
+    return false;
+
+  mBuffer[mPosition++] = value;
+  return true;
+}
+
+bool MqttPacketBuilder::writeUint16(const uint16_t value)
+{
+  if (remaining() < 2)
+    return false;
+
+  mBuffer[mPosition++] = value >> 8;
+  mBuffer[mPosition++] = value & 0xFF;
+  return true;
+}
+
+bool MqttPacketBuilder::writeString(const char* str, const size_t length)
+{
+  if (length > 0xFFFF || remaining() < stringSize(length))
+    return false;
+
+  writeUint16(length);
+  return writeBytes((const uint8_t*)str, length);
+}
+
+bool MqttPacketBuilder::writeBytes(const uint8_t* data, const size_t length)
+{
+  if (remaining() < length)
+    return false;
+
+  memcpy(mBuffer + mPosition, data, length);
+  mPosition += length;
+  return true;
+}
+
+/**
+ * The remaining length is encoded on 1 to 4 bytes, so the fixed header is written right before the
+ * variable header and the packet start somewhere in the 5 reserved bytes.
+ */
+const uint8_t* MqttPacketBuilder::finish(size_t* packetLength)
+{
+  size_t remainingLength = mPosition - MAX_HEADER_SIZE;
+  uint8_t encoded[4];
+  size_t encodedSize = 0;
+
+  do
+  {
+    uint8_t digit = remainingLength % 128;
+    remainingLength /= 128;
+    if (remainingLength > 0)
+      digit |= 0x80;
+    encoded[encodedSize++] = digit;
+  } while (remainingLength > 0 && encodedSize < sizeof(encoded));
+
+  size_t start = MAX_HEADER_SIZE - 1 - encodedSize;
+  mBuffer[start] = mHeader;
+  memcpy(mBuffer + start + 1, encoded, encodedSize);
+
+  *packetLength = mPosition - start;
+  return mBuffer + start;
+}
@@ -0,0 +1,37 @@
+#ifndef MQTT_PACKET_BUILDER_H
+#define MQTT_PACKET_BUILDER_H
+
+#include <Arduino.h>
+
+/*
+  Serialize MQTT 3.1.1 control packets into a caller provided buffer, for the packets PubSubClient can't build.
+  Like PubSubClient, the first 5 bytes are reserved for the fixed header which is written by finish() once
+  the length of the packet is known.
+*/
+class MqttPacketBuilder
+{
+public:
+  static const size_t MAX_HEADER_SIZE = 5;
+
+  MqttPacketBuilder(uint8_t* buffer, size_t capacity);
+
+  void begin(const uint8_t header);
+  bool writeByte(const uint8_t value);
+  bool writeUint16(const uint16_t value);
+  bool writeString(const char* str, const size_t length); // Length prefixed string
+  bool writeBytes(const uint8_t* data, const size_t length);
+  const uint8_t* finish(size_t* packetLength); // Write the fixed header and return the start of the packet
+
+  inline bool isEmpty() const { return mPosition == MAX_HEADER_SIZE; };
+  inline size_t remaining() const { return mCapacity - mPosition; };
+
+  static size_t stringSize(const size_t length) { return length + 2; };
+
+private:
+  uint8_t* mBuffer;
+  size_t mCapacity;
+  size_t mPosition;
+  uint8_t mHeader;
+};
+
+#endif
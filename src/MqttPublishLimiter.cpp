@@ -0,0 +1,271 @@
+#include "MqttPublishLimiter.h"
+#include <math.h>
+
+
+// =============== Constructor / destructor ===================
+
+MqttPublishLimiter::MqttPublishLimiter()
+{
+  mPolicyCount = 0;
+  mTopics = NULL;
+  mHeldCount = 0;
+  mNextDueMillis = 0;
+  mStats = { 0, 0, 0 };
+}
+
+MqttPublishLimiter::~MqttPublishLimiter()
+{
+  if (mTopics == NULL)
+    return;
+
+  for (unsigned int i = 0 ; i < MQTT_PUBLISH_POLICY_MAX_TOPICS ; i++)
+  {
+    free(mTopics[i].topic);
+    free(mTopics[i].payload);
+  }
+  free(mTopics);
+}
+
+
+// =============== Public functions =================
+
+bool MqttPublishLimiter::addPolicy(const char* topicFilter, const MqttPublishPolicy &policy)
+{
+  int index = mPolicyFilters.find(topicFilter);
+  if (index >= 0)
+  {
+    mPolicies[index] = policy;
+    return true;
+  }
+
+  if (mPolicyCount >= MQTT_PUBLISH_POLICY_MAX_POLICIES)
+    return false;
+
+  if (mTopics == NULL)
+  {
+    mTopics = (TopicState*)calloc(MQTT_PUBLISH_POLICY_MAX_TOPICS, sizeof(TopicState));
+    if (mTopics == NULL)
+      return false;
+  }
+
+  if (!mPolicyFilters.insert(topicFilter, mPolicyCount))
+    return false;
+
+  mPolicies[mPolicyCount++] = policy;
+  return true;
+}
+
+MqttPublishLimiter::Decision MqttPublishLimiter::submit(const char* topic, const uint8_t* payload, const size_t length, const byte flags, const unsigned long currentMillis)
+{
+  // When several filters match the topic, the one added first is used
+  int policyIndex = MQTT_PUBLISH_POLICY_MAX_POLICIES;
+  mPolicyFilters.match(topic, keepFirstPolicy, &policyIndex);
+  if (policyIndex == MQTT_PUBLISH_POLICY_MAX_POLICIES)
+    return SEND;
+
+  // Without room for its state the topic is not limited, rather than losing its messages
+  TopicState* state = findTopic(topic);
+  if (state == NULL)
+    return SEND;
+
+  state->policy = policyIndex;
+  const MqttPublishPolicy &policy = mPolicies[policyIndex];
+
+  float value;
+  if (policy.deadband > 0 && state->hasValue && parseValue(payload, length, &value) && fabsf(value - state->lastValue) <= policy.deadband)
+  {
+    // The value went back close to the one sent, a held message would no longer be the last value
+    if (state->held)
+      release(*state);
+
+    mStats.suppressed++;
+    return SUPPRESSED;
+  }
+
+  // Last value wins, the message takes the place of the held one and is sent when it was due
+  if (state->held)
+  {
+    if (hold(*state, payload, length, flags, state->dueMillis))
+    {
+      mStats.replaced++;
+      return HELD;
+    }
+
+    // Without memory for the new message, the held one is dropped and the new one is sent right away as the last value
+    release(*state);
+  }
+  else
+  {
+    unsigned long dueMillis = earliestSendMillis(*state, policy, currentMillis, true);
+    if (dueMillis != currentMillis && hold(*state, payload, length, flags, dueMillis))
+    {
+      mStats.held++;
+      return HELD;
+    }
+  }
+
+  markSent(*state, policy, payload, length, currentMillis);
+  return SEND;
+}
+
+void MqttPublishLimiter::flush(const unsigned long currentMillis, Sender sender, void* context)
+{
+  if (mTopics == NULL)
+    return;
+
+  bool hasNextDue = false;
+  for (unsigned int i = 0 ; i < MQTT_PUBLISH_POLICY_MAX_TOPICS && mHeldCount > 0 ; i++)
+  {
+    TopicState &state = mTopics[i];
+    if (!state.held)
+      continue;
+
+    if (isBefore(currentMillis, state.dueMillis))
+    {
+      if (!hasNextDue || isBefore(state.dueMillis, mNextDueMillis))
+        mNextDueMillis = state.dueMillis;
+      hasNextDue = true;
+      continue;
+    }
+
+    // A message failing to be sent is lost like one published directly, the sender reports the failure
+    release(state);
+    markSent(state, mPolicies[state.policy], state.payload, state.length, currentMillis);
+    sender(state.topic, state.payload, state.length, state.flags, context);
+  }
+}
+
+
+// =============== Private functions =================
+
+MqttPublishLimiter::TopicState* MqttPublishLimiter::findTopic(const char* topic)
+{
+  TopicState* freeState = NULL;
+  for (unsigned int i = 0 ; i < MQTT_PUBLISH_POLICY_MAX_TOPICS ; i++)
+  {
+    if (mTopics[i].topic == NULL)
+    {
+      if (freeState == NULL)
+        freeState = &mTopics[i];
+    }
+    else if (strcmp(mTopics[i].topic, topic) == 0)
+      return &mTopics[i];
+  }
+
+  if (freeState == NULL || (freeState->topic = strdup(topic)) == NULL)
+    return NULL;
+
+  return freeState;
+}
+
+// Time at which a message can be sent on the topic, each limit of the policy delaying it a bit more
+unsigned long MqttPublishLimiter::earliestSendMillis(TopicState &state, const MqttPublishPolicy &policy, const unsigned long currentMillis, const bool newMessage)
+{
+  unsigned long dueMillis = currentMillis;
+
+  if (newMessage && policy.coalesceWindow > 0)
+    dueMillis = currentMillis + policy.coalesceWindow;
+
+  if (policy.minInterval > 0 && state.hasSent && isBefore(dueMillis, state.lastSentMillis + policy.minInterval))
+    dueMillis = state.lastSentMillis + policy.minInterval;
+
+  if (policy.ratePerSecond > 0)
+  {
+    // The bucket starts full and is refilled lazily, from the time elapsed since it was last updated
+    float burst = policy.burst > 0 ? policy.burst : 1;
+    if (!state.hasSent)
+      state.tokens = burst;
+    else
+      state.tokens += (currentMillis - state.tokensMillis) * policy.ratePerSecond / 1000;
+    if (state.tokens > burst)
+      state.tokens = burst;
+    state.tokensMillis = currentMillis;
+
+    if (state.tokens < 1)
+    {
+      unsigned long tokenMillis = currentMillis + (unsigned long)ceilf((1 - state.tokens) * 1000 / policy.ratePerSecond);
+      if (isBefore(dueMillis, tokenMillis))
+        dueMillis = tokenMillis;
+    }
+  }
+
+  return dueMillis;
+}
+
+void MqttPublishLimiter::markSent(TopicState &state, const MqttPublishPolicy &policy, const uint8_t* payload, const size_t length, const unsigned long currentMillis)
+{
+  if (policy.ratePerSecond > 0)
+  {
+    // Held messages were due once a token was available, so the bucket is updated to now before taking it
+    earliestSendMillis(state, policy, currentMillis, false);
+    state.tokens -= 1;
+  }
+
+  state.hasSent = true;
+  state.lastSentMillis = currentMillis;
+
+  if (policy.deadband > 0)
+    state.hasValue = parseValue(payload, length, &state.lastValue);
+}
+
+bool MqttPublishLimiter::hold(TopicState &state, const uint8_t* payload, const size_t length, const byte flags, const unsigned long dueMillis)
+{
+  if (length > state.capacity)
+  {
+    uint8_t* buffer = (uint8_t*)realloc(state.payload, length);
+    if (buffer == NULL)
+      return false;
+
+    state.payload = buffer;
+    state.capacity = length;
+  }
+
+  if (length > 0)
+    memcpy(state.payload, payload, length);
+  state.length = length;
+  state.flags = flags;
+  state.dueMillis = dueMillis;
+
+  if (!state.held)
+  {
+    state.held = true;
+    if (mHeldCount == 0 || isBefore(dueMillis, mNextDueMillis))
+      mNextDueMillis = dueMillis;
+    mHeldCount++;
+  }
+
+  return true;
+}
+
+void MqttPublishLimiter::release(TopicState &state)
+{
+  state.held = false;
+  mHeldCount--;
+}
+
+// The payload is a number only if it is entirely made of it, surrounding spaces apart
+bool MqttPublishLimiter::parseValue(const uint8_t* payload, const size_t length, float* value)
+{
+  char text[32];
+  if (length == 0 || length >= sizeof(text))
+    return false;
+
+  memcpy(text, payload, length);
+  text[length] = '\0';
+
+  char* end;
+  *value = strtof(text, &end);
+  if (end == text)
+    return false;
+
+  while (*end == ' ')
+    end++;
+  return *end == '\0';
+}
+
+void MqttPublishLimiter::keepFirstPolicy(int value, void* context)
+{
+  int* policyIndex = (int*)context;
+  if (value < *policyIndex)
+    *policyIndex = value;
+}
@@ -0,0 +1,97 @@
+#ifndef MQTT_PUBLISH_LIMITER_H
+#define MQTT_PUBLISH_LIMITER_H
+
+#include <Arduino.h>
+#include "MqttTopicTrie.h"
+
+#ifndef MQTT_PUBLISH_POLICY_MAX_POLICIES
+  #define MQTT_PUBLISH_POLICY_MAX_POLICIES 8
+#endif
+#ifndef MQTT_PUBLISH_POLICY_MAX_TOPICS
+  #define MQTT_PUBLISH_POLICY_MAX_TOPICS 16 // Topics whose state is kept, the messages of the next ones are sent without limit
+#endif
+
+// Limits applied to the messages published on the topics matching a filter, each of them is disabled by 0
+struct MqttPublishPolicy
+{
+  unsigned long coalesceWindow; // A message is held for this long, the messages published meanwhile replace it: only the last one is sent
+  unsigned long minInterval; // Between two messages sent on a topic, the last one published meanwhile is sent at the end of the interval
+  float deadband; // A numeric payload is not sent while it differs by this much or less from the last one sent
+  float ratePerSecond; // Token bucket, messages sent per second on average and in a row. Messages over the limit are held like with minInterval
+  unsigned int burst;
+
+  MqttPublishPolicy() : coalesceWindow(0), minInterval(0), deadband(0), ratePerSecond(0), burst(1) {};
+};
+
+/*
+  Per topic limits of the published messages, so a value read at hundreds of Hz is not sent as many times.
+  A message published too early is held rather than dropped, and replaced by the next one published on its topic,
+  so the last value is always sent once its topic is allowed to send again. The held messages are sent by flush().
+  Each topic takes an entry of a table of MQTT_PUBLISH_POLICY_MAX_TOPICS, which also keeps its held message.
+*/
+class MqttPublishLimiter
+{
+public:
+  enum Decision : byte {
+    SEND, // The message can be sent now
+    HELD, // It will be given to flush() later
+    SUPPRESSED // Within the deadband of the last message sent
+  };
+  typedef bool (*Sender)(const char* topic, const uint8_t* payload, size_t length, byte flags, void* context);
+
+  struct Stats {
+    unsigned long held;
+    unsigned long replaced; // Held messages replaced by a newer one before being sent
+    unsigned long suppressed;
+  };
+
+  MqttPublishLimiter();
+  ~MqttPublishLimiter();
+
+  bool addPolicy(const char* topicFilter, const MqttPublishPolicy &policy); // Replace the policy of a filter already added. Return false if the filter is invalid or the table full
+  Decision submit(const char* topic, const uint8_t* payload, const size_t length, const byte flags, const unsigned long currentMillis);
+  void flush(const unsigned long currentMillis, Sender sender, void* context); // Give the held messages that are due to sender
+
+  inline bool isEnabled() const { return mPolicyCount > 0; };
+  inline bool isDue(const unsigned long currentMillis) const { return mHeldCount > 0 && !isBefore(currentMillis, mNextDueMillis); };
+  inline unsigned int heldCount() const { return mHeldCount; };
+  inline const Stats& stats() const { return mStats; };
+
+private:
+  struct TopicState {
+    char* topic; // NULL for a free entry
+    byte policy;
+    bool hasSent;
+    bool hasValue;
+    bool held;
+    byte flags;
+    unsigned long lastSentMillis;
+    float lastValue;
+    float tokens;
+    unsigned long tokensMillis;
+    unsigned long dueMillis;
+    uint8_t* payload; // Held message, the buffer is kept for the next ones
+    size_t length;
+    size_t capacity;
+  };
+
+  MqttPublishPolicy mPolicies[MQTT_PUBLISH_POLICY_MAX_POLICIES];
+  byte mPolicyCount;
+  MqttTopicTrie mPolicyFilters; // Map each filter to its index in mPolicies
+  TopicState* mTopics; // Allocated with the first policy
+  unsigned int mHeldCount;
+  unsigned long mNextDueMillis;
+  Stats mStats;
+
+  TopicState* findTopic(const char* topic);
+  unsigned long earliestSendMillis(TopicState &state, const MqttPublishPolicy &policy, const unsigned long currentMillis, const bool newMessage);
+  void markSent(TopicState &state, const MqttPublishPolicy &policy, const uint8_t* payload, const size_t length, const unsigned long currentMillis);
+  bool hold(TopicState &state, const uint8_t* payload, const size_t length, const byte flags, const unsigned long dueMillis);
+  void release(TopicState &state);
+  static bool parseValue(const uint8_t* payload, const size_t length, float* value);
+  static void keepFirstPolicy(int value, void* context);
+
+  static inline bool isBefore(const unsigned long a, const unsigned long b) { return (long)(a - b) < 0; };
+};
+
+#endif
@@ -0,0 +1,233 @@
+#include "MqttPublishQueue.h"
+
+
+// =============== Constructor / destructor ===================
+
+MqttPublishQueue::MqttPublishQueue()
+{
+  mBuffer = NULL;
+  mCapacity = 0;
+  mOverflowPolicy = DROP_OLDEST;
+  mHead = 0;
+  mTail = 0;
+  mWrapEnd = 0;
+  mWrapped = false;
+  mCount = 0;
+  mDeadCount = 0;
+  mStats = { 0, 0, 0 };
+}
+
+MqttPublishQueue::~MqttPublishQueue()
+{
+  free(mBuffer);
+}
+
+
+// =============== Public functions =================
+
+bool MqttPublishQueue::begin(const size_t capacity, const OverflowPolicy overflowPolicy)
+{
+  free(mBuffer);
+
+  // Records are kept aligned so their header can be accessed in place
+  mCapacity = capacity & ~(size_t)3;
+  mBuffer = (uint8_t*)malloc(mCapacity);
+  mOverflowPolicy = overflowPolicy;
+  mHead = mTail = mWrapEnd = 0;
+  mWrapped = false;
+  mCount = 0;
+  mDeadCount = 0;
+
+  return mBuffer != NULL;
+}
+
+bool MqttPublishQueue::push(const char* topic, const uint8_t* payload, const size_t length, const byte flags, const uint16_t packetId)
+{
+  size_t topicLength = strlen(topic);
+  size_t size = (sizeof(RecordHeader) + topicLength + 1 + length + 3) & ~(size_t)3;
+
+  if (mBuffer == NULL || size > mCapacity || topicLength > 0xFFFF)
+  {
+    mStats.dropped++;
+    return false;
+  }
+
+  if (mOverflowPolicy == COALESCE_BY_TOPIC)
+    coalesce(topic, topicLength);
+
+  size_t offset;
+  while (!allocate(size, &offset))
+  {
+    if (mOverflowPolicy == DROP_NEWEST)
+    {
+      mStats.dropped++;
+      return false;
+    }
+
+    if (!recordAt(mHead)->dead) // Coalesced records are already counted
+      mStats.dropped++;
+    removeFront();
+  }
+
+  RecordHeader* record = recordAt(offset);
+  record->size = size;
+  record->payloadLength = length;
+  record->topicLength = topicLength;
+  record->packetId = packetId;
+  record->flags = flags;
+  record->dead = false;
+
+  char* recordTopic = (char*)(record + 1);
+  memcpy(recordTopic, topic, topicLength + 1);
+  memcpy(recordTopic + topicLength + 1, payload, length);
+
+  mStats.queued++;
+  return true;
+}
+
+bool MqttPublishQueue::front(const char** topic, const uint8_t** payload, size_t* length, byte* flags, uint16_t* packetId)
+{
+  removeDeadFront();
+
+  if (mCount == 0)
+    return false;
+
+  RecordHeader* record = recordAt(mHead);
+  *topic = (const char*)(record + 1);
+  *payload = (const uint8_t*)(*topic + record->topicLength + 1);
+  *length = record->payloadLength;
+  *flags = record->flags;
+  if (packetId != NULL)
+    *packetId = record->packetId;
+  return true;
+}
+
+void MqttPublishQueue::pop(const bool sent)
+{
+  if (mCount == 0)
+    return;
+
+  if (sent)
+    mStats.sent++;
+  else
+    mStats.dropped++;
+  removeFront();
+}
+
+// Acknowledgements usually come in order, so the record is found at the front and removed right away
+bool MqttPublishQueue::acknowledge(const uint16_t packetId)
+{
+  size_t offset = mHead;
+  for (unsigned int i = 0 ; i < mCount ; i++)
+  {
+    if (mWrapped && offset == mWrapEnd)
+      offset = 0;
+
+    RecordHeader* record = recordAt(offset);
+    if (!record->dead && record->packetId == packetId)
+    {
+      record->dead = true;
+      mDeadCount++;
+      mStats.sent++;
+      removeDeadFront();
+      return true;
+    }
+    offset += record->size;
+  }
+  return false;
+}
+
+void MqttPublishQueue::forEach(RecordVisitor visitor, void* context) const
+{
+  size_t offset = mHead;
+  for (unsigned int i = 0 ; i < mCount ; i++)
+  {
+    if (mWrapped && offset == mWrapEnd)
+      offset = 0;
+
+    const RecordHeader* record = recordAt(offset);
+    if (!record->dead)
+    {
+      const char* topic = (const char*)(record + 1);
+      visitor(topic, (const uint8_t*)(topic + record->topicLength + 1), record->payloadLength, record->flags, record->packetId, context);
+    }
+    offset += record->size;
+  }
+}
+
+
+// ================== Private functions ====================
+
+/**
+ * Find room for a contiguous record. Once the end of the buffer is reached, records continue
+ * at its beginning and mWrapEnd remembers where the records before the wrap end.
+ */
+bool MqttPublishQueue::allocate(const size_t size, size_t* offset)
+{
+  if (mCount == 0)
+  {
+    mHead = mTail = mWrapEnd = 0;
+    mWrapped = false;
+  }
+
+  if (!mWrapped)
+  {
+    if (mCapacity - mTail >= size)
+      *offset = mTail;
+    else if (mHead >= size)
+    {
+      mWrapEnd = mTail;
+      mWrapped = true;
+      *offset = 0;
+    }
+    else
+      return false;
+  }
+  else if (mHead - mTail >= size)
+    *offset = mTail;
+  else
+    return false;
+
+  mTail = *offset + size;
+  mCount++;
+  return true;
+}
+
+void MqttPublishQueue::coalesce(const char* topic, const size_t topicLength)
+{
+  size_t offset = mHead;
+  for (unsigned int i = 0 ; i < mCount ; i++)
+  {
+    if (mWrapped && offset == mWrapEnd)
+      offset = 0;
+
+    RecordHeader* record = recordAt(offset);
+    if (!record->dead && !(record->flags & FLAG_QOS1) && record->topicLength == topicLength && memcmp(record + 1, topic, topicLength) == 0)
+    {
+      record->dead = true;
+      mDeadCount++;
+      mStats.dropped++;
+    }
+    offset += record->size;
+  }
+}
+
+void MqttPublishQueue::removeFront()
+{
+  if (recordAt(mHead)->dead)
+    mDeadCount--;
+  mHead += recordAt(mHead)->size;
+  mCount--;
+
+  if (mWrapped && mHead == mWrapEnd)
+  {
+    mHead = 0;
+    mWrapped = false;
+  }
+}
+
+void MqttPublishQueue::removeDeadFront()
+{
+  while (mCount > 0 && recordAt(mHead)->dead)
+    removeFront();
+}
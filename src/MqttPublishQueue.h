@@ -0,0 +1,73 @@
+#ifndef MQTT_PUBLISH_QUEUE_H
+#define MQTT_PUBLISH_QUEUE_H
+
+#include <Arduino.h>
+
+/*
+  Bounded queue of outgoing messages, stored in a ring buffer of a fixed number of bytes.
+  Each message is stored contiguously (topic, NUL, payload) so it can be published straight from the buffer.
+*/
+class MqttPublishQueue
+{
+public:
+  enum OverflowPolicy : byte {
+    DROP_OLDEST, // Older messages are discarded to make room for the new one
+    DROP_NEWEST, // The new message is discarded
+    COALESCE_BY_TOPIC // A queued message is replaced by a new one on the same topic, then older messages are discarded if still needed. QoS 1 messages are never replaced
+  };
+
+  static const byte FLAG_RETAIN = 0x01;
+  static const byte FLAG_QOS1 = 0x02;
+
+  typedef void (*RecordVisitor)(const char* topic, const uint8_t* payload, size_t length, byte flags, uint16_t packetId, void* context);
+
+  struct Stats {
+    unsigned long queued;
+    unsigned long sent;
+    unsigned long dropped;
+  };
+
+  MqttPublishQueue();
+  ~MqttPublishQueue();
+
+  bool begin(const size_t capacity, const OverflowPolicy overflowPolicy); // Allocate the buffer, return false if the allocation failed
+  bool push(const char* topic, const uint8_t* payload, const size_t length, const byte flags, const uint16_t packetId = 0);
+  bool front(const char** topic, const uint8_t** payload, size_t* length, byte* flags, uint16_t* packetId = NULL); // Return false if the queue is empty
+  void pop(const bool sent); // Remove the front message, counted as sent or dropped
+  bool acknowledge(const uint16_t packetId); // Remove the message with this packet id wherever it is, counted as sent. Return false if there is none
+  void forEach(RecordVisitor visitor, void* context) const; // Visit the messages from the oldest
+
+  inline bool isEnabled() const { return mBuffer != NULL; };
+  inline bool isEmpty() const { return mCount == mDeadCount; };
+  inline unsigned int count() const { return mCount - mDeadCount; };
+  inline const Stats& stats() const { return mStats; };
+
+private:
+  struct RecordHeader {
+    uint32_t size; // Of the whole record, header and alignment included
+    uint32_t payloadLength;
+    uint16_t topicLength;
+    uint16_t packetId;
+    byte flags;
+    byte dead; // Coalesced and acknowledged records are kept until they reach the front
+  };
+
+  uint8_t* mBuffer;
+  size_t mCapacity;
+  OverflowPolicy mOverflowPolicy;
+  size_t mHead; // Oldest record
+  size_t mTail; // Where the next record is written
+  size_t mWrapEnd; // End of the records placed before mTail wrapped to the beginning of the buffer
+  bool mWrapped;
+  unsigned int mCount;
+  unsigned int mDeadCount;
+  Stats mStats;
+
+  bool allocate(const size_t size, size_t* offset);
+  void coalesce(const char* topic, const size_t topicLength);
+  void removeFront();
+  void removeDeadFront();
+  inline RecordHeader* recordAt(const size_t offset) const { return (RecordHeader*)(mBuffer + offset); };
+};
+
+#endif
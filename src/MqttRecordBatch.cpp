@@ -0,0 +1,175 @@
+#include "MqttRecordBatch.h"
+
+
+// =============== Constructor / destructor ===================
+
+MqttRecordBatch::MqttRecordBatch()
+{
+  mBuffer = NULL;
+  mCapacity = 0;
+  mSize = 0;
+  mRecordCount = 0;
+  mLastTimestamp = 0;
+  mRecordTimestamp = 0;
+  mRecordStart = 0;
+  mValueCountOffset = 0;
+  mRecordOverflow = false;
+}
+
+MqttRecordBatch::~MqttRecordBatch()
+{
+  free(mBuffer);
+}
+
+
+// =============== Public functions =================
+
+bool MqttRecordBatch::begin(const size_t capacity)
+{
+  free(mBuffer);
+
+  mBuffer = capacity > HEADER_SIZE ? (uint8_t*)malloc(capacity) : NULL;
+  mCapacity = mBuffer != NULL ? capacity : 0;
+  clear();
+
+  return mBuffer != NULL;
+}
+
+bool MqttRecordBatch::beginRecord(const unsigned long timestamp)
+{
+  // A record left open is dropped
+  if (mValueCountOffset != 0)
+    mSize = mRecordStart;
+
+  if (mBuffer == NULL || mRecordCount == 0xFFFF)
+    return false;
+
+  mRecordStart = mSize;
+  mRecordOverflow = false;
+
+  if (mRecordCount == 0)
+  {
+    writeUint(3, timestamp, 4);
+    mLastTimestamp = timestamp;
+  }
+  mRecordTimestamp = timestamp;
+
+  // The delta is computed on 32 bits so it stays right when millis() wraps
+  writeVarint((uint32_t)(timestamp - mLastTimestamp));
+  mValueCountOffset = mSize;
+  writeByte(0);
+
+  return !mRecordOverflow;
+}
+
+bool MqttRecordBatch::addInt(const int32_t value)
+{
+  if (!addValue(TYPE_INT))
+    return false;
+
+  // Zigzag encoding, so small negative values are as short as small positive ones
+  uint32_t zigzag = ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+  return writeVarint(zigzag);
+}
+
+bool MqttRecordBatch::addFloat(const float value)
+{
+  if (!addValue(TYPE_FLOAT))
+    return false;
+
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  if (mSize + 4 > mCapacity)
+  {
+    mRecordOverflow = true;
+    return false;
+  }
+
+  writeUint(mSize, bits, 4);
+  mSize += 4;
+  return true;
+}
+
+bool MqttRecordBatch::endRecord()
+{
+  if (mValueCountOffset == 0)
+    return false;
+
+  mValueCountOffset = 0;
+  if (mRecordOverflow)
+  {
+    mSize = mRecordStart;
+    return false;
+  }
+
+  mLastTimestamp = mRecordTimestamp;
+  mRecordCount++;
+  writeUint(1, mRecordCount, 2);
+  return true;
+}
+
+void MqttRecordBatch::clear()
+{
+  mSize = 0;
+  mRecordCount = 0;
+  mLastTimestamp = 0;
+  mRecordTimestamp = 0;
+  mRecordStart = 0;
+  mValueCountOffset = 0;
+  mRecordOverflow = false;
+
+  if (mBuffer == NULL)
+    return;
+
+  mBuffer[0] = FORMAT_VERSION;
+  writeUint(1, 0, 2);
+  writeUint(3, 0, 4);
+  mSize = HEADER_SIZE;
+}
+
+
+// =============== Private functions =================
+
+bool MqttRecordBatch::addValue(const byte type)
+{
+  if (mValueCountOffset == 0 || mRecordOverflow)
+    return false;
+
+  if (mBuffer[mValueCountOffset] == 0xFF)
+  {
+    mRecordOverflow = true;
+    return false;
+  }
+
+  mBuffer[mValueCountOffset]++;
+  return writeByte(type);
+}
+
+bool MqttRecordBatch::writeByte(const byte value)
+{
+  if (mSize >= mCapacity)
+  {
+    mRecordOverflow = true;
+    return false;
+  }
+
+  mBuffer[mSize++] = value;
+  return true;
+}
+
+bool MqttRecordBatch::writeVarint(uint32_t value)
+{
+  while (value >= 0x80)
+  {
+    if (!writeByte((value & 0x7F) | 0x80))
+      return false;
+    value >>= 7;
+  }
+  return writeByte(value);
+}
+
+void MqttRecordBatch::writeUint(const size_t offset, const uint32_t value, const size_t length)
+{
+  for (size_t i = 0 ; i < length ; i++)
+    mBuffer[offset + i] = (value >> (8 * i)) & 0xFF;
+}
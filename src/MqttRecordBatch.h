@@ -0,0 +1,61 @@
+#ifndef MQTT_RECORD_BATCH_H
+#define MQTT_RECORD_BATCH_H
+
+#include <Arduino.h>
+
+/*
+  Records (a timestamp and a few numeric values) accumulated in a fixed buffer, to be sent as the payload of a single message.
+  Little-endian binary frame, decoded by extras/mqtt_record_decoder.py:
+    header   version (1 byte), record count (uint16), timestamp of the first record (uint32, milliseconds)
+    record   milliseconds since the previous record (varint), value count (1 byte), values
+    value    type (1 byte) then TYPE_INT: zigzag varint, or TYPE_FLOAT: 4 bytes IEEE 754
+  Varints are 7 bits per byte, least significant group first, the high bit set on every byte but the last.
+*/
+class MqttRecordBatch
+{
+public:
+  static const byte FORMAT_VERSION = 1;
+  static const size_t HEADER_SIZE = 7;
+  enum ValueType : byte {
+    TYPE_INT = 0,
+    TYPE_FLOAT = 1
+  };
+
+  MqttRecordBatch();
+  ~MqttRecordBatch();
+
+  bool begin(const size_t capacity); // Allocate the buffer, the whole frame must fit in a message. Return false if the allocation failed
+
+  // A record is written by beginRecord(), the add functions and endRecord(), which returns false if it did not fit in the buffer
+  // and removes it, so the batch can be published and the record added again. Timestamps must not decrease.
+  // The frame only holds the complete records: a batch is not published while a record is open.
+  bool beginRecord(const unsigned long timestamp);
+  bool addInt(const int32_t value);
+  bool addFloat(const float value);
+  bool endRecord();
+  void clear(); // Remove all records, after the batch was published
+
+  inline bool isEnabled() const { return mBuffer != NULL; };
+  inline const uint8_t* data() const { return mBuffer; };
+  inline size_t size() const { return mSize; }; // Of the frame, header included
+  inline unsigned int count() const { return mRecordCount; };
+  inline bool isRecordOpen() const { return mValueCountOffset != 0; }; // Between beginRecord() and endRecord()
+
+private:
+  uint8_t* mBuffer;
+  size_t mCapacity;
+  size_t mSize;
+  uint16_t mRecordCount;
+  unsigned long mLastTimestamp; // Of the last complete record, the deltas being relative to it
+  unsigned long mRecordTimestamp;
+  size_t mRecordStart; // Size of the frame before the record being written
+  size_t mValueCountOffset; // 0 when no record is being written
+  bool mRecordOverflow;
+
+  bool addValue(const byte type);
+  bool writeByte(const byte value);
+  bool writeVarint(uint32_t value);
+  void writeUint(const size_t offset, const uint32_t value, const size_t length);
+};
+
+#endif
@@ -0,0 +1,118 @@
+#include "MqttSpscRing.h"
+
+
+// =============== Constructor / destructor ===================
+
+MqttSpscRing::MqttSpscRing() :
+  mHead(0),
+  mTail(0)
+{
+  mBuffer = NULL;
+  mCapacity = 0;
+}
+
+MqttSpscRing::~MqttSpscRing()
+{
+  free(mBuffer);
+}
+
+
+// =============== Public functions =================
+
+bool MqttSpscRing::begin(const size_t capacity)
+{
+  free(mBuffer);
+
+  // Records are kept aligned so their header can be accessed in place
+  mCapacity = capacity & ~(size_t)3;
+  mBuffer = (uint8_t*)malloc(mCapacity);
+  mHead.store(0, std::memory_order_relaxed);
+  mTail.store(0, std::memory_order_relaxed);
+
+  return mBuffer != NULL;
+}
+
+bool MqttSpscRing::push(const char* topic, const uint8_t* payload, const size_t length, const byte flags)
+{
+  size_t topicLength = strlen(topic);
+  size_t size = (sizeof(RecordHeader) + topicLength + 1 + length + 3) & ~(size_t)3;
+
+  if (mBuffer == NULL || size >= mCapacity || topicLength >= WRAP_MARKER)
+    return false;
+
+  // The head never catches up with the tail, equal positions mean an empty ring
+  size_t head = mHead.load(std::memory_order_relaxed);
+  size_t tail = mTail.load(std::memory_order_acquire);
+  size_t offset;
+  if (head >= tail)
+  {
+    if (head + size < mCapacity || (head + size == mCapacity && tail > 0))
+      offset = head;
+    else if (size < tail)
+    {
+      // Without room for the marker the consumer wraps by itself
+      if (mCapacity - head >= sizeof(RecordHeader))
+        recordAt(head)->topicLength = WRAP_MARKER;
+      offset = 0;
+    }
+    else
+      return false;
+  }
+  else if (head + size < tail)
+    offset = head;
+  else
+    return false;
+
+  RecordHeader* record = recordAt(offset);
+  record->size = size;
+  record->payloadLength = length;
+  record->topicLength = topicLength;
+  record->flags = flags;
+
+  char* recordTopic = (char*)(record + 1);
+  memcpy(recordTopic, topic, topicLength + 1);
+  if (length > 0)
+    memcpy(recordTopic + topicLength + 1, payload, length);
+
+  // Publish the record to the consumer once it is complete
+  mHead.store(offset + size == mCapacity ? 0 : offset + size, std::memory_order_release);
+  return true;
+}
+
+bool MqttSpscRing::front(const char** topic, const uint8_t** payload, size_t* length, byte* flags)
+{
+  size_t tail = mTail.load(std::memory_order_relaxed);
+  if (tail == mHead.load(std::memory_order_acquire))
+    return false;
+
+  RecordHeader* record = recordAt(skipWrap(tail));
+  *topic = (const char*)(record + 1);
+  *payload = (const uint8_t*)(*topic + record->topicLength + 1);
+  *length = record->payloadLength;
+  *flags = record->flags;
+  return true;
+}
+
+void MqttSpscRing::pop()
+{
+  size_t tail = mTail.load(std::memory_order_relaxed);
+  if (tail == mHead.load(std::memory_order_acquire))
+    return;
+
+  tail = skipWrap(tail);
+  size_t next = tail + recordAt(tail)->size;
+
+  // Give the space back to the producer once the record is no longer used
+  mTail.store(next == mCapacity ? 0 : next, std::memory_order_release);
+}
+
+
+// =============== Private functions =================
+
+// Offset of the oldest record, which is at the beginning of the buffer if the producer wrapped there
+size_t MqttSpscRing::skipWrap(size_t tail) const
+{
+  if (mCapacity - tail < sizeof(RecordHeader) || recordAt(tail)->topicLength == WRAP_MARKER)
+    return 0;
+  return tail;
+}
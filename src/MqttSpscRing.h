@@ -0,0 +1,52 @@
+#ifndef MQTT_SPSC_RING_H
+#define MQTT_SPSC_RING_H
+
+#include <Arduino.h>
+#include <atomic>
+
+/*
+  Lock-free ring buffer of messages between exactly one producer task and one consumer task.
+  Each message is stored contiguously (header, topic, NUL, payload) so the consumer uses it in place until pop().
+  The producer only moves mHead and the consumer only moves mTail, each one reading the other with acquire
+  ordering, so a record is complete before it becomes visible. A record that does not fit before the end
+  of the buffer is written at its beginning, behind a wrap marker.
+*/
+class MqttSpscRing
+{
+public:
+  MqttSpscRing();
+  ~MqttSpscRing();
+
+  bool begin(const size_t capacity); // Allocate the buffer, before the producer and the consumer use the ring. Return false if the allocation failed
+
+  // Producer side
+  bool push(const char* topic, const uint8_t* payload, const size_t length, const byte flags); // Return false if the ring is full
+
+  // Consumer side
+  bool front(const char** topic, const uint8_t** payload, size_t* length, byte* flags); // Return false if the ring is empty. The message stays valid until pop()
+  void pop();
+
+  inline bool isEnabled() const { return mBuffer != NULL; };
+  inline bool isEmpty() const { return mHead.load(std::memory_order_acquire) == mTail.load(std::memory_order_acquire); };
+
+private:
+  static const uint16_t WRAP_MARKER = 0xFFFF; // Topic length of the record telling the consumer to go back to the beginning
+
+  struct RecordHeader {
+    uint32_t size; // Of the whole record, header and alignment included
+    uint32_t payloadLength;
+    uint16_t topicLength;
+    byte flags;
+    byte reserved;
+  };
+
+  uint8_t* mBuffer;
+  size_t mCapacity;
+  std::atomic<size_t> mHead; // Where the next record is written, only moved by the producer
+  std::atomic<size_t> mTail; // Oldest record, only moved by the consumer
+
+  size_t skipWrap(size_t tail) const;
+  inline RecordHeader* recordAt(const size_t offset) const { return (RecordHeader*)(mBuffer + offset); };
+};
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef MQTT_TOPIC_BUFFER_H
+#define MQTT_TOPIC_BUFFER_H
+
+#include <Arduino.h>
+
+/*
+  Topic built in a fixed buffer of CAPACITY characters, to replace String concatenations such as
+  String(clientName) + "/sensor/" + index, which allocate at every message and fragment the heap over time.
+  A topic that would exceed the capacity is rejected as a whole: c_str() then returns an empty string,
+  which publish() refuses, until clear() or truncate(). The buffer converts to const char*, so it is given
+  straight to publish() and subscribe():
+
+    MqttTopicBuffer<48> topic(clientName);
+    topic.appendLevel("sensor").appendLevel(index);
+    char payload[16];
+    int length = snprintf(payload, sizeof(payload), "%d", value);
+    client.publish(topic, payload, length);
+*/
+template <size_t CAPACITY>
+class MqttTopicBuffer
+{
+public:
+  MqttTopicBuffer() { clear(); };
+  MqttTopicBuffer(const char* topic) { clear(); append(topic); };
+
+  MqttTopicBuffer& clear()
+  {
+    mLength = 0;
+    mTopic[0] = '\0';
+    mOverflow = false;
+    return *this;
+  };
+
+  // Go back to the first length characters, typically to reuse a device prefix for the next topic
+  MqttTopicBuffer& truncate(const size_t length)
+  {
+    if (length < mLength)
+      mLength = length;
+    mTopic[mLength] = '\0';
+    mOverflow = false;
+    return *this;
+  };
+
+  MqttTopicBuffer& append(const char* text, const size_t length)
+  {
+    if (mOverflow || mLength + length > CAPACITY)
+    {
+      mOverflow = true;
+      return *this;
+    }
+
+    memcpy(mTopic + mLength, text, length);
+    mLength += length;
+    mTopic[mLength] = '\0';
+    return *this;
+  };
+
+  MqttTopicBuffer& append(const char* text) { return append(text, strlen(text)); };
+  MqttTopicBuffer& append(const int value) { return append((long)value); }; // Not ambiguous with a literal 0
+
+  MqttTopicBuffer& append(const long value)
+  {
+    char digits[24];
+    snprintf(digits, sizeof(digits), "%ld", value);
+    return append(digits);
+  };
+
+  // Append a level, preceded by a '/' unless the topic is empty
+  MqttTopicBuffer& appendLevel(const char* level) { return mLength > 0 ? append("/", 1).append(level) : append(level); };
+  MqttTopicBuffer& appendLevel(const long value) { return mLength > 0 ? append("/", 1).append(value) : append(value); };
+  MqttTopicBuffer& appendLevel(const int value) { return appendLevel((long)value); };
+
+  inline const char* c_str() const { return mOverflow ? "" : mTopic; };
+  inline operator const char*() const { return c_str(); };
+  inline size_t length() const { return mOverflow ? 0 : mLength; };
+  inline bool isValid() const { return !mOverflow && mLength > 0; };
+
+private:
+  char mTopic[CAPACITY + 1];
+  size_t mLength;
+  bool mOverflow; // Set when an append did not fit, until clear() or truncate()
+};
+
+#endif
@@ -0,0 +1,77 @@
+#include "MqttTopicRegistry.h"
+
+
+// =============== Constructor / destructor ===================
+
+MqttTopicRegistry::MqttTopicRegistry()
+{
+  mPrefix = NULL;
+  mBuffer = NULL;
+  mBufferSize = 0;
+  mCount = 0;
+}
+
+MqttTopicRegistry::~MqttTopicRegistry()
+{
+  free(mPrefix);
+  free(mBuffer);
+}
+
+
+// =============== Public functions =================
+
+bool MqttTopicRegistry::setPrefix(const char* prefix)
+{
+  if (mCount > 0)
+    return false;
+
+  free(mPrefix);
+  mPrefix = NULL;
+  if (prefix == NULL || prefix[0] == '\0')
+    return true;
+
+  mPrefix = strdup(prefix);
+  return mPrefix != NULL;
+}
+
+MqttTopicHandle MqttTopicRegistry::add(const char* topic)
+{
+  size_t prefixLength = mPrefix != NULL ? strlen(mPrefix) + 1 : 0;
+  size_t topicLength = strlen(topic);
+
+  for (unsigned int i = 0 ; i < mCount ; i++)
+  {
+    const char* registered = mBuffer + mOffsets[i];
+    if (strncmp(registered + prefixLength, topic, topicLength + 1) == 0)
+      return i + 1;
+  }
+
+  if (mCount >= MQTT_MAX_TOPIC_HANDLES || topicLength == 0)
+    return 0;
+
+  size_t size = prefixLength + topicLength + 1;
+  char* buffer = (char*)realloc(mBuffer, mBufferSize + size);
+  if (buffer == NULL)
+    return 0;
+
+  mBuffer = buffer;
+  char* entry = mBuffer + mBufferSize;
+  if (mPrefix != NULL)
+  {
+    memcpy(entry, mPrefix, prefixLength - 1);
+    entry[prefixLength - 1] = '/';
+  }
+  memcpy(entry + prefixLength, topic, topicLength + 1);
+
+  mOffsets[mCount++] = mBufferSize;
+  mBufferSize += size;
+  return mCount;
+}
+
+const char* MqttTopicRegistry::topic(const MqttTopicHandle handle) const
+{
+  if (handle == 0 || handle > mCount)
+    return NULL;
+
+  return mBuffer + mOffsets[handle - 1];
+}
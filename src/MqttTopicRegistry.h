@@ -0,0 +1,38 @@
+#ifndef MQTT_TOPIC_REGISTRY_H
+#define MQTT_TOPIC_REGISTRY_H
+
+#include <Arduino.h>
+
+#ifndef MQTT_MAX_TOPIC_HANDLES
+  #define MQTT_MAX_TOPIC_HANDLES 32 // At most 255, the handles being bytes
+#endif
+
+typedef byte MqttTopicHandle; // 0 is never a valid handle
+
+/*
+  Topics registered once and then referred to by a small handle, so publishing does not build the topic again.
+  Each topic is stored with the device prefix already prepended ("<prefix>/<topic>"), back to back in a single
+  buffer that grows at each registration. The pointers returned by topic() are only valid until the next add().
+*/
+class MqttTopicRegistry
+{
+public:
+  MqttTopicRegistry();
+  ~MqttTopicRegistry();
+
+  bool setPrefix(const char* prefix); // Return false once topics are registered, they would keep the previous prefix
+  MqttTopicHandle add(const char* topic); // Return the handle of the topic, the same one if already registered. 0 if the table is full or memory is exhausted
+  const char* topic(const MqttTopicHandle handle) const; // Full topic, NULL if the handle is not valid
+
+  inline unsigned int count() const { return mCount; };
+  inline size_t memoryUsage() const { return mBufferSize + (mPrefix != NULL ? strlen(mPrefix) + 1 : 0); };
+
+private:
+  char* mPrefix; // NULL without prefix
+  char* mBuffer; // NUL terminated topics, back to back
+  size_t mBufferSize;
+  size_t mOffsets[MQTT_MAX_TOPIC_HANDLES]; // Offset in mBuffer of the topic of handle i + 1
+  unsigned int mCount;
+};
+
+#endif
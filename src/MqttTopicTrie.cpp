@@ -0,0 +1,257 @@
+#include "MqttTopicTrie.h"
+
+
+// =============== Constructor / destructor ===================
+
+MqttTopicTrie::MqttTopicTrie()
+{
+  mRoot.level = NULL;
+  mRoot.firstChild = NULL;
+  mRoot.nextSibling = NULL;
+  mRoot.value = -1;
+  mMemoryUsage = 0;
+}
+
+MqttTopicTrie::~MqttTopicTrie()
+{
+  clear();
+}
+
+
+// =============== Public functions =================
+
+bool MqttTopicTrie::insert(const char* filter, int value)
+{
+  if (value < 0 || !isValidFilter(filter))
+    return false;
+
+  Node* node = &mRoot;
+  const char* level = filter;
+
+  while (true)
+  {
+    size_t length = levelLength(level);
+    Node* child = findChild(node, level, length);
+
+    if (child == NULL)
+    {
+      child = new Node;
+      child->level = (char*)malloc(length + 1);
+      if (child->level == NULL)
+      {
+        delete child;
+        return false;
+      }
+      memcpy(child->level, level, length);
+      child->level[length] = '\0';
+      child->firstChild = NULL;
+      child->value = -1;
+      child->nextSibling = node->firstChild;
+      node->firstChild = child;
+      mMemoryUsage += sizeof(Node) + length + 1;
+    }
+
+    node = child;
+    if (level[length] == '\0')
+      break;
+    level += length + 1;
+  }
+
+  if (node->value >= 0)
+    return false;
+
+  node->value = value;
+  return true;
+}
+
+bool MqttTopicTrie::remove(const char* filter)
+{
+  return removeLevel(&mRoot, filter);
+}
+
+int MqttTopicTrie::find(const char* filter) const
+{
+  Node* node = findNode(filter);
+  return node != NULL ? node->value : -1;
+}
+
+bool MqttTopicTrie::setValue(const char* filter, int value)
+{
+  Node* node = findNode(filter);
+  if (node == NULL || node->value < 0 || value < 0)
+    return false;
+
+  node->value = value;
+  return true;
+}
+
+void MqttTopicTrie::match(const char* topic, MatchHandler handler, void* context) const
+{
+  if (topic[0] != '\0')
+    matchLevel(&mRoot, topic, true, handler, context);
+}
+
+void MqttTopicTrie::clear()
+{
+  deleteChildren(&mRoot);
+  mMemoryUsage = 0;
+}
+
+/**
+ * Check that wildcards are used as defined by the MQTT specification:
+ * '+' and '#' must occupy a whole level and '#' must be the last level.
+ */
+bool MqttTopicTrie::isValidFilter(const char* filter)
+{
+  if (filter == NULL || filter[0] == '\0')
+    return false;
+
+  const char* level = filter;
+  while (true)
+  {
+    size_t length = levelLength(level);
+    for (size_t i = 0; i < length; i++)
+    {
+      if ((level[i] == '+' || level[i] == '#') && length != 1)
+        return false;
+    }
+
+    if (level[length] == '\0')
+      return true;
+    if (level[0] == '#')
+      return false;
+    level += length + 1;
+  }
+}
+
+
+// ================== Private functions ====================
+
+MqttTopicTrie::Node* MqttTopicTrie::findNode(const char* filter) const
+{
+  const Node* node = &mRoot;
+  const char* level = filter;
+
+  while (node != NULL)
+  {
+    size_t length = levelLength(level);
+    node = findChild(node, level, length);
+    if (level[length] == '\0')
+      break;
+    level += length + 1;
+  }
+
+  return (Node*)node;
+}
+
+// Remove the filter below parent and prune the nodes left without filter nor children
+bool MqttTopicTrie::removeLevel(Node* parent, const char* level)
+{
+  size_t length = levelLength(level);
+  Node* previous = NULL;
+  Node* child = parent->firstChild;
+
+  while (child != NULL && !(strncmp(child->level, level, length) == 0 && child->level[length] == '\0'))
+  {
+    previous = child;
+    child = child->nextSibling;
+  }
+
+  if (child == NULL)
+    return false;
+
+  bool found;
+  if (level[length] == '\0')
+  {
+    found = child->value >= 0;
+    child->value = -1;
+  }
+  else
+    found = removeLevel(child, level + length + 1);
+
+  if (child->value < 0 && child->firstChild == NULL)
+  {
+    if (previous == NULL)
+      parent->firstChild = child->nextSibling;
+    else
+      previous->nextSibling = child->nextSibling;
+
+    mMemoryUsage -= sizeof(Node) + strlen(child->level) + 1;
+    free(child->level);
+    delete child;
+  }
+
+  return found;
+}
+
+/**
+ * Report the filters below parent that match the topic starting at level.
+ * Wildcards at the first level never match topics beginning with '$' (MQTT specification 4.7.2).
+ */
+void MqttTopicTrie::matchLevel(const Node* parent, const char* level, bool firstLevel, MatchHandler handler, void* context) const
+{
+  size_t length = levelLength(level);
+  bool lastLevel = level[length] == '\0';
+  bool wildcardAllowed = !(firstLevel && level[0] == '$');
+
+  for (const Node* child = parent->firstChild ; child != NULL ; child = child->nextSibling)
+  {
+    if (isWildcard(child, '#'))
+    {
+      if (wildcardAllowed && child->value >= 0)
+        handler(child->value, context);
+    }
+    else if ((wildcardAllowed && isWildcard(child, '+')) || (strncmp(child->level, level, length) == 0 && child->level[length] == '\0'))
+    {
+      if (!lastLevel)
+        matchLevel(child, level + length + 1, false, handler, context);
+      else
+      {
+        if (child->value >= 0)
+          handler(child->value, context);
+
+        // "a/#" also match the parent level "a"
+        for (const Node* grandChild = child->firstChild ; grandChild != NULL ; grandChild = grandChild->nextSibling)
+        {
+          if (isWildcard(grandChild, '#') && grandChild->value >= 0)
+            handler(grandChild->value, context);
+        }
+      }
+    }
+  }
+}
+
+void MqttTopicTrie::deleteChildren(Node* node)
+{
+  Node* child = node->firstChild;
+  while (child != NULL)
+  {
+    Node* next = child->nextSibling;
+    deleteChildren(child);
+    free(child->level);
+    delete child;
+    child = next;
+  }
+  node->firstChild = NULL;
+}
+
+MqttTopicTrie::Node* MqttTopicTrie::findChild(const Node* parent, const char* level, size_t length)
+{
+  for (Node* child = parent->firstChild ; child != NULL ; child = child->nextSibling)
+  {
+    if (strncmp(child->level, level, length) == 0 && child->level[length] == '\0')
+      return child;
+  }
+  return NULL;
+}
+
+size_t MqttTopicTrie::levelLength(const char* level)
+{
+  const char* end = strchr(level, '/');
+  return end != NULL ? end - level : strlen(level);
+}
+
+bool MqttTopicTrie::isWildcard(const Node* node, char wildcard)
+{
+  return node->level[0] == wildcard && node->level[1] == '\0';
+}
@@ -0,0 +1,50 @@
+#ifndef MQTT_TOPIC_TRIE_H
+#define MQTT_TOPIC_TRIE_H
+
+#include <Arduino.h>
+
+/*
+  Routing table of MQTT topic filters, one trie level per topic level.
+  Filters are split when they are inserted, so matching a received topic only walks the topic
+  levels and never allocates. Handles the '+' and '#' wildcards as defined by the MQTT specification.
+*/
+class MqttTopicTrie
+{
+public:
+  typedef void (*MatchHandler)(int value, void* context);
+
+  MqttTopicTrie();
+  ~MqttTopicTrie();
+
+  bool insert(const char* filter, int value); // Return false if the filter is invalid, already present or if memory is exhausted
+  bool remove(const char* filter); // Return false if the filter is not present
+  int find(const char* filter) const; // Return the value of this exact filter, -1 if not present
+  bool setValue(const char* filter, int value); // Change the value of an existing filter
+  void match(const char* topic, MatchHandler handler, void* context) const; // Call handler with the value of every filter matching topic
+  void clear();
+  inline size_t memoryUsage() const { return mMemoryUsage; }; // Return the number of bytes allocated for the nodes
+
+  static bool isValidFilter(const char* filter);
+
+private:
+  struct Node {
+    char* level;
+    Node* firstChild;
+    Node* nextSibling;
+    int value; // -1 when no filter ends on this node
+  };
+
+  Node mRoot;
+  size_t mMemoryUsage;
+
+  Node* findNode(const char* filter) const;
+  bool removeLevel(Node* parent, const char* level);
+  void matchLevel(const Node* parent, const char* level, bool firstLevel, MatchHandler handler, void* context) const;
+  void deleteChildren(Node* node);
+
+  static Node* findChild(const Node* parent, const char* level, size_t length);
+  static size_t levelLength(const char* level);
+  static bool isWildcard(const Node* node, char wildcard);
+};
+
+#endif
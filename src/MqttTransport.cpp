@@ -0,0 +1,414 @@
+#include "MqttTransport.h"
+
+
+MqttTransport::MqttTransport(Client& client) :
+  mClient(&client)
+{
+  mReplaying = false;
+  mReplayLength = 0;
+  mReplayPosition = 0;
+  mStreamHandler = NULL;
+  mStreamContext = NULL;
+  mStreamThreshold = 0;
+  mStreamTopic = NULL;
+  mAckHandler = NULL;
+  mAckContext = NULL;
+  mBytesRead = 0;
+  mBytesWritten = 0;
+  resetInbound();
+}
+
+MqttTransport::~MqttTransport()
+{
+  free(mStreamTopic);
+}
+
+void MqttTransport::resetByteCounters()
+{
+  mBytesRead = 0;
+  mBytesWritten = 0;
+}
+
+
+// =============== Handshake replay =================
+
+void MqttTransport::beginHandshakeReplay(const uint8_t* connack, const size_t length)
+{
+  mReplayLength = length < sizeof(mReplayBuffer) ? length : sizeof(mReplayBuffer);
+  memcpy(mReplayBuffer, connack, mReplayLength);
+  mReplayPosition = 0;
+  mReplaying = true;
+}
+
+void MqttTransport::endHandshakeReplay()
+{
+  // Some PubSubClient versions consider themselves connected as soon as the socket is, so they may not read the replay
+  mReplaying = false;
+  mReplayLength = 0;
+  mReplayPosition = 0;
+}
+
+
+// =============== Large packets streaming =================
+
+/**
+ * Must be called between two packets, which is the case outside of PubSubClient::loop() and from the
+ * message callbacks, as PubSubClient reads a whole packet before calling them.
+ */
+bool MqttTransport::setStreamHandler(const size_t threshold, StreamHandler handler, void* context)
+{
+  if (handler != NULL && mStreamTopic == NULL)
+  {
+    mStreamTopic = (char*)malloc(MQTT_STREAM_MAX_TOPIC_LENGTH + 1);
+    if (mStreamTopic == NULL)
+      return false;
+  }
+
+  mStreamThreshold = threshold;
+  mStreamHandler = handler;
+  mStreamContext = context;
+  resetInbound();
+  return true;
+}
+
+// Same constraint as setStreamHandler()
+void MqttTransport::setAckHandler(AckHandler handler, void* context)
+{
+  mAckHandler = handler;
+  mAckContext = context;
+  resetInbound();
+}
+
+
+// =============== Client interface =================
+
+int MqttTransport::connect(IPAddress ip, uint16_t port)
+{
+  if (mReplaying)
+    return 1;
+  resetInbound();
+  return mClient->connect(ip, port);
+}
+
+int MqttTransport::connect(const char* host, uint16_t port)
+{
+  if (mReplaying)
+    return 1;
+  resetInbound();
+  return mClient->connect(host, port);
+}
+
+size_t MqttTransport::write(uint8_t b)
+{
+  return write(&b, 1);
+}
+
+size_t MqttTransport::write(const uint8_t* buffer, size_t size)
+{
+  if (mReplaying)
+    return size; // The handshake was already sent
+
+  size_t written = mClient->write(buffer, size);
+  mBytesWritten += written;
+  return written;
+}
+
+int MqttTransport::available()
+{
+  if (mReplayPosition < mReplayLength)
+    return mReplayLength - mReplayPosition;
+  if (!isFraming())
+    return mClient->available();
+
+  if (mInboundState != INBOUND_PASS)
+    processInbound();
+  if (mInboundState != INBOUND_PASS)
+    return 0;
+
+  // Only the bytes of the current packet are shown, the next one has to be framed first
+  int networkAvailable = mClient->available();
+  if (networkAvailable < 0)
+    networkAvailable = 0;
+  if ((uint32_t)networkAvailable > mPacketRemaining)
+    networkAvailable = mPacketRemaining;
+  return (mHeaderLength - mHeaderPosition) + networkAvailable;
+}
+
+int MqttTransport::read()
+{
+  if (mReplayPosition < mReplayLength)
+    return mReplayBuffer[mReplayPosition++];
+  if (!isFraming())
+    return readNetwork();
+
+  if (mInboundState != INBOUND_PASS)
+    return -1;
+
+  int b;
+  if (mHeaderPosition < mHeaderLength)
+    b = mHeader[mHeaderPosition++];
+  else if (mPacketRemaining > 0)
+  {
+    b = readNetwork();
+    if (b < 0)
+      return b;
+    mPacketRemaining--;
+  }
+  else
+    return -1;
+
+  if (mHeaderPosition == mHeaderLength && mPacketRemaining == 0)
+    resetInbound();
+  return b;
+}
+
+int MqttTransport::read(uint8_t* buffer, size_t size)
+{
+  size_t count = 0;
+  while (count < size && mReplayPosition < mReplayLength)
+    buffer[count++] = mReplayBuffer[mReplayPosition++];
+
+  if (count < size && isFraming())
+  {
+    while (count < size && mInboundState == INBOUND_PASS && (mHeaderPosition < mHeaderLength || mClient->available() > 0))
+    {
+      int b = read();
+      if (b < 0)
+        break;
+      buffer[count++] = b;
+    }
+    return count > 0 ? (int)count : -1;
+  }
+
+  if (count < size)
+  {
+    int result = readNetwork(buffer + count, size - count);
+    if (result > 0)
+      count += result;
+    else if (count == 0)
+      return result;
+  }
+  return count;
+}
+
+int MqttTransport::peek()
+{
+  if (mReplayPosition < mReplayLength)
+    return mReplayBuffer[mReplayPosition];
+  if (!isFraming())
+    return mClient->peek();
+
+  if (mInboundState != INBOUND_PASS)
+    return -1;
+  if (mHeaderPosition < mHeaderLength)
+    return mHeader[mHeaderPosition];
+  return mPacketRemaining > 0 ? mClient->peek() : -1;
+}
+
+void MqttTransport::flush()
+{
+  mClient->flush();
+}
+
+void MqttTransport::stop()
+{
+  if (mStreamHandler != NULL && mInboundState == INBOUND_PAYLOAD && mStreamStarted)
+    mStreamHandler(STREAM_ABORT, mStreamTopic, NULL, 0, mStreamContext);
+
+  resetInbound();
+  mClient->stop();
+}
+
+uint8_t MqttTransport::connected()
+{
+  return mClient->connected();
+}
+
+MqttTransport::operator bool()
+{
+  return (bool)*mClient;
+}
+
+
+// ================== Private functions ====================
+
+void MqttTransport::processInbound()
+{
+  if (mInboundState == INBOUND_HEADER && !receiveHeader())
+    return;
+  if (mInboundState != INBOUND_PASS)
+    receiveDivertedPacket();
+}
+
+// Receive the fixed header of the next packet, return true once it is complete and the packet is either passed or diverted
+bool MqttTransport::receiveHeader()
+{
+  while (mClient->available() > 0)
+  {
+    int b = readNetwork();
+    if (b < 0)
+      return false;
+    mHeader[mHeaderLength++] = b;
+
+    // The remaining length is encoded on 1 to 4 bytes, the high bit telling if another byte follows
+    if (mHeaderLength >= 2 && (!(b & 0x80) || mHeaderLength == sizeof(mHeader)))
+    {
+      mPacketRemaining = 0;
+      for (size_t i = mHeaderLength - 1 ; i > 0 ; i--)
+        mPacketRemaining = (mPacketRemaining << 7) | (mHeader[i] & 0x7F);
+      mHeaderPosition = 0;
+
+      bool isPublish = (mHeader[0] & 0xF0) == 0x30;
+      bool isPuback = (mHeader[0] & 0xF0) == 0x40;
+      mFieldLength = 0;
+      mFieldPosition = 0;
+      if (isPublish && mStreamHandler != NULL && mHeaderLength + mPacketRemaining > mStreamThreshold)
+        mInboundState = INBOUND_TOPIC_LENGTH;
+      else if (isPuback && mAckHandler != NULL && mPacketRemaining == 2)
+        mInboundState = INBOUND_ACK;
+      else
+        mInboundState = INBOUND_PASS;
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Go on with the diverted packet, with the bytes received so far: the packet usually spans several loop() calls.
+ * The variable header is read byte per byte, the payload is read by chunks and given to the stream handler.
+ * A PUBACK is complete once its packet id is read.
+ * Subscriptions are made with QoS 0, so the broker never sends these packets with a QoS requiring an acknowledgement.
+ */
+void MqttTransport::receiveDivertedPacket()
+{
+  while (mInboundState != INBOUND_HEADER && mInboundState != INBOUND_PASS)
+  {
+    if (mInboundState == INBOUND_PAYLOAD)
+    {
+      if (mPacketRemaining == 0)
+      {
+        if (mStreamStarted)
+          mStreamHandler(STREAM_END, mStreamTopic, NULL, 0, mStreamContext);
+        resetInbound();
+        return;
+      }
+
+      int networkAvailable = mClient->available();
+      if (networkAvailable <= 0)
+        return;
+
+      uint8_t chunk[MQTT_STREAM_CHUNK_SIZE];
+      size_t size = sizeof(chunk);
+      if (size > (size_t)networkAvailable)
+        size = networkAvailable;
+      if (size > mPacketRemaining)
+        size = mPacketRemaining;
+
+      int count = readNetwork(chunk, size);
+      if (count <= 0)
+        return;
+      mPacketRemaining -= count;
+
+      if (mStreamStarted)
+        mStreamHandler(STREAM_CHUNK, mStreamTopic, chunk, count, mStreamContext);
+      continue;
+    }
+
+    // A topic of length 0 is complete without reading anything
+    if (mInboundState == INBOUND_TOPIC && mFieldPosition == mFieldLength)
+    {
+      size_t topicLength = mFieldLength < MQTT_STREAM_MAX_TOPIC_LENGTH ? mFieldLength : MQTT_STREAM_MAX_TOPIC_LENGTH;
+      mStreamTopic[topicLength] = '\0';
+      mStreamStarted = mFieldLength <= MQTT_STREAM_MAX_TOPIC_LENGTH;
+      mFieldPosition = 0;
+      mInboundState = (mHeader[0] & 0x06) != 0 ? INBOUND_PACKET_ID : INBOUND_PAYLOAD;
+
+      if (mInboundState == INBOUND_PAYLOAD && mStreamStarted)
+        mStreamHandler(STREAM_BEGIN, mStreamTopic, NULL, mPacketRemaining, mStreamContext);
+      continue;
+    }
+
+    // Malformed packet, ending in its variable header
+    if (mPacketRemaining == 0)
+    {
+      resetInbound();
+      return;
+    }
+
+    if (mClient->available() <= 0)
+      return;
+    int b = readNetwork();
+    if (b < 0)
+      return;
+    mPacketRemaining--;
+
+    switch (mInboundState)
+    {
+      case INBOUND_TOPIC_LENGTH:
+        mFieldLength = (mFieldLength << 8) | b;
+        if (++mFieldPosition == 2)
+        {
+          mFieldPosition = 0;
+          mInboundState = INBOUND_TOPIC;
+        }
+        break;
+
+      case INBOUND_TOPIC:
+        if (mFieldPosition < MQTT_STREAM_MAX_TOPIC_LENGTH)
+          mStreamTopic[mFieldPosition] = b;
+        mFieldPosition++;
+        break;
+
+      case INBOUND_PACKET_ID:
+        if (++mFieldPosition == 2)
+        {
+          mInboundState = INBOUND_PAYLOAD;
+          if (mStreamStarted)
+            mStreamHandler(STREAM_BEGIN, mStreamTopic, NULL, mPacketRemaining, mStreamContext);
+        }
+        break;
+
+      case INBOUND_ACK:
+        mFieldLength = (mFieldLength << 8) | b;
+        if (++mFieldPosition == 2)
+        {
+          uint16_t packetId = mFieldLength;
+          resetInbound();
+          mAckHandler(packetId, mAckContext);
+          return;
+        }
+        break;
+
+      default:
+        break;
+    }
+  }
+}
+
+void MqttTransport::resetInbound()
+{
+  mInboundState = INBOUND_HEADER;
+  mHeaderLength = 0;
+  mHeaderPosition = 0;
+  mPacketRemaining = 0;
+  mFieldLength = 0;
+  mFieldPosition = 0;
+  mStreamStarted = false;
+}
+
+int MqttTransport::readNetwork()
+{
+  int b = mClient->read();
+  if (b >= 0)
+    mBytesRead++;
+  return b;
+}
+
+int MqttTransport::readNetwork(uint8_t* buffer, size_t size)
+{
+  int result = mClient->read(buffer, size);
+  if (result > 0)
+    mBytesRead += result;
+  return result;
+}
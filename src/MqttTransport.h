@@ -0,0 +1,110 @@
+#ifndef MQTT_TRANSPORT_H
+#define MQTT_TRANSPORT_H
+
+#include <Arduino.h>
+#include <Client.h>
+
+#ifndef MQTT_STREAM_CHUNK_SIZE
+  #define MQTT_STREAM_CHUNK_SIZE 128 // Stack buffer used to read the payload of a diverted PUBLISH packet
+#endif
+#ifndef MQTT_STREAM_MAX_TOPIC_LENGTH
+  #define MQTT_STREAM_MAX_TOPIC_LENGTH 128 // Diverted packets with a longer topic are discarded
+#endif
+
+/*
+  Client given to PubSubClient, forwarding everything to the network client.
+  EspMQTTClient does the connection handshake itself without blocking, then lets PubSubClient::connect() replay it:
+  during the replay the CONNECT packet written by PubSubClient is discarded and the CONNACK already received
+  is read again, so PubSubClient ends in its connected state without waiting on the network.
+
+  Once a stream handler is set, the incoming packets are framed here: the PUBLISH packets larger than the threshold
+  never reach PubSubClient, which could not hold them, their payload is given to the handler chunk by chunk
+  as it arrives. The other packets are handed to PubSubClient one at a time, once their fixed header is received.
+  Once an ack handler is set, the PUBACK packets, which PubSubClient ignores, are given to it the same way.
+*/
+class MqttTransport : public Client
+{
+public:
+  enum StreamEvent : byte {
+    STREAM_BEGIN, // length is the size of the whole payload
+    STREAM_CHUNK,
+    STREAM_END,
+    STREAM_ABORT // The connection was closed before the end of the payload
+  };
+  typedef void (*StreamHandler)(StreamEvent event, const char* topic, const uint8_t* data, size_t length, void* context);
+  typedef void (*AckHandler)(uint16_t packetId, void* context);
+
+  MqttTransport(Client& client);
+  ~MqttTransport();
+
+  void beginHandshakeReplay(const uint8_t* connack, const size_t length);
+  void endHandshakeReplay();
+  bool setStreamHandler(const size_t threshold, StreamHandler handler, void* context); // Divert the PUBLISH packets larger than threshold bytes, header included
+  void setAckHandler(AckHandler handler, void* context); // Divert the PUBACK packets
+
+  inline Client& networkClient() { return *mClient; };
+  inline void setNetworkClient(Client& client) { mClient = &client; };
+  inline unsigned long bytesRead() const { return mBytesRead; }; // Bytes exchanged with the network client, the replayed handshake is not counted
+  inline unsigned long bytesWritten() const { return mBytesWritten; };
+  void resetByteCounters();
+
+  // Client interface
+  int connect(IPAddress ip, uint16_t port) override;
+  int connect(const char* host, uint16_t port) override;
+  size_t write(uint8_t b) override;
+  size_t write(const uint8_t* buffer, size_t size) override;
+  int available() override;
+  int read() override;
+  int read(uint8_t* buffer, size_t size) override;
+  int peek() override;
+  void flush() override;
+  void stop() override;
+  uint8_t connected() override;
+  operator bool() override;
+
+private:
+  enum InboundState : byte {
+    INBOUND_HEADER, // Between two packets, receiving the fixed header of the next one
+    INBOUND_PASS, // Packet read by PubSubClient
+    INBOUND_TOPIC_LENGTH, // Packet diverted to the stream handler
+    INBOUND_TOPIC,
+    INBOUND_PACKET_ID,
+    INBOUND_PAYLOAD,
+    INBOUND_ACK // PUBACK diverted to the ack handler
+  };
+
+  Client* mClient;
+
+  bool mReplaying;
+  uint8_t mReplayBuffer[4];
+  size_t mReplayLength;
+  size_t mReplayPosition;
+
+  StreamHandler mStreamHandler;
+  void* mStreamContext;
+  size_t mStreamThreshold;
+  AckHandler mAckHandler;
+  void* mAckContext;
+  char* mStreamTopic; // Allocated with the stream handler
+  InboundState mInboundState;
+  uint8_t mHeader[5];
+  size_t mHeaderLength;
+  size_t mHeaderPosition; // Header bytes already given back to PubSubClient
+  uint32_t mPacketRemaining; // Bytes of the current packet not read from the network client yet, header excluded
+  uint16_t mFieldLength; // Topic length or packet id being received
+  size_t mFieldPosition;
+  bool mStreamStarted;
+
+  unsigned long mBytesRead;
+  unsigned long mBytesWritten;
+
+  inline bool isFraming() const { return mStreamHandler != NULL || mAckHandler != NULL; };
+  void processInbound();
+  bool receiveHeader();
+  void receiveDivertedPacket();
+  void resetInbound();
+  int readNetwork();
+  int readNetwork(uint8_t* buffer, size_t size);
+};
+
+#endif
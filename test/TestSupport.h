@@ -0,0 +1,91 @@
+#ifndef TEST_SUPPORT_H
+#define TEST_SUPPORT_H
+
+/*
+  Helpers shared by the host tests. CHECK stays active whatever NDEBUG is, and the broker helpers
+  append packets to the input of the host network as if the broker had sent them.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <WiFiClient.h>
+
+#define CHECK(condition) \
+  do \
+  { \
+    if (!(condition)) \
+    { \
+      fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+      abort(); \
+    } \
+  } while (0)
+
+inline void brokerSend(const uint8_t* packet, size_t length)
+{
+  std::lock_guard<std::recursive_mutex> lock(HostNetwork::mutex);
+  HostNetwork::in.insert(HostNetwork::in.end(), packet, packet + length);
+}
+
+inline void brokerSendConnack(uint8_t returnCode = 0)
+{
+  uint8_t connack[4] = { 0x20, 2, 0, returnCode };
+  brokerSend(connack, sizeof(connack));
+}
+
+inline void brokerSendPuback(uint16_t packetId)
+{
+  uint8_t puback[4] = { 0x40, 2, (uint8_t)(packetId >> 8), (uint8_t)packetId };
+  brokerSend(puback, sizeof(puback));
+}
+
+inline void brokerSendPublish(const char* topic, const uint8_t* payload, size_t length)
+{
+  std::vector<uint8_t> packet;
+  size_t topicLength = strlen(topic);
+  uint32_t remainingLength = 2 + topicLength + length;
+
+  packet.push_back(0x30);
+  do
+  {
+    uint8_t digit = remainingLength & 0x7F;
+    remainingLength >>= 7;
+    packet.push_back(remainingLength > 0 ? digit | 0x80 : digit);
+  } while (remainingLength > 0);
+  packet.push_back(topicLength >> 8);
+  packet.push_back(topicLength & 0xFF);
+  packet.insert(packet.end(), topic, topic + topicLength);
+  packet.insert(packet.end(), payload, payload + length);
+  brokerSend(packet.data(), packet.size());
+}
+
+inline void brokerSendPublish(const char* topic, size_t length, char fill)
+{
+  std::vector<uint8_t> payload(length, (uint8_t)fill);
+  brokerSendPublish(topic, payload.data(), length);
+}
+
+inline std::string sentBytes()
+{
+  return std::string(HostNetwork::out.begin(), HostNetwork::out.end());
+}
+
+// Run the client until it wrote its CONNECT packet, then accept it. Clears what was sent until then.
+template <typename Client>
+void connectClient(Client &client)
+{
+  for (int i = 0 ; i < 5 && !HostNetwork::isConnected ; i++)
+  {
+    client.loop();
+    hostMillis += 10;
+  }
+  CHECK(HostNetwork::isConnected);
+
+  brokerSendConnack();
+  client.loop();
+  CHECK(client.isMqttConnected());
+  HostNetwork::out.clear();
+}
+
+#endif
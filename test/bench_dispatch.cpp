@@ -0,0 +1,57 @@
+#include "EspMQTTClient.h"
+#include "TestSupport.h"
+#include <chrono>
+
+/*
+  Messages dispatched per second with 10, 100 and 1000 subscriptions, from the bytes received to the callback.
+  Each subscription has its own topic and a "bench/#" subscription matches every message too.
+  The numbers are only comparable between runs of the same build, the sanitizers slow everything down.
+*/
+
+static const int MESSAGE_COUNT = 20000;
+
+static void benchmark(unsigned int subscriptionCount)
+{
+  HostNetwork::reset();
+  hostMillis += 100000;
+  EspMQTTClient client("broker", 1883, "bench");
+  client.enableDebuggingMessages(false);
+  client.setMaxTopicSubscriptions(subscriptionCount + 1);
+
+  std::vector<std::string> topics;
+  long received = 0;
+  for (unsigned int i = 0 ; i < subscriptionCount ; i++)
+  {
+    topics.push_back("bench/sensor" + std::to_string(i) + "/value");
+    CHECK(client.subscribe(topics.back().c_str(), [&](const char* topic, const uint8_t* payload, size_t length) { received++; }));
+  }
+  CHECK(client.subscribe("bench/#", [&](const char* topic, const uint8_t* payload, size_t length) { received++; }));
+  connectClient(client);
+
+  // Queued in batches so that the inbound queue of the client never overflows
+  std::chrono::steady_clock::duration elapsed(0);
+  for (int sent = 0 ; sent < MESSAGE_COUNT ; )
+  {
+    for (int i = 0 ; i < 8 && sent < MESSAGE_COUNT ; i++, sent++)
+      brokerSendPublish(topics[(sent * 7919) % subscriptionCount].c_str(), 16, 'p');
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    while (!HostNetwork::in.empty())
+      client.loop();
+    client.loop();
+    elapsed += std::chrono::steady_clock::now() - start;
+  }
+  CHECK(received == 2 * MESSAGE_COUNT);
+
+  double seconds = std::chrono::duration<double>(elapsed).count();
+  printf("%4u subscriptions: %9.0f messages/s (%.2f us per message)\n", subscriptionCount, MESSAGE_COUNT / seconds, seconds * 1e6 / MESSAGE_COUNT);
+}
+
+int main()
+{
+  benchmark(10);
+  benchmark(100);
+  benchmark(1000);
+  puts("bench_dispatch passed");
+  return 0;
+}
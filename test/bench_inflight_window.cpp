@@ -0,0 +1,106 @@
+#include "EspMQTTClient.h"
+#include "TestSupport.h"
+#include <chrono>
+#include <deque>
+#include <thread>
+
+/*
+  Messages per second published with QoS 1 through windows of 1, 4 and 16 messages waiting for their PUBACK. The
+  broker stand-in acknowledges each PUBLISH a fixed delay after it was sent, as a broker a round trip away would.
+  The messages are published at once, those that don't fit in the window wait in the publish queue. The time is
+  that of the whole exchange, as with a real broker: the delay of the PUBACK dominates, the window hides it.
+*/
+
+static const int MESSAGE_COUNT = 200;
+static const unsigned long PUBACK_DELAY_MICROS = 5000;
+
+struct SentPublish
+{
+  uint16_t packetId;
+  std::chrono::steady_clock::time_point acknowledgeAt;
+};
+
+// Appends the QoS 1 PUBLISH packets sent since offset, returns the offset of the next packet
+static size_t readSentPublishes(size_t offset, std::deque<SentPublish> &sent)
+{
+  const std::vector<uint8_t> &out = HostNetwork::out;
+  while (offset + 2 <= out.size())
+  {
+    size_t remainingLength = 0;
+    size_t headerLength = 1;
+    int shift = 0;
+    do
+    {
+      if (offset + headerLength >= out.size())
+        return offset;
+      remainingLength |= (size_t)(out[offset + headerLength] & 0x7F) << shift;
+      shift += 7;
+    } while (out[offset + headerLength++] & 0x80);
+    if (offset + headerLength + remainingLength > out.size())
+      return offset;
+
+    if ((out[offset] & 0xF0) == MQTTPUBLISH && (out[offset] & 0x06) == MQTTQOS1)
+    {
+      size_t topicOffset = offset + headerLength;
+      size_t topicLength = (out[topicOffset] << 8) | out[topicOffset + 1];
+      SentPublish publish = { (uint16_t)((out[topicOffset + 2 + topicLength] << 8) | out[topicOffset + 3 + topicLength]),
+        std::chrono::steady_clock::now() + std::chrono::microseconds(PUBACK_DELAY_MICROS) };
+      sent.push_back(publish);
+    }
+    offset += headerLength + remainingLength;
+  }
+  return offset;
+}
+
+static void benchmark(unsigned int windowSize)
+{
+  HostNetwork::reset();
+  hostMillis += 100000;
+  EspMQTTClient client("broker", 1883, "bench");
+  client.enableDebuggingMessages(false);
+  client.enableQos1Publish(windowSize, 64 * windowSize);
+  client.enablePublishQueue(MESSAGE_COUNT * 64, MqttPublishQueue::DROP_OLDEST, windowSize);
+  connectClient(client);
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  char payload[16];
+  for (int i = 0 ; i < MESSAGE_COUNT ; i++)
+  {
+    snprintf(payload, sizeof(payload), "%d", i);
+    CHECK(client.publish("bench/window", payload, false, 1));
+  }
+
+  std::deque<SentPublish> sent;
+  size_t offset = 0;
+  int acknowledged = 0;
+  while (acknowledged < MESSAGE_COUNT)
+  {
+    client.loop();
+    offset = readSentPublishes(offset, sent);
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    while (!sent.empty() && sent.front().acknowledgeAt <= now)
+    {
+      brokerSendPuback(sent.front().packetId);
+      sent.pop_front();
+      acknowledged++;
+    }
+    CHECK(sent.size() <= windowSize);
+    std::this_thread::sleep_for(std::chrono::microseconds(50));
+  }
+  while (client.getUnacknowledgedCount() > 0)
+    client.loop();
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  CHECK(client.getMetrics().messagesOut == MESSAGE_COUNT && client.getMetrics().publishFailures == 0);
+  printf("window of %2u: %7.0f messages/s\n", windowSize, MESSAGE_COUNT / seconds);
+}
+
+int main()
+{
+  printf("%d messages, PUBACK %u us after each PUBLISH\n", MESSAGE_COUNT, (unsigned int)PUBACK_DELAY_MICROS);
+  benchmark(1);
+  benchmark(4);
+  benchmark(16);
+  puts("bench_inflight_window passed");
+  return 0;
+}
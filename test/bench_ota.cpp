@@ -0,0 +1,59 @@
+#include "EspMQTTClient.h"
+#include "TestSupport.h"
+#include <chrono>
+#include <Update.h>
+
+/*
+  Bytes per second of a 4 MB firmware update received over MQTT, with chunks of 512 bytes to MQTT_OTA_MAX_CHUNK_SIZE.
+  Only the time spent in loop() is measured: reading the data messages, checking their offset, buffering the chunks
+  and giving them to the Update stand-in, which doesn't write any flash. On a device the flash writes dominate.
+*/
+
+static const size_t FIRMWARE_SIZE = 4 * 1024 * 1024;
+
+static void benchmark(size_t chunkSize)
+{
+  HostNetwork::reset();
+  hostMillis += 100000;
+  EspMQTTClient client("broker", 1883, "bench");
+  client.enableDebuggingMessages(false);
+  client.enableMqttOtaUpdate();
+  connectClient(client);
+
+  std::string begin = std::to_string(FIRMWARE_SIZE) + " 0123456789abcdef0123456789abcdef";
+  brokerSendPublish("bench/ota/begin", (const uint8_t*)begin.data(), begin.size());
+  client.loop();
+
+  // A chunk at a time, as the sender waits for the status when the offset is wrong
+  std::vector<uint8_t> chunk(4 + chunkSize, 0xAB);
+  std::chrono::steady_clock::duration elapsed(0);
+  for (size_t offset = 0 ; offset < FIRMWARE_SIZE ; offset += chunkSize)
+  {
+    chunk[0] = offset >> 24;
+    chunk[1] = offset >> 16;
+    chunk[2] = offset >> 8;
+    chunk[3] = offset;
+    brokerSendPublish("bench/ota/data", chunk.data(), chunk.size());
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    while (!HostNetwork::in.empty())
+      client.loop();
+    client.loop();
+    elapsed += std::chrono::steady_clock::now() - start;
+  }
+  CHECK(Update.written == FIRMWARE_SIZE);
+  CHECK(sentBytes().find("succeeded") != std::string::npos);
+
+  double seconds = std::chrono::duration<double>(elapsed).count();
+  printf("%4u bytes per chunk: %10.0f bytes/s (%.2f us per chunk)\n", (unsigned int)chunkSize,
+    FIRMWARE_SIZE / seconds, seconds * 1e6 / (FIRMWARE_SIZE / chunkSize));
+}
+
+int main()
+{
+  benchmark(512);
+  benchmark(1024);
+  benchmark(MQTT_OTA_MAX_CHUNK_SIZE);
+  puts("bench_ota passed");
+  return 0;
+}
@@ -0,0 +1,95 @@
+#include "EspMQTTClient.h"
+#include "TestSupport.h"
+#include <chrono>
+
+/*
+  Wire size of the same readings sent as one JSON message each and as MqttRecordBatch frames, MQTT header and
+  topic included, and the packets per second it takes at 10 readings per second. A reading is a timestamp,
+  a temperature and a humidity, as in the README example.
+*/
+
+static const int READING_COUNT = 1000;
+static const int READINGS_PER_SECOND = 10;
+static const char* TOPIC = "home/livingroom/telemetry";
+
+struct WireCost
+{
+  size_t bytes;
+  int packets;
+  double encodeMicros;
+};
+
+static float temperature(int i) { return 21.5f + (i % 40) * 0.05f; }
+static int humidity(int i) { return 40 + i % 7; }
+static unsigned long timestamp(int i) { return 3600000 + i * (1000 / READINGS_PER_SECOND); }
+
+static WireCost sendJson(EspMQTTClient &client)
+{
+  WireCost cost = { 0, 0, 0 };
+  HostNetwork::out.clear();
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (int i = 0 ; i < READING_COUNT ; i++)
+  {
+    char json[96];
+    snprintf(json, sizeof(json), "{\"t\":%lu,\"temperature\":%.2f,\"humidity\":%d}", timestamp(i), temperature(i), humidity(i));
+    CHECK(client.publish(TOPIC, json));
+    cost.packets++;
+  }
+  cost.encodeMicros = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+  cost.bytes = HostNetwork::out.size();
+  return cost;
+}
+
+static WireCost sendBatches(EspMQTTClient &client, MqttRecordBatch &batch)
+{
+  WireCost cost = { 0, 0, 0 };
+  HostNetwork::out.clear();
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (int i = 0 ; i < READING_COUNT ; i++)
+  {
+    batch.beginRecord(timestamp(i));
+    batch.addFloat(temperature(i));
+    batch.addInt(humidity(i));
+    if (batch.endRecord())
+      continue;
+
+    // The record did not fit, send the batch and add it again
+    CHECK(client.publish(TOPIC, batch));
+    cost.packets++;
+    i--;
+  }
+  CHECK(client.publish(TOPIC, batch));
+  cost.packets++;
+  cost.encodeMicros = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+  cost.bytes = HostNetwork::out.size();
+  return cost;
+}
+
+static void print(const char* name, const WireCost &cost)
+{
+  double seconds = (double)READING_COUNT / READINGS_PER_SECOND;
+  printf("%-6s %6.1f bytes per reading, %5.2f packets/s, %7.0f bytes/s, %.2f us per reading\n", name,
+    (double)cost.bytes / READING_COUNT, cost.packets / seconds, cost.bytes / seconds, cost.encodeMicros / READING_COUNT);
+}
+
+int main()
+{
+  HostNetwork::reset();
+  hostMillis += 100000;
+  EspMQTTClient client("broker", 1883, "bench");
+  client.enableDebuggingMessages(false);
+  connectClient(client);
+
+  // The largest frame fitting a message with the topic, under MQTT_MAX_PACKET_SIZE
+  MqttRecordBatch batch;
+  CHECK(batch.begin(MQTT_MAX_PACKET_SIZE - MQTT_MAX_HEADER_SIZE - 2 - strlen(TOPIC)));
+
+  WireCost json = sendJson(client);
+  WireCost binary = sendBatches(client, batch);
+  print("JSON", json);
+  print("binary", binary);
+  CHECK(binary.bytes * 3 < json.bytes && binary.packets * 5 < json.packets);
+
+  puts("bench_record_batch passed");
+  return 0;
+}
@@ -0,0 +1,97 @@
+#include "EspMQTTClient.h"
+#include "TestSupport.h"
+#include <chrono>
+#include <malloc.h>
+
+/*
+  Heap used and cost of the sketch loop() for 1 to 4 brokers, as separate clients each looped by the sketch (the
+  first one handling the WiFi) and as sessions of a single client. Each broker connection has a subscription and a
+  periodic timer. The heap is read with mallinfo2(), so this bench is built without the sanitizers, and includes
+  the client objects, allocated with new. The loop() cost is measured once connected, with no traffic.
+*/
+
+static const int LOOP_COUNT = 100000;
+
+static size_t heapBytes()
+{
+  return mallinfo2().uordblks;
+}
+
+static void benchmark(int brokerCount, bool asSessions, bool report = true)
+{
+  HostNetwork::reset();
+  hostMillis += 100000;
+  HostNetwork::out.reserve(1 << 16);
+  HostNetwork::in.push_back(0);
+  HostNetwork::in.clear();
+  size_t startBytes = heapBytes();
+
+  std::vector<EspMQTTClient*> clients;
+  clients.push_back(new EspMQTTClient("ssid", "password", "broker", "client0"));
+  for (int i = 1 ; i < brokerCount ; i++)
+  {
+    std::string name = "client" + std::to_string(i);
+    clients.push_back(new EspMQTTClient("broker", 1883, name.c_str()));
+    if (asSessions)
+      clients[0]->addSession(*clients[i]);
+  }
+  int executions = 0;
+  for (EspMQTTClient* client : clients)
+  {
+    client->enableDebuggingMessages(false);
+    client->subscribe("cmd/+", [](const String &payload) {});
+    client->executePeriodically(1000, [&]() { executions++; });
+  }
+
+  // The sketch loop() calls loop() on each client, or on the first one only
+  auto sketchLoop = [&]()
+  {
+    for (int i = 0 ; i < (asSessions ? 1 : brokerCount) ; i++)
+      clients[i]->loop();
+  };
+
+  for (int i = 0 ; i < 10 && HostNetwork::connectCount < brokerCount ; i++)
+  {
+    sketchLoop();
+    hostMillis += 10;
+  }
+  CHECK(HostNetwork::connectCount == brokerCount);
+  for (int i = 0 ; i < brokerCount ; i++)
+    brokerSendConnack();
+  for (int i = 0 ; i < 10 && !HostNetwork::in.empty() ; i++)
+    sketchLoop();
+  sketchLoop();
+  for (EspMQTTClient* client : clients)
+    CHECK(client->isMqttConnected());
+  size_t usedBytes = heapBytes() - startBytes;
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (int i = 0 ; i < LOOP_COUNT ; i++)
+    sketchLoop();
+  double micros = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+
+  hostMillis += 1000;
+  sketchLoop();
+  CHECK(executions == brokerCount);
+
+  if (report)
+    printf("%d broker%s as %-8s %6u heap bytes, %.3f us per sketch loop()\n", brokerCount, brokerCount > 1 ? "s" : " ",
+      asSessions ? "sessions" : "clients", (unsigned int)usedBytes, micros / LOOP_COUNT);
+
+  // Sessions are deleted before their owner
+  for (int i = brokerCount - 1 ; i >= 0 ; i--)
+    delete clients[i];
+}
+
+int main()
+{
+  // What is allocated once for the process is left out of the measures
+  benchmark(1, false, false);
+  for (int brokerCount = 1 ; brokerCount <= 4 ; brokerCount++)
+  {
+    benchmark(brokerCount, false);
+    benchmark(brokerCount, true);
+  }
+  puts("bench_sessions passed");
+  return 0;
+}
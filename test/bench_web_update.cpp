@@ -0,0 +1,69 @@
+#include "ESP32HTTPUpdateServer.h"
+#include "TestSupport.h"
+#include <chrono>
+
+/*
+  Bytes per second of a 512 KB firmware uploaded to the web updater, against the previous updater that wrote each
+  part of the upload to flash before receiving the next one. Receiving a part and writing a kilobyte to flash are
+  given a time of the order of a device's, so the figures only show how much of the two overlap: with the writer
+  task, the upload is received while the previous buffer is written.
+*/
+
+static const size_t FIRMWARE_SIZE = 512 * 1024;
+static const unsigned long RECEIVE_MICROS_PER_PART = 1000;
+static const unsigned long WRITE_MICROS_PER_KILOBYTE = 700;
+
+// Upload handler of the previous updater, without its logs
+static void setupPreviousUpdater(WebServer &web)
+{
+  web.on("/", HTTP_POST, [&]() {
+    web.send_P(200, "text/html", Update.hasError() ? "FAIL" : ESP32_WEB_UPDATE_SUCCESS_RESPONSE);
+  }, [&]() {
+    HTTPUpload& upload = web.upload();
+    if (upload.status == UPLOAD_FILE_START)
+      Update.begin(UPDATE_SIZE_UNKNOWN);
+    else if (upload.status == UPLOAD_FILE_WRITE)
+      Update.write(upload.buf, upload.currentSize);
+    else if (upload.status == UPLOAD_FILE_END)
+      Update.end(true);
+  });
+}
+
+static double measure(WebServer &web, const std::vector<uint8_t> &data)
+{
+  Update.reset();
+  Update.writeMicrosPerKilobyte = WRITE_MICROS_PER_KILOBYTE;
+  web.receiveMicrosPerPart = RECEIVE_MICROS_PER_PART;
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  web.hostUpload(data.data(), data.size());
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  CHECK(web.responseCode == 200 && Update.written == data.size());
+  CHECK(Update.hash == UpdateClass::hashOf(data.data(), data.size()));
+  return data.size() / seconds;
+}
+
+int main()
+{
+  std::vector<uint8_t> data(FIRMWARE_SIZE);
+  for (size_t i = 0 ; i < data.size() ; i++)
+    data[i] = (uint8_t)(i * 7);
+
+  WebServer previousWeb(80);
+  setupPreviousUpdater(previousWeb);
+  double previous = measure(previousWeb, data);
+
+  WebServer web(80);
+  ESP32HTTPUpdateServer server;
+  server.setup(&web);
+  web.args["size"] = std::to_string(FIRMWARE_SIZE);
+  double current = measure(web, data);
+
+  printf("%u us to receive a part, %u us to write a kilobyte\n", (unsigned int)RECEIVE_MICROS_PER_PART, (unsigned int)WRITE_MICROS_PER_KILOBYTE);
+  printf("previous updater: %9.0f bytes/s\n", previous);
+  printf("writer task:      %9.0f bytes/s (x%.2f)\n", current, current / previous);
+
+  puts("bench_web_update passed");
+  return 0;
+}
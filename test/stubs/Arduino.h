@@ -0,0 +1,159 @@
+#ifndef HOST_STUB_ARDUINO_H
+#define HOST_STUB_ARDUINO_H
+
+/*
+  Host stand-in for the Arduino core, only what the library uses.
+  millis() returns hostMillis, which the tests move forward themselves, micros() follows the real clock.
+  random() returns its lower bound until a test calls randomSeed(), so the retry delays are known.
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <strings.h>
+#include <functional>
+#include <string>
+
+typedef uint8_t byte;
+
+extern unsigned long hostMillis;
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void yield();
+long random(long max);
+long random(long min, long max);
+void randomSeed(unsigned long seed);
+
+#define F(x) x
+#define PSTR(x) x
+
+class String
+{
+public:
+  String(const char* text = "") : mText(text != NULL ? text : "") {}
+  String(int value) : mText(std::to_string(value)) {}
+  String(unsigned int value) : mText(std::to_string(value)) {}
+  String(long value) : mText(std::to_string(value)) {}
+  String(unsigned long value) : mText(std::to_string(value)) {}
+
+  const char* c_str() const { return mText.c_str(); }
+  unsigned int length() const { return mText.size(); }
+  bool reserve(unsigned int size) { mText.reserve(size); return true; }
+  bool concat(const char* text) { mText += text; return true; }
+  bool concat(const char* text, unsigned int length) { mText.append(text, length); return true; }
+  bool concat(char c) { mText += c; return true; }
+  bool equals(const String &other) const { return mText == other.mText; }
+  bool equals(const char* other) const { return mText == other; }
+  bool equalsIgnoreCase(const String &other) const { return strcasecmp(c_str(), other.c_str()) == 0; }
+  bool startsWith(const String &prefix) const { return mText.compare(0, prefix.mText.size(), prefix.mText) == 0; }
+  bool endsWith(const String &suffix) const { return mText.size() >= suffix.mText.size() && mText.compare(mText.size() - suffix.mText.size(), suffix.mText.size(), suffix.mText) == 0; }
+  int indexOf(char c) const { size_t position = mText.find(c); return position == std::string::npos ? -1 : (int)position; }
+  String substring(unsigned int from, unsigned int to = ~0u) const { return String(mText.substr(from, to - from).c_str()); }
+  long toInt() const { return atol(c_str()); }
+  float toFloat() const { return atof(c_str()); }
+
+  String& operator=(const char* text) { mText = text; return *this; }
+  String& operator+=(const String &other) { mText += other.mText; return *this; }
+  String& operator+=(const char* text) { mText += text; return *this; }
+  String& operator+=(char c) { mText += c; return *this; }
+  bool operator==(const char* text) const { return mText == text; }
+  bool operator==(const String &other) const { return mText == other.mText; }
+  char operator[](unsigned int index) const { return mText[index]; }
+
+private:
+  std::string mText;
+};
+
+inline String operator+(const String &a, const String &b) { String result(a); result += b; return result; }
+inline String operator+(const String &a, const char* b) { String result(a); result += b; return result; }
+
+class Print
+{
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t b) = 0;
+  virtual size_t write(const uint8_t* buffer, size_t size) { for (size_t i = 0 ; i < size ; i++) write(buffer[i]); return size; }
+  size_t write(const char* text) { return write((const uint8_t*)text, strlen(text)); }
+  virtual int availableForWrite() { return 0; }
+  virtual void flush() {}
+  size_t print(const char*) { return 0; }
+  size_t print(const String&) { return 0; }
+  size_t print(int) { return 0; }
+  size_t println(const char* = "") { return 0; }
+  size_t println(const String&) { return 0; }
+  size_t println(int) { return 0; }
+  size_t printf(const char*, ...) __attribute__((format(printf, 2, 3))) { return 0; }
+};
+
+class Stream : public Print
+{
+public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+};
+
+// Discards everything, the tests read the logs from the library log buffer if they need them
+class HardwareSerial : public Stream
+{
+public:
+  using Print::write;
+  size_t write(uint8_t) override { return 1; }
+  size_t write(const uint8_t*, size_t size) override { return size; }
+  int availableForWrite() override { return 64; }
+  int available() override { return 0; }
+  int read() override { return -1; }
+  int peek() override { return -1; }
+  void begin(unsigned long) {}
+  void setDebugOutput(bool) {}
+};
+extern HardwareSerial Serial;
+
+class IPAddress
+{
+public:
+  IPAddress() : mAddress(0) {}
+  IPAddress(uint32_t address) : mAddress(address) {}
+  IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : mAddress(a | (b << 8) | (c << 16) | ((uint32_t)d << 24)) {}
+  operator uint32_t() const { return mAddress; }
+  bool operator==(const IPAddress &other) const { return mAddress == other.mAddress; }
+
+  bool fromString(const char* text)
+  {
+    unsigned int bytes[4];
+    char extra;
+    if (sscanf(text, "%u.%u.%u.%u%c", &bytes[0], &bytes[1], &bytes[2], &bytes[3], &extra) != 4)
+      return false;
+    mAddress = bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+    return true;
+  }
+
+  String toString() const
+  {
+    char text[16];
+    snprintf(text, sizeof(text), "%u.%u.%u.%u", mAddress & 0xFF, (mAddress >> 8) & 0xFF, (mAddress >> 16) & 0xFF, mAddress >> 24);
+    return String(text);
+  }
+
+private:
+  uint32_t mAddress;
+};
+
+class EspClass
+{
+public:
+  int restartCount;
+  uint32_t freeHeap; // What getFreeHeap() returns
+
+  EspClass() : restartCount(0), freeHeap(0) {}
+  uint32_t getFreeHeap() { return freeHeap; }
+  uint32_t getMinFreeHeap() { return 0; }
+  void restart() { restartCount++; }
+};
+extern EspClass ESP;
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef HOST_STUB_ESPMDNS_H
+#define HOST_STUB_ESPMDNS_H
+
+class MDNSResponder
+{
+public:
+  bool begin(const char*) { return true; }
+  void addService(const char*, const char*, int) {}
+};
+extern MDNSResponder MDNS;
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef HOST_STUB_FS_H
+#define HOST_STUB_FS_H
+
+#include <Arduino.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+// In-memory file system, the tests inspect `files` directly
+namespace fs {
+
+class File
+{
+public:
+  File() : data(NULL), position(0) {}
+  size_t write(const uint8_t* buffer, size_t size) { if (data == NULL) return 0; data->insert(data->end(), buffer, buffer + size); return size; }
+  size_t read(uint8_t* buffer, size_t size)
+  {
+    if (data == NULL)
+      return 0;
+    size_t count = std::min(size, data->size() - position);
+    memcpy(buffer, data->data() + position, count);
+    position += count;
+    return count;
+  }
+  size_t size() { return data != NULL ? data->size() : 0; }
+  void flush() {}
+  void close() { data = NULL; }
+  operator bool() const { return data != NULL; }
+
+  std::vector<uint8_t>* data;
+  size_t position;
+};
+
+class FS
+{
+public:
+  File open(const String &path, const char* mode)
+  {
+    File file;
+    std::string name = path.c_str();
+    if (mode[0] == 'r' && files.count(name) == 0)
+      return file;
+    if (mode[0] == 'w')
+      files[name].clear();
+    file.data = &files[name];
+    return file;
+  }
+
+  std::map<std::string, std::vector<uint8_t> > files;
+};
+
+}
+
+#endif
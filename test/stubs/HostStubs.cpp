@@ -0,0 +1,123 @@
+#include <Arduino.h>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <WiFiClient.h>
+#include <WiFiClientSecure.h>
+#include <ESPmDNS.h>
+#include <Update.h>
+#include <lwip/dns.h>
+#include <freertos/FreeRTOS.h>
+
+
+// =============== Arduino core ===================
+
+unsigned long hostMillis = 1;
+
+unsigned long millis()
+{
+  return hostMillis;
+}
+
+unsigned long micros()
+{
+  using namespace std::chrono;
+  return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+void delay(unsigned long ms)
+{
+  std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+void yield()
+{
+  std::this_thread::yield();
+}
+
+static bool hostRandomSeeded = false;
+static std::minstd_rand hostRandomGenerator;
+
+long random(long max)
+{
+  return random(0, max);
+}
+
+long random(long min, long max)
+{
+  if (!hostRandomSeeded || max <= min)
+    return min;
+  return min + hostRandomGenerator() % (max - min);
+}
+
+void randomSeed(unsigned long seed)
+{
+  hostRandomGenerator.seed(seed);
+  hostRandomSeeded = true;
+}
+
+HardwareSerial Serial;
+EspClass ESP;
+WiFiClass WiFi;
+MDNSResponder MDNS;
+UpdateClass Update;
+
+thread_local HostTask* hostCurrentTask = NULL;
+
+// Normally implemented by the sketch
+void onConnectionEstablished()
+{
+}
+
+
+// =============== Network stand-ins ===================
+
+bool HostNetwork::acceptConnections = true;
+bool HostNetwork::isConnected = false;
+int HostNetwork::connectCount = 0;
+IPAddress HostNetwork::lastAddress;
+std::deque<uint8_t> HostNetwork::in;
+std::vector<uint8_t> HostNetwork::out;
+std::recursive_mutex HostNetwork::mutex;
+
+void HostNetwork::reset()
+{
+  acceptConnections = true;
+  isConnected = false;
+  connectCount = 0;
+  lastAddress = IPAddress();
+  in.clear();
+  out.clear();
+}
+
+int WiFiClass::wifiStatus = WL_CONNECTED;
+
+const char* HostTls::caCert = NULL;
+bool HostTls::insecure = false;
+const char* HostTls::host = NULL;
+int HostTls::verifyCount = 0;
+unsigned long HostTls::handshakeMillis = 0;
+uint32_t HostTls::handshakeHeap = 0;
+
+void HostTls::reset()
+{
+  caCert = NULL;
+  insecure = false;
+  host = NULL;
+  verifyCount = 0;
+  handshakeMillis = 0;
+  handshakeHeap = 0;
+}
+
+HostDns::Mode HostDns::mode = HostDns::CACHED;
+int HostDns::lookupCount = 0;
+dns_found_callback HostDns::pendingCallback = NULL;
+void* HostDns::pendingArg = NULL;
+
+void HostDns::reset()
+{
+  mode = CACHED;
+  lookupCount = 0;
+  pendingCallback = NULL;
+  pendingArg = NULL;
+}
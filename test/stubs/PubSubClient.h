@@ -0,0 +1,189 @@
+#ifndef HOST_STUB_PUBSUBCLIENT_H
+#define HOST_STUB_PUBSUBCLIENT_H
+
+/*
+  Subset of PubSubClient 2.8 used by the library, writing and reading real MQTT 3.1.1 packets through its Client:
+  PUBLISH packets are serialized like the real library does, received PUBLISH packets are given to the callback
+  and the other packets are skipped. The CONNECT packet is a placeholder, EspMQTTClient writes the real one.
+*/
+
+#include <Arduino.h>
+#include <Client.h>
+
+#define MQTT_MAX_PACKET_SIZE 128
+#define MQTT_KEEPALIVE 15
+#define MQTT_SOCKET_TIMEOUT 15
+#define MQTT_MAX_HEADER_SIZE 5
+
+#define MQTTCONNECT     1 << 4
+#define MQTTCONNACK     2 << 4
+#define MQTTPUBLISH     3 << 4
+#define MQTTPUBACK      4 << 4
+#define MQTTSUBSCRIBE   8 << 4
+#define MQTTUNSUBSCRIBE 10 << 4
+#define MQTTPINGREQ     12 << 4
+#define MQTTDISCONNECT  14 << 4
+#define MQTTQOS0        (0 << 1)
+#define MQTTQOS1        (1 << 1)
+
+#define MQTT_CONNECTION_TIMEOUT     -4
+#define MQTT_CONNECTION_LOST        -3
+#define MQTT_CONNECT_FAILED         -2
+#define MQTT_DISCONNECTED           -1
+#define MQTT_CONNECTED               0
+#define MQTT_CONNECT_BAD_PROTOCOL    1
+#define MQTT_CONNECT_BAD_CLIENT_ID   2
+#define MQTT_CONNECT_UNAVAILABLE     3
+#define MQTT_CONNECT_BAD_CREDENTIALS 4
+#define MQTT_CONNECT_UNAUTHORIZED    5
+
+#define MQTT_CALLBACK_SIGNATURE std::function<void(char*, uint8_t*, unsigned int)> callback
+
+class PubSubClient : public Print
+{
+public:
+  PubSubClient(Client &client) : mClient(&client), mState(MQTT_DISCONNECTED) {}
+  PubSubClient(const char*, uint16_t, Client &client) : mClient(&client), mState(MQTT_DISCONNECTED) {}
+
+  PubSubClient& setServer(const char*, uint16_t) { return *this; }
+  PubSubClient& setClient(Client &client) { mClient = &client; return *this; }
+  PubSubClient& setCallback(MQTT_CALLBACK_SIGNATURE) { mCallback = callback; return *this; }
+
+  bool connect(const char*, const char*, const char*, const char*, uint8_t, bool, const char*, bool)
+  {
+    if (connected())
+      return true;
+    if (mClient->connect("broker", 1883) != 1)
+    {
+      mState = MQTT_CONNECT_FAILED;
+      return false;
+    }
+
+    uint8_t connect[10] = { MQTTCONNECT, 8 };
+    if (mClient->write(connect, sizeof(connect)) != sizeof(connect))
+      return false;
+    if (!mClient->available())
+    {
+      mState = MQTT_CONNECTION_TIMEOUT;
+      return false;
+    }
+
+    uint8_t connack[4];
+    for (int i = 0 ; i < 4 ; i++)
+      connack[i] = mClient->read();
+    mState = connack[0] == MQTTCONNACK && connack[3] == 0 ? MQTT_CONNECTED : connack[3];
+    return mState == MQTT_CONNECTED;
+  }
+
+  void disconnect() { mClient->stop(); mState = MQTT_DISCONNECTED; }
+
+  bool publish(const char* topic, const uint8_t* payload, unsigned int length, bool retain)
+  {
+    size_t topicLength = strlen(topic);
+    if (!connected() || MQTT_MAX_HEADER_SIZE + 2 + topicLength + length > MQTT_MAX_PACKET_SIZE)
+      return false;
+    return writeHeader(MQTTPUBLISH | (retain ? 1 : 0), topic, 2 + topicLength + length) && mClient->write(payload, length) == length;
+  }
+
+  bool beginPublish(const char* topic, unsigned int length, bool retain)
+  {
+    return connected() && writeHeader(MQTTPUBLISH | (retain ? 1 : 0), topic, 2 + strlen(topic) + length);
+  }
+  int endPublish() { return 1; }
+  size_t write(uint8_t b) override { return mClient->write(&b, 1); }
+  size_t write(const uint8_t* buffer, size_t size) override { return mClient->write(buffer, size); }
+
+  // Packet id and QoS byte left out, the tests only look at the type and the topic
+  bool subscribe(const char* topic) { return connected() && writeTopicPacket((MQTTSUBSCRIBE) | MQTTQOS1, topic); }
+  bool unsubscribe(const char* topic) { return connected() && writeTopicPacket((MQTTUNSUBSCRIBE) | MQTTQOS1, topic); }
+
+  // Read at most one packet, waiting for its end like the real library does
+  bool loop()
+  {
+    if (!connected())
+      return false;
+    if (!mClient->available())
+      return true;
+
+    uint8_t header = readByte();
+    uint32_t length = 0;
+    uint32_t multiplier = 1;
+    uint8_t digit;
+    do
+    {
+      digit = readByte();
+      length += (digit & 0x7F) * multiplier;
+      multiplier <<= 7;
+    } while (digit & 0x80);
+
+    for (uint32_t i = 0 ; i < length ; i++)
+    {
+      uint8_t b = readByte();
+      if (i < sizeof(mBuffer) - 1)
+        mBuffer[i] = b;
+    }
+
+    if ((header & 0xF0) == MQTTPUBLISH && 2 + length <= MQTT_MAX_PACKET_SIZE && mCallback)
+    {
+      // Like the real library, the topic is moved back by 2 bytes to make room for its NUL
+      uint16_t topicLength = (mBuffer[0] << 8) | mBuffer[1];
+      memmove(mBuffer, mBuffer + 2, topicLength);
+      mBuffer[topicLength] = '\0';
+      mCallback((char*)mBuffer, mBuffer + 2 + topicLength, length - 2 - topicLength);
+    }
+    return true;
+  }
+
+  bool connected()
+  {
+    if (mClient->connected())
+      return mState == MQTT_CONNECTED;
+
+    if (mState == MQTT_CONNECTED)
+    {
+      mState = MQTT_CONNECTION_LOST;
+      mClient->stop();
+    }
+    return false;
+  }
+
+  int state() { return mState; }
+
+private:
+  Client* mClient;
+  int mState;
+  std::function<void(char*, uint8_t*, unsigned int)> mCallback;
+  uint8_t mBuffer[MQTT_MAX_PACKET_SIZE + 1];
+
+  uint8_t readByte()
+  {
+    while (!mClient->available())
+      ;
+    return mClient->read();
+  }
+
+  bool writeTopicPacket(uint8_t type, const char* topic)
+  {
+    return writeHeader(type, topic, 2 + strlen(topic));
+  }
+
+  bool writeHeader(uint8_t type, const char* topic, uint32_t remainingLength)
+  {
+    uint8_t header[MQTT_MAX_HEADER_SIZE + 2];
+    size_t headerLength = 0;
+    header[headerLength++] = type;
+    do
+    {
+      uint8_t digit = remainingLength & 0x7F;
+      remainingLength >>= 7;
+      header[headerLength++] = remainingLength > 0 ? digit | 0x80 : digit;
+    } while (remainingLength > 0);
+
+    size_t topicLength = strlen(topic);
+    header[headerLength++] = topicLength >> 8;
+    header[headerLength++] = topicLength & 0xFF;
+    return mClient->write(header, headerLength) == headerLength && mClient->write((const uint8_t*)topic, topicLength) == topicLength;
+  }
+};
+
+#endif
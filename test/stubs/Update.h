@@ -0,0 +1,85 @@
+#ifndef HOST_STUB_UPDATE_H
+#define HOST_STUB_UPDATE_H
+
+#include <Arduino.h>
+#include <chrono>
+#include <thread>
+
+#define UPDATE_SIZE_UNKNOWN 0xFFFFFFFF
+
+/*
+  Accepts any firmware, counting the bytes written and hashing them in order. A test can limit the space,
+  make the writes fail past a number of bytes, or make them take time as flash writes do.
+*/
+class UpdateClass
+{
+public:
+  size_t written;
+  uint32_t hash; // hashOf() the bytes written
+  size_t maxSize; // begin() fails above
+  size_t failWritesAfter; // Bytes written before write() fails
+  unsigned long writeMicrosPerKilobyte;
+
+  UpdateClass() : written(0), hash(0), maxSize(UPDATE_SIZE_UNKNOWN), failWritesAfter(UPDATE_SIZE_UNKNOWN),
+    writeMicrosPerKilobyte(0), mSize(0), mError(NULL) {}
+
+  void reset()
+  {
+    *this = UpdateClass();
+  }
+
+  static uint32_t hashOf(const uint8_t* data, size_t length, uint32_t hash = 0)
+  {
+    for (size_t i = 0 ; i < length ; i++)
+      hash = hash * 31 + data[i];
+    return hash;
+  }
+
+  bool begin(size_t size, int = 0)
+  {
+    written = 0;
+    hash = 0;
+    mSize = size;
+    mError = size != UPDATE_SIZE_UNKNOWN && size > maxSize ? "Not Enough Space" : NULL;
+    return mError == NULL;
+  }
+
+  size_t write(uint8_t* data, size_t size)
+  {
+    if (written + size > failWritesAfter)
+    {
+      mError = "Flash Write Failed";
+      return 0;
+    }
+    if (writeMicrosPerKilobyte > 0)
+      std::this_thread::sleep_for(std::chrono::microseconds(writeMicrosPerKilobyte * size / 1024));
+    hash = hashOf(data, size, hash);
+    written += size;
+    return size;
+  }
+
+  // A firmware of known size must be complete, unless evenIfRemaining
+  bool end(bool evenIfRemaining = false)
+  {
+    if (mError == NULL && !evenIfRemaining && mSize != UPDATE_SIZE_UNKNOWN && written < mSize)
+      mError = "Premature End";
+    return mError == NULL;
+  }
+
+  void abort() { mError = "Aborted"; }
+  bool setMD5(const char* md5) { return strlen(md5) == 32; }
+  bool isRunning() { return false; }
+  bool hasError() { return mError != NULL; }
+  uint8_t getError() { return mError != NULL ? 1 : 0; }
+  const char* errorString() { return mError != NULL ? mError : "No Error"; }
+  void printError(Print&) {}
+  size_t progress() { return written; }
+  size_t size() { return mSize; }
+
+private:
+  size_t mSize;
+  const char* mError;
+};
+extern UpdateClass Update;
+
+#endif
@@ -0,0 +1,119 @@
+#ifndef HOST_STUB_WEB_SERVER_H
+#define HOST_STUB_WEB_SERVER_H
+
+#include <WiFiClient.h>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <string>
+#include <thread>
+
+enum HTTPMethod { HTTP_ANY, HTTP_GET, HTTP_POST };
+enum HTTPUploadStatus { UPLOAD_FILE_START, UPLOAD_FILE_WRITE, UPLOAD_FILE_END, UPLOAD_FILE_ABORTED };
+
+#define HTTP_UPLOAD_BUFLEN 1436
+
+struct HTTPUpload
+{
+  HTTPUploadStatus status;
+  String filename;
+  String name;
+  String type;
+  size_t totalSize;
+  size_t currentSize;
+  uint8_t buf[HTTP_UPLOAD_BUFLEN];
+};
+
+/*
+  Keeps the handlers given to on() so a test can send requests to them: hostGet() and hostUpload() call them as
+  the ESP32 WebServer does, with the query in args and the upload cut in parts of HTTP_UPLOAD_BUFLEN bytes, each
+  taking receiveMicrosPerPart to arrive. The last response sent is kept in responseCode and response.
+*/
+class WebServer
+{
+public:
+  typedef std::function<void()> THandlerFunction;
+
+  std::map<std::string, std::string> args; // Query of the next request
+  bool authenticated; // What authenticate() answers
+  unsigned long receiveMicrosPerPart;
+  int responseCode;
+  std::string response;
+
+  WebServer(int) : authenticated(true), receiveMicrosPerPart(0), responseCode(0) {}
+  void begin() {}
+  void handleClient() {}
+
+  void on(const String&, HTTPMethod method, THandlerFunction handler)
+  {
+    if (method == HTTP_GET)
+      mGetHandler = handler;
+  }
+
+  void on(const String&, HTTPMethod method, THandlerFunction handler, THandlerFunction uploadHandler)
+  {
+    if (method == HTTP_POST)
+    {
+      mPostHandler = handler;
+      mUploadHandler = uploadHandler;
+    }
+  }
+
+  bool authenticate(const char*, const char*) { return authenticated; }
+  void requestAuthentication() { send(401, "text/plain", String("")); }
+  bool hasArg(const String& name) { return args.count(name.c_str()) > 0; }
+  String arg(const String& name) { return hasArg(name) ? String(args[name.c_str()].c_str()) : String(""); }
+  void sendHeader(const String&, const String&) {}
+  void send(int code, const char*, const String& content) { responseCode = code; response = content.c_str(); }
+  void send_P(int code, const char* type, const char* content) { send(code, type, String(content)); }
+  WiFiClient client() { return WiFiClient(); }
+  HTTPUpload& upload() { return mUpload; }
+
+  void hostGet()
+  {
+    mGetHandler();
+  }
+
+  // Posts the file, the connection breaks after interruptAt bytes if given: the upload is aborted without response
+  void hostUpload(const uint8_t* data, size_t length, size_t interruptAt = (size_t)-1)
+  {
+    responseCode = 0;
+    response.clear();
+    mUpload.filename = "firmware.bin";
+    mUpload.name = "update";
+    mUpload.totalSize = 0;
+    mUpload.currentSize = 0;
+    mUpload.status = UPLOAD_FILE_START;
+    mUploadHandler();
+
+    mUpload.status = UPLOAD_FILE_WRITE;
+    for (size_t offset = 0 ; offset < length ; offset += mUpload.currentSize)
+    {
+      if (offset >= interruptAt)
+      {
+        mUpload.status = UPLOAD_FILE_ABORTED;
+        mUploadHandler();
+        return;
+      }
+      if (receiveMicrosPerPart > 0)
+        std::this_thread::sleep_for(std::chrono::microseconds(receiveMicrosPerPart));
+      mUpload.currentSize = std::min(length - offset, std::min((size_t)HTTP_UPLOAD_BUFLEN, interruptAt - offset));
+      memcpy(mUpload.buf, data + offset, mUpload.currentSize);
+      mUpload.totalSize += mUpload.currentSize;
+      mUploadHandler();
+    }
+
+    mUpload.status = UPLOAD_FILE_END;
+    mUploadHandler();
+    mPostHandler();
+  }
+
+private:
+  THandlerFunction mGetHandler;
+  THandlerFunction mPostHandler;
+  THandlerFunction mUploadHandler;
+  HTTPUpload mUpload;
+};
+
+#endif
@@ -0,0 +1 @@
+#include <WiFiClient.h>
@@ -0,0 +1,107 @@
+#ifndef HOST_STUB_WIFI_CLIENT_H
+#define HOST_STUB_WIFI_CLIENT_H
+
+#include <Arduino.h>
+#include <Client.h>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+/*
+  Broker stand-in shared by every WiFiClient: the tests append the packets sent by the broker to `in`
+  and read the packets written by the library from `out`. A single connection exists at a time.
+  With the network task, the tests hold `mutex` while they use the buffers.
+*/
+struct HostNetwork
+{
+  static bool acceptConnections; // connect() fails while false
+  static bool isConnected;
+  static int connectCount;
+  static IPAddress lastAddress; // Of the last connect()
+  static std::deque<uint8_t> in;
+  static std::vector<uint8_t> out;
+  static std::recursive_mutex mutex; // Held by every WiFiClient call
+
+  static void reset();
+};
+
+class WiFiClient : public Client
+{
+public:
+  int connect(IPAddress ip, uint16_t port) override
+  {
+    std::lock_guard<std::recursive_mutex> lock(HostNetwork::mutex);
+    HostNetwork::connectCount++;
+    HostNetwork::lastAddress = ip;
+    HostNetwork::isConnected = HostNetwork::acceptConnections;
+    return HostNetwork::acceptConnections;
+  }
+  int connect(const char* host, uint16_t port) override { return connect(IPAddress(), port); }
+  int connect(IPAddress ip, uint16_t port, int32_t timeout) { return connect(ip, port); }
+
+  size_t write(uint8_t b) override { return write(&b, 1); }
+  size_t write(const uint8_t* buffer, size_t size) override
+  {
+    std::lock_guard<std::recursive_mutex> lock(HostNetwork::mutex);
+    if (!HostNetwork::isConnected)
+      return 0;
+    HostNetwork::out.insert(HostNetwork::out.end(), buffer, buffer + size);
+    return size;
+  }
+
+  int available() override
+  {
+    std::lock_guard<std::recursive_mutex> lock(HostNetwork::mutex);
+    return HostNetwork::isConnected ? HostNetwork::in.size() : 0;
+  }
+  int read() override
+  {
+    std::lock_guard<std::recursive_mutex> lock(HostNetwork::mutex);
+    if (HostNetwork::in.empty())
+      return -1;
+    int b = HostNetwork::in.front();
+    HostNetwork::in.pop_front();
+    return b;
+  }
+  int read(uint8_t* buffer, size_t size) override
+  {
+    std::lock_guard<std::recursive_mutex> lock(HostNetwork::mutex);
+    size_t count = 0;
+    while (count < size && !HostNetwork::in.empty())
+      buffer[count++] = read();
+    return count > 0 ? (int)count : -1;
+  }
+  int peek() override
+  {
+    std::lock_guard<std::recursive_mutex> lock(HostNetwork::mutex);
+    return HostNetwork::in.empty() ? -1 : HostNetwork::in.front();
+  }
+
+  void flush() override {}
+  void stop() override { std::lock_guard<std::recursive_mutex> lock(HostNetwork::mutex); HostNetwork::isConnected = false; }
+  uint8_t connected() override { std::lock_guard<std::recursive_mutex> lock(HostNetwork::mutex); return HostNetwork::isConnected; }
+  operator bool() override { return connected(); }
+  int availableForWrite() override { return 0; }
+  void setNoDelay(bool) {}
+  void setTimeout(uint32_t) {}
+};
+
+#define WL_CONNECTED 3
+#define WIFI_STA 1
+
+class WiFiClass
+{
+public:
+  static int wifiStatus; // WL_CONNECTED unless a test changes it
+
+  int status() { return wifiStatus; }
+  IPAddress localIP() { return IPAddress(192, 168, 1, 2); }
+  void mode(int) {}
+  void begin(const char*, const char*) {}
+  void disconnect() {}
+  void setHostname(const char*) {}
+  int hostByName(const char*, IPAddress &address) { address = IPAddress(127, 0, 0, 1); return 1; }
+};
+extern WiFiClass WiFi;
+
+#endif
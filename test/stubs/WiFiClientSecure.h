@@ -0,0 +1,62 @@
+#ifndef HOST_STUB_WIFI_CLIENT_SECURE_H
+#define HOST_STUB_WIFI_CLIENT_SECURE_H
+
+#include <WiFiClient.h>
+#include <algorithm>
+
+/*
+  Records how the library configured the TLS connection, a fingerprint starting with '0' fails verification.
+  A handshake moves millis() forward by handshakeMillis and takes handshakeHeap bytes of ESP.getFreeHeap() until
+  the connection is closed, no cryptography is done.
+*/
+struct HostTls
+{
+  static const char* caCert;
+  static bool insecure;
+  static const char* host;
+  static int verifyCount;
+  static unsigned long handshakeMillis;
+  static uint32_t handshakeHeap;
+
+  static void reset();
+};
+
+class WiFiClientSecure : public WiFiClient
+{
+public:
+  WiFiClientSecure() : mHeapTaken(0) {}
+  void setCACert(const char* caCert) { HostTls::caCert = caCert; }
+  void setInsecure() { HostTls::insecure = true; }
+  void setHandshakeTimeout(unsigned long) {}
+  int connect(IPAddress ip, uint16_t port, const char* host, const char* caCert, const char*, const char*)
+  {
+    HostTls::host = host;
+    if (caCert != NULL)
+      HostTls::caCert = caCert;
+    if (!WiFiClient::connect(ip, port))
+      return 0;
+
+    hostMillis += HostTls::handshakeMillis;
+    mHeapTaken = std::min(HostTls::handshakeHeap, ESP.freeHeap);
+    ESP.freeHeap -= mHeapTaken;
+    return 1;
+  }
+
+  void stop() override
+  {
+    ESP.freeHeap += mHeapTaken;
+    mHeapTaken = 0;
+    WiFiClient::stop();
+  }
+
+  bool verify(const char* fingerprint, const char*)
+  {
+    HostTls::verifyCount++;
+    return fingerprint[0] != '0';
+  }
+
+private:
+  uint32_t mHeapTaken;
+};
+
+#endif
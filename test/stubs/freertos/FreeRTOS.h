@@ -0,0 +1,161 @@
+#ifndef HOST_STUB_FREERTOS_H
+#define HOST_STUB_FREERTOS_H
+
+/*
+  FreeRTOS on top of std::thread: a task is a detached thread, the recursive mutex a std::recursive_mutex,
+  a queue a std::deque under a std::mutex and a critical section a std::mutex. A deleted task stops at its next
+  vTaskDelay() or taskYIELD(), its thread is parked forever since a std::thread can't be killed.
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+typedef void* QueueHandle_t;
+typedef void* SemaphoreHandle_t;
+typedef void* TaskHandle_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdFALSE 0
+#define pdTRUE 1
+#define pdPASS 1
+#define portMAX_DELAY 0xFFFFFFFF
+
+struct portMUX_TYPE { std::mutex mutex; };
+#define portMUX_INITIALIZE(mux) ((void)(mux))
+#define portENTER_CRITICAL(mux) (mux)->mutex.lock()
+#define portEXIT_CRITICAL(mux) (mux)->mutex.unlock()
+
+// Items are copied in and out, a binary semaphore is a queue of a single empty item. A tick is a millisecond.
+struct HostQueue
+{
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::deque<std::vector<uint8_t> > items;
+  size_t capacity;
+  size_t itemSize;
+
+  HostQueue(size_t capacity, size_t itemSize) : capacity(capacity), itemSize(itemSize) {}
+
+  template <typename Predicate>
+  bool wait(std::unique_lock<std::mutex> &lock, TickType_t ticks, Predicate predicate)
+  {
+    if (ticks != portMAX_DELAY)
+      return changed.wait_for(lock, std::chrono::milliseconds(ticks), predicate);
+    changed.wait(lock, predicate);
+    return true;
+  }
+
+  BaseType_t send(const void* item, TickType_t ticks)
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!wait(lock, ticks, [this]() { return items.size() < capacity; }))
+      return pdFALSE;
+    items.push_back(std::vector<uint8_t>((const uint8_t*)item, (const uint8_t*)item + itemSize));
+    changed.notify_all();
+    return pdTRUE;
+  }
+
+  BaseType_t receive(void* item, TickType_t ticks)
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!wait(lock, ticks, [this]() { return !items.empty(); }))
+      return pdFALSE;
+    if (itemSize > 0)
+      memcpy(item, items.front().data(), itemSize);
+    items.pop_front();
+    changed.notify_all();
+    return pdTRUE;
+  }
+};
+
+inline QueueHandle_t xQueueCreate(int length, int itemSize) { return new HostQueue(length, itemSize); }
+inline BaseType_t xQueueSend(QueueHandle_t queue, const void* item, TickType_t ticks) { return ((HostQueue*)queue)->send(item, ticks); }
+inline BaseType_t xQueueReceive(QueueHandle_t queue, void* item, TickType_t ticks) { return ((HostQueue*)queue)->receive(item, ticks); }
+inline void vQueueDelete(QueueHandle_t queue) { delete (HostQueue*)queue; }
+inline SemaphoreHandle_t xSemaphoreCreateBinary() { return new HostQueue(1, 0); }
+inline BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore) { uint8_t none = 0; return ((HostQueue*)semaphore)->send(&none, 0); }
+inline BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks) { uint8_t none = 0; return ((HostQueue*)semaphore)->receive(&none, ticks); }
+
+inline SemaphoreHandle_t xSemaphoreCreateRecursiveMutex() { return new std::recursive_mutex(); }
+inline BaseType_t xSemaphoreTakeRecursive(SemaphoreHandle_t mutex, TickType_t) { ((std::recursive_mutex*)mutex)->lock(); return pdTRUE; }
+inline BaseType_t xSemaphoreGiveRecursive(SemaphoreHandle_t mutex) { ((std::recursive_mutex*)mutex)->unlock(); return pdTRUE; }
+
+// Kept, a deleted task may still be waiting on it
+inline void vSemaphoreDelete(SemaphoreHandle_t mutex)
+{
+  static std::vector<SemaphoreHandle_t>* deletedMutexes = new std::vector<SemaphoreHandle_t>(); // Never destroyed, so they stay reachable at exit
+  deletedMutexes->push_back(mutex);
+}
+
+struct HostTask
+{
+  std::atomic<bool> deleted;
+  HostTask() : deleted(false) {}
+};
+extern thread_local HostTask* hostCurrentTask; // NULL on the main thread
+
+inline TaskHandle_t xTaskGetCurrentTaskHandle()
+{
+  static HostTask mainTask;
+  return hostCurrentTask != NULL ? hostCurrentTask : &mainTask;
+}
+
+inline BaseType_t xTaskCreatePinnedToCore(void (*function)(void*), const char*, uint32_t, void* parameter, UBaseType_t, TaskHandle_t* handle, BaseType_t)
+{
+  HostTask* task = new HostTask();
+  if (handle != NULL)
+    *handle = task;
+
+  // A task that returns is freed unless its handle was taken, vTaskDelete() may still be given it
+  bool owned = handle == NULL;
+  std::thread([function, parameter, task, owned]()
+  {
+    hostCurrentTask = task;
+    function(parameter);
+    if (owned)
+      delete task;
+  }).detach();
+  return pdPASS;
+}
+
+inline BaseType_t xTaskCreate(void (*function)(void*), const char* name, uint32_t stackSize, void* parameter, UBaseType_t priority, TaskHandle_t* handle)
+{
+  return xTaskCreatePinnedToCore(function, name, stackSize, parameter, priority, handle, 0);
+}
+
+inline void vTaskDelete(TaskHandle_t task)
+{
+  if (task != NULL)
+    ((HostTask*)task)->deleted = true;
+}
+
+// Checked after waiting, as the task may have been deleted meanwhile
+inline void hostParkIfDeleted()
+{
+  if (hostCurrentTask != NULL && hostCurrentTask->deleted)
+    for (;;)
+      std::this_thread::sleep_for(std::chrono::seconds(1));
+}
+
+inline void vTaskDelay(TickType_t)
+{
+  std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  hostParkIfDeleted();
+}
+
+inline void taskYIELD()
+{
+  std::this_thread::yield();
+  hostParkIfDeleted();
+}
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef HOST_STUB_LWIP_DNS_H
+#define HOST_STUB_LWIP_DNS_H
+
+#include <stdint.h>
+
+typedef int8_t err_t;
+#define ERR_OK 0
+#define ERR_INPROGRESS -5
+#define ERR_ARG -16
+
+struct ip4_addr_t { uint32_t addr; };
+struct ip_addr_t { ip4_addr_t ip4; };
+#define ip_2_ip4(a) (&(a)->ip4)
+#define ip4_addr_get_u32(a) ((a)->addr)
+#define IP_IS_V4(a) 1
+
+typedef void (*dns_found_callback)(const char* name, const ip_addr_t* address, void* arg);
+
+// Resolver stand-in: answers from its cache, leaves the lookup pending until a test calls the callback, or fails
+struct HostDns
+{
+  enum Mode { CACHED, PENDING, FAILING };
+  static Mode mode;
+  static int lookupCount;
+  static dns_found_callback pendingCallback;
+  static void* pendingArg;
+
+  static void reset();
+};
+
+inline err_t dns_gethostbyname(const char* host, ip_addr_t* address, dns_found_callback callback, void* arg)
+{
+  HostDns::lookupCount++;
+  if (HostDns::mode == HostDns::CACHED)
+  {
+    address->ip4.addr = 0x04030201;
+    return ERR_OK;
+  }
+  if (HostDns::mode == HostDns::PENDING)
+  {
+    HostDns::pendingCallback = callback;
+    HostDns::pendingArg = arg;
+    return ERR_INPROGRESS;
+  }
+  return ERR_ARG;
+}
+
+#endif
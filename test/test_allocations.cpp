@@ -0,0 +1,229 @@
+#include "EspMQTTClient.h"
+#include "TestSupport.h"
+#include <malloc.h>
+#include <new>
+
+/*
+  Counts the heap allocations made by publish() and loop() once the client is running: a topic built in a
+  MqttTopicBuffer, a payload formatted on the stack, raw subscriptions and a publish policy must not allocate.
+  The bytes in use are followed too, to report the peak of the heap while connecting, subscribing and dispatching,
+  and to check that large messages are streamed without a heap copy of their payload.
+  malloc() and operator new are replaced, so this test is built without the sanitizers, which replace them too.
+*/
+
+static bool countAllocations = false;
+static long allocationCount = 0;
+static long heapBytes = 0;
+static long peakHeapBytes = 0;
+
+static void allocated(void* pointer)
+{
+  if (pointer == NULL)
+    return;
+  heapBytes += malloc_usable_size(pointer);
+  if (heapBytes > peakHeapBytes)
+    peakHeapBytes = heapBytes;
+}
+
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t count, size_t size);
+extern "C" void* __libc_realloc(void* pointer, size_t size);
+extern "C" void __libc_free(void* pointer);
+
+extern "C" void* malloc(size_t size)
+{
+  if (countAllocations)
+    allocationCount++;
+  void* pointer = __libc_malloc(size);
+  allocated(pointer);
+  return pointer;
+}
+
+extern "C" void* calloc(size_t count, size_t size)
+{
+  if (countAllocations)
+    allocationCount++;
+  void* pointer = __libc_calloc(count, size);
+  allocated(pointer);
+  return pointer;
+}
+
+extern "C" void* realloc(void* pointer, size_t size)
+{
+  if (countAllocations)
+    allocationCount++;
+  size_t previousSize = pointer != NULL ? malloc_usable_size(pointer) : 0;
+  void* newPointer = __libc_realloc(pointer, size);
+  if (newPointer != NULL || size == 0)
+    heapBytes -= previousSize;
+  allocated(newPointer);
+  return newPointer;
+}
+
+extern "C" void free(void* pointer)
+{
+  if (pointer != NULL)
+    heapBytes -= malloc_usable_size(pointer);
+  __libc_free(pointer);
+}
+
+void* operator new(size_t size)
+{
+  void* pointer = malloc(size);
+  if (pointer == NULL)
+    throw std::bad_alloc();
+  return pointer;
+}
+
+void* operator new[](size_t size)
+{
+  return operator new(size);
+}
+
+void operator delete(void* pointer) noexcept
+{
+  free(pointer);
+}
+
+void operator delete[](void* pointer) noexcept
+{
+  free(pointer);
+}
+
+// Zero would mean nothing if the replacements were not called, or if they lost track of the bytes
+static void testCounting()
+{
+  allocationCount = 0;
+  long startBytes = heapBytes;
+  countAllocations = true;
+  String text = "a string longer than the small string buffer";
+  std::vector<int>* vector = new std::vector<int>(16);
+  countAllocations = false;
+  CHECK(heapBytes >= startBytes + 16 * (long)sizeof(int) + (long)text.length());
+  delete vector;
+  CHECK(allocationCount >= 2 && heapBytes < peakHeapBytes);
+}
+
+static void testSteadyState()
+{
+  HostNetwork::reset();
+  EspMQTTClient client("broker", 1883, "dev");
+  client.enableDebuggingMessages(false);
+  long receivedBytes = 0;
+  client.subscribe("cmd/+", [&](const char* topic, const uint8_t* payload, size_t length) { receivedBytes += length; });
+  MqttPublishPolicy policy;
+  policy.minInterval = 5;
+  client.setPublishPolicy("dev/+/+", policy);
+  connectClient(client);
+
+  // The broker input and output grow outside of the measure
+  HostNetwork::out.reserve(1 << 20);
+  for (int i = 0 ; i < 2000 ; i++)
+    brokerSendPublish("cmd/x", 20, 'a');
+
+  // The first round warms up what is allocated once, the second one is measured
+  MqttTopicBuffer<32> topic("dev");
+  char payload[16];
+  for (int round = 0 ; round < 2 ; round++)
+  {
+    HostNetwork::out.clear();
+    allocationCount = 0;
+    countAllocations = round == 1;
+    for (int i = 0 ; i < 1000 ; i++)
+    {
+      topic.truncate(3).appendLevel("sensor").appendLevel(i % 4);
+      int length = snprintf(payload, sizeof(payload), "%d", i);
+      client.publish(topic, (const uint8_t*)payload, length);
+      client.loop();
+      hostMillis += 1;
+    }
+    countAllocations = false;
+  }
+
+  printf("%ld allocations for 1000 publishes and loops, %ld bytes received, %u bytes sent\n",
+    allocationCount, receivedBytes, (unsigned int)HostNetwork::out.size());
+  CHECK(receivedBytes == 2000 * 20 && HostNetwork::out.size() > 0);
+  CHECK(allocationCount == 0);
+}
+
+// Growth of the heap, from the bytes in use when the measure starts to the highest point reached
+static long peakFrom(long startBytes)
+{
+  return peakHeapBytes - startBytes;
+}
+
+static long startPeak()
+{
+  peakHeapBytes = heapBytes;
+  return heapBytes;
+}
+
+static void testPeakHeap()
+{
+  const size_t largeLength = 16 * 1024;
+
+  HostNetwork::reset();
+  HostNetwork::out.reserve(1 << 20);
+  long start = startPeak();
+  EspMQTTClient client("broker", 1883, "dev");
+  client.enableDebuggingMessages(false);
+  connectClient(client);
+  long connectPeak = peakFrom(start);
+
+  start = startPeak();
+  long receivedBytes = 0;
+  size_t streamedBytes = 0;
+  client.subscribe("cmd/+", [&](const char* topic, const uint8_t* payload, size_t length) { receivedBytes += length; });
+  client.subscribe("cfg/value", [&](const String &payload) { receivedBytes += payload.length(); });
+  MessageStreamCallbacks callbacks;
+  callbacks.onChunk = [&](const uint8_t* data, size_t length) { streamedBytes += length; };
+  client.subscribe("blob/#", callbacks);
+  for (int i = 0 ; i < 10 && HostNetwork::out.size() < 3 * 5 ; i++)
+    client.loop();
+  long subscribePeak = peakFrom(start);
+
+  // The broker input is queued before the measure
+  for (int i = 0 ; i < 100 ; i++)
+  {
+    brokerSendPublish("cmd/x", 20, 'a');
+    brokerSendPublish("cfg/value", 50, 'b');
+  }
+  brokerSendPublish("blob/image", largeLength, 'c');
+  start = startPeak();
+  for (int i = 0 ; i < 1000 && !HostNetwork::in.empty() ; i++)
+    client.loop();
+  client.loop();
+  long dispatchPeak = peakFrom(start);
+  CHECK(receivedBytes == 100 * (20 + 50) && streamedBytes == largeLength);
+
+  // Streamed publish, from a buffer written in parts and from a producer
+  std::vector<uint8_t> part(1024, 'd');
+  start = startPeak();
+  CHECK(client.beginPublish("dev/image", largeLength));
+  for (size_t written = 0 ; written < largeLength ; written += part.size())
+    CHECK(client.write(part.data(), part.size()) == part.size());
+  CHECK(client.endPublish());
+  CHECK(client.publish("dev/image", largeLength, [](uint8_t* buffer, size_t maxLength) {
+    memset(buffer, 'e', maxLength);
+    return maxLength;
+  }));
+  long publishPeak = peakFrom(start);
+  CHECK(HostNetwork::out.size() > 2 * largeLength);
+
+  printf("Peak of the heap: connect %ld bytes, subscribe %ld bytes, dispatch %ld bytes with a %u bytes stream, "
+    "streamed publish of %u bytes %ld bytes\n", connectPeak, subscribePeak, dispatchPeak, (unsigned int)largeLength,
+    (unsigned int)largeLength, publishPeak);
+
+  // Messages larger than the packet buffer never get a heap copy of their payload
+  CHECK(dispatchPeak < (long)largeLength / 4);
+  CHECK(publishPeak < (long)largeLength / 4);
+}
+
+int main()
+{
+  testCounting();
+  testSteadyState();
+  testPeakHeap();
+  puts("test_allocations passed");
+  return 0;
+}
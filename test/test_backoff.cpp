@@ -0,0 +1,95 @@
+#include "ExponentialBackoff.h"
+#include "TestSupport.h"
+
+/*
+  Many instances drawing their delays from a seeded random(), as many devices retrying at the same time would:
+  the delays of each attempt must spread over the whole window, and never go past the maximum delay.
+*/
+
+static const int INSTANCE_COUNT = 500;
+
+// Window of full jitter of the attempt, from minDelay
+static unsigned long windowOf(unsigned int attempt, unsigned long initialDelay, unsigned long maxDelay)
+{
+  unsigned long window = initialDelay;
+  for (unsigned int i = 0 ; i < attempt && window < maxDelay ; i++)
+    window = window > maxDelay / 2 ? maxDelay : window * 2;
+  return window;
+}
+
+static void testJitterSpread()
+{
+  const unsigned long initialDelay = 1000;
+  const unsigned long maxDelay = 60000;
+  const unsigned long minDelay = 200;
+  std::vector<ExponentialBackoff> instances(INSTANCE_COUNT, ExponentialBackoff(initialDelay, maxDelay, minDelay));
+
+  for (unsigned int attempt = 0 ; attempt < 12 ; attempt++)
+  {
+    unsigned long window = windowOf(attempt, initialDelay, maxDelay);
+    int quarters[4] = { 0, 0, 0, 0 };
+    double total = 0;
+    for (int i = 0 ; i < INSTANCE_COUNT ; i++)
+    {
+      unsigned long delay = instances[i].nextDelay();
+      CHECK(delay >= minDelay && delay <= window && delay <= maxDelay);
+      quarters[(delay - minDelay) * 4 / (window - minDelay + 1)]++;
+      total += delay;
+    }
+
+    // Each quarter of the window gets a fair share of the instances, the mean is near its middle
+    for (int quarter = 0 ; quarter < 4 ; quarter++)
+      CHECK(quarters[quarter] > INSTANCE_COUNT / 4 / 2);
+    double middle = (minDelay + window) / 2.0;
+    CHECK(total / INSTANCE_COUNT > middle * 0.9 && total / INSTANCE_COUNT < middle * 1.1);
+  }
+  CHECK(instances[0].attempts() == 12);
+}
+
+static void testReset()
+{
+  std::vector<ExponentialBackoff> instances(INSTANCE_COUNT, ExponentialBackoff(1000, 60000, 200));
+  for (int i = 0 ; i < INSTANCE_COUNT ; i++)
+  {
+    for (int attempt = 0 ; attempt < 20 ; attempt++)
+      instances[i].nextDelay();
+
+    // Back to the first window once connected
+    instances[i].reset();
+    CHECK(instances[i].attempts() == 0);
+    unsigned long delay = instances[i].nextDelay();
+    CHECK(delay >= 200 && delay <= 1000);
+  }
+
+  // Without room for jitter, the delay is the minimum delay
+  ExponentialBackoff backoff(100, 100, 500);
+  for (int attempt = 0 ; attempt < 5 ; attempt++)
+    CHECK(backoff.nextDelay() == 500);
+  backoff.reset();
+  CHECK(backoff.nextDelay() == 500);
+}
+
+// The window stops at the maximum delay, however many attempts failed
+static void testMaxDelay()
+{
+  ExponentialBackoff backoff(1000, 24 * 3600 * 1000UL + 1);
+  unsigned long previous = 0;
+  for (int attempt = 0 ; attempt < 100 ; attempt++)
+  {
+    unsigned long window = windowOf(attempt, 1000, backoff.maxDelay());
+    CHECK(window >= previous && window <= backoff.maxDelay());
+    CHECK(backoff.nextDelay() <= window);
+    previous = window;
+  }
+  CHECK(previous == backoff.maxDelay());
+}
+
+int main()
+{
+  randomSeed(20261016);
+  testJitterSpread();
+  testReset();
+  testMaxDelay();
+  puts("test_backoff passed");
+  return 0;
+}
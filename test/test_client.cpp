@@ -0,0 +1,741 @@
+#include "EspMQTTClient.h"
+#include "TestSupport.h"
+#include <algorithm>
+#include <chrono>
+#include <FS.h>
+#include <Update.h>
+
+/*
+  EspMQTTClient against the host network: the tests play the broker, reading the packets the client writes
+  and sending it theirs. millis() only moves when a test advances hostMillis.
+*/
+
+static void resetHost()
+{
+  HostNetwork::reset();
+  HostTls::reset();
+  HostDns::reset();
+  hostMillis += 100000; // Past the retry delays of the previous test
+}
+
+// Packet id of the QoS 1 PUBLISH starting at offset of the bytes sent
+static uint16_t sentPacketId(size_t offset)
+{
+  const std::vector<uint8_t> &out = HostNetwork::out;
+  size_t topicOffset = offset + 2;
+  CHECK((out[offset] & 0x06) == MQTTQOS1 && out[offset + 1] < 0x80);
+  size_t topicLength = (out[topicOffset] << 8) | out[topicOffset + 1];
+  return (out[topicOffset + 2 + topicLength] << 8) | out[topicOffset + 3 + topicLength];
+}
+
+static void testDispatch()
+{
+  resetHost();
+  EspMQTTClient client("broker", 1883, "dispatch");
+  std::vector<std::string> received;
+  client.subscribe("a/+", [&](const String &payload) { received.push_back(std::string("a/+ ") + payload.c_str()); });
+  client.subscribe("a/b", [&](const String &topic, const String &payload) { received.push_back(std::string(topic.c_str()) + " " + payload.c_str()); });
+  client.subscribe("#", [&](const char* topic, const uint8_t* payload, size_t length) { received.push_back(std::string("# ") + std::string((const char*)payload, length)); });
+  connectClient(client);
+
+  brokerSendPublish("a/b", 2, 'h');
+  client.loop();
+  CHECK(received.size() == 3);
+  std::sort(received.begin(), received.end());
+  CHECK(received == std::vector<std::string>({ "# hh", "a/+ hh", "a/b hh" }));
+
+  received.clear();
+  CHECK(client.unsubscribe("a/+"));
+  CHECK(!client.unsubscribe("a/+"));
+  brokerSendPublish("a/b", 1, 'x');
+  client.loop();
+  CHECK(received.size() == 2);
+
+  received.clear();
+  brokerSendPublish("c", 1, 'x');
+  client.loop();
+  CHECK(received == std::vector<std::string>({ "# x" }));
+}
+
+// Callbacks changing the subscriptions of the message being dispatched, run under AddressSanitizer
+static void testBinaryPayload()
+{
+  resetHost();
+  EspMQTTClient client("broker", 1883, "binary");
+  std::vector<std::string> received;
+  client.subscribe("bin", [&](const String &payload) { received.push_back(std::string(payload.c_str(), payload.length())); });
+  connectClient(client);
+
+  // The String given to the callbacks keeps the NUL bytes of the payload
+  const uint8_t payload[5] = { 'a', 0, 'b', 0, 'c' };
+  brokerSendPublish("bin", payload, sizeof(payload));
+  brokerSendPublish("bin", payload, 0);
+  client.loop();
+  client.loop();
+  CHECK(received == std::vector<std::string>({ std::string("a\0b\0c", 5), "" }));
+}
+
+static void testSubscribeFromCallback()
+{
+  resetHost();
+  EspMQTTClient client("broker", 1883, "resubscribe");
+  std::vector<std::string> received;
+  std::string label(64, 's'); // Captured by copy, freed if the running callback is destroyed
+
+  client.subscribe("s/self", [&client, &received, label](const String &payload) {
+    client.unsubscribe("s/self");
+    received.push_back(label.substr(0, 4) + " self");
+  });
+  client.subscribe("s/+", [&client, &received, label](const String &payload) {
+    client.unsubscribe("s/#");
+    client.subscribe("s/+", [&received](const String &payload) { received.push_back("s/+ replaced"); });
+    received.push_back(label.substr(0, 4) + " s/+");
+  });
+  client.subscribe("s/#", [&received](const String &payload) { received.push_back("s/#"); });
+  connectClient(client);
+
+  brokerSendPublish("s/self", 1, 'x');
+  client.loop();
+  std::sort(received.begin(), received.end());
+  CHECK(received.size() >= 2 && received.size() <= 3);
+  CHECK(received[received.size() - 2] == "ssss s/+" && received.back() == "ssss self");
+  CHECK(!client.unsubscribe("s/self") && !client.unsubscribe("s/#"));
+
+  received.clear();
+  brokerSendPublish("s/self", 1, 'x');
+  client.loop();
+  CHECK(received == std::vector<std::string>({ "s/+ replaced" }));
+
+  // Unsubscribed and subscribed again by its own callback, the broker sees both
+  client.subscribe("r", [&](const String &payload) {
+    client.unsubscribe("r");
+    client.subscribe("r", [&received](const String &payload) { received.push_back("r again"); });
+    received.push_back(label.substr(0, 4) + " r");
+  });
+  HostNetwork::out.clear();
+  received.clear();
+  brokerSendPublish("r", 1, 'x');
+  client.loop();
+  CHECK(received == std::vector<std::string>({ "ssss r" }));
+  CHECK(HostNetwork::out.size() == 2 * (2 + 2 + 1));
+  CHECK(HostNetwork::out[0] == ((MQTTUNSUBSCRIBE) | MQTTQOS1) && HostNetwork::out[5] == ((MQTTSUBSCRIBE) | MQTTQOS1));
+
+  received.clear();
+  brokerSendPublish("r", 1, 'x');
+  client.loop();
+  CHECK(received == std::vector<std::string>({ "r again" }));
+  CHECK(client.unsubscribe("r") && client.unsubscribe("s/+") && !client.unsubscribe("s/+"));
+}
+
+static void testSubscriptionsMemoryUsage()
+{
+  resetHost();
+  EspMQTTClient small("broker", 1883, "small");
+  EspMQTTClient large("broker", 1883, "large");
+  small.setMaxTopicSubscriptions(2);
+  const char* topics[2] = { "home/livingroom/temperature", "home/+/light/#" };
+  size_t smallUsage[3];
+  size_t largeUsage[3];
+
+  // The table is sized by the capacity, the topics and the trie nodes grow with each subscription
+  for (int i = 0 ; i < 3 ; i++)
+  {
+    smallUsage[i] = small.getSubscriptionsMemoryUsage();
+    largeUsage[i] = large.getSubscriptionsMemoryUsage();
+    if (i < 2)
+    {
+      CHECK(small.subscribe(topics[i], [](const String &payload) {}));
+      CHECK(large.subscribe(topics[i], [](const String &payload) {}));
+    }
+  }
+  CHECK(smallUsage[0] < smallUsage[1] && smallUsage[1] < smallUsage[2]);
+  CHECK(largeUsage[2] - largeUsage[0] == smallUsage[2] - smallUsage[0]);
+  size_t recordSize = (largeUsage[0] - smallUsage[0]) / (MAX_TOPIC_SUBSCRIPTION_LIST_SIZE - 2);
+  CHECK(largeUsage[0] - smallUsage[0] == recordSize * (MAX_TOPIC_SUBSCRIPTION_LIST_SIZE - 2));
+  CHECK(!small.subscribe("third", [](const String &payload) {}) && small.getSubscriptionsMemoryUsage() == smallUsage[2]);
+
+  // And shrink back when they are unsubscribed, in any order
+  CHECK(small.unsubscribe(topics[0]));
+  CHECK(small.getSubscriptionsMemoryUsage() < smallUsage[2]);
+  CHECK(small.unsubscribe(topics[1]));
+  CHECK(small.getSubscriptionsMemoryUsage() == smallUsage[0]);
+  CHECK(large.unsubscribe(topics[1]) && large.getSubscriptionsMemoryUsage() == largeUsage[1]);
+
+  printf("%u bytes per record, 2 subscriptions: %u bytes with a table of 2, %u bytes with a table of %d\n",
+    (unsigned int)recordSize, (unsigned int)smallUsage[2], (unsigned int)largeUsage[2], MAX_TOPIC_SUBSCRIPTION_LIST_SIZE);
+}
+
+static void testConnection()
+{
+  resetHost();
+  EspMQTTClient client("broker", 1883, "user", "pass", "conn");
+  int established = 0;
+  client.setOnConnectionEstablishedCallback([&]() { established++; });
+  client.subscribe("a/b", [](const String &payload) {});
+
+  // The CONNECT packet is written without waiting for the CONNACK
+  for (int i = 0 ; i < 5 ; i++)
+  {
+    client.loop();
+    hostMillis += 10;
+  }
+  CHECK(HostNetwork::connectCount == 1 && !client.isMqttConnected());
+  CHECK(HostNetwork::out.size() > 0 && HostNetwork::out[0] == MQTTCONNECT);
+  std::string connect = sentBytes();
+  CHECK(connect.find("conn") != std::string::npos && connect.find("user") != std::string::npos);
+
+  HostNetwork::out.clear();
+  brokerSendConnack();
+  client.loop();
+  CHECK(client.isMqttConnected() && established == 1);
+  CHECK(HostNetwork::out.size() > 0 && HostNetwork::out[0] == (MQTTSUBSCRIBE | MQTTQOS1)); // Subscriptions sent again
+
+  // The broker never answers the next CONNECT: the connection is closed after the timeout
+  HostNetwork::isConnected = false;
+  client.loop();
+  CHECK(!client.isMqttConnected());
+  hostMillis += 11000;
+  for (int i = 0 ; i < 4 ; i++)
+  {
+    client.loop();
+    hostMillis += 10;
+  }
+  CHECK(HostNetwork::connectCount == 2 && HostNetwork::isConnected);
+  hostMillis += 16000;
+  client.loop();
+  CHECK(!HostNetwork::isConnected && established == 1);
+}
+
+// Longest loop() in each step of the connection, against a broker that accepts the socket but never answers
+static void testConnectionLoopLatency()
+{
+  resetHost();
+  EspMQTTClient client("broker.local", 1883, "latency");
+  client.enableDebuggingMessages(false);
+  HostDns::mode = HostDns::PENDING; // For the first attempt, the next ones use the cached address
+
+  // Seconds were spent in PubSubClient::connect() against such a broker, this leaves room for the host scheduler
+  static const double MAX_LOOP_MICROS = 20000;
+  enum { RESOLVING, CONNECTING, WAITING_CONNACK, STEP_COUNT };
+  const char* stepNames[STEP_COUNT] = { "resolving", "connecting", "waiting CONNACK" };
+  double maxMicros[STEP_COUNT] = { 0, 0, 0 };
+  long loopCounts[STEP_COUNT] = { 0, 0, 0 };
+
+  // Three connection attempts, each one closed by the CONNACK timeout
+  for (int i = 0 ; HostNetwork::connectCount < 3 || HostNetwork::isConnected ; i++)
+  {
+    CHECK(i < 10000);
+    int connectCount = HostNetwork::connectCount;
+    bool waitingConnack = HostNetwork::isConnected;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    client.loop();
+    double micros = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+    CHECK(!client.isMqttConnected());
+
+    int step = -1;
+    if (HostNetwork::connectCount != connectCount)
+      step = CONNECTING;
+    else if (waitingConnack)
+      step = WAITING_CONNACK;
+    else if (HostDns::pendingCallback != NULL)
+      step = RESOLVING;
+    if (step >= 0)
+    {
+      maxMicros[step] = std::max(maxMicros[step], micros);
+      loopCounts[step]++;
+    }
+
+    // The lookup answers after a second
+    if (HostDns::pendingCallback != NULL && loopCounts[RESOLVING] == 10)
+    {
+      ip_addr_t address;
+      address.ip4.addr = 0x0100007F;
+      dns_found_callback callback = HostDns::pendingCallback;
+      HostDns::pendingCallback = NULL;
+      callback("broker.local", &address, HostDns::pendingArg);
+    }
+    hostMillis += 100;
+  }
+
+  // The socket is opened at once on the host, on a device connect() can also take up to MQTT_TCP_CONNECT_TIMEOUT
+  for (int step = 0 ; step < STEP_COUNT ; step++)
+  {
+    printf("%-16s %5ld loops, longest %.1f us\n", stepNames[step], loopCounts[step], maxMicros[step]);
+    CHECK(loopCounts[step] > 0 && maxMicros[step] < MAX_LOOP_MICROS);
+  }
+  CHECK(loopCounts[CONNECTING] == 3 && loopCounts[WAITING_CONNACK] >= 3 * MQTT_SOCKET_TIMEOUT * 10 - 3);
+}
+
+static void testStreamedPublish()
+{
+  resetHost();
+  EspMQTTClient client("broker", 1883, "stream");
+  connectClient(client);
+
+  // Header of 2 + 3 bytes, a topic of 2 + 3
+  uint8_t data[200] = { 0 };
+  CHECK(client.beginPublish("big", 300));
+  CHECK(client.write(data, 200) == 200);
+  CHECK(client.write(data, 200) == 100);
+  CHECK(client.endPublish());
+  CHECK(HostNetwork::out.size() == 3 + 2 + 3 + 300);
+
+  HostNetwork::out.clear();
+  size_t produced = 0;
+  CHECK(client.publish("big", 1000, [&](uint8_t* buffer, size_t maxLength) {
+    memset(buffer, 'x', maxLength);
+    produced += maxLength;
+    return maxLength;
+  }));
+  CHECK(produced == 1000 && HostNetwork::out.size() == 3 + 2 + 3 + 1000);
+
+  // A streamed publish left incomplete closes the connection
+  CHECK(client.beginPublish("big", 10));
+  client.write(data, 5);
+  client.loop();
+  CHECK(!HostNetwork::isConnected);
+  CHECK(client.getMetrics().publishFailures == 1 && client.getMetrics().messagesOut == 2);
+}
+
+static void testStreamedReceive()
+{
+  resetHost();
+  EspMQTTClient client("broker", 1883, "receive");
+  std::string small;
+  std::string large;
+  std::string largeTopic;
+  size_t largeLength = 0;
+  int completed = 0;
+  int aborted = 0;
+  client.subscribe("small", [&](const String &payload) { small = payload.c_str(); });
+  MessageStreamCallbacks callbacks;
+  callbacks.onBegin = [&](const char* topic, size_t length) { largeTopic = topic; largeLength = length; large.clear(); };
+  callbacks.onChunk = [&](const uint8_t* data, size_t length) { large.append((const char*)data, length); };
+  callbacks.onEnd = [&](bool complete) { if (complete) completed++; else aborted++; };
+  CHECK(client.subscribe("blob/#", callbacks));
+  connectClient(client);
+
+  // Stream subscriptions receive the messages of any size, the others are unchanged
+  brokerSendPublish("small", 5, 's');
+  brokerSendPublish("blob/a", 1000, 'b');
+  brokerSendPublish("small", 3, 't');
+  brokerSendPublish("blob/b", 10, 'c');
+  for (int i = 0 ; i < 10 ; i++)
+    client.loop();
+  CHECK(small == "ttt" && completed == 2);
+  CHECK(largeTopic == "blob/b" && large == std::string(10, 'c'));
+
+  brokerSendPublish("blob/c", 2000, 'd');
+  HostNetwork::in.resize(HostNetwork::in.size() - 500);
+  client.loop();
+  client.loop();
+  CHECK(large.size() == 1500 && largeLength == 2000 && aborted == 0);
+  HostNetwork::isConnected = false;
+  client.loop();
+  CHECK(aborted == 1);
+}
+
+static std::vector<uint8_t> firmwareChunk(uint32_t offset, size_t length)
+{
+  std::vector<uint8_t> chunk = { (uint8_t)(offset >> 24), (uint8_t)(offset >> 16), (uint8_t)(offset >> 8), (uint8_t)offset };
+  chunk.insert(chunk.end(), length, 0xAB);
+  return chunk;
+}
+
+static void testOtaUpdate()
+{
+  resetHost();
+  EspMQTTClient client("broker", 1883, "ota");
+  client.enableMqttOtaUpdate();
+  connectClient(client);
+
+  std::string begin = "5000 0123456789abcdef0123456789abcdef";
+  brokerSendPublish("ota/ota/begin", (const uint8_t*)begin.data(), begin.size());
+  client.loop();
+
+  // Chunks out of order are ignored, the sender sends them again from the expected offset
+  std::vector<std::vector<uint8_t> > chunks = { firmwareChunk(0, 2000), firmwareChunk(4000, 1000), firmwareChunk(2000, 2000), firmwareChunk(4000, 1000) };
+  for (size_t i = 0 ; i < chunks.size() ; i++)
+    brokerSendPublish("ota/ota/data", chunks[i].data(), chunks[i].size());
+  for (int i = 0 ; i < 10 ; i++)
+    client.loop();
+
+  CHECK(Update.written == 5000);
+  CHECK(sentBytes().find("succeeded") != std::string::npos);
+  int restartCount = ESP.restartCount;
+  hostMillis += 10000;
+  client.loop();
+  CHECK(ESP.restartCount == restartCount + 1);
+}
+
+static void testQos1()
+{
+  resetHost();
+  fs::FS fileSystem;
+  {
+    EspMQTTClient client("broker", 1883, "qos");
+    client.enableLastWillMessage("qos/will", "bye", true, 1);
+    client.enableQos1Publish(2, 512);
+    client.enableQos1Persistence(fileSystem);
+    client.enablePublishQueue(1024);
+
+    // Connect flags: clean session, will, will QoS 1 and will retain
+    for (int i = 0 ; i < 5 && !HostNetwork::isConnected ; i++)
+    {
+      client.loop();
+      hostMillis += 10;
+    }
+    CHECK(HostNetwork::out[9] == (0x02 | 0x04 | 0x08 | 0x20));
+    HostNetwork::out.clear();
+    brokerSendConnack();
+    client.loop();
+    CHECK(client.isMqttConnected());
+    HostNetwork::out.clear();
+
+    // The third message waits in the queue for room in the window
+    CHECK(client.publish("q/a", "one", false, 1));
+    CHECK(client.publish("q/a", "two", true, 1));
+    CHECK(client.publish("q/a", "three", false, 1));
+    CHECK(HostNetwork::out[0] == (MQTTPUBLISH | MQTTQOS1));
+    CHECK(client.getUnacknowledgedCount() == 2);
+    uint16_t firstId = sentPacketId(0);
+
+    // Acknowledged out of order
+    brokerSendPuback(firstId + 1);
+    client.loop();
+    CHECK(client.getUnacknowledgedCount() == 2);
+    CHECK(sentBytes().find("three") != std::string::npos);
+    brokerSendPuback(firstId);
+    client.loop();
+    CHECK(client.getUnacknowledgedCount() == 1);
+    CHECK(fileSystem.files["/mqtt_inflight"].size() > 0);
+
+    // The PUBLISH packets from the broker still reach PubSubClient
+    std::string received;
+    client.subscribe("in", [&](const String &payload) { received = payload.c_str(); });
+    brokerSendPublish("in", 3, 'z');
+    client.loop();
+    client.loop();
+    CHECK(received == "zzz");
+  }
+
+  // After a reboot the unacknowledged message is sent again, with the DUP flag
+  {
+    HostNetwork::reset();
+    EspMQTTClient client("broker", 1883, "qos");
+    client.enableQos1Publish(2, 512);
+    client.enableQos1Persistence(fileSystem);
+    CHECK(client.getUnacknowledgedCount() == 1);
+    for (int i = 0 ; i < 5 && !HostNetwork::isConnected ; i++)
+    {
+      client.loop();
+      hostMillis += 10;
+    }
+    HostNetwork::out.clear();
+    brokerSendConnack();
+    client.loop();
+    CHECK(client.isMqttConnected());
+    size_t offset = std::string(HostNetwork::out.begin(), HostNetwork::out.end()).find((char)(MQTTPUBLISH | MQTTQOS1 | 0x08));
+    CHECK(offset != std::string::npos);
+    brokerSendPuback(sentPacketId(offset));
+    client.loop();
+    CHECK(client.getUnacknowledgedCount() == 0 && fileSystem.files["/mqtt_inflight"].empty());
+  }
+}
+
+static void testSessions()
+{
+  resetHost();
+  EspMQTTClient* owner = new EspMQTTClient("broker", 1883, "owner");
+  EspMQTTClient first("broker2", 1883, "first");
+  EspMQTTClient second("broker3", 1883, "second");
+
+  // A timer set before addSession() stays on the session scheduler, the next ones go to the owner
+  int executions = 0;
+  first.executeDelayed(5, [&]() { executions += 1; });
+  owner->addSession(first);
+  first.executeDelayed(5, [&]() { executions += 10; });
+  owner->addSession(second);
+  second.executeDelayed(1, [&]() { executions += 100; });
+
+  for (int i = 0 ; i < 3 ; i++)
+  {
+    owner->loop();
+    hostMillis += 10;
+  }
+  CHECK(HostNetwork::connectCount == 3); // One connection per session, sharing the host network
+  CHECK(executions == 111);
+
+  // Once the owner is deleted the sessions handle their connection and timers again
+  delete owner;
+  second.executeDelayed(1, [&]() { executions += 1000; });
+  hostMillis += 10;
+  second.loop();
+  CHECK(executions == 1111);
+}
+
+static void testFailover()
+{
+  resetHost();
+  EspMQTTClient client("b1", 1883, "failover");
+  CHECK(client.addBroker("b2", 1884));
+  CHECK(client.addBroker("b3"));
+
+  HostNetwork::acceptConnections = false;
+  for (int i = 0 ; i < 4 ; i++)
+    client.loop();
+  CHECK(HostNetwork::connectCount == 1 && strcmp(client.getBrokerHost(), "b2") == 0);
+  client.loop();
+  client.loop();
+  CHECK(HostNetwork::connectCount == 2);
+
+  HostNetwork::acceptConnections = true;
+  for (int i = 0 ; i < 3 ; i++)
+    client.loop();
+  CHECK(strcmp(client.getBrokerHost(), "b3") == 0 && HostNetwork::connectCount == 3);
+  brokerSendConnack();
+  client.loop();
+  CHECK(client.isMqttConnected());
+}
+
+static void testDnsCache()
+{
+  resetHost();
+  EspMQTTClient client("broker.local", 1883, "dns");
+
+  // The lookup doesn't block loop()
+  HostDns::mode = HostDns::PENDING;
+  client.loop();
+  client.loop();
+  CHECK(HostDns::lookupCount == 1 && HostNetwork::connectCount == 0);
+  ip_addr_t address;
+  address.ip4.addr = 0x0100007F;
+  HostDns::pendingCallback("broker.local", &address, HostDns::pendingArg);
+  client.loop();
+  client.loop();
+  CHECK(HostNetwork::connectCount == 1 && (uint32_t)HostNetwork::lastAddress == 0x0100007F);
+
+  // Reconnecting uses the cached address
+  HostNetwork::isConnected = false;
+  client.loop();
+  for (int i = 0 ; i < 3 ; i++)
+  {
+    client.loop();
+    hostMillis += 10;
+  }
+  CHECK(HostDns::lookupCount == 1 && HostNetwork::connectCount == 2);
+
+  // Once expired the address is resolved again, and kept when DNS fails
+  HostNetwork::isConnected = false;
+  client.loop();
+  hostMillis += DNS_CACHE_TTL;
+  HostDns::mode = HostDns::FAILING;
+  for (int i = 0 ; i < 3 ; i++)
+  {
+    client.loop();
+    hostMillis += 10;
+  }
+  CHECK(HostDns::lookupCount == 2 && HostNetwork::connectCount == 3);
+  CHECK((uint32_t)HostNetwork::lastAddress == 0x0100007F);
+
+  // A lookup that never completes times out, the last known address being used
+  HostNetwork::isConnected = false;
+  client.loop();
+  client.setDnsCache(0, true);
+  HostDns::mode = HostDns::PENDING;
+  int connectCount = HostNetwork::connectCount;
+  for (int i = 0 ; i < 40 && HostNetwork::connectCount == connectCount ; i++)
+  {
+    client.loop();
+    hostMillis += 1000;
+  }
+  CHECK(HostDns::lookupCount >= 3 && HostNetwork::connectCount == connectCount + 1);
+}
+
+static void testTls()
+{
+  resetHost();
+  {
+    // Verified by fingerprint, which fails
+    EspMQTTClient client("broker.tls", 8883, "tls");
+    client.enableTls(NULL, "00bad");
+    for (int i = 0 ; i < 4 ; i++)
+    {
+      client.loop();
+      hostMillis += 10;
+    }
+    CHECK(HostNetwork::connectCount == 1 && !HostNetwork::isConnected);
+    CHECK(HostTls::insecure && HostTls::verifyCount == 1);
+    CHECK(strcmp(HostTls::host, "broker.tls") == 0 && client.getMetrics().tlsHandshakes == 0);
+  }
+
+  resetHost();
+  {
+    EspMQTTClient client("broker.tls", 8883, "tls");
+    client.enableTls("-----BEGIN CERTIFICATE-----", "ab");
+    for (int i = 0 ; i < 4 ; i++)
+    {
+      client.loop();
+      hostMillis += 10;
+    }
+    CHECK(HostNetwork::isConnected && HostTls::verifyCount == 0); // The CA certificate takes precedence over the fingerprint
+    CHECK(HostTls::caCert != NULL && client.getMetrics().tlsHandshakes == 1);
+  }
+
+  // The time and heap of each handshake are recorded, the ESP32 client can't resume the session
+  resetHost();
+  {
+    HostTls::handshakeMillis = 1200;
+    HostTls::handshakeHeap = 22000;
+    ESP.freeHeap = 150000;
+    EspMQTTClient client("broker.tls", 8883, "tls");
+    client.enableTls("-----BEGIN CERTIFICATE-----");
+    connectClient(client);
+    CHECK(client.getMetrics().lastTlsHandshakeMillis == 1200 && client.getMetrics().lastTlsHeapUsage == 22000);
+    CHECK(ESP.freeHeap == 150000 - 22000);
+
+    HostTls::handshakeMillis = 900;
+    HostNetwork::isConnected = false;
+    for (int i = 0 ; i < 1000 && client.getMetrics().tlsHandshakes < 2 ; i++)
+    {
+      client.loop();
+      hostMillis += 100;
+    }
+    CHECK(client.getMetrics().tlsHandshakes == 2 && client.getMetrics().tlsResumedHandshakes == 0);
+    CHECK(client.getMetrics().lastTlsHandshakeMillis == 900 && client.getMetrics().lastTlsHeapUsage == 22000);
+    CHECK(ESP.freeHeap == 150000 - 22000); // Given back when the first connection was closed
+  }
+  ESP.freeHeap = 0;
+}
+
+static void testPublishPolicy()
+{
+  resetHost();
+  EspMQTTClient client("broker", 1883, "policy");
+  MqttPublishPolicy policy;
+  policy.minInterval = 1000;
+  CHECK(client.setPublishPolicy("sensor/#", policy));
+  CHECK(!client.setPublishPolicy("bad/#/x", policy));
+  connectClient(client);
+
+  // The last value published during the interval is sent at its end
+  CHECK(client.publish("sensor/t", "1"));
+  size_t sent = HostNetwork::out.size();
+  for (int i = 2 ; i < 50 ; i++)
+    CHECK(client.publish("sensor/t", String(i)));
+  client.loop();
+  CHECK(HostNetwork::out.size() == sent);
+  hostMillis += 1000;
+  client.loop();
+  CHECK(HostNetwork::out.size() > sent);
+  CHECK(sentBytes().substr(sent).find("sensor/t49") != std::string::npos);
+  CHECK(client.getPublishPolicyStats().replaced == 47);
+}
+
+static void testRecordBatch()
+{
+  resetHost();
+  EspMQTTClient client("broker", 1883, "batch");
+  connectClient(client);
+
+  MqttRecordBatch batch;
+  CHECK(batch.begin(64));
+  for (int i = 0 ; i < 5 ; i++)
+  {
+    batch.beginRecord(1000 + i * 250);
+    batch.addFloat(21.5f + i);
+    CHECK(batch.endRecord());
+  }
+  size_t size = batch.size();
+
+  // Published in one message and cleared, an empty batch is not sent
+  CHECK(client.publish("tele", batch));
+  CHECK(batch.count() == 0 && batch.size() == MqttRecordBatch::HEADER_SIZE);
+  CHECK(HostNetwork::out.size() == 2 + 2 + 4 + size);
+  CHECK(client.publish("tele", batch));
+  CHECK(HostNetwork::out.size() == 2 + 2 + 4 + size);
+
+  // Nothing is sent nor cleared while a record is open, the record is completed afterwards
+  CHECK(batch.beginRecord(3000) && batch.addInt(7) && batch.endRecord());
+  CHECK(batch.beginRecord(3500) && batch.addInt(8));
+  CHECK(batch.isRecordOpen());
+  size_t failures = client.getMetrics().publishFailures;
+  CHECK(!client.publish("tele", batch));
+  CHECK(HostNetwork::out.size() == 2 + 2 + 4 + size && client.getMetrics().publishFailures == failures + 1);
+  CHECK(batch.endRecord() && !batch.isRecordOpen() && batch.count() == 2);
+  CHECK(client.publish("tele", batch) && batch.count() == 0);
+}
+
+static void testTopicBuffer()
+{
+  resetHost();
+  EspMQTTClient client("broker", 1883, "buffer");
+  connectClient(client);
+
+  // A topic buffer too small for its topic is not published
+  MqttTopicBuffer<8> topic("abc");
+  topic.appendLevel("defgh");
+  CHECK(!topic.isValid() && !client.publish(topic, "x"));
+  topic.truncate(3).appendLevel(0);
+  CHECK(strcmp(topic, "abc/0") == 0 && client.publish(topic, "x"));
+  CHECK(sentBytes().find("abc/0x") != std::string::npos);
+
+  // A char buffer and its length, the length is not taken as retain
+  HostNetwork::out.clear();
+  char payload[16];
+  int length = snprintf(payload, sizeof(payload), "%d", 42);
+  strcpy(payload + length + 1, "rest");
+  CHECK(client.publish(topic, payload, length));
+  CHECK(sentBytes() == std::string("\x30\x09\x00\x05" "abc/042", 11)); // Not retained
+}
+
+static void testTopicHandles()
+{
+  resetHost();
+  EspMQTTClient client("broker", 1883, "handles");
+  CHECK(client.setTopicPrefix("home/handles"));
+  MqttTopicHandle temperature = client.registerTopic("temp");
+  MqttTopicHandle humidity = client.registerTopic("hum");
+  CHECK(temperature == 1 && humidity == 2);
+  CHECK(client.registerTopic("temp") == temperature);
+  CHECK(!client.setTopicPrefix("other"));
+  CHECK(strcmp(client.getTopic(humidity), "home/handles/hum") == 0);
+  connectClient(client);
+
+  CHECK(client.publish(temperature, "21.5"));
+  CHECK(client.publish(humidity, String("40")));
+  const char buffer[] = "19.0 and more";
+  CHECK(client.publish(temperature, buffer, 4));
+  std::string sent = sentBytes();
+  CHECK(sent.find("home/handles/temp21.5") != std::string::npos && sent.find("home/handles/hum40") != std::string::npos);
+  CHECK(sent.find("home/handles/temp19.0") != std::string::npos && sent.find("and more") == std::string::npos);
+
+  // Unknown handles are refused and counted as failures, nothing is sent
+  HostNetwork::out.clear();
+  CHECK(!client.publish((MqttTopicHandle)0, "x") && !client.publish((MqttTopicHandle)99, "x"));
+  CHECK(client.getTopic(99) == NULL && HostNetwork::out.empty() && client.getMetrics().publishFailures == 2);
+}
+
+int main()
+{
+  testDispatch();
+  testBinaryPayload();
+  testSubscribeFromCallback();
+  testSubscriptionsMemoryUsage();
+  testConnection();
+  testConnectionLoopLatency();
+  testStreamedPublish();
+  testStreamedReceive();
+  testOtaUpdate();
+  testQos1();
+  testSessions();
+  testFailover();
+  testDnsCache();
+  testTls();
+  testPublishPolicy();
+  testRecordBatch();
+  testTopicBuffer();
+  testTopicHandles();
+  puts("test_client passed");
+  return 0;
+}
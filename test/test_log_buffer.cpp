@@ -0,0 +1,63 @@
+#include "MqttLogBuffer.h"
+#include "TestSupport.h"
+
+// Serial port that accepts everything
+class CaptureOutput : public Print
+{
+public:
+  std::string text;
+
+  size_t write(uint8_t b) override { text += (char)b; return 1; }
+  size_t write(const uint8_t* buffer, size_t size) override { text.append((const char*)buffer, size); return size; }
+};
+
+static void testDrain()
+{
+  MqttLogBuffer log(64);
+  CaptureOutput output;
+  log.printf("hello %d\n", 1);
+  log.printf("world\n");
+
+  log.drain(output, 3);
+  CHECK(output.text == "hel");
+  log.drain(output, 100);
+  CHECK(output.text == "hello 1\nworld\n");
+  CHECK(log.isEmpty());
+}
+
+static void testDroppedMessages()
+{
+  // Lines of 15 bytes, 4 of them fit
+  MqttLogBuffer log(64);
+  CaptureOutput output;
+  for (int i = 0 ; i < 10 ; i++)
+    log.printf("line number %02d\n", i);
+  CHECK(log.dropped() == 6);
+
+  // The drop is reported once there is room again, the lines wrapping around the end of the buffer
+  log.drain(output, 30);
+  log.printf("next\n");
+  log.drain(output, 1000);
+  CHECK(output.text == "line number 00\nline number 01\nline number 02\nline number 03\nSYS! 6 log messages dropped\nnext\n");
+  CHECK(log.isEmpty() && log.dropped() == 6);
+}
+
+static void testTruncation()
+{
+  MqttLogBuffer log(1024);
+  CaptureOutput output;
+  std::string longLine(300, 'a');
+  log.printf("%s\n", longLine.c_str());
+  log.drain(output, 1000);
+  CHECK(output.text.size() == ESPMQTT_LOG_MAX_LINE_LENGTH - 1);
+  CHECK(output.text.compare(output.text.size() - 4, 4, "...\n") == 0);
+}
+
+int main()
+{
+  testDrain();
+  testDroppedMessages();
+  testTruncation();
+  puts("test_log_buffer passed");
+  return 0;
+}
@@ -0,0 +1,130 @@
+#include "EspMQTTClient.h"
+#include "TestSupport.h"
+#include <chrono>
+#include <thread>
+
+/*
+  EspMQTTClient with its network task, a std::thread on the host. The test thread is the sketch: it publishes,
+  calls loop() and holds HostNetwork::mutex while it reads the bytes sent. The payloads received carry the time
+  they were sent by the broker, to measure the handoff from the network task to the callbacks called by loop().
+*/
+
+static long long nowNanos()
+{
+  using namespace std::chrono;
+  return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+static size_t sentSize()
+{
+  std::lock_guard<std::recursive_mutex> lock(HostNetwork::mutex);
+  return HostNetwork::out.size();
+}
+
+static void brokerSendTimestamp(const char* topic)
+{
+  long long now = nowNanos();
+  brokerSendPublish(topic, (const uint8_t*)&now, sizeof(now));
+}
+
+static void testNetworkTask()
+{
+  EspMQTTClient client("broker", 1883, "task");
+  client.enableDebuggingMessages(false);
+  int established = 0;
+  long received = 0;
+  double latencyTotalNanos = 0;
+  std::thread::id callbackThread;
+  client.setOnConnectionEstablishedCallback([&]() { established++; });
+  client.subscribe("in/#", [&](const char* topic, const uint8_t* payload, size_t length) {
+    long long sent;
+    memcpy(&sent, payload, sizeof(sent));
+    latencyTotalNanos += nowNanos() - sent;
+    callbackThread = std::this_thread::get_id();
+    received++;
+  });
+
+  CHECK(client.enableNetworkTask(8192));
+  while (sentSize() == 0)
+    std::this_thread::sleep_for(std::chrono::microseconds(100));
+  brokerSendConnack();
+  while (!client.isMqttConnected())
+    std::this_thread::sleep_for(std::chrono::microseconds(100));
+
+  // The task flags the connection for loop() just after it is established
+  for (int i = 0 ; i < 10000 && established == 0 ; i++)
+  {
+    client.loop();
+    std::this_thread::sleep_for(std::chrono::microseconds(100));
+  }
+  CHECK(established == 1);
+  {
+    std::lock_guard<std::recursive_mutex> lock(HostNetwork::mutex);
+    HostNetwork::out.clear();
+  }
+
+  // Published by the sketch, sent by the task. PUBLISH packets of 2 bytes of header, 2 + 5 of topic and 15 of payload
+  // The publish() calls refused while the buffer is full are counted as failures by the sketch
+  static const int PUBLISH_COUNT = 50000;
+  unsigned long refused = 0;
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (int i = 0 ; i < PUBLISH_COUNT ; )
+  {
+    if (client.publish("out/x", "0123456789abcde"))
+      i++;
+    else
+    {
+      refused++;
+      std::this_thread::yield();
+    }
+  }
+  while (sentSize() < PUBLISH_COUNT * (2 + 2 + 5 + 15))
+    std::this_thread::yield();
+  double publishSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  CHECK(sentSize() == PUBLISH_COUNT * (2 + 2 + 5 + 15));
+
+  // Received by the task, dispatched by loop() on the sketch side
+  static const int RECEIVE_COUNT = 20000;
+  start = std::chrono::steady_clock::now();
+  for (int i = 0 ; i < RECEIVE_COUNT ; i++)
+  {
+    brokerSendTimestamp("in/a");
+    client.loop();
+  }
+  while (received < RECEIVE_COUNT)
+  {
+    client.loop();
+    std::this_thread::yield();
+  }
+  double receiveSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  CHECK(received == RECEIVE_COUNT && callbackThread == std::this_thread::get_id());
+  CHECK(client.getMetrics().inboundDropped == 0 && client.getMetrics().messagesIn == RECEIVE_COUNT);
+
+  // One message at a time, the latency without a backlog: mostly the tick the idle task sleeps for
+  static const int LATENCY_COUNT = 1000;
+  latencyTotalNanos = 0;
+  for (int i = 0 ; i < LATENCY_COUNT ; i++)
+  {
+    brokerSendTimestamp("in/b");
+    while (received < RECEIVE_COUNT + i + 1)
+      client.loop();
+  }
+
+  printf("%.0f publishes/s out, %.0f messages/s in, %.1f us from the broker to the callback\n",
+    PUBLISH_COUNT / publishSeconds, RECEIVE_COUNT / receiveSeconds, latencyTotalNanos / LATENCY_COUNT / 1000);
+
+  // Failures counted on the sketch side, while the task updates the other counters
+  CHECK(client.getMetrics().publishFailures == refused);
+  CHECK(!client.publish("", "x") && !client.publish((MqttTopicHandle)7, "x"));
+  CHECK(client.getMetrics().publishFailures == refused + 2 && client.getMetrics().messagesOut == PUBLISH_COUNT);
+  client.resetMetrics();
+  CHECK(!client.publish("", "x"));
+  CHECK(client.getMetrics().publishFailures == 1 && client.getMetrics().messagesOut == 0);
+}
+
+int main()
+{
+  testNetworkTask();
+  puts("test_network_task passed");
+  return 0;
+}
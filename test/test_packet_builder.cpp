@@ -0,0 +1,52 @@
+#include "MqttPacketBuilder.h"
+#include "TestSupport.h"
+
+static void testSubscribePacket()
+{
+  uint8_t buffer[64];
+  MqttPacketBuilder packet(buffer, sizeof(buffer));
+  packet.begin(0x82);
+  CHECK(packet.isEmpty());
+  CHECK(packet.writeUint16(1));
+  CHECK(packet.writeString("a/b", 3));
+  CHECK(packet.writeByte(0));
+
+  size_t length;
+  const uint8_t* data = packet.finish(&length);
+  const uint8_t expected[] = { 0x82, 8, 0, 1, 0, 3, 'a', '/', 'b', 0 };
+  CHECK(length == sizeof(expected) && memcmp(data, expected, length) == 0);
+}
+
+static void testMultiByteLength()
+{
+  uint8_t buffer[300];
+  MqttPacketBuilder packet(buffer, sizeof(buffer));
+  packet.begin(0x30);
+  uint8_t payload[200] = { 0 };
+  CHECK(packet.writeBytes(payload, sizeof(payload)));
+
+  // The fixed header takes 3 bytes, so the packet starts 2 bytes into the buffer
+  size_t length;
+  const uint8_t* data = packet.finish(&length);
+  CHECK(length == 203 && data == buffer + 2);
+  CHECK(data[1] == ((200 & 0x7F) | 0x80) && data[2] == 1);
+}
+
+static void testOverflow()
+{
+  uint8_t buffer[10];
+  MqttPacketBuilder packet(buffer, sizeof(buffer));
+  packet.begin(0x82);
+  CHECK(packet.writeUint16(1));
+  CHECK(!packet.writeString("abc", 3));
+  CHECK(packet.remaining() == 3);
+}
+
+int main()
+{
+  testSubscribePacket();
+  testMultiByteLength();
+  testOverflow();
+  puts("test_packet_builder passed");
+  return 0;
+}
@@ -0,0 +1,103 @@
+#include "MqttPublishLimiter.h"
+#include "TestSupport.h"
+
+typedef MqttPublishLimiter Limiter;
+
+static std::vector<std::string> sentMessages;
+
+static bool recordSent(const char* topic, const uint8_t* payload, size_t length, byte flags, void* context)
+{
+  sentMessages.push_back(std::string(topic) + "=" + std::string((const char*)payload, length));
+  return true;
+}
+
+static Limiter::Decision submit(Limiter &limiter, const char* topic, const char* payload, unsigned long currentMillis)
+{
+  return limiter.submit(topic, (const uint8_t*)payload, strlen(payload), 0, currentMillis);
+}
+
+static void testMinInterval()
+{
+  Limiter limiter;
+  MqttPublishPolicy interval;
+  interval.minInterval = 100;
+  CHECK(limiter.addPolicy("s/+", interval));
+  MqttPublishPolicy deadband;
+  deadband.deadband = 0.5;
+  CHECK(limiter.addPolicy("s/#", deadband)); // The first policy added wins for s/x
+  CHECK(!limiter.addPolicy("s/#/x", deadband));
+
+  sentMessages.clear();
+  CHECK(submit(limiter, "other", "1", 0) == Limiter::SEND);
+  CHECK(submit(limiter, "s/x", "1", 1000) == Limiter::SEND);
+  CHECK(submit(limiter, "s/x", "2", 1010) == Limiter::HELD);
+  CHECK(submit(limiter, "s/x", "3", 1050) == Limiter::HELD);
+  CHECK(!limiter.isDue(1099) && limiter.isDue(1100));
+  limiter.flush(1100, recordSent, NULL);
+  CHECK(sentMessages == std::vector<std::string>({ "s/x=3" }));
+  CHECK(limiter.heldCount() == 0);
+  CHECK(submit(limiter, "s/x", "4", 1250) == Limiter::SEND);
+  CHECK(limiter.stats().held == 1 && limiter.stats().replaced == 1);
+}
+
+static void testDeadband()
+{
+  Limiter limiter;
+  MqttPublishPolicy deadband;
+  deadband.deadband = 0.5;
+  CHECK(limiter.addPolicy("t/#", deadband));
+
+  CHECK(submit(limiter, "t/a", "10", 0) == Limiter::SEND);
+  CHECK(submit(limiter, "t/a", "10.4", 1) == Limiter::SUPPRESSED);
+  CHECK(submit(limiter, "t/a", " 10.6 ", 2) == Limiter::SEND);
+  CHECK(submit(limiter, "t/a", "on", 3) == Limiter::SEND); // Not numeric
+  CHECK(submit(limiter, "t/a", "on", 4) == Limiter::SEND);
+  CHECK(limiter.stats().suppressed == 1);
+}
+
+static void testCoalesceAcrossWrap()
+{
+  Limiter limiter;
+  MqttPublishPolicy coalesce;
+  coalesce.coalesceWindow = 50;
+  CHECK(limiter.addPolicy("c", coalesce));
+
+  sentMessages.clear();
+  CHECK(submit(limiter, "c", "a", (unsigned long)-16) == Limiter::HELD);
+  CHECK(submit(limiter, "c", "b", 5) == Limiter::HELD);
+  CHECK(!limiter.isDue(0x21) && limiter.isDue(0x22));
+  limiter.flush(0x22, recordSent, NULL);
+  CHECK(sentMessages == std::vector<std::string>({ "c=b" }));
+}
+
+static void testTokenBucket()
+{
+  Limiter limiter;
+  MqttPublishPolicy rate;
+  rate.ratePerSecond = 10;
+  rate.burst = 3;
+  CHECK(limiter.addPolicy("r", rate));
+
+  // A message every 10 ms for a second: the burst and then 10 per second
+  sentMessages.clear();
+  int sent = 0;
+  for (unsigned long t = 0 ; t < 1000 ; t += 10)
+  {
+    if (submit(limiter, "r", "x", t) == Limiter::SEND)
+      sent++;
+    if (limiter.isDue(t))
+      limiter.flush(t, recordSent, NULL);
+  }
+  sent += sentMessages.size();
+  CHECK(sent >= 11 && sent <= 13);
+}
+
+int main()
+{
+  testMinInterval();
+  testDeadband();
+  testCoalesceAcrossWrap();
+  testTokenBucket();
+  puts("test_publish_limiter passed");
+  return 0;
+}
@@ -0,0 +1,114 @@
+#include "MqttPublishQueue.h"
+#include "TestSupport.h"
+
+static bool push(MqttPublishQueue &queue, const char* topic, const char* payload, byte flags = 0, uint16_t packetId = 0)
+{
+  return queue.push(topic, (const uint8_t*)payload, strlen(payload), flags, packetId);
+}
+
+// "topic=payload" of the front message, empty if the queue is empty
+static std::string front(MqttPublishQueue &queue)
+{
+  const char* topic;
+  const uint8_t* payload;
+  size_t length;
+  byte flags;
+  if (!queue.front(&topic, &payload, &length, &flags))
+    return "";
+  return std::string(topic) + "=" + std::string((const char*)payload, length);
+}
+
+static std::string drain(MqttPublishQueue &queue)
+{
+  std::string messages;
+  while (!queue.isEmpty())
+  {
+    messages += front(queue) + " ";
+    queue.pop(true);
+  }
+  return messages;
+}
+
+static void testDropOldest()
+{
+  // Records of 16 bytes of header, "t", NUL and 10 bytes of payload: 28 bytes, 3 of them fit
+  MqttPublishQueue queue;
+  CHECK(queue.begin(100, MqttPublishQueue::DROP_OLDEST));
+  for (int i = 0 ; i < 10 ; i++)
+  {
+    char payload[11];
+    snprintf(payload, sizeof(payload), "payload%03d", i);
+    CHECK(push(queue, "t", payload));
+  }
+  CHECK(queue.count() == 3 && queue.stats().dropped == 7);
+  CHECK(front(queue) == "t=payload007");
+
+  // Wraps to the beginning of the buffer
+  queue.pop(true);
+  queue.pop(true);
+  CHECK(push(queue, "t", "payload010"));
+  CHECK(drain(queue) == "t=payload009 t=payload010 ");
+  CHECK(queue.stats().sent == 4 && queue.stats().queued == 11);
+}
+
+static void testDropNewest()
+{
+  MqttPublishQueue queue;
+  CHECK(queue.begin(40, MqttPublishQueue::DROP_NEWEST));
+  CHECK(push(queue, "a", "1"));
+  CHECK(push(queue, "a", "2"));
+  CHECK(!push(queue, "a", "3"));
+  CHECK(queue.stats().dropped == 1);
+  CHECK(drain(queue) == "a=1 a=2 ");
+
+  std::string tooLarge(64, 'x');
+  CHECK(!push(queue, "a", tooLarge.c_str()));
+}
+
+static void testCoalesce()
+{
+  MqttPublishQueue queue;
+  CHECK(queue.begin(200, MqttPublishQueue::COALESCE_BY_TOPIC));
+  CHECK(push(queue, "a", "1"));
+  CHECK(push(queue, "b", "2"));
+  CHECK(push(queue, "a", "3"));
+  CHECK(queue.count() == 2);
+  CHECK(drain(queue) == "b=2 a=3 ");
+  CHECK(queue.stats().dropped == 1 && queue.stats().sent == 2);
+
+  // Delivery of QoS 1 messages is promised, they are kept and followed by the new message
+  CHECK(push(queue, "q", "1", MqttPublishQueue::FLAG_QOS1, 1));
+  CHECK(push(queue, "q", "2"));
+  CHECK(push(queue, "q", "3", MqttPublishQueue::FLAG_QOS1, 2));
+  CHECK(push(queue, "q", "4"));
+  CHECK(queue.count() == 3 && queue.stats().dropped == 2);
+  CHECK(front(queue) == "q=1");
+  CHECK(queue.acknowledge(1) && queue.acknowledge(2));
+  CHECK(drain(queue) == "q=4 ");
+}
+
+static void testAcknowledge()
+{
+  MqttPublishQueue queue;
+  CHECK(queue.begin(200, MqttPublishQueue::DROP_NEWEST));
+  CHECK(push(queue, "q", "1", MqttPublishQueue::FLAG_QOS1, 1));
+  CHECK(push(queue, "q", "2", MqttPublishQueue::FLAG_QOS1, 2));
+  CHECK(push(queue, "q", "3", MqttPublishQueue::FLAG_QOS1, 3));
+
+  CHECK(queue.acknowledge(2));
+  CHECK(!queue.acknowledge(2));
+  CHECK(queue.count() == 2 && front(queue) == "q=1");
+  CHECK(queue.acknowledge(1));
+  CHECK(queue.count() == 1 && front(queue) == "q=3");
+  CHECK(queue.stats().sent == 2);
+}
+
+int main()
+{
+  testDropOldest();
+  testDropNewest();
+  testCoalesce();
+  testAcknowledge();
+  puts("test_publish_queue passed");
+  return 0;
+}
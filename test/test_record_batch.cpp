@@ -0,0 +1,125 @@
+#include "MqttRecordBatch.h"
+#include "TestSupport.h"
+
+struct DecodedRecord
+{
+  uint32_t timestamp;
+  std::vector<double> values;
+};
+
+static uint32_t readVarint(const uint8_t* data, size_t* position)
+{
+  uint32_t value = 0;
+  for (int shift = 0 ; ; shift += 7)
+  {
+    uint8_t b = data[(*position)++];
+    value |= (uint32_t)(b & 0x7F) << shift;
+    if ((b & 0x80) == 0)
+      return value;
+  }
+}
+
+// Same decoding as extras/mqtt_record_decoder.py
+static std::vector<DecodedRecord> decode(const uint8_t* data, size_t size)
+{
+  std::vector<DecodedRecord> records;
+  CHECK(size >= MqttRecordBatch::HEADER_SIZE && data[0] == MqttRecordBatch::FORMAT_VERSION);
+  uint16_t count = data[1] | (data[2] << 8);
+  uint32_t timestamp = data[3] | (data[4] << 8) | (data[5] << 16) | ((uint32_t)data[6] << 24);
+
+  size_t position = MqttRecordBatch::HEADER_SIZE;
+  for (uint16_t i = 0 ; i < count ; i++)
+  {
+    DecodedRecord record;
+    timestamp += readVarint(data, &position);
+    record.timestamp = timestamp;
+    uint8_t valueCount = data[position++];
+    for (uint8_t v = 0 ; v < valueCount ; v++)
+    {
+      uint8_t type = data[position++];
+      if (type == MqttRecordBatch::TYPE_INT)
+      {
+        uint32_t zigzag = readVarint(data, &position);
+        record.values.push_back((int32_t)(zigzag >> 1) ^ -(int32_t)(zigzag & 1));
+      }
+      else
+      {
+        CHECK(type == MqttRecordBatch::TYPE_FLOAT);
+        uint32_t bits = data[position] | (data[position + 1] << 8) | (data[position + 2] << 16) | ((uint32_t)data[position + 3] << 24);
+        float value;
+        memcpy(&value, &bits, sizeof(value));
+        record.values.push_back(value);
+        position += 4;
+      }
+    }
+    records.push_back(record);
+  }
+  CHECK(position == size);
+  return records;
+}
+
+static void testRoundTripAcrossWrap()
+{
+  MqttRecordBatch batch;
+  CHECK(!batch.isEnabled() && !batch.beginRecord(0));
+  CHECK(batch.begin(64));
+  CHECK(batch.size() == MqttRecordBatch::HEADER_SIZE && batch.count() == 0);
+
+  // millis() wraps between the second and the third record
+  unsigned long start = (unsigned long)(uint32_t)-500;
+  int count = 0;
+  while (true)
+  {
+    batch.beginRecord(start + count * 250);
+    batch.addFloat(21.5f + count);
+    batch.addInt(count % 2 ? -count * 1000 : count);
+    if (!batch.endRecord())
+      break;
+    count++;
+  }
+  CHECK(count == 5 && batch.count() == 5);
+
+  std::vector<DecodedRecord> records = decode(batch.data(), batch.size());
+  CHECK(records.size() == 5);
+  for (int i = 0 ; i < 5 ; i++)
+  {
+    CHECK(records[i].timestamp == (uint32_t)(start + i * 250));
+    CHECK(records[i].values.size() == 2);
+    CHECK(records[i].values[0] == 21.5 + i);
+    CHECK(records[i].values[1] == (i % 2 ? -i * 1000 : i));
+  }
+
+  batch.clear();
+  CHECK(batch.count() == 0 && batch.size() == MqttRecordBatch::HEADER_SIZE);
+}
+
+static void testRejectedValues()
+{
+  MqttRecordBatch batch;
+  CHECK(batch.begin(12));
+  CHECK(!batch.addInt(1)); // Outside of a record
+  CHECK(!batch.endRecord());
+
+  batch.beginRecord(1);
+  for (int i = 0 ; i < 10 ; i++)
+    batch.addInt(i);
+  CHECK(!batch.endRecord());
+  CHECK(batch.size() == MqttRecordBatch::HEADER_SIZE && batch.count() == 0);
+
+  // A record left open is dropped by the next one
+  batch.beginRecord(1);
+  batch.addInt(1);
+  batch.beginRecord(2);
+  batch.addInt(2);
+  CHECK(batch.endRecord());
+  std::vector<DecodedRecord> records = decode(batch.data(), batch.size());
+  CHECK(records.size() == 1 && records[0].timestamp == 2 && records[0].values[0] == 2);
+}
+
+int main()
+{
+  testRoundTripAcrossWrap();
+  testRejectedValues();
+  puts("test_record_batch passed");
+  return 0;
+}
@@ -0,0 +1,67 @@
+#include "DelayedExecutionScheduler.h"
+#include "TestSupport.h"
+
+// Many timers around the wrap of millis(), a third of them cancelled, and a periodic timer cancelling itself
+static void testOrderingAcrossWrap()
+{
+  DelayedExecutionScheduler scheduler;
+  const unsigned long start = (unsigned long)-5000;
+  const int count = 3000;
+
+  std::vector<int> executions(count, 0);
+  std::vector<unsigned long> executedAt(count, 0);
+  std::vector<DelayedExecutionHandle> handles;
+  for (int i = 0 ; i < count ; i++)
+  {
+    unsigned long delay = (i * 7919) % 10000;
+    handles.push_back(scheduler.schedule(start, delay, 0, [&executions, &executedAt, i, start, delay]() {
+      executions[i]++;
+      CHECK(executedAt[i] == 0);
+      executedAt[i] = start + delay;
+    }));
+  }
+  for (int i = 0 ; i < count ; i += 3)
+    CHECK(scheduler.cancel(handles[i]));
+  CHECK(!scheduler.cancel(handles[0]));
+  CHECK(!scheduler.cancel(0));
+
+  int periodicExecutions = 0;
+  DelayedExecutionHandle periodic = 0;
+  periodic = scheduler.schedule(start, 100, 100, [&]() {
+    if (++periodicExecutions == 50)
+      CHECK(scheduler.cancel(periodic));
+  });
+
+  for (unsigned long elapsed = 0 ; elapsed < 20000 ; elapsed++)
+  {
+    if (scheduler.isDue(start + elapsed))
+      scheduler.run(start + elapsed);
+  }
+
+  for (int i = 0 ; i < count ; i++)
+    CHECK(executions[i] == (i % 3 == 0 ? 0 : 1));
+  CHECK(periodicExecutions == 50);
+  CHECK(scheduler.size() == 0);
+}
+
+static void testScheduleFromCallback()
+{
+  DelayedExecutionScheduler scheduler;
+  std::vector<int> order;
+  scheduler.schedule(0, 10, 0, [&]() {
+    order.push_back(1);
+    scheduler.schedule(10, 0, 0, [&]() { order.push_back(2); });
+  });
+  scheduler.run(10);
+  scheduler.run(10);
+  CHECK(order == std::vector<int>({ 1, 2 }));
+  CHECK(!scheduler.isDue(1000));
+}
+
+int main()
+{
+  testOrderingAcrossWrap();
+  testScheduleFromCallback();
+  puts("test_scheduler passed");
+  return 0;
+}
@@ -0,0 +1,136 @@
+#include "MqttSpscRing.h"
+#include "TestSupport.h"
+#include <chrono>
+#include <thread>
+
+static std::string front(MqttSpscRing &ring)
+{
+  const char* topic;
+  const uint8_t* payload;
+  size_t length;
+  byte flags;
+  if (!ring.front(&topic, &payload, &length, &flags))
+    return "";
+  return std::string(topic) + "=" + std::string((const char*)payload, length);
+}
+
+static void testOrderAndWrap()
+{
+  MqttSpscRing ring;
+  CHECK(!ring.isEnabled());
+  CHECK(ring.begin(128));
+  CHECK(ring.isEmpty() && front(ring).empty());
+
+  // Records of 12 bytes of header, 4 of topic and payload: 16 bytes, the ring keeps one free so it never looks empty when full
+  int pushed = 0;
+  int popped = 0;
+  for (int round = 0 ; round < 50 ; round++)
+  {
+    char payload[4]; // Room for the sign snprintf() can't rule out
+    while (true)
+    {
+      snprintf(payload, sizeof(payload), "%02d", pushed % 100);
+      if (!ring.push("t", (const uint8_t*)payload, 2, (byte)pushed))
+        break;
+      pushed++;
+    }
+
+    // Pop a varying number of records so the writes wrap at every offset
+    for (int i = 0 ; i <= round % 5 && !ring.isEmpty() ; i++)
+    {
+      snprintf(payload, sizeof(payload), "%02d", popped % 100);
+      CHECK(front(ring) == std::string("t=") + payload);
+      ring.pop();
+      popped++;
+    }
+  }
+
+  while (!ring.isEmpty())
+  {
+    ring.pop();
+    popped++;
+  }
+  CHECK(popped == pushed && pushed > 50);
+}
+
+static void testTooLarge()
+{
+  MqttSpscRing ring;
+  CHECK(ring.begin(64));
+  std::string payload(64, 'x');
+  CHECK(!ring.push("t", (const uint8_t*)payload.data(), payload.size(), 0));
+  CHECK(ring.isEmpty());
+}
+
+// Record i has a topic of 1 + i % 20 letters and a payload of (i * 7) % 64 bytes, all derived from i
+static void fillRecord(int i, char* topic, uint8_t* payload, size_t* length)
+{
+  int topicLength = 1 + i % 20;
+  for (int k = 0 ; k < topicLength ; k++)
+    topic[k] = 'a' + (i + k) % 26;
+  topic[topicLength] = '\0';
+
+  *length = (i * 7) % 64;
+  for (size_t k = 0 ; k < *length ; k++)
+    payload[k] = (uint8_t)(i + k);
+}
+
+// A producer thread and the consumer spinning on each side of a small ring, every record checked byte per byte
+static void testThreads()
+{
+  static const int RECORD_COUNT = 200000;
+  MqttSpscRing ring;
+  CHECK(ring.begin(1000));
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  std::thread producer([&ring]() {
+    char topic[32];
+    uint8_t payload[64];
+    size_t length;
+    for (int i = 0 ; i < RECORD_COUNT ; )
+    {
+      fillRecord(i, topic, payload, &length);
+      if (ring.push(topic, payload, length, (byte)i))
+        i++;
+      else
+        std::this_thread::yield();
+    }
+  });
+
+  bool valid = true;
+  for (int i = 0 ; i < RECORD_COUNT ; )
+  {
+    const char* topic;
+    const uint8_t* payload;
+    size_t length;
+    byte flags;
+    if (!ring.front(&topic, &payload, &length, &flags))
+    {
+      std::this_thread::yield();
+      continue;
+    }
+
+    char expectedTopic[32];
+    uint8_t expectedPayload[64];
+    size_t expectedLength;
+    fillRecord(i, expectedTopic, expectedPayload, &expectedLength);
+    valid = valid && strcmp(topic, expectedTopic) == 0 && length == expectedLength && flags == (byte)i
+      && memcmp(payload, expectedPayload, length) == 0;
+    ring.pop();
+    i++;
+  }
+
+  producer.join();
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  CHECK(valid && ring.isEmpty());
+  printf("%d records through a ring of 1000 bytes: %.0f records/s\n", RECORD_COUNT, RECORD_COUNT / seconds);
+}
+
+int main()
+{
+  testOrderAndWrap();
+  testTooLarge();
+  testThreads();
+  puts("test_spsc_ring passed");
+  return 0;
+}
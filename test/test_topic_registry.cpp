@@ -0,0 +1,71 @@
+#include "MqttTopicRegistry.h"
+#include "TestSupport.h"
+
+static void testPrefix()
+{
+  MqttTopicRegistry registry;
+  CHECK(registry.setPrefix("home/livingroom"));
+  CHECK(registry.setPrefix("home/kitchen")); // Replaced while nothing is registered
+  MqttTopicHandle temperature = registry.add("temperature");
+  MqttTopicHandle humidity = registry.add("sensors/humidity");
+  CHECK(temperature == 1 && humidity == 2 && registry.count() == 2);
+  CHECK(strcmp(registry.topic(temperature), "home/kitchen/temperature") == 0);
+  CHECK(strcmp(registry.topic(humidity), "home/kitchen/sensors/humidity") == 0);
+
+  // The same handle for the same topic, compared without the prefix
+  CHECK(registry.add("temperature") == temperature && registry.add("temp") == 3);
+  CHECK(registry.add("home/kitchen/temperature") == 4);
+  CHECK(!registry.setPrefix("other") && strcmp(registry.topic(temperature), "home/kitchen/temperature") == 0);
+  CHECK(registry.memoryUsage() == strlen("home/kitchen") + 1 + strlen(registry.topic(1)) + 1 + strlen(registry.topic(2)) + 1
+    + strlen(registry.topic(3)) + 1 + strlen(registry.topic(4)) + 1);
+}
+
+static void testWithoutPrefix()
+{
+  MqttTopicRegistry registry;
+  CHECK(registry.setPrefix(""));
+  CHECK(registry.add("a/b") == 1 && strcmp(registry.topic(1), "a/b") == 0);
+  CHECK(registry.add("") == 0 && registry.count() == 1);
+}
+
+static void testUnknownHandles()
+{
+  MqttTopicRegistry registry;
+  CHECK(registry.topic(0) == NULL && registry.topic(1) == NULL);
+  CHECK(registry.add("t") == 1);
+  CHECK(registry.topic(0) == NULL && registry.topic(2) == NULL && registry.topic(99) == NULL && registry.topic(255) == NULL);
+}
+
+static void testOverflow()
+{
+  MqttTopicRegistry registry;
+  CHECK(registry.setPrefix("device"));
+  char topic[32];
+  for (unsigned int i = 0 ; i < MQTT_MAX_TOPIC_HANDLES ; i++)
+  {
+    snprintf(topic, sizeof(topic), "sensor/%u", i);
+    CHECK(registry.add(topic) == i + 1);
+  }
+
+  // The table is full for new topics, the registered ones still get their handle
+  CHECK(registry.add("sensor/overflow") == 0 && registry.count() == MQTT_MAX_TOPIC_HANDLES);
+  CHECK(registry.add("sensor/7") == 8);
+  CHECK(registry.topic(MQTT_MAX_TOPIC_HANDLES + 1) == NULL);
+
+  // Every topic is still right after the buffer grew at each registration
+  for (unsigned int i = 0 ; i < MQTT_MAX_TOPIC_HANDLES ; i++)
+  {
+    snprintf(topic, sizeof(topic), "device/sensor/%u", i);
+    CHECK(strcmp(registry.topic(i + 1), topic) == 0);
+  }
+}
+
+int main()
+{
+  testPrefix();
+  testWithoutPrefix();
+  testUnknownHandles();
+  testOverflow();
+  puts("test_topic_registry passed");
+  return 0;
+}
@@ -0,0 +1,77 @@
+#include "MqttTopicTrie.h"
+#include "TestSupport.h"
+#include <algorithm>
+
+static void collect(int value, void* context)
+{
+  ((std::vector<int>*)context)->push_back(value);
+}
+
+static std::vector<int> matches(const MqttTopicTrie &trie, const char* topic)
+{
+  std::vector<int> values;
+  trie.match(topic, collect, &values);
+  std::sort(values.begin(), values.end());
+  return values;
+}
+
+static void testWildcards()
+{
+  MqttTopicTrie trie;
+  CHECK(trie.insert("sport/#", 0));
+  CHECK(trie.insert("sport/+/player", 1));
+  CHECK(trie.insert("sport/tennis/player", 2));
+  CHECK(trie.insert("#", 3));
+  CHECK(trie.insert("+/+", 4));
+
+  CHECK(matches(trie, "sport/tennis/player") == std::vector<int>({ 0, 1, 2, 3 }));
+  CHECK(matches(trie, "sport") == std::vector<int>({ 0, 3 })); // "#" also matches its parent level
+  CHECK(matches(trie, "sport/x") == std::vector<int>({ 0, 3, 4 }));
+  CHECK(matches(trie, "/x") == std::vector<int>({ 3, 4 }));
+  CHECK(matches(trie, "$SYS/x").empty()); // Wildcards at the first level don't match topics starting with '$'
+}
+
+static void testInvalidFilters()
+{
+  MqttTopicTrie trie;
+  CHECK(trie.insert("a/b", 0));
+  CHECK(!trie.insert("a/b", 1));
+  CHECK(!trie.insert("a/b#", 1));
+  CHECK(!trie.insert("#/a", 1));
+  CHECK(!trie.insert("a+/b", 1));
+  CHECK(!trie.insert("", 1));
+  CHECK(MqttTopicTrie::isValidFilter("+/+/#"));
+  CHECK(!MqttTopicTrie::isValidFilter("a/#/b"));
+}
+
+static void testRemoveAndUpdate()
+{
+  MqttTopicTrie trie;
+  CHECK(trie.insert("a/b/c", 0));
+  CHECK(trie.insert("a/b", 1));
+  size_t memoryUsage = trie.memoryUsage();
+  CHECK(trie.insert("a/x/y/z", 2));
+  CHECK(trie.remove("a/x/y/z"));
+  CHECK(!trie.remove("a/x/y/z"));
+  CHECK(trie.memoryUsage() == memoryUsage); // Nodes left without filter are freed
+
+  CHECK(trie.find("a/b") == 1);
+  CHECK(trie.find("a") == -1);
+  CHECK(trie.setValue("a/b", 7));
+  CHECK(!trie.setValue("a", 7));
+  CHECK(matches(trie, "a/b") == std::vector<int>({ 7 }));
+
+  CHECK(trie.remove("a/b"));
+  CHECK(matches(trie, "a/b/c") == std::vector<int>({ 0 }));
+  trie.clear();
+  CHECK(trie.memoryUsage() == 0 && matches(trie, "a/b/c").empty());
+}
+
+int main()
+{
+  testWildcards();
+  testInvalidFilters();
+  testRemoveAndUpdate();
+  puts("test_topic_trie passed");
+  return 0;
+}
@@ -0,0 +1,122 @@
+#include "MqttTransport.h"
+#include "TestSupport.h"
+
+struct StreamLog
+{
+  std::string events; // One letter per event: Begin, Chunk, End, Abort
+  std::string topic;
+  std::string payload;
+  size_t announcedLength;
+  std::vector<uint16_t> acks;
+};
+
+static void onStream(MqttTransport::StreamEvent event, const char* topic, const uint8_t* data, size_t length, void* context)
+{
+  StreamLog* log = (StreamLog*)context;
+  switch (event)
+  {
+    case MqttTransport::STREAM_BEGIN:
+      log->events += 'B';
+      log->topic = topic;
+      log->payload.clear();
+      log->announcedLength = length;
+      break;
+    case MqttTransport::STREAM_CHUNK:
+      if (log->events.empty() || log->events[log->events.size() - 1] != 'C')
+        log->events += 'C';
+      log->payload.append((const char*)data, length);
+      break;
+    case MqttTransport::STREAM_END:
+      log->events += 'E';
+      break;
+    case MqttTransport::STREAM_ABORT:
+      log->events += 'A';
+      break;
+  }
+}
+
+static void onAck(uint16_t packetId, void* context)
+{
+  ((StreamLog*)context)->acks.push_back(packetId);
+}
+
+// Read what the transport passes to PubSubClient
+static std::string readPassed(MqttTransport &transport)
+{
+  std::string passed;
+  while (transport.available() > 0)
+    passed += (char)transport.read();
+  return passed;
+}
+
+static void testHandshakeReplay()
+{
+  HostNetwork::reset();
+  WiFiClient network;
+  MqttTransport transport(network);
+  CHECK(transport.connect("broker", 1883) == 1);
+
+  const uint8_t connack[4] = { 0x20, 2, 0, 0 };
+  transport.beginHandshakeReplay(connack, sizeof(connack));
+  CHECK(transport.connect("broker", 1883) == 1 && HostNetwork::connectCount == 1);
+  CHECK(transport.write((const uint8_t*)"CONNECT", 7) == 7 && HostNetwork::out.empty());
+  CHECK(readPassed(transport) == std::string((const char*)connack, 4));
+  transport.endHandshakeReplay();
+
+  CHECK(transport.write((const uint8_t*)"x", 1) == 1 && HostNetwork::out.size() == 1);
+  CHECK(transport.bytesWritten() == 1 && transport.bytesRead() == 0);
+}
+
+static void testStreamDiversion()
+{
+  HostNetwork::reset();
+  WiFiClient network;
+  MqttTransport transport(network);
+  StreamLog log;
+  CHECK(transport.setStreamHandler(100, onStream, &log));
+  transport.setAckHandler(onAck, &log);
+  transport.connect("broker", 1883);
+
+  // A small PUBLISH is passed, a large one diverted, a PUBACK given to the ack handler
+  brokerSendPublish("small", 3, 's');
+  brokerSendPublish("large/topic", 500, 'L');
+  brokerSendPuback(42);
+  brokerSendPublish("small", 2, 't');
+
+  // available() stops at the end of each passed packet, and at each diverted packet
+  std::string passed;
+  while (!HostNetwork::in.empty())
+    passed += readPassed(transport);
+  CHECK(passed.size() == 2 * (2 + 2 + 5) + 3 + 2);
+  CHECK(passed.compare(4, 8, "smallsss") == 0 && passed.compare(12 + 4, 7, "smalltt") == 0);
+  CHECK(log.events == "BCE" && log.topic == "large/topic" && log.announcedLength == 500);
+  CHECK(log.payload == std::string(500, 'L'));
+  CHECK(log.acks == std::vector<uint16_t>({ 42 }));
+}
+
+static void testStreamAbort()
+{
+  HostNetwork::reset();
+  WiFiClient network;
+  MqttTransport transport(network);
+  StreamLog log;
+  CHECK(transport.setStreamHandler(100, onStream, &log));
+  transport.connect("broker", 1883);
+
+  // The connection is lost in the middle of the payload
+  brokerSendPublish("blob", 1000, 'b');
+  HostNetwork::in.resize(HostNetwork::in.size() - 400);
+  readPassed(transport);
+  CHECK(log.events == "BC" && log.payload.size() == 600);
+  transport.stop();
+  CHECK(log.events == "BCA");
+}
+
+int main()
+{
+  testHandshakeReplay();
+  testStreamDiversion();
+  testStreamAbort();
+  puts("test_transport passed");
+  return 0;
+}
@@ -0,0 +1,170 @@
+#include "ESP32HTTPUpdateServer.h"
+#include "TestSupport.h"
+
+/*
+  Firmware uploads through the stand-in of WebServer, written to Update by the writer task of the server.
+  The firmware is longer than both buffers, and its size isn't a multiple of the parts or of the buffers.
+*/
+
+static const size_t FIRMWARE_SIZE = 5 * ESP32_WEB_UPDATE_BUFFER_SIZE + 1000;
+static const char* MD5 = "0123456789abcdef0123456789abcdef";
+
+static std::vector<uint8_t> firmware()
+{
+  std::vector<uint8_t> data(FIRMWARE_SIZE);
+  for (size_t i = 0 ; i < data.size() ; i++)
+    data[i] = (uint8_t)(i * 7 + i / 251);
+  return data;
+}
+
+static void testUpload()
+{
+  Update.reset();
+  std::vector<uint8_t> data = firmware();
+  WebServer web(80);
+  ESP32HTTPUpdateServer server;
+  server.setup(&web);
+
+  web.hostGet();
+  CHECK(web.responseCode == 200 && web.response.find("<form") != std::string::npos);
+
+  web.args["size"] = std::to_string(FIRMWARE_SIZE);
+  web.args["md5"] = MD5;
+  web.hostUpload(data.data(), data.size());
+  CHECK(web.responseCode == 200);
+  CHECK(Update.written == FIRMWARE_SIZE && Update.hash == UpdateClass::hashOf(data.data(), data.size()));
+
+  // Restarted once the response had time to be sent
+  int restartCount = ESP.restartCount;
+  server.loop();
+  CHECK(ESP.restartCount == restartCount);
+  hostMillis += ESP32_WEB_UPDATE_RESTART_DELAY;
+  server.loop();
+  CHECK(ESP.restartCount == restartCount + 1);
+}
+
+// From the browser form of a sketch that doesn't give the size
+static void testUnknownSize()
+{
+  Update.reset();
+  std::vector<uint8_t> data = firmware();
+  WebServer web(80);
+  ESP32HTTPUpdateServer server;
+  server.setup(&web);
+
+  web.hostUpload(data.data(), data.size());
+  CHECK(web.responseCode == 200);
+  CHECK(Update.written == FIRMWARE_SIZE && Update.hash == UpdateClass::hashOf(data.data(), data.size()));
+}
+
+static void testErrors()
+{
+  std::vector<uint8_t> data = firmware();
+  WebServer web(80);
+  ESP32HTTPUpdateServer server;
+  server.setup(&web);
+  web.args["size"] = std::to_string(FIRMWARE_SIZE);
+
+  // The space is checked before anything is written
+  Update.reset();
+  Update.maxSize = FIRMWARE_SIZE - 1;
+  web.hostUpload(data.data(), data.size());
+  CHECK(web.responseCode == 500 && web.response == "FAIL: Not Enough Space" && Update.written == 0);
+
+  // The writer task fails in the middle, the rest of the upload is ignored
+  Update.reset();
+  Update.failWritesAfter = 2 * ESP32_WEB_UPDATE_BUFFER_SIZE;
+  web.hostUpload(data.data(), data.size());
+  CHECK(web.responseCode == 500 && web.response == "FAIL: flash write failed");
+  CHECK(Update.written == 2 * ESP32_WEB_UPDATE_BUFFER_SIZE && Update.hasError());
+
+  // The size given is checked at the end
+  Update.reset();
+  web.hostUpload(data.data(), FIRMWARE_SIZE - 1000);
+  CHECK(web.responseCode == 500 && web.response == "FAIL: Premature End");
+
+  Update.reset();
+  web.args["md5"] = "not a md5";
+  web.hostUpload(data.data(), data.size());
+  CHECK(web.responseCode == 500 && web.response == "FAIL: invalid MD5" && Update.written == 0);
+
+  // A sketch can upload again after a failure
+  Update.reset();
+  web.args.erase("md5");
+  web.hostUpload(data.data(), data.size());
+  CHECK(web.responseCode == 200 && Update.written == FIRMWARE_SIZE);
+}
+
+static void testResume()
+{
+  Update.reset();
+  std::vector<uint8_t> data = firmware();
+  WebServer web(80);
+  ESP32HTTPUpdateServer server;
+  server.setup(&web);
+
+  // The connection breaks in the middle of a part, what was received is written
+  const size_t interruptAt = 3 * HTTP_UPLOAD_BUFLEN + 100;
+  web.args["size"] = std::to_string(FIRMWARE_SIZE);
+  web.args["md5"] = MD5;
+  web.hostUpload(data.data(), data.size(), interruptAt);
+  CHECK(web.responseCode == 0);
+
+  std::map<std::string, std::string> upload = web.args;
+  web.args.clear();
+  web.args["status"] = "";
+  web.hostGet();
+  CHECK(web.responseCode == 200);
+  CHECK(web.response == "{\"active\":true,\"offset\":" + std::to_string(interruptAt) + ",\"size\":" + std::to_string(FIRMWARE_SIZE) + "}");
+
+  // Resumed at the wrong offset or for another firmware, the session is kept
+  web.args = upload;
+  web.args["offset"] = std::to_string(interruptAt - 100);
+  web.hostUpload(data.data() + interruptAt - 100, data.size() - interruptAt + 100);
+  CHECK(web.responseCode == 500 && web.response == "FAIL: no update to resume at this offset");
+  web.args["offset"] = std::to_string(interruptAt);
+  web.args["md5"] = "fedcba9876543210fedcba9876543210";
+  web.hostUpload(data.data() + interruptAt, data.size() - interruptAt);
+  CHECK(web.responseCode == 500);
+
+  web.args["md5"] = MD5;
+  web.hostUpload(data.data() + interruptAt, data.size() - interruptAt);
+  CHECK(web.responseCode == 200);
+  CHECK(Update.written == FIRMWARE_SIZE && Update.hash == UpdateClass::hashOf(data.data(), data.size()));
+
+  // Nothing left to resume
+  web.args.clear();
+  web.args["status"] = "";
+  web.hostGet();
+  CHECK(web.response.find("\"active\":false") != std::string::npos);
+}
+
+static void testAuthentication()
+{
+  Update.reset();
+  std::vector<uint8_t> data = firmware();
+  WebServer web(80);
+  ESP32HTTPUpdateServer server;
+  server.setup(&web, "/", "admin", "secret");
+
+  web.authenticated = false;
+  web.hostGet();
+  CHECK(web.responseCode == 401);
+  web.hostUpload(data.data(), data.size());
+  CHECK(web.responseCode == 401 && Update.written == 0);
+
+  web.authenticated = true;
+  web.hostUpload(data.data(), data.size());
+  CHECK(web.responseCode == 200 && Update.written == FIRMWARE_SIZE);
+}
+
+int main()
+{
+  testUpload();
+  testUnknownSize();
+  testErrors();
+  testResume();
+  testAuthentication();
+  puts("test_web_update passed");
+  return 0;
+}